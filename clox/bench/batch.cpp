@@ -0,0 +1,87 @@
+// Runs a batch of short independent scripts on the scheduler and reports
+// jobs per second for a growing number of worker threads, up to one per
+// hardware thread or `--workers`.
+//
+//   clox_batch [--registers] [--jit] [--trace] [--workers N] [jobs]
+//
+// Every job defines a few globals of its own and prints a result naming
+// its job, so output that leaked between VMs would show up as a mismatch.
+
+#include "scheduler.hpp"
+#include "vm.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+  using namespace clox;
+
+  using clock_type = std::chrono::steady_clock;
+
+  string_t script(size_t job) {
+    string_t index = std::to_string(job);
+    return
+      "var job = " + index + ";\n"
+      "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+      "class Counter { init() { this.count = 0; } add(n) { this.count = this.count + n; } }\n"
+      "var counter = Counter();\n"
+      "for (var i = 0; i < 200; i = i + 1) counter.add(i);\n"
+      "var name = \"job\";\n"
+      "print name + \" " + index + "\";\n"
+      "print fib(16) + counter.count + job;\n";
+  }
+
+  string_t expected(size_t job) {
+    return "job " + std::to_string(job) + "\n" + std::to_string(987 + 19900 + job) + "\n";
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  scheduler::Options options;
+  size_t jobs = 4000;
+  size_t most = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--registers") == 0)
+      options.m_Mode = compiler::ExecutionMode::REGISTER;
+    else if (std::strcmp(argv[i], "--jit") == 0)
+      options.m_Jit = true;
+    else if (std::strcmp(argv[i], "--trace") == 0)
+      options.m_Tracing = true;
+    else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc && std::strtoull(argv[i + 1], nullptr, 10) > 0)
+      most = std::strtoull(argv[++i], nullptr, 10);
+    else if ((jobs = std::strtoull(argv[i], nullptr, 10)) == 0) {
+      fprintf(stderr, "Usage: clox_batch [--registers] [--jit] [--trace] [--workers N] [jobs]\n");
+      return 64;
+    }
+  }
+
+  std::vector<string_t> sources;
+  for (size_t job = 0; job < jobs; ++job)
+    sources.push_back(script(job));
+
+  printf("%8s %12s %12s %8s\n", "workers", "ms", "jobs/s", "steals");
+  for (size_t workers = 1;; workers = std::min(workers * 2, most)) {
+    options.m_Workers = workers;
+    scheduler::Scheduler pool(options);
+
+    auto start = clock_type::now();
+    std::vector<scheduler::Result> results = pool.run(sources);
+    double ms = std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+
+    for (size_t job = 0; job < jobs; ++job) {
+      const scheduler::Result& result = results[job];
+      if (result.m_Status != vm::InterpretResult::OK || result.m_Output != expected(job)) {
+        fprintf(stderr, "Job %zu went wrong:\n%s%s", job, result.m_Output.c_str(), result.m_Errors.c_str());
+        return 1;
+      }
+    }
+
+    printf("%8zu %12.1f %12.0f %8llu\n", workers, ms, jobs / ms * 1000.,
+           static_cast<unsigned long long>(pool.stats().m_Steals));
+    if (workers == most)
+      break;
+  }
+
+  return 0;
+}
@@ -0,0 +1,476 @@
+// Runs Lox benchmark scripts and reports wall time, executed instructions,
+// quickened arithmetic hit rate, allocations and peak RSS.
+//
+//   clox_bench [--runs N] [--registers] [--jit] [--trace] [--json FILE] [script.lox | directory]...
+//   clox_bench --lines [--registers] [script.lox | directory]...
+//
+// With no scripts given, every .lox file in test/benchmark is run. Each run
+// happens in a fresh child process, and so in a fresh VM, so that peak RSS
+// belongs to that run alone. Instructions and quickening hits are counted
+// in one extra run, because counting slows the dispatch loop down.
+// `--registers` runs the scripts compiled for the register instructions,
+// `--jit` with hot functions compiled to machine code, and `--trace` with
+// hot loops recorded into traces; the share of instructions traces stood in
+// for is reported along with the count.
+// `--json -` writes the report to stdout.
+// `--lines` runs nothing; it compiles the scripts and reports the bytes of
+// code and of line runs, next to the 4 bytes per byte of code that a table
+// of one line number per byte would take.
+
+#include "vm.hpp"
+#include "compiler.hpp"
+#include "object.hpp"
+#include "optimizer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+  namespace fs = std::filesystem;
+  using clox::string_t;
+
+  // What one child process reports back about one run.
+  struct Sample {
+    string_t m_Status;
+    double m_WallMs = 0.;
+    uint64_t m_Instructions = 0;
+    uint64_t m_QuickenedHits = 0;
+    uint64_t m_QuickenedMisses = 0;
+    uint64_t m_TracedInstructions = 0;
+    uint64_t m_Objects = 0;
+    uint64_t m_Bytes = 0;
+    uint64_t m_Collections = 0;
+    double m_GCPauseMs = 0.;
+    uint64_t m_PeakRssKb = 0;
+  };
+
+  struct Summary {
+    double m_Median = 0.;
+    double m_Mean = 0.;
+    double m_Stddev = 0.;
+    double m_Min = 0.;
+    double m_Max = 0.;
+  };
+
+  struct Result {
+    string_t m_Name;
+    string_t m_Status;
+    size_t m_Runs = 0;
+    Summary m_WallMs;
+    Summary m_PeakRssKb;
+    Summary m_GCPauseMs;
+    uint64_t m_Instructions = 0;
+    // Share of quickenable arithmetic and comparisons run by quickened
+    // instructions.
+    double m_QuickenedHitRate = 0.;
+    // Share of instructions run by traces rather than the interpreter.
+    double m_TracedShare = 0.;
+    uint64_t m_Objects = 0;
+    uint64_t m_Bytes = 0;
+    uint64_t m_Collections = 0;
+  };
+
+  using result_vec_t = std::vector<Result>;
+  using path_vec_t = std::vector<fs::path>;
+
+  uint64_t peakRssKb(void) {
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss) / 1024;
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+#endif
+  }
+
+  const char* statusName(clox::vm::InterpretResult result) {
+    switch (result) {
+    case clox::vm::InterpretResult::OK:
+      return "ok";
+    case clox::vm::InterpretResult::COMPILE_ERROR:
+      return "compile_error";
+    case clox::vm::InterpretResult::RUNTIME_ERROR:
+      return "runtime_error";
+    }
+
+    return "unknown";
+  }
+
+  // How the VM runs the scripts.
+  struct Mode {
+    bool m_Registers = false;
+    bool m_Jit = false;
+    bool m_Trace = false;
+  };
+
+  // Child side: run one script once and print a single result line.
+  int runChild(const char* path, bool countInstructions, const Mode& mode) {
+    std::ifstream in(path);
+    if (!in) {
+      printf("io_error 0 0 0 0 0 0 0 0 0 0\n");
+      return 74;
+    }
+
+    std::stringstream source;
+    source << in.rdbuf();
+
+#ifdef _WIN32
+    FILE* sink = fopen("NUL", "w");
+#else
+    FILE* sink = fopen("/dev/null", "w");
+#endif
+
+    clox::vm::InterpretResult result;
+    double wallMs;
+    clox::vm::RunStats run;
+    clox::gc::Stats gc;
+    {
+      clox::vm::VM vm(sink ? sink : stdout);
+      vm.setCountInstructions(countInstructions);
+      if (mode.m_Registers)
+        vm.setExecutionMode(clox::compiler::ExecutionMode::REGISTER);
+      vm.setJit(mode.m_Jit);
+      vm.setTracing(mode.m_Trace);
+
+      auto start = std::chrono::steady_clock::now();
+      result = vm.interpret(source.str());
+      wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+      run = vm.runStats();
+      gc = vm.gcStats();
+    }
+
+    if (sink)
+      fclose(sink);
+
+    double pauseMs = std::chrono::duration<double, std::milli>(gc.m_TotalPause).count();
+    printf("%s %.6f %llu %llu %llu %llu %zu %zu %zu %.6f %llu\n", statusName(result), wallMs,
+           static_cast<unsigned long long>(run.m_Instructions),
+           static_cast<unsigned long long>(run.m_QuickenedHits),
+           static_cast<unsigned long long>(run.m_QuickenedMisses),
+           static_cast<unsigned long long>(run.m_TracedInstructions),
+           gc.m_ObjectsAllocated, gc.m_BytesAllocated, gc.m_Collections, pauseMs,
+           static_cast<unsigned long long>(peakRssKb()));
+    return 0;
+  }
+
+  bool spawn(const char* self, const fs::path& script, bool countInstructions, const Mode& mode, Sample& sample) {
+    string_t command = "\"" + string_t(self) + "\" --child" + (mode.m_Registers ? " --registers" : "") +
+                       (mode.m_Jit ? " --jit" : "") + (mode.m_Trace ? " --trace" : "") + (countInstructions ? " --count" : "") +
+                       " \"" + script.string() + "\"";
+#ifndef _WIN32
+    command += " 2>/dev/null";
+#endif
+
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe)
+      return false;
+
+    char status[32] = {};
+    unsigned long long instructions = 0, hits = 0, misses = 0, traced = 0, objects = 0, bytes = 0, collections = 0, rss = 0;
+    int fields = fscanf(pipe, "%31s %lf %llu %llu %llu %llu %llu %llu %llu %lf %llu", status, &sample.m_WallMs,
+                        &instructions, &hits, &misses, &traced, &objects, &bytes, &collections, &sample.m_GCPauseMs,
+                        &rss);
+    pclose(pipe);
+    if (fields != 11)
+      return false;
+
+    sample.m_Status = status;
+    sample.m_Instructions = instructions;
+    sample.m_QuickenedHits = hits;
+    sample.m_QuickenedMisses = misses;
+    sample.m_TracedInstructions = traced;
+    sample.m_Objects = objects;
+    sample.m_Bytes = bytes;
+    sample.m_Collections = collections;
+    sample.m_PeakRssKb = rss;
+    return true;
+  }
+
+  Summary summarize(std::vector<double> values) {
+    Summary summary;
+    if (values.empty())
+      return summary;
+
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    summary.m_Median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.;
+    summary.m_Min = values.front();
+    summary.m_Max = values.back();
+
+    double sum = 0.;
+    for (double value : values)
+      sum += value;
+    summary.m_Mean = sum / static_cast<double>(n);
+
+    double squares = 0.;
+    for (double value : values)
+      squares += (value - summary.m_Mean) * (value - summary.m_Mean);
+    summary.m_Stddev = n > 1 ? std::sqrt(squares / static_cast<double>(n - 1)) : 0.;
+
+    return summary;
+  }
+
+  Result benchmark(const char* self, const fs::path& script, size_t runs, const Mode& mode) {
+    Result result;
+    result.m_Name = script.stem().string();
+    result.m_Status = "ok";
+
+    std::vector<double> wall, rss, pause;
+    for (size_t i = 0; i < runs; ++i) {
+      Sample sample;
+      if (!spawn(self, script, false, mode, sample)) {
+        result.m_Status = "spawn_error";
+        break;
+      }
+
+      if (sample.m_Status != "ok") {
+        result.m_Status = sample.m_Status;
+        break;
+      }
+
+      wall.push_back(sample.m_WallMs);
+      rss.push_back(static_cast<double>(sample.m_PeakRssKb));
+      pause.push_back(sample.m_GCPauseMs);
+
+      // Allocation counts are deterministic; any run will do.
+      result.m_Objects = sample.m_Objects;
+      result.m_Bytes = sample.m_Bytes;
+      result.m_Collections = sample.m_Collections;
+    }
+
+    Sample counted;
+    if (result.m_Status == "ok" && spawn(self, script, true, mode, counted)) {
+      // Instructions traces stood in for are counted apart from the ones
+      // the interpreter dispatched.
+      result.m_Instructions = counted.m_Instructions + counted.m_TracedInstructions;
+      if (result.m_Instructions > 0)
+        result.m_TracedShare = static_cast<double>(counted.m_TracedInstructions) /
+                               static_cast<double>(result.m_Instructions);
+      uint64_t quickenable = counted.m_QuickenedHits + counted.m_QuickenedMisses;
+      if (quickenable > 0)
+        result.m_QuickenedHitRate = static_cast<double>(counted.m_QuickenedHits) / static_cast<double>(quickenable);
+    }
+
+    result.m_Runs = wall.size();
+    result.m_WallMs = summarize(wall);
+    result.m_PeakRssKb = summarize(rss);
+    result.m_GCPauseMs = summarize(pause);
+    return result;
+  }
+
+  void printSummary(FILE* out, const char* name, const Summary& summary, bool last = false) {
+    fprintf(out, "      \"%s\": { \"median\": %.3f, \"mean\": %.3f, \"stddev\": %.3f, \"min\": %.3f, \"max\": %.3f }%s\n",
+            name, summary.m_Median, summary.m_Mean, summary.m_Stddev, summary.m_Min, summary.m_Max,
+            last ? "" : ",");
+  }
+
+  void writeJson(FILE* out, const result_vec_t& results, size_t runs, const Mode& mode) {
+    fprintf(out, "{\n  \"runs\": %zu,\n  \"mode\": \"%s\",\n  \"jit\": %s,\n  \"trace\": %s,\n  \"benchmarks\": [\n",
+            runs, mode.m_Registers ? "register" : "stack", mode.m_Jit ? "true" : "false",
+            mode.m_Trace ? "true" : "false");
+    for (size_t i = 0; i < results.size(); ++i) {
+      const Result& result = results[i];
+      fprintf(out, "    {\n");
+      fprintf(out, "      \"name\": \"%s\",\n", result.m_Name.c_str());
+      fprintf(out, "      \"status\": \"%s\",\n", result.m_Status.c_str());
+      fprintf(out, "      \"runs\": %zu,\n", result.m_Runs);
+      fprintf(out, "      \"instructions\": %llu,\n", static_cast<unsigned long long>(result.m_Instructions));
+      fprintf(out, "      \"quickened_hit_rate\": %.4f,\n", result.m_QuickenedHitRate);
+      fprintf(out, "      \"traced_share\": %.4f,\n", result.m_TracedShare);
+      fprintf(out, "      \"objects_allocated\": %llu,\n", static_cast<unsigned long long>(result.m_Objects));
+      fprintf(out, "      \"bytes_allocated\": %llu,\n", static_cast<unsigned long long>(result.m_Bytes));
+      fprintf(out, "      \"collections\": %llu,\n", static_cast<unsigned long long>(result.m_Collections));
+      printSummary(out, "wall_ms", result.m_WallMs);
+      printSummary(out, "gc_pause_ms", result.m_GCPauseMs);
+      printSummary(out, "peak_rss_kb", result.m_PeakRssKb, true);
+      fprintf(out, "    }%s\n", i + 1 == results.size() ? "" : ",");
+    }
+
+    fprintf(out, "  ]\n}\n");
+  }
+
+  void writeTable(const result_vec_t& results) {
+    printf("%-18s %-14s %10s %9s %14s %8s %8s %12s %10s\n",
+           "benchmark", "status", "median ms", "stddev", "instructions", "quick %", "traced %", "objects", "rss KiB");
+    for (const Result& result : results) {
+      printf("%-18s %-14s %10.2f %9.2f %14llu %8.1f %8.1f %12llu %10.0f\n",
+             result.m_Name.c_str(), result.m_Status.c_str(),
+             result.m_WallMs.m_Median, result.m_WallMs.m_Stddev,
+             static_cast<unsigned long long>(result.m_Instructions),
+             100. * result.m_QuickenedHitRate,
+             100. * result.m_TracedShare,
+             static_cast<unsigned long long>(result.m_Objects),
+             result.m_PeakRssKb.m_Median);
+    }
+  }
+
+  // Code and line runs of one function and every function nested in it.
+  struct LineTable {
+    size_t m_Functions = 0;
+    size_t m_CodeBytes = 0;
+    size_t m_Runs = 0;
+  };
+
+  void measureLines(const clox::obj::Function& function, LineTable& table) {
+    const clox::vm::Chunk& chunk = function.m_Chunk;
+    ++table.m_Functions;
+    table.m_CodeBytes += chunk.size();
+    table.m_Runs += chunk.lineRuns().size();
+    for (size_t i = 0; i < chunk.constantCount(); ++i) {
+      const clox::value_t& constant = chunk.readConstant(i);
+      if (clox::obj::isObjType<clox::obj::Function>(constant))
+        measureLines(*clox::obj::asObjType<clox::obj::Function>(constant), table);
+    }
+  }
+
+  int reportLines(const path_vec_t& scripts, const Mode& mode) {
+    printf("%-18s %9s %10s %8s %12s %14s\n",
+           "script", "functions", "code", "runs", "runs bytes", "per-byte bytes");
+    bool failed = false;
+    for (const fs::path& script : scripts) {
+      std::ifstream in(script);
+      std::stringstream source;
+      source << in.rdbuf();
+
+      // `globals` is no root of `gc`. Compiling only allocates functions and
+      // strings, far short of the first collection, and a script that gets
+      // there anyway is reported rather than measured.
+      clox::vm::VM vm;
+      clox::gc::Collector gc(vm);
+      clox::vm::GlobalTable globals;
+      clox::compiler::Compiler compiler(gc, globals, clox::compiler::MAX_OPTIMIZATION_LEVEL,
+                                        mode.m_Registers ? clox::compiler::ExecutionMode::REGISTER
+                                                         : clox::compiler::ExecutionMode::STACK,
+                                        stderr);
+      clox::function_ptr_t function = in ? compiler.compile(source.str()) : nullptr;
+      if (!function || gc.stats().m_Collections > 0) {
+        printf("%-18s %9s\n", script.stem().string().c_str(), function ? "collected" : "error");
+        failed = true;
+        continue;
+      }
+
+      LineTable table;
+      measureLines(*function, table);
+      printf("%-18s %9zu %10zu %8zu %12zu %14zu\n", script.stem().string().c_str(), table.m_Functions,
+             table.m_CodeBytes, table.m_Runs, table.m_Runs * sizeof(clox::vm::LineRun),
+             table.m_CodeBytes * sizeof(clox::int_t));
+    }
+
+    return failed ? 70 : 0;
+  }
+
+  void collect(const fs::path& path, path_vec_t& scripts) {
+    if (!fs::is_directory(path)) {
+      scripts.push_back(path);
+      return;
+    }
+
+    path_vec_t found;
+    for (const fs::directory_entry& entry : fs::directory_iterator(path)) {
+      if (entry.path().extension() == ".lox")
+        found.push_back(entry.path());
+    }
+
+    std::sort(found.begin(), found.end());
+    scripts.insert(scripts.end(), found.begin(), found.end());
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc >= 3 && std::strcmp(argv[1], "--child") == 0) {
+    Mode mode;
+    bool count = false;
+    int i = 2;
+    for (; i + 1 < argc; ++i) {
+      if (std::strcmp(argv[i], "--registers") == 0)
+        mode.m_Registers = true;
+      else if (std::strcmp(argv[i], "--jit") == 0)
+        mode.m_Jit = true;
+      else if (std::strcmp(argv[i], "--trace") == 0)
+        mode.m_Trace = true;
+      else if (std::strcmp(argv[i], "--count") == 0)
+        count = true;
+      else
+        return 64;
+    }
+
+    return runChild(argv[i], count, mode);
+  }
+
+  size_t runs = 5;
+  Mode mode;
+  const char* json = nullptr;
+  bool lines = false;
+  path_vec_t scripts;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+    } else if (std::strcmp(argv[i], "--registers") == 0) {
+      mode.m_Registers = true;
+    } else if (std::strcmp(argv[i], "--jit") == 0) {
+      mode.m_Jit = true;
+    } else if (std::strcmp(argv[i], "--trace") == 0) {
+      mode.m_Trace = true;
+    } else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json = argv[++i];
+    } else if (std::strcmp(argv[i], "--lines") == 0) {
+      lines = true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "Usage: clox_bench [--runs N] [--registers] [--jit] [--trace] [--json FILE] [script.lox | directory]...\n"
+                      "       clox_bench --lines [--registers] [script.lox | directory]...\n");
+      return 64;
+    } else {
+      collect(argv[i], scripts);
+    }
+  }
+
+  if (scripts.empty())
+    collect(CLOX_BENCH_DIR, scripts);
+
+  if (lines)
+    return reportLines(scripts, mode);
+
+  result_vec_t results;
+  for (const fs::path& script : scripts) {
+    fprintf(stderr, "running %s\n", script.stem().string().c_str());
+    results.push_back(benchmark(argv[0], script, runs, mode));
+  }
+
+  if (json && std::strcmp(json, "-") == 0) {
+    writeJson(stdout, results, runs, mode);
+  } else {
+    writeTable(results);
+    if (json) {
+      FILE* out = fopen(json, "w");
+      if (!out) {
+        fprintf(stderr, "Could not open file \"%s\".\n", json);
+        return 74;
+      }
+
+      writeJson(out, results, runs, mode);
+      fclose(out);
+    }
+  }
+
+  bool failed = std::any_of(results.begin(), results.end(),
+                            [](const Result& result) { return result.m_Status != "ok"; });
+  return failed ? 70 : 0;
+}
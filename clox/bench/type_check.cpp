@@ -0,0 +1,96 @@
+// Compares the two ways the VM has had of asking what an object is:
+// dynamic_cast, and a compare of the ObjType tag.
+//
+//   clox_type_check [iterations]
+
+#include "object.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+namespace {
+  using namespace clox;
+  using namespace clox::obj;
+
+  constexpr size_t POPULATION = 1 << 16;
+
+  using clock_type = std::chrono::steady_clock;
+
+  template<typename T>
+  size_t countByCast(const obj_vec_t& objects, size_t iterations) {
+    size_t count = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+      for (obj_ptr_t object : objects)
+        count += dynamic_cast<T*>(object) != nullptr;
+    }
+
+    return count;
+  }
+
+  template<typename T>
+  size_t countByTag(const obj_vec_t& objects, size_t iterations) {
+    size_t count = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+      for (obj_ptr_t object : objects)
+        count += object->m_Type == T::TYPE;
+    }
+
+    return count;
+  }
+
+  template<typename F>
+  void measure(const char* name, const obj_vec_t& objects, size_t iterations, F&& check) {
+    auto start = clock_type::now();
+    size_t count = check(objects, iterations);
+    auto elapsed = std::chrono::duration<double, std::nano>(clock_type::now() - start);
+
+    double perCheck = elapsed.count() / static_cast<double>(objects.size() * iterations);
+    printf("%-28s %8.3f ns/check  (%zu matches)\n", name, perCheck, count);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  size_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200;
+
+  // A mix of every object type the VM meets on the stack.
+  function_ptr_t function = new Function();
+  shape_ptr_t shape = new Shape();
+  string_ptr_t name = new String("Point", String::hash("Point"));
+  class_ptr_t klass = new Class(name, shape);
+  closure_ptr_t method = new (Closure::Trailing{ 0 }) Closure(function);
+
+  obj_vec_t owned;
+  std::mt19937 random(42);
+  for (size_t i = 0; i < 64; ++i) {
+    switch (random() % 5) {
+    case 0: owned.push_back(new String("s", String::hash("s"))); break;
+    case 1: owned.push_back(new (Closure::Trailing{ 0 }) Closure(function)); break;
+    case 2: owned.push_back(new Instance(klass)); break;
+    case 3: owned.push_back(new BoundMethod(value_t(nullptr), method)); break;
+    default: owned.push_back(new Upvalue(nullptr)); break;
+    }
+  }
+
+  obj_vec_t objects;
+  objects.reserve(POPULATION);
+  for (size_t i = 0; i < POPULATION; ++i)
+    objects.push_back(owned[random() % owned.size()]);
+
+  measure("dynamic_cast<String>", objects, iterations, countByCast<String>);
+  measure("tag == STRING", objects, iterations, countByTag<String>);
+  measure("dynamic_cast<Instance>", objects, iterations, countByCast<Instance>);
+  measure("tag == INSTANCE", objects, iterations, countByTag<Instance>);
+  measure("dynamic_cast<BoundMethod>", objects, iterations, countByCast<BoundMethod>);
+  measure("tag == BOUND_METHOD", objects, iterations, countByTag<BoundMethod>);
+
+  for (obj_ptr_t object : owned)
+    delete object;
+
+  delete method;
+  delete klass;
+  delete name;
+  delete shape;
+  delete function;
+  return 0;
+}
@@ -1,10 +1,19 @@
 #include "vm.hpp"
 #include "chunk.hpp"
 #include "common.hpp"
+#include "optimizer.hpp"
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
 
 namespace {
+#ifdef CLOX_PROFILE
+  const char* USAGE = "Usage: clox [-O<level>] [--registers] [--jit] [--trace] [--cache] [--profile=<file>] [path]\n";
+#else
+  const char* USAGE = "Usage: clox [-O<level>] [--registers] [--jit] [--trace] [--cache] [path]\n";
+#endif
+
   void repl(clox::vm::VM& vm) {
     std::string line;
     while (true) {
@@ -20,95 +29,123 @@ namespace {
     }
   }
 
-  void runFile(clox::vm::VM& vm, const char* path) {
-    std::string source;
-    std::string line;
-
+  int runFile(clox::vm::VM& vm, const char* path, bool cache) {
     std::ifstream in(path);
-    while (std::getline(in, line)) {
-      source += line;
-      source += "\n";
+    if (!in) {
+      fprintf(stderr, "Could not open file \"%s\".\n", path);
+      return 74;
+    }
+
+    // With --cache the compiled script is kept next to the source, as
+    // script.loxc for script.lox, and the VM reads the source only if the
+    // image is out of date.
+    clox::vm::InterpretResult result;
+    if (cache) {
+      in.close();
+      result = vm.interpretFile(path, std::filesystem::path(path).replace_extension(".loxc").string());
+    } else {
+      std::string source;
+      std::string line;
+      while (std::getline(in, line)) {
+        source += line;
+        source += "\n";
+      }
+
+      result = vm.interpret(source);
     }
 
-    vm.interpret(source);
+    switch (result) {
+    case clox::vm::InterpretResult::COMPILE_ERROR:
+      return 65;
+    case clox::vm::InterpretResult::RUNTIME_ERROR:
+      return 70;
+    default:
+      return 0;
+    }
   }
+
+#ifdef CLOX_PROFILE
+  bool writeProfile(const clox::vm::VM& vm, const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+      fprintf(stderr, "Could not open file \"%s\".\n", path);
+      return false;
+    }
+
+    vm.profiler().writeCollapsed(out);
+    fclose(out);
+    return true;
+  }
+#endif
 }
 
 int main(int argc, const char* argv[]) {
   clox::vm::VM vm;
 
-  //if (argc == 1) {
-  //  repl(vm);
-  //} else if (argc == 2) {
-  //  runFile(vm, argv[1]);
-  //} else {
-  //  fprintf(stderr, "Usage: clox [path]\n");
-  //  exit(64);
-  //}
-
-  //vm.interpret("var a = 3;                   \n"
-  //             "var b = 4;                   \n"
-  //             "{                            \n"
-  //             "  var d = 5;                 \n"
-  //             "  print a + b * d;           \n"
-  //             "}                            \n");
-
-  //vm.interpret("fun hello() {                \n"
-  //             "  print \"Hello!\";          \n"
-  //             "}                            \n"
-  //             "print hello;                 \n");
-
-  //vm.interpret("fun sum(a, b, c) {           \n"
-  //             "  return a + b + c;          \n"
-  //             "}                            \n"
-  //             "print 4 + sum(5, 6, 7);      \n");
-
-  //vm.interpret("var x = \"global\";          \n"
-  //             "fun outer() {                \n"
-  //             "  var x = \"outer\";         \n"
-  //             "  fun inner() {              \n"
-  //             "    print x;                 \n"
-  //             "  }                          \n"
-  //             "  inner();                   \n"
-  //             "}                            \n"
-  //             "outer();                     \n");
-
-  //vm.interpret("fun noReturn() {             \n"
-  //             "  print \"Do something.\";   \n"
-  //             "}                            \n"
-  //             "print noReturn();            \n");
-
-  //vm.interpret("var x = 123;                 \n"
-  //             "x();                         \n");
-
-  //vm.interpret("{                            \n"
-  //             "  fun fib(n) {               \n"
-  //             "    if (n < 2) return n;     \n"
-  //             "    return fib(n - 1) + fib(n - 2);   \n"
-  //             "  }                                   \n"
-  //             "  print fib(8);                       \n"
-  //             "}                                     \n");
-
-  //vm.interpret("fun makeClosure() {          \n"
-  //             "  var local = \"local\";     \n"
-  //             "  fun closure() {            \n"
-  //             "    print local;             \n"
-  //             "  }                          \n"
-  //             "  return closure;            \n"
-  //             "}                            \n"
-  //             "var closure = makeClosure(); \n"
-  //             "closure();                   \n");
-
-  //vm.interpret("fun makeClosure(value) {                \n"
-  //             "  fun closure() {                       \n"
-  //             "    print value;                        \n"
-  //             "  }                                     \n"
-  //             "  return closure;                       \n"
-  //             "}                                       \n"
-  //             "var donut = makeClosure(\"donut\");     \n"
-  //             "var bagel = makeClosure(\"bagel\");     \n"
-  //             "donut();                                \n"
-  //             "bagel();                                \n");
+  // -O0 .. -O2 pick the optimization level; the highest is the default.
+  // --registers compiles to the register instructions instead of the plain
+  // stack machine. --jit compiles hot functions to machine code where the
+  // build supports it. --trace records hot loops into traces and runs those.
+  // --cache reuses the compiled script of an unchanged source file.
+  // --profile=<file> writes the call stacks the script ran under to <file>
+  // for flamegraph.pl, and a flat report to stderr.
+  int argi = 1;
+  bool cache = false;
+  const char* profile = nullptr;
+  for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+    if (std::strcmp(argv[argi], "--cache") == 0) {
+      cache = true;
+      continue;
+    }
+
+    if (std::strcmp(argv[argi], "--registers") == 0) {
+      vm.setExecutionMode(clox::compiler::ExecutionMode::REGISTER);
+      continue;
+    }
+
+    if (std::strcmp(argv[argi], "--jit") == 0) {
+      vm.setJit(true);
+      continue;
+    }
+
+    if (std::strcmp(argv[argi], "--trace") == 0) {
+      vm.setTracing(true);
+      continue;
+    }
+
+#ifdef CLOX_PROFILE
+    if (std::strncmp(argv[argi], "--profile=", 10) == 0 && argv[argi][10] != '\0') {
+      profile = argv[argi] + 10;
+      continue;
+    }
+#endif
+
+    const char* level = argv[argi] + 2;
+    if (std::strncmp(argv[argi], "-O", 2) != 0 ||
+        level[0] < '0' || level[0] > '0' + clox::compiler::MAX_OPTIMIZATION_LEVEL || level[1] != '\0') {
+      fprintf(stderr, "%s", USAGE);
+      return 64;
+    }
+
+    vm.setOptimizationLevel(level[0] - '0');
+  }
+
+  if (argi == argc && !cache && !profile) {
+    repl(vm);
+  } else if (argi + 1 == argc) {
+    int status = runFile(vm, argv[argi], cache);
+#ifdef CLOX_PROFILE
+    if (profile) {
+      vm.profiler().report(stderr);
+      if (!writeProfile(vm, profile))
+        return 74;
+    }
+#endif
+    return status;
+  } else {
+    fprintf(stderr, "%s", USAGE);
+    return 64;
+  }
 
   return 0;
-} 
\ No newline at end of file
+}
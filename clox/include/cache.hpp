@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.hpp"
+#include <array>
+
+namespace clox {
+  namespace vm {
+    // What a property access site learned about receivers of one shape.
+    struct CacheEntry {
+      shape_ptr_t m_Shape;
+      // Field slot, or -1 when the name resolves to a method of the class.
+      int_t m_Slot;
+      closure_ptr_t m_Method;
+      // For stores that add the field: the shape the instance moves to.
+      shape_ptr_t m_Transition;
+    };
+
+    // Inline cache of one property access site, kept in a side table of its
+    // chunk and keyed by receiver shape. Since every class roots its own
+    // shapes, the shape also pins down the class and so its methods.
+    //
+    // A site starts monomorphic and grows polymorphic up to MAX_ENTRIES
+    // shapes; past that it stops learning and misses go to the slow path.
+    struct PropertyCache {
+    public:
+      static constexpr size_t MAX_ENTRIES = 4;
+    public:
+      PropertyCache(const string_ptr_t& name);
+
+      const CacheEntry* find(const shape_ptr_t& shape) const;
+      void add(const CacheEntry& entry);
+
+      void blacken(gc::Collector& gc) const;
+    public:
+      string_ptr_t m_Name;
+      std::array<CacheEntry, MAX_ENTRIES> m_Entries;
+      size_t m_Count;
+      uint64_t m_Hits;
+      uint64_t m_Misses;
+    };
+
+    struct CacheStats {
+      uint64_t m_Hits = 0;
+      uint64_t m_Misses = 0;
+    };
+
+    inline const CacheEntry* PropertyCache::find(const shape_ptr_t& shape) const {
+      for (size_t i = 0; i < m_Count; ++i) {
+        if (m_Entries[i].m_Shape == shape)
+          return &m_Entries[i];
+      }
+
+      return nullptr;
+    }
+  }
+}
@@ -1,61 +1,251 @@
 #pragma once
 
 #include "common.hpp"
+#include "value.hpp"
+#include "cache.hpp"
+#include <cstdio>
+#include <memory>
 
 namespace clox {
   namespace vm {
-    enum class OpCode {
-      CONSTANT,
-      RETURN,
-      NEGATE,
-      ADD,
-      SUBTRACT,
-      MULTIPLY,
-      DIVIDE,
-      NIL,
-      TRUE,
-      FALSE,
-      NOT,
-      EQUAL,
-      GREATER,
-      LESS,
-      PRINT,
-      POP,
-      DEFINE_GLOBAL,
-      GET_GLOBAL,
-      SET_GLOBAL,
-      GET_LOCAL,
-      SET_LOCAL,
-      JUMP_IF_FALSE,
+    // Every opcode, in encoding order. Expanded into the OpCode enum and into
+    // the threaded dispatch table of VM::run, which must agree on the order.
+    //
+    // WIDE carries the high byte and EXTRA_WIDE the two high bytes of the
+    // single-byte operand of the instruction that follows them.
+    //
+    // GET_PROPERTY, SET_PROPERTY and INVOKE take the index of their inline
+    // cache in the chunk's side table, which also records the property name.
+    // INVOKE and SUPER_INVOKE are followed by a one-byte argument count that
+    // the prefixes do not widen.
+    //
+    // The opcodes from NOT_EQUAL on are superinstructions, only ever emitted
+    // by the optimizer. POP_JUMP_IF_FALSE and the compare-and-jumps pop what
+    // they test. ADD_LOCAL_CONSTANT and SUBTRACT_LOCAL_CONSTANT take a local
+    // slot and a constant index, one byte each and never widened.
+    //
+    // The *_NUM opcodes are never compiled. The VM quickens a generic
+    // arithmetic or comparison instruction into one once it sees number
+    // operands there, and turns it back when its guard fails. A site turned
+    // back is pinned to the generic opcode, so that operands of mixed types
+    // cannot flip it back and forth on every execution.
+    //
+    // The opcodes from MOVE on are the register forms, compiled only in
+    // ExecutionMode::REGISTER. They read and write frame slots directly;
+    // their operands are single bytes that are never widened. An _RR form
+    // takes its right operand from a slot and an _RK form from the constant
+    // table.
+#define CLOX_OPCODES(X)        \
+    X(CONSTANT)                \
+    X(RETURN)                  \
+    X(NEGATE)                  \
+    X(ADD)                     \
+    X(SUBTRACT)                \
+    X(MULTIPLY)                \
+    X(DIVIDE)                  \
+    X(NIL)                     \
+    X(TRUE)                    \
+    X(FALSE)                   \
+    X(NOT)                     \
+    X(EQUAL)                   \
+    X(GREATER)                 \
+    X(LESS)                    \
+    X(PRINT)                   \
+    X(POP)                     \
+    X(DEFINE_GLOBAL)           \
+    X(GET_GLOBAL)              \
+    X(SET_GLOBAL)              \
+    X(GET_LOCAL)               \
+    X(SET_LOCAL)               \
+    X(JUMP_IF_FALSE)           \
+    X(JUMP)                    \
+    X(LOOP)                    \
+    X(CALL)                    \
+    X(CLOSURE)                 \
+    X(GET_UPVALUE)             \
+    X(SET_UPVALUE)             \
+    X(CLOSE_UPVALUE)           \
+    X(CLASS)                   \
+    X(GET_PROPERTY)            \
+    X(SET_PROPERTY)            \
+    X(METHOD)                  \
+    X(INHERIT)                 \
+    X(GET_SUPER)               \
+    X(INVOKE)                  \
+    X(SUPER_INVOKE)            \
+    X(NOT_EQUAL)               \
+    X(GREATER_EQUAL)           \
+    X(LESS_EQUAL)              \
+    X(POP_JUMP_IF_FALSE)       \
+    X(JUMP_IF_LESS)            \
+    X(JUMP_IF_NOT_LESS)        \
+    X(JUMP_IF_GREATER)         \
+    X(JUMP_IF_NOT_GREATER)     \
+    X(ADD_LOCAL_CONSTANT)      \
+    X(SUBTRACT_LOCAL_CONSTANT) \
+    X(ADD_NUM)                 \
+    X(SUBTRACT_NUM)            \
+    X(MULTIPLY_NUM)            \
+    X(DIVIDE_NUM)              \
+    X(GREATER_NUM)             \
+    X(LESS_NUM)                \
+    X(GREATER_EQUAL_NUM)       \
+    X(LESS_EQUAL_NUM)          \
+    X(MOVE)                    \
+    X(LOAD_CONSTANT)           \
+    X(ADD_RR)                  \
+    X(SUBTRACT_RR)             \
+    X(MULTIPLY_RR)             \
+    X(DIVIDE_RR)               \
+    X(ADD_RK)                  \
+    X(SUBTRACT_RK)             \
+    X(MULTIPLY_RK)             \
+    X(DIVIDE_RK)               \
+    X(JUMP_IF_LESS_RR)         \
+    X(JUMP_IF_NOT_LESS_RR)     \
+    X(JUMP_IF_GREATER_RR)      \
+    X(JUMP_IF_NOT_GREATER_RR)  \
+    X(JUMP_IF_LESS_RK)         \
+    X(JUMP_IF_NOT_LESS_RK)     \
+    X(JUMP_IF_GREATER_RK)      \
+    X(JUMP_IF_NOT_GREATER_RK)  \
+    X(WIDE)                    \
+    X(EXTRA_WIDE)
+
+    enum class OpCode : byte_t {
+#define CLOX_OPCODE_ENUM(name) name,
+      CLOX_OPCODES(CLOX_OPCODE_ENUM)
+#undef CLOX_OPCODE_ENUM
+    };
+
+    // Largest operand encodable with the 1-, 2- and 3-byte forms.
+    constexpr size_t MAX_OPERAND = 0xFFFFFF;
+    // Jump operands are always two bytes wide.
+    constexpr size_t MAX_JUMP = UINT16_MAX;
+    // Argument counts fit the one-byte operand of INVOKE.
+    constexpr size_t MAX_ARGS = UINT8_MAX;
+
+    // How the operand bytes that follow an opcode are laid out.
+    enum class OperandFormat {
+      NONE,
+      // One operand, widened by WIDE / EXTRA_WIDE.
+      OPERAND,
+      // One widenable operand and a one-byte argument count.
+      INVOKE,
+      // A two-byte jump offset.
       JUMP,
-      LOOP,
-      CALL,
-      CLOSURE
+      // A one-byte local slot and a one-byte constant index.
+      LOCAL_CONSTANT,
+      // A destination slot and a source slot.
+      MOVE,
+      // A destination slot, a left operand slot and a right operand slot or
+      // constant.
+      THREE_ADDRESS,
+      // A left operand slot, a right operand slot or constant, and a
+      // two-byte jump offset.
+      REGISTER_JUMP,
+    };
+
+    OperandFormat operandFormat(const OpCode& code);
+    // Bytes of operands that follow an opcode of this format, not counting
+    // any prefix.
+    size_t operandSize(const OperandFormat& format);
+    // Mnemonic of `code`, as the disassembler prints it.
+    const char* opcodeName(const OpCode& code);
+    // Bytes of WIDE / EXTRA_WIDE prefix an operand this large needs.
+    size_t prefixSize(size_t operand);
+
+    // Net change in stack height caused by one instruction. `count` is the
+    // argument count of CALL, INVOKE and SUPER_INVOKE and ignored otherwise.
+    int_t stackEffect(const OpCode& code, size_t count);
+
+    // Consecutive bytes compiled from the same source line share one entry:
+    // the run starting at m_Offset and ending where the next run starts.
+    // Both fields are 32 bits wide so that an entry takes 8 bytes, not 16.
+    struct LineRun {
+      uint32_t m_Offset;
+      uint32_t m_Line;
     };
 
     class Chunk {
     public:
-      void write(const byte_code_t& code, int_t line);
-      void replace(size_t offset, const byte_code_t& code);
+      Chunk(void);
+
+      void write(byte_t byte, int_t line);
+      void write(const OpCode& code, int_t line);
+      void write(const OpCode& code, size_t operand, int_t line);
+      void writeShort(uint16_t value, int_t line);
+      void replace(size_t offset, uint16_t value);
       size_t addConstant(const value_t& value);
+      // Side table of inline caches, one per property access site.
+      size_t addCache(const string_ptr_t& name);
+      // Side table of the VM global slots the code uses. Global operands
+      // index it rather than the VM's table, so code does not depend on
+      // the slots a VM happens to give each name.
+      size_t addGlobal(size_t slot);
+      // Runs the code and line runs of an image, and its constants unless
+      // `constants` is null, where the image is mapped: `image` stays mapped
+      // as long as the chunk. Quickening writes to the mapped code, which
+      // must be private to the process.
+      void borrow(const std::shared_ptr<void>& image, byte_t* code, size_t size, line_run_vec_t lines,
+                  value_t* constants, size_t count);
+      size_t constantCount(void) const;
+      size_t cacheCount(void) const;
+      size_t globalCount(void) const;
+      // Drops the code and its line numbers but keeps the constants and
+      // caches, for the optimizer to write the rewritten code back.
+      void resetCode(void);
+      // Keeps the instruction at `offset` from being quickened again.
+      void pin(size_t offset);
+      bool isPinned(size_t offset) const;
       size_t size(void) const;
       void disassemble(const string_t& name) const;
 
-      const OpCode& readByte(size_t offset);
-      size_t readOffset(size_t offset);
-      const value_t& readConstant(size_t offset);
-      void printValue(const value_t& value) const;
+      byte_t readByte(size_t offset) const;
+      uint16_t readShort(size_t offset) const;
+      const value_t& readConstant(size_t offset) const;
+      // Binary search over the line runs, so only error reporting and the
+      // disassembler pay for it.
+      int_t readLine(size_t offset) const;
+      const line_run_vec_t& lineRuns(void) const;
+      const byte_t* code(void) const;
+      const value_t* constants(void) const;
+      const size_t* globals(void) const;
+      PropertyCache* caches(void);
+      const PropertyCache& readCache(size_t offset) const;
+      void printValue(FILE* out, const value_t& value) const;
+      void blacken(gc::Collector& gc) const;
     private:
       size_t disassemble(size_t offset) const;
 
       size_t simpleInstruction(const string_t& name, size_t offset) const;
-      size_t constantInstruction(const string_t& name, size_t offset) const;
-      size_t byteInstruction(const string_t& name, size_t offset) const;
+      size_t constantInstruction(const string_t& name, size_t offset, size_t ext) const;
+      size_t cacheInstruction(const string_t& name, size_t offset, size_t ext) const;
+      size_t invokeInstruction(const string_t& name, size_t offset, size_t ext) const;
+      size_t superInvokeInstruction(const string_t& name, size_t offset, size_t ext) const;
+      size_t globalInstruction(const string_t& name, size_t offset, size_t ext) const;
+      size_t closureInstruction(size_t offset, size_t ext) const;
+      size_t byteInstruction(const string_t& name, size_t offset, size_t ext) const;
       size_t jumpInstruction(const string_t& name, int_t sign, size_t offset) const;
+      size_t localConstantInstruction(const string_t& name, size_t offset) const;
+      size_t moveInstruction(const string_t& name, size_t offset) const;
+      size_t threeAddressInstruction(const string_t& name, bool constant, size_t offset) const;
+      size_t registerJumpInstruction(const string_t& name, bool constant, size_t offset) const;
     private:
-      byte_code_vec_t m_ByteCodes;
+      byte_vec_t m_Code;
       value_vec_t m_Constants;
-      int_vec_t m_Lines;
+      cache_vec_t m_Caches;
+      index_vec_t m_Globals;
+      line_run_vec_t m_Lines;
+      // One flag per byte of code, allocated at the first pin.
+      bool_vec_t m_Pinned;
+      // Set when the code, and maybe the constants, are borrowed from an
+      // image instead of held in m_Code and m_Constants.
+      std::shared_ptr<void> m_Image;
+      byte_t* m_ImageCode;
+      size_t m_ImageSize;
+      value_t* m_ImageConstants;
+      size_t m_ImageConstantCount;
     };
   }
 }
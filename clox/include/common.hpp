@@ -10,13 +10,21 @@
 namespace clox {
 
   namespace vm {
-    enum class OpCode;
+    enum class OpCode : uint8_t;
     class Chunk;
+    struct PropertyCache;
+    struct LineRun;
 
     enum class InterpretResult;
     class VM;
 
     struct CallFrame;
+
+    struct Global;
+    class GlobalTable;
+
+    class Profiler;
+    struct RunStats;
   }
 
   namespace scanner {
@@ -30,7 +38,25 @@ namespace clox {
     class Compiler;
     struct Local;
     enum class FunctionType;
+    enum class ExecutionMode;
     struct Scope;
+    struct ClassScope;
+  }
+
+  namespace jit {
+    enum class Exit : uint32_t;
+    struct Call;
+    struct Runtime;
+    class Code;
+  }
+
+  namespace trace {
+    class Loops;
+  }
+
+  namespace gc {
+    struct Stats;
+    class Collector;
   }
 
   namespace obj {
@@ -38,6 +64,13 @@ namespace clox {
     struct String;
     struct Function;
     struct Closure;
+    struct Upvalue;
+    struct Capture;
+    struct Shape;
+    struct Class;
+    struct Instance;
+    struct BoundMethod;
+    struct Native;
   }
 
   namespace util {
@@ -53,25 +86,44 @@ namespace clox {
   using string_ptr_t = obj::String*;
   using function_ptr_t = obj::Function*;
   using closure_ptr_t = obj::Closure*;
+  using upvalue_ptr_t = obj::Upvalue*;
+  using shape_ptr_t = obj::Shape*;
+  using class_ptr_t = obj::Class*;
+  using instance_ptr_t = obj::Instance*;
+  using bound_method_ptr_t = obj::BoundMethod*;
+  using native_ptr_t = obj::Native*;
+  using native_code_ptr_t = jit::Code*;
+  using loops_ptr_t = trace::Loops*;
 
-  using byte_code_t = std::variant<vm::OpCode, size_t>;
-  using byte_code_vec_t = std::vector<byte_code_t>;
+  using capture_vec_t = std::vector<obj::Capture>;
 
-  using value_t = std::variant<dbl_t,
-                               bool, 
-                               nullptr_t,
-                               obj_ptr_t>;
-  using value_vec_t = std::vector<value_t>;
-  using value_stack_t = std::vector<value_t>;
+  using obj_vec_t = std::vector<obj_ptr_t>;
+  using string_vec_t = std::vector<string_ptr_t>;
 
-  using int_vec_t = std::vector<int_t>;
+  using method_table_t = std::unordered_map<string_ptr_t, closure_ptr_t>;
+  using transition_table_t = std::unordered_map<string_ptr_t, shape_ptr_t>;
 
-  using global_table_t = std::unordered_map<string_t, value_t>;
+  using byte_t = uint8_t;
+  using byte_vec_t = std::vector<byte_t>;
+  using bool_vec_t = std::vector<bool>;
+
+  using cache_vec_t = std::vector<vm::PropertyCache>;
+  using line_run_vec_t = std::vector<vm::LineRun>;
+
+  using int_vec_t = std::vector<int_t>;
+  using index_vec_t = std::vector<size_t>;
 
   using local_vec_t = std::vector<compiler::Local>;
 
-  using call_frame_vec_t = std::vector<vm::CallFrame>;
+  using call_frame_stack_t = std::unique_ptr<vm::CallFrame[]>;
+
+  using global_vec_t = std::vector<vm::Global>;
+  using global_index_table_t = std::unordered_map<string_ptr_t, size_t>;
+
+  using jump_height_table_t = std::unordered_map<size_t, int_t>;
+  using global_operand_table_t = std::unordered_map<size_t, size_t>;
 
   using scope_ptr_t = compiler::Scope*;
+  using class_scope_ptr_t = compiler::ClassScope*;
   using chunk_ptr_t = vm::Chunk*;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "common.hpp"
 #include "scanner.hpp"
 #include "object.hpp"
+#include <array>
 
 namespace clox {
   using namespace scanner;
@@ -46,29 +47,24 @@ namespace clox {
       Precedence m_Prec;
     };
 
-    namespace {
-      struct Hash {
-        template<typename T>
-        size_t operator()(const T& t) const {
-          return static_cast<size_t>(t);
-        }
-      };
-    }
-
     struct Local {
       Token m_Token;
       int m_Depth;
+      bool m_IsCaptured;
     };
 
     enum class FunctionType {
       CLOSURE,
       FUNCTION,
+      INITIALIZER,
+      METHOD,
       SCRIPT
     };
 
     struct Scope {
       Scope(const scope_ptr_t& enclosing,
-            const FunctionType& type);
+            const FunctionType& type,
+            gc::Collector& gc);
 
       scope_ptr_t m_Enclosing;
 
@@ -77,15 +73,38 @@ namespace clox {
 
       local_vec_t m_Locals;
       int_t m_Depth;
+
+      // Stack height the code emitted so far leaves behind, and the height
+      // recorded at each forward jump still to be patched.
+      int_t m_StackHeight;
+      jump_height_table_t m_JumpHeights;
+
+      // Index in the chunk's global table of each VM slot used so far.
+      global_operand_table_t m_GlobalOperands;
     };
 
-    using parse_rule_table_t = std::unordered_map<TokenType, ParseRule, Hash>;
+    // The class whose body is being compiled, for resolving 'this' and 'super'.
+    struct ClassScope {
+      class_scope_ptr_t m_Enclosing;
+      bool m_HasSuperclass;
+    };
+
+    using parse_rule_table_t = std::array<ParseRule, TOKEN_TYPE_COUNT>;
 
     class Compiler {
     public:
-      //void compile(const string_t& source);
-      Compiler(void);
+      // `optimizationLevel` is passed to compiler::optimize for every
+      // function compiled. Errors are reported to `err`.
+      Compiler(gc::Collector& gc, GlobalTable& globals, int_t optimizationLevel, const ExecutionMode& mode,
+               FILE* err);
+      ~Compiler(void);
+
+      Compiler(const Compiler&) = delete;
+      Compiler& operator=(const Compiler&) = delete;
+
       function_ptr_t compile(const string_t& source);
+      // Functions still being compiled are only reachable from here.
+      void markRoots(gc::Collector& gc) const;
     private:
       void advance(void);
       void consume(const TokenType& type, const string_t& message);
@@ -94,6 +113,8 @@ namespace clox {
 
       void varDeclaration(void);
       void funDeclaration(void);
+      void classDeclaration(void);
+      void method(void);
 
       void statement(void);
       void printStatement(void);
@@ -117,9 +138,12 @@ namespace clox {
       void endScope(void);
 
     private:
-      void emitByte(const byte_code_t& code);
-      void emitBytes(const byte_code_vec_t& codes);
+      void adjustStack(int_t delta);
+      void emitByte(const OpCode& code);
+      void emitBytes(const OpCode& first, const OpCode& second);
+      void emitBytes(const OpCode& code, size_t operand);
       void emitConstant(const value_t& value);
+      void emitInvoke(const OpCode& code, size_t operand, size_t count);
       void emitReturn(void);
       size_t emitJump(const OpCode& jump);
       void patchJump(size_t offset);
@@ -127,8 +151,10 @@ namespace clox {
       function_ptr_t endCompiler(void);
 
       size_t makeConstant(const value_t& value);
+      size_t makeCache(const Token& token);
       size_t parseVariable(const char* message);
       size_t identifierConstant(const Token& token);
+      size_t globalSlot(const Token& token);
       void defineVariable(size_t offset);
       void declareVariable(void);
       void addLocal(const Token& token);
@@ -144,22 +170,33 @@ namespace clox {
       void and_(bool canAssign);
       void or_(bool canAssign);
       void call(bool canAssign);
+      void dot(bool canAssign);
+      void this_(bool canAssign);
+      void super_(bool canAssign);
 
       void parse(const Precedence& prec);
       void namedVariable(const Token& token, bool canAssign);
 
-      int_t resolveLocal(const Token& token);
+      int_t resolveLocal(Scope& scope, const Token& token);
+      int_t resolveUpvalue(Scope& scope, const Token& token);
+      int_t addUpvalue(Scope& scope, size_t index, bool isLocal);
 
-      static parse_rule_table_t getParseRules(void);
-      ParseRule parseRule(const TokenType& type);
+      static const parse_rule_table_t& getParseRules(void);
+      const ParseRule& parseRule(const TokenType& type) const;
 
       void function(const FunctionType& type);
       size_t argumentList(void);
     private:
+      gc::Collector& m_Collector;
+      GlobalTable& m_Globals;
       chunk_ptr_t m_Chunk;
       Scope m_Scope;
+      class_scope_ptr_t m_Class;
       Parser m_Parser;
       Scanner m_Scanner;
+      int_t m_OptimizationLevel;
+      ExecutionMode m_Mode;
+      FILE* m_Err;
     };
   }
 }
\ No newline at end of file
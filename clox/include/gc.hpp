@@ -0,0 +1,133 @@
+#pragma once
+
+#include "common.hpp"
+#include "value.hpp"
+#include <chrono>
+#include <string_view>
+#include <unordered_set>
+
+namespace clox {
+  namespace gc {
+    struct Stats {
+      size_t m_BytesAllocated = 0;
+      size_t m_BytesFreed = 0;
+      size_t m_ObjectsAllocated = 0;
+      size_t m_ObjectsFreed = 0;
+      size_t m_Collections = 0;
+      std::chrono::nanoseconds m_TotalPause{ 0 };
+      std::chrono::nanoseconds m_MaxPause{ 0 };
+    };
+
+    // Interned strings are keyed on the hash cached in each String, and can
+    // be looked up by contents without allocating a String first.
+    struct StringKey {
+      std::string_view m_Str;
+      uint32_t m_Hash;
+    };
+
+    struct StringHash {
+      using is_transparent = void;
+      size_t operator()(const string_ptr_t& string) const;
+      size_t operator()(const StringKey& key) const;
+    };
+
+    struct StringEqual {
+      using is_transparent = void;
+      bool operator()(const string_ptr_t& left, const string_ptr_t& right) const;
+      bool operator()(const StringKey& left, const string_ptr_t& right) const;
+      bool operator()(const string_ptr_t& left, const StringKey& right) const;
+    };
+
+    using string_set_t = std::unordered_set<string_ptr_t, StringHash, StringEqual>;
+
+    // Tracing mark-sweep collector owning every object allocated for one VM.
+    // A collection runs whenever the live heap grows past a threshold, which
+    // is then reset to a multiple of what survived.
+    class Collector {
+    public:
+      static constexpr size_t INITIAL_THRESHOLD = 1024 * 1024;
+      static constexpr size_t GROW_FACTOR = 2;
+    public:
+      Collector(vm::VM& vm);
+      ~Collector(void);
+
+      Collector(const Collector&) = delete;
+      Collector(Collector&&) = delete;
+      Collector& operator=(const Collector&) = delete;
+      Collector& operator=(Collector&&) = delete;
+
+      template<typename T, typename... Args>
+      T* allocate(Args&&... args);
+      // For objects laid out with a trailing array of `count` elements.
+      template<typename T, typename... Args>
+      T* allocateTrailing(size_t count, Args&&... args);
+
+      // Charges what `object` has grown by since its size() was `before`,
+      // for objects whose containers grow after allocation. This may run a
+      // collection, so `object` has to be reachable.
+      void grow(obj_ptr_t object, size_t before);
+
+      void markObject(obj_ptr_t object);
+      void markValue(const value_t& value);
+      void collect(void);
+
+      void setCompiler(compiler::Compiler* compiler);
+      // Keeps `object` alive until the matching popRoot, for object graphs
+      // built outside the VM's reach, such as a bytecode image being loaded.
+      void pushRoot(obj_ptr_t object);
+      void popRoot(void);
+
+      string_ptr_t findString(std::string_view str, uint32_t hash) const;
+      void intern(string_ptr_t string);
+
+      size_t bytesInUse(void) const;
+      const Stats& stats(void) const;
+    private:
+      void markRoots(void);
+      void traceReferences(void);
+      void sweep(void);
+      void removeUnmarkedStrings(void);
+
+      void reserve(size_t size);
+      template<typename T>
+      T* track(T* object);
+    private:
+      vm::VM& m_VM;
+      compiler::Compiler* m_Compiler;
+      obj_vec_t m_Roots;
+
+      obj_ptr_t m_Objects;
+      obj_vec_t m_Gray;
+      // Weak: entries do not keep their strings alive.
+      string_set_t m_Strings;
+
+      size_t m_BytesInUse;
+      size_t m_NextGC;
+      Stats m_Stats;
+    };
+
+    template<typename T, typename... Args>
+    T* Collector::allocate(Args&&... args) {
+      reserve(sizeof(T));
+      return track(new T(std::forward<Args>(args)...));
+    }
+
+    template<typename T, typename... Args>
+    T* Collector::allocateTrailing(size_t count, Args&&... args) {
+      reserve(sizeof(T));
+      return track(new (typename T::Trailing{ count }) T(std::forward<Args>(args)...));
+    }
+
+    template<typename T>
+    T* Collector::track(T* object) {
+      object->m_Next = m_Objects;
+      m_Objects = object;
+
+      size_t size = object->size();
+      m_BytesInUse += size;
+      m_Stats.m_BytesAllocated += size;
+      ++m_Stats.m_ObjectsAllocated;
+      return object;
+    }
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.hpp"
+#include "value.hpp"
+
+namespace clox {
+  namespace vm {
+    struct Global {
+      value_t m_Value;
+      string_ptr_t m_Name;
+      bool m_Defined;
+    };
+
+    // VM-wide global variables. The compiler resolves each global name to a
+    // slot once, so the VM reads and writes globals by index. The by-name
+    // side table keeps the slot of a name stable across interpret() calls,
+    // which lets a later script (or REPL line) use or redefine a global
+    // declared by an earlier one.
+    class GlobalTable {
+    public:
+      GlobalTable(void) = default;
+
+      size_t resolve(const string_ptr_t& name);
+      size_t size(void) const;
+
+      Global& operator[](size_t slot);
+      const Global& operator[](size_t slot) const;
+      // Slot 0; moves only when a new name is resolved.
+      Global* data(void);
+
+      void markRoots(gc::Collector& gc) const;
+    private:
+      global_vec_t m_Slots;
+      global_index_table_t m_Indices;
+    };
+  }
+}
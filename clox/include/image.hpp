@@ -0,0 +1,45 @@
+#pragma once
+
+#include "common.hpp"
+#include <string_view>
+
+namespace clox {
+  namespace image {
+    // A bytecode image is a compiled script saved to disk, so that later runs
+    // of the same source skip scanning and compiling. Bump VERSION whenever
+    // the layout or the instruction set changes.
+    constexpr uint32_t VERSION = 3;
+
+    // What an image records of the source it was compiled from. Size and
+    // modification time are checked first, so an unchanged file is not read;
+    // the hash catches a file that was touched but not changed.
+    struct Source {
+      uint64_t m_Size;
+      int64_t m_ModifiedTime;
+      uint64_t m_Hash;
+    };
+
+    uint64_t hashSource(std::string_view source);
+
+    // Fills in the size and modification time of the file at `path`, leaving
+    // the hash alone. Returns false if the file cannot be inspected.
+    bool describeSource(const string_t& path, Source& source);
+
+    bool readSource(const string_t& path, string_t& text);
+
+    // Writes the script `function` and every function nested in it. Global
+    // names are stored rather than slots, so the image does not depend on
+    // the global table of the VM that compiled it. Returns false if the file
+    // could not be written.
+    bool save(const string_t& path, const obj::Function& function, const vm::GlobalTable& globals,
+              const Source& source, int_t optimizationLevel, compiler::ExecutionMode mode);
+
+    // Loads the image at `path` if this build wrote it for `source`, compiled
+    // at `optimizationLevel` for `mode`. The source matches on its hash if
+    // `byHash` is set, and on size and modification time otherwise. Global
+    // names are resolved in `globals`. Returns nullptr if there is no such
+    // image or it is damaged; the source has to be compiled then.
+    function_ptr_t load(const string_t& path, gc::Collector& gc, vm::GlobalTable& globals, const Source& source,
+                        bool byHash, int_t optimizationLevel, compiler::ExecutionMode mode);
+  }
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.hpp"
+#include "value.hpp"
+
+// The native code follows the System V x86-64 calling convention and works
+// on NaN-boxed words. Profiled builds leave it out, since the profiler has to
+// see every instruction.
+#if defined(CLOX_JIT) && defined(CLOX_NAN_BOXING) && !defined(CLOX_PROFILE) && \
+    defined(__x86_64__) && defined(__linux__)
+#define CLOX_JIT_ENABLED 1
+#else
+#define CLOX_JIT_ENABLED 0
+#endif
+
+namespace clox {
+  namespace jit {
+    constexpr bool SUPPORTED = CLOX_JIT_ENABLED;
+
+    // Calls plus loop iterations of a function, counted in the interpreter,
+    // after which it is compiled.
+    constexpr size_t HOT_THRESHOLD = 1000;
+
+    // How native code gave a frame back.
+    enum class Exit : uint32_t {
+      // The function returned; its result replaced the callee and arguments.
+      RETURNED,
+      // The interpreter carries on with the frame on top, from its m_IP.
+      INTERPRET,
+      // A runtime error has been reported.
+      RUNTIME_ERROR,
+    };
+
+    // What a call from native code did. A callee with native code has its
+    // frame pushed and is left to the caller to enter at m_Entry, nested in
+    // its own native frame; the Exit is then RETURNED.
+    struct Call {
+      Exit m_Exit;
+      const byte_t* m_Entry;
+    };
+
+    // The slow paths native code calls back into the VM for. Each works on
+    // the VM stack the way the instruction it stands in for does; those
+    // returning bool report whether it succeeded. A failed one has left the
+    // stack alone for the interpreter to run the instruction and report the
+    // error. Operands that are not numbers are an error for every other
+    // arithmetic and comparison, which native code leaves to the interpreter
+    // without calling back.
+    struct Runtime {
+      // ADD and ADD_RR / ADD_RK, on operands that are not both numbers.
+      bool (*m_Add)(vm::VM& vm);
+      bool (*m_RegisterAdd)(vm::VM& vm, value_t* destination, const value_t* left, const value_t* right);
+      // Property accesses other than fields of the shape a site's cache
+      // first saw, which native code reads and writes itself.
+      bool (*m_GetProperty)(vm::VM& vm, vm::PropertyCache& cache);
+      bool (*m_SetProperty)(vm::VM& vm, vm::PropertyCache& cache);
+      void (*m_Print)(vm::VM& vm);
+      // CALL and INVOKE, with `ip` the instruction after them. RETURNED
+      // without an entry means the call is complete.
+      Call (*m_Call)(vm::VM& vm, vm::CallFrame& frame, size_t count, const byte_t* ip);
+      Call (*m_Invoke)(vm::VM& vm, vm::CallFrame& frame, vm::PropertyCache& cache, size_t count, const byte_t* ip);
+      // Returns from the running function, unless it is the script: the
+      // interpreter ends the run.
+      bool (*m_Return)(vm::VM& vm);
+    };
+
+    // The machine code of one function: one template per instruction, with
+    // the value stack kept in memory, so the interpreter and the native code
+    // can hand a frame back and forth at any instruction. Instructions
+    // without a template are left to the interpreter, as are guards that
+    // fail; calls of functions that have not been compiled, and whatever
+    // called into them natively, carry on in the interpreter too.
+    class Code {
+    public:
+      Code(byte_t* memory, size_t capacity, const byte_t* start, const byte_t* bytecode, std::vector<uint32_t> entries,
+           uint32_t nested);
+      ~Code(void);
+
+      Code(const Code&) = delete;
+      Code& operator=(const Code&) = delete;
+
+      // Runs `frame` from its m_IP, which must start an instruction, with
+      // `top` the top of the VM stack.
+      Exit run(vm::VM& vm, value_t*& top, vm::CallFrame& frame, vm::Global* globals) const;
+      // Where native code calls the function from, with its frame just
+      // pushed above the caller's.
+      const byte_t* nested(void) const;
+    private:
+      byte_t* m_Memory;
+      size_t m_Capacity;
+      // Where in m_Memory the code starts, which varies from one function
+      // to the next.
+      const byte_t* m_Start;
+      const byte_t* m_Bytecode;
+      // Offset from m_Start of the template of each instruction, by the
+      // bytecode offset the instruction starts at.
+      std::vector<uint32_t> m_Entries;
+      uint32_t m_Nested;
+    };
+
+    // Compiles `function` to native code. Returns nullptr where native code
+    // is not supported or executable memory could not be mapped, and for
+    // functions that would spend most of their instructions calling back
+    // into the VM or invoking methods left to the interpreter, which the
+    // interpreter runs faster.
+    Code* compile(obj::Function& function, const Runtime& runtime);
+  }
+}
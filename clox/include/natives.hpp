@@ -0,0 +1,16 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace clox {
+  namespace natives {
+    // Defines the built-in natives as globals of `vm`. Arguments of the wrong
+    // type are runtime errors.
+    //   clock()           seconds since the program started
+    //   sqrt(x), floor(x), abs(x), pow(x, y)
+    //   min(x, ...), max(x, ...)
+    //   len(s)            length of a string in bytes
+    //   ord(s, i)         byte value of s[i], or nil if out of range
+    void defineAll(vm::VM& vm);
+  }
+}
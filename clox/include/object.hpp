@@ -2,48 +2,276 @@
 
 #include "common.hpp"
 #include "chunk.hpp"
+#include <cassert>
+#include <cstdio>
 
 namespace clox {
   namespace obj {
+    // One tag per concrete object type. Type checks and printing switch on
+    // the tag instead of going through RTTI or a virtual call.
+    enum class ObjType : uint8_t {
+      STRING,
+      FUNCTION,
+      CLOSURE,
+      UPVALUE,
+      SHAPE,
+      CLASS,
+      INSTANCE,
+      BOUND_METHOD,
+      NATIVE,
+    };
+
     struct Object {
     public:
-      Object(void) = default;
+      Object(const ObjType& type) : m_Type(type) { }
       virtual ~Object(void) = default;
     public:
-      virtual void print(void) const = 0;
+      void print(FILE* out) const;
+      // Marks every object directly referenced by this one.
+      virtual void blacken(gc::Collector& gc) const = 0;
+      // Bytes charged to the collector for this object. Must not change
+      // while the object is alive.
+      virtual size_t size(void) const = 0;
     public:
-      static string_ptr_t formStringObject(const string_t& str);
-      static function_ptr_t formFunctionObject(void);
-      static closure_ptr_t formClosureObject(const function_ptr_t& function);
+      // Strings are interned: equal contents always yield the same object.
+      static string_ptr_t formStringObject(gc::Collector& gc, std::string_view str);
+      static function_ptr_t formFunctionObject(gc::Collector& gc);
+      static closure_ptr_t formClosureObject(gc::Collector& gc, const function_ptr_t& function);
+      static upvalue_ptr_t formUpvalueObject(gc::Collector& gc, value_t* slot);
+      static shape_ptr_t formShapeObject(gc::Collector& gc);
+      // The class takes ownership of `shape` as the root of its instances' shapes.
+      static class_ptr_t formClassObject(gc::Collector& gc, const string_ptr_t& name, const shape_ptr_t& shape);
+      static instance_ptr_t formInstanceObject(gc::Collector& gc, const class_ptr_t& klass);
+      static bound_method_ptr_t formBoundMethodObject(gc::Collector& gc, const value_t& receiver, const closure_ptr_t& method);
+      static native_ptr_t formNativeObject(gc::Collector& gc, native_fn_t function, int_t arity);
+    public:
+      const ObjType m_Type;
+      bool m_Marked = false;
+      obj_ptr_t m_Next = nullptr;
     };
 
     struct String final : public Object {
     public:
-      String(const string_t& str);
+      static constexpr ObjType TYPE = ObjType::STRING;
+    public:
+      String(string_t str, uint32_t hash);
     public:
-      virtual void print(void) const override;
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      static uint32_t hash(std::string_view str);
     public:
       string_t m_Str;
+      uint32_t m_Hash;
+    };
+
+    // Where a closure finds one of its upvalues when it is created: a local
+    // slot of the enclosing function, or an upvalue of the enclosing closure.
+    struct Capture {
+      bool m_IsLocal;
+      uint32_t m_Index;
     };
 
     struct Function final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::FUNCTION;
     public:
       Function(void);
+      virtual ~Function(void) override;
     public:
-      virtual void print(void) const override;
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
     public:
       string_t m_Name;
       size_t m_Arity;
+      // Most stack slots a call needs, counting the callee slot, so the VM
+      // can check for overflow once per call.
+      size_t m_MaxStack;
       vm::Chunk m_Chunk;
+      capture_vec_t m_Captures;
+      // Calls and loop iterations counted while the JIT is on, and the
+      // native code compiled once they reach jit::HOT_THRESHOLD.
+      size_t m_Hotness;
+      native_code_ptr_t m_Native;
+      // The loops traced while tracing is on, created at the first back-edge.
+      loops_ptr_t m_Loops;
     };
 
+    // A closure and its upvalue pointers form one contiguous allocation: the
+    // pointers are laid out right after the object itself.
     struct Closure final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::CLOSURE;
+    public:
+      struct Trailing {
+        size_t m_Count;
+      };
     public:
       Closure(const function_ptr_t& function);
     public:
-      virtual void print(void) const override;
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      upvalue_ptr_t* upvalues(void);
+      const upvalue_ptr_t* upvalues(void) const;
+    public:
+      static void* operator new(size_t size, Trailing trailing);
+      static void operator delete(void* memory, Trailing trailing);
+      static void operator delete(void* memory);
     public:
       function_ptr_t m_Function;
+      size_t m_UpvalueCount;
+    };
+
+    // A variable captured by a closure. While the variable is still on the
+    // stack the upvalue is open and m_Location points at its stack slot; once
+    // the slot is popped the value moves into m_Closed and m_Location points
+    // there instead.
+    struct Upvalue final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::UPVALUE;
+    public:
+      Upvalue(value_t* slot);
+    public:
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      value_t* m_Location;
+      value_t m_Closed;
+      // Open upvalues form a list sorted by slot address, highest first.
+      upvalue_ptr_t m_NextOpen;
+    };
+
+    // The layout of an instance: which field lives in which slot. Instances
+    // that gained the same fields in the same order share one shape, so a
+    // field lookup is a search of the shape's keys followed by an index into
+    // the instance's dense field array.
+    //
+    // Every class roots its own tree of shapes. Adding a field follows (or
+    // creates) the transition labelled with its name. Transitions are strong
+    // references, so a tree lives as long as its class.
+    struct Shape final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::SHAPE;
+    public:
+      Shape(void);
+      Shape(const shape_ptr_t& parent, const string_ptr_t& key);
+    public:
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      // Slot of `key`, or -1 if instances of this shape have no such field.
+      int_t find(const string_ptr_t& key) const;
+      // The shape reached by adding the field `key` to this one.
+      shape_ptr_t transition(gc::Collector& gc, const string_ptr_t& key);
+    public:
+      shape_ptr_t m_Parent;
+      // Field names, indexed by slot.
+      string_vec_t m_Keys;
+      transition_table_t m_Transitions;
+    };
+
+    struct Class final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::CLASS;
+    public:
+      Class(const string_ptr_t& name, const shape_ptr_t& shape);
+    public:
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      string_ptr_t m_Name;
+      method_table_t m_Methods;
+      // Cached "init" method, or null if the class has none.
+      closure_ptr_t m_Initializer;
+      // Shape of a freshly created instance.
+      shape_ptr_t m_Shape;
+      // Most fields any instance has grown to; new instances reserve this
+      // many slots up front.
+      size_t m_FieldHint;
+    };
+
+    struct Instance final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::INSTANCE;
+    public:
+      Instance(const class_ptr_t& klass);
+      virtual ~Instance(void) override;
+    public:
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      // Appends a field, moving to `shape`, the transition for its name, and
+      // charges any growth of the fields to `gc`.
+      void addField(gc::Collector& gc, const shape_ptr_t& shape, const value_t& value);
+    public:
+      class_ptr_t m_Class;
+      shape_ptr_t m_Shape;
+      // One value per key of m_Shape. A plain array rather than a vector,
+      // so that native code can load the pointer and index it.
+      value_t* m_Fields;
+      size_t m_FieldCount;
+      size_t m_FieldCapacity;
     };
+
+    struct BoundMethod final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::BOUND_METHOD;
+    public:
+      BoundMethod(const value_t& receiver, const closure_ptr_t& method);
+    public:
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      value_t m_Receiver;
+      closure_ptr_t m_Method;
+    };
+
+    struct Native final : public Object {
+    public:
+      static constexpr ObjType TYPE = ObjType::NATIVE;
+      // Arity of natives that take any number of arguments.
+      static constexpr int_t VARIADIC = -1;
+    public:
+      Native(native_fn_t function, int_t arity);
+    public:
+      void print(FILE* out) const;
+      virtual void blacken(gc::Collector& gc) const override;
+      virtual size_t size(void) const override;
+    public:
+      native_fn_t m_Function;
+      int_t m_Arity;
+    };
+
+    template<typename T>
+    inline T* objCast(obj_ptr_t object) {
+      assert(object->m_Type == T::TYPE);
+      return static_cast<T*>(object);
+    }
+
+    template<typename T>
+    inline const T* objCast(const Object* object) {
+      assert(object->m_Type == T::TYPE);
+      return static_cast<const T*>(object);
+    }
+
+    template<typename T>
+    inline bool isObjType(const value_t& value) {
+      return isObj(value) && asObj(value)->m_Type == T::TYPE;
+    }
+
+    // The value must hold an object of type T; checked in debug builds only.
+    template<typename T>
+    inline T* asObjType(const value_t& value) {
+      return objCast<T>(asObj(value));
+    }
   }
 }
\ No newline at end of file
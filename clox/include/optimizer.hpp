@@ -0,0 +1,30 @@
+#pragma once
+
+#include "common.hpp"
+#include "chunk.hpp"
+
+namespace clox {
+  namespace compiler {
+    // How much work the compiler puts into each function's bytecode once it
+    // is complete:
+    //   0  none; the code is exactly what the parser emitted
+    //   1  constant folding, jump threading and dead code removal
+    //   2  also fuses common sequences into superinstructions
+    constexpr int_t MAX_OPTIMIZATION_LEVEL = 2;
+
+    // The instruction set code is compiled to. REGISTER keeps the stack
+    // machine for calls and objects, but turns assignments, arithmetic and
+    // compare-and-branch on locals into register instructions that work on
+    // frame slots directly, instead of going through the stack. It builds on
+    // the superinstructions, so it fuses them at every level.
+    enum class ExecutionMode {
+      STACK,
+      REGISTER,
+    };
+
+    // Rewrites the code of `chunk` in place, keeping jump offsets and line
+    // numbers consistent. Constants may be added for folded values. The chunk
+    // is left untouched if the rewritten code could not be encoded.
+    void optimize(vm::Chunk& chunk, int_t level, const ExecutionMode& mode);
+  }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "common.hpp"
+#include "chunk.hpp"
+#include <cstdio>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define CLOX_PROFILE_RDTSC 1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define CLOX_PROFILE_RDTSC 1
+#else
+#include <chrono>
+#define CLOX_PROFILE_RDTSC 0
+#endif
+
+namespace clox {
+  namespace vm {
+    // Where the VM spends its time; built in with CLOX_PROFILE. Every
+    // executed instruction is counted and charged the ticks until the next
+    // one starts, against its opcode, its offset in the function (reported
+    // as a source line) and the call stack it ran under.
+    //
+    // Ticks come from the time-stamp counter where there is one and are
+    // nanoseconds elsewhere. Time in natives and the collector is charged to
+    // the instruction that entered them.
+    class Profiler {
+    public:
+      // Call tree node the script of each interpret() call hangs off.
+      static constexpr size_t ROOT = 0;
+    public:
+      Profiler(void);
+
+      // Node of a call of `function` made from node `caller`.
+      size_t enter(size_t caller, const function_ptr_t& function);
+      // Called as the instruction at `ip` starts, in a frame at `node`.
+      void tick(size_t node, const byte_t* ip);
+      // Charges the instruction in progress and stops the clock, for when
+      // the VM returns to its caller.
+      void pause(void);
+
+      // Flat tables per opcode, function and line, hottest first.
+      void report(FILE* out) const;
+      // One line per call stack, frames separated by ';' and followed by the
+      // ticks spent in that stack: the collapsed format flamegraph.pl reads.
+      void writeCollapsed(FILE* out) const;
+
+      void markRoots(gc::Collector& gc) const;
+    private:
+      struct Counter {
+        uint64_t m_Count = 0;
+        uint64_t m_Ticks = 0;
+      };
+
+      struct FunctionProfile {
+        function_ptr_t m_Function;
+        const byte_t* m_Code;
+        // Indexed by offset; only offsets that start an instruction are used.
+        std::vector<Counter> m_Offsets;
+      };
+
+      struct CallNode {
+        size_t m_Caller;
+        size_t m_Function;
+        Counter m_Self;
+        std::unordered_map<function_ptr_t, size_t> m_Callees;
+      };
+
+      static uint64_t now(void);
+      void charge(uint64_t time);
+
+      string_t functionName(size_t function) const;
+      string_t stackName(size_t node) const;
+    private:
+      std::vector<FunctionProfile> m_Functions;
+      std::unordered_map<function_ptr_t, size_t> m_FunctionIndices;
+      std::vector<CallNode> m_Nodes;
+      Counter m_Opcodes[static_cast<size_t>(OpCode::EXTRA_WIDE) + 1];
+
+      // The instruction that started at m_Start and has not been charged.
+      bool m_Running;
+      uint64_t m_Start;
+      size_t m_Node;
+      size_t m_Offset;
+      byte_t m_Code;
+    };
+
+    inline uint64_t Profiler::now(void) {
+#if CLOX_PROFILE_RDTSC
+      return __rdtsc();
+#else
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    inline void Profiler::charge(uint64_t time) {
+      uint64_t ticks = time - m_Start;
+      m_Opcodes[m_Code].m_Ticks += ticks;
+      CallNode& node = m_Nodes[m_Node];
+      node.m_Self.m_Ticks += ticks;
+      m_Functions[node.m_Function].m_Offsets[m_Offset].m_Ticks += ticks;
+    }
+
+    inline void Profiler::tick(size_t node, const byte_t* ip) {
+      uint64_t time = now();
+      if (m_Running)
+        charge(time);
+
+      FunctionProfile& function = m_Functions[m_Nodes[node].m_Function];
+      m_Node = node;
+      m_Offset = static_cast<size_t>(ip - function.m_Code);
+      m_Code = *ip;
+
+      ++m_Opcodes[m_Code].m_Count;
+      ++m_Nodes[node].m_Self.m_Count;
+      ++function.m_Offsets[m_Offset].m_Count;
+
+      m_Running = true;
+      m_Start = time;
+    }
+  }
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.hpp"
+#include <string_view>
 
 namespace clox {
   namespace scanner {
@@ -56,9 +57,13 @@ namespace clox {
       END_OF_FILE,
     };
 
+    constexpr size_t TOKEN_TYPE_COUNT = static_cast<size_t>(TokenType::END_OF_FILE) + 1;
+
+    // Tokens borrow their lexeme from the source buffer, which the caller of
+    // Scanner::set must keep alive while the tokens are in use.
     struct Token {
       TokenType m_Type;
-      string_t m_Lexeme;
+      std::string_view m_Lexeme;
       int_t m_Line;
     };
 
@@ -66,12 +71,12 @@ namespace clox {
     public:
       Scanner(void) = default;
       Token scan();
-      void set(const string_t& source);
+      void set(std::string_view source);
 
     private:
       bool isAtEnd(void) const;
       Token makeToken(const TokenType&) const;
-      Token errorToken(const string_t& message) const;
+      Token errorToken(const char* message) const;
       char advance(void);
       bool match(char expected);
       void skipWhitespace(void);
@@ -83,9 +88,10 @@ namespace clox {
       bool isAlpha(char c) const;
       Token identifier(void);
       TokenType identifierType(void) const;
+      TokenType checkKeyword(int_t start, std::string_view rest, const TokenType& type) const;
 
     private:
-      string_t m_Source;
+      std::string_view m_Source;
       int_t m_Start;
       int_t m_Current;
       int_t m_Line;
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "common.hpp"
+#include "optimizer.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace clox {
+  namespace scheduler {
+    // How the VM of every job is set up.
+    struct Options {
+      // Worker threads; 0 is one per hardware thread.
+      size_t m_Workers = 0;
+      int_t m_OptimizationLevel = compiler::MAX_OPTIMIZATION_LEVEL;
+      compiler::ExecutionMode m_Mode = compiler::ExecutionMode::STACK;
+      bool m_Jit = false;
+      bool m_Tracing = false;
+    };
+
+    struct Result {
+      vm::InterpretResult m_Status;
+      // What the script printed, and the compile or runtime errors it had.
+      string_t m_Output;
+      string_t m_Errors;
+    };
+
+    struct Stats {
+      uint64_t m_Jobs = 0;
+      // Jobs a worker took from the queue of another.
+      uint64_t m_Steals = 0;
+    };
+
+    // Runs batches of independent scripts on a pool of worker threads. Every
+    // script runs in a VM of its own, with its own heap, which is thrown away
+    // once it finishes; nothing a script defines is seen by another. A batch
+    // is dealt out evenly to the workers' queues, and a worker whose queue
+    // runs dry steals from the others, so a few long scripts do not hold up
+    // the rest.
+    class Scheduler {
+    public:
+      Scheduler(const Options& options);
+      // Waits for the batch being run, if any, and stops the workers.
+      ~Scheduler(void);
+
+      Scheduler(const Scheduler&) = delete;
+      Scheduler& operator=(const Scheduler&) = delete;
+
+      // Runs every script of `sources` and returns their results in the same
+      // order. Batches from different threads are run one after another.
+      // Must not be called from a script running on this scheduler: run()
+      // holds m_Running for the whole batch, so the nested call would wait
+      // for its own batch to finish and never return.
+      std::vector<Result> run(const std::vector<string_t>& sources);
+
+      size_t workers(void) const;
+      Stats stats(void) const;
+    private:
+      struct Worker {
+        std::mutex m_Lock;
+        // Indices into the batch; the owner takes from the front, thieves
+        // from the back.
+        std::deque<size_t> m_Jobs;
+        std::thread m_Thread;
+      };
+
+      void work(size_t index);
+      // The next job for worker `index`, from its own queue or else stolen.
+      // Returns false once every queue is empty.
+      bool next(size_t index, size_t& job);
+      void execute(size_t job);
+    private:
+      Options m_Options;
+      std::vector<std::unique_ptr<Worker>> m_Workers;
+
+      // Held by run() for a whole batch.
+      std::mutex m_Running;
+
+      // Guards the fields below, which hand a batch to the workers.
+      std::mutex m_Lock;
+      std::condition_variable m_Started;
+      std::condition_variable m_Finished;
+      uint64_t m_Batch = 0;
+      // Workers still taking jobs from the current batch.
+      size_t m_Busy = 0;
+      bool m_Stopping = false;
+      const std::vector<string_t>* m_Sources = nullptr;
+      std::vector<Result>* m_Results = nullptr;
+
+      std::atomic<uint64_t> m_Jobs = 0;
+      std::atomic<uint64_t> m_Steals = 0;
+    };
+  }
+}
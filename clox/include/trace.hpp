@@ -0,0 +1,205 @@
+#pragma once
+
+#include "common.hpp"
+#include "value.hpp"
+#include <cstdio>
+
+namespace clox {
+  namespace trace {
+    // Profiled builds leave traces out, since the profiler has to see every
+    // instruction.
+#ifdef CLOX_PROFILE
+    constexpr bool SUPPORTED = false;
+#else
+    constexpr bool SUPPORTED = true;
+#endif
+
+    // Back-edges to a loop header, counted in the interpreter, after which
+    // the next iteration from it is recorded.
+    constexpr size_t HOT_LOOP = 50;
+    // Recordings given up, or traces thrown away, at one header before its
+    // loop is left to the interpreter for good.
+    constexpr size_t MAX_ATTEMPTS = 3;
+    // Bytecode instructions one recording follows before it is given up.
+    // This also bounds how far an inner loop is unrolled into a trace.
+    constexpr size_t MAX_RECORDED = 4000;
+    // Runs of a trace that leave it within the first iteration, after which
+    // it is thrown away and the loop recorded again.
+    constexpr size_t MAX_MISSES = 100;
+
+    // Index of an IR instruction, which is also the value it produces.
+    using ref_t = uint16_t;
+
+    // What an IR value is known to hold. Loads check their type on entry to
+    // the trace; ANY is for variables only ever written back at exits.
+    enum class Type : uint8_t {
+      NIL,
+      BOOL,
+      NUMBER,
+      OBJECT,
+      ANY,
+    };
+
+    enum class Op : uint8_t {
+      // Preloaded into its register; never executed.
+      CONSTANT,
+      // A frame slot or global as the trace is entered, checked against the
+      // type of the instruction.
+      LOAD_SLOT,
+      LOAD_GLOBAL,
+      // On numbers.
+      ADD,
+      SUBTRACT,
+      MULTIPLY,
+      DIVIDE,
+      NEGATE,
+      LESS,
+      GREATER,
+      GREATER_EQUAL,
+      LESS_EQUAL,
+      EQUAL,
+      NOT_EQUAL,
+      // On a bool.
+      NOT,
+      // Leave the trace through their snapshot unless the bool is as named.
+      GUARD_TRUE,
+      GUARD_FALSE,
+      // Leaves the trace unless the value is an instance of the shape.
+      GUARD_SHAPE,
+      // A field of an instance whose shape has been guarded, checked against
+      // the type of the instruction.
+      LOAD_FIELD,
+      STORE_FIELD,
+      PRINT,
+    };
+
+    // One SSA instruction. m_A and m_B are the refs it reads, or for
+    // GUARD_SHAPE the shape index and for LOAD_FIELD the field slot in m_B;
+    // m_Aux is the snapshot of instructions that can leave the trace, the
+    // slot or global index of loads, the constant index of CONSTANT and the
+    // field slot of STORE_FIELD.
+    struct Instruction {
+      Op m_Op;
+      Type m_Type;
+      ref_t m_Destination;
+      ref_t m_A;
+      ref_t m_B;
+      uint32_t m_Aux;
+    };
+
+    // Where a snapshot entry is written back: a frame slot, or with GLOBAL
+    // set, a global.
+    constexpr uint32_t GLOBAL = 0x80000000;
+
+    struct SnapshotEntry {
+      uint32_t m_Location;
+      ref_t m_Register;
+    };
+
+    // The interpreter state at an instruction a guard stands in front of:
+    // the stores the trace has held back, and the stack above the loop's
+    // locals. Leaving the trace writes it out and resumes at the instruction.
+    struct Snapshot {
+      uint32_t m_Resume;
+      // Frame slots in use, so the stack top is the slots plus this.
+      uint32_t m_Height;
+      // Bytecode instructions of the iteration recorded before the guard.
+      uint32_t m_Instructions;
+      uint32_t m_First;
+      uint32_t m_Count;
+    };
+
+    // A loop-carried variable: at the back-edge, m_Source is copied into the
+    // register the next iteration reads the variable from.
+    struct Phi {
+      ref_t m_Destination;
+      ref_t m_Source;
+    };
+
+    // How one run of a trace ended.
+    struct Run {
+      // Bytecode offset the interpreter resumes at.
+      size_t m_Resume;
+      uint64_t m_Iterations;
+      // Bytecode instructions the run stood in for: those of the recorded
+      // iteration for every full iteration, and those before the guard that
+      // left the trace.
+      uint64_t m_Instructions;
+    };
+
+    // The optimized IR of one loop iteration. A preamble, run once per entry,
+    // loads the variables the loop uses and computes what does not change
+    // from one iteration to the next; the body after it repeats until a
+    // guard fails. Stores to variables are held back in registers until the
+    // trace is left.
+    class Trace {
+    public:
+      // `constants` go in the first registers, out of `registers` in all.
+      Trace(const vm::Chunk& chunk, std::vector<Instruction> code, size_t body, const value_vec_t& constants,
+            size_t registers, std::vector<Phi> phis, std::vector<Snapshot> snapshots, std::vector<SnapshotEntry> entries,
+            std::vector<shape_ptr_t> shapes, size_t length);
+
+      Trace(const Trace&) = delete;
+      Trace& operator=(const Trace&) = delete;
+
+      // Runs the loop from its header in the frame at `slots`, with `top`
+      // the top of the VM stack.
+      Run run(value_t* slots, value_t*& top, vm::Global* globals, FILE* out);
+
+      void blacken(gc::Collector& gc) const;
+    private:
+      // Runs until a guard fails and returns its snapshot.
+      uint32_t execute(value_t* slots, vm::Global* globals, FILE* out, uint64_t& iterations);
+    private:
+      const vm::Chunk& m_Chunk;
+      std::vector<Instruction> m_Code;
+      // Index in m_Code where the loop body starts.
+      size_t m_Body;
+      // One per value; the constants come first and are loaded once.
+      value_vec_t m_Registers;
+      size_t m_Constants;
+      std::vector<Phi> m_Phis;
+      // Where the values the phis carry wait while they are copied.
+      value_vec_t m_Carried;
+      std::vector<Snapshot> m_Snapshots;
+      std::vector<SnapshotEntry> m_Entries;
+      std::vector<shape_ptr_t> m_Shapes;
+      // Bytecode instructions of the recorded iteration.
+      size_t m_Length;
+    };
+
+    // A loop header of one function: its back-edges are counted until its
+    // loop is recorded, and then enter the trace.
+    struct Loop {
+      size_t m_Header;
+      size_t m_Count;
+      size_t m_Attempts;
+      std::unique_ptr<Trace> m_Trace;
+      size_t m_Misses;
+    };
+
+    // Where the interpreter carries on after a back-edge.
+    struct Resume {
+      const byte_t* m_IP;
+      // Instructions executed while recording, which the interpreter has not
+      // counted.
+      size_t m_Recorded;
+    };
+
+    // The loops of one function, created as their back-edges are first taken.
+    class Loops {
+    public:
+      // At a back-edge to `header` in the frame at `slots`: runs the trace
+      // of the loop if it has one, otherwise counts the back-edge and once
+      // the loop is hot records its next iteration, executing it as it goes.
+      Resume enter(obj::Function& function, const byte_t* header, value_t* slots, value_t*& top,
+                   vm::GlobalTable& globals, FILE* out, vm::RunStats& stats);
+
+      void blacken(gc::Collector& gc) const;
+    private:
+      Loop& find(size_t header);
+    private:
+      std::vector<Loop> m_Loops;
+    };
+  }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "common.hpp"
+#include <cstring>
+
+namespace clox {
+
+#ifdef CLOX_NAN_BOXING
+  // A value packed into a single 64-bit word. Numbers are stored as plain
+  // doubles; every other type lives inside the payload of a quiet NaN, with
+  // the sign bit marking object pointers and the low bits tagging nil/bool.
+  class Value {
+  public:
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+    static constexpr uint64_t QNAN = 0x7ffc000000000000;
+
+    static constexpr uint64_t TAG_NIL = 1;
+    static constexpr uint64_t TAG_FALSE = 2;
+    static constexpr uint64_t TAG_TRUE = 3;
+
+    static constexpr uint64_t NIL_VAL = QNAN | TAG_NIL;
+    static constexpr uint64_t FALSE_VAL = QNAN | TAG_FALSE;
+    static constexpr uint64_t TRUE_VAL = QNAN | TAG_TRUE;
+  public:
+    Value(void) : m_Bits(NIL_VAL) { }
+    Value(dbl_t number) { std::memcpy(&m_Bits, &number, sizeof(dbl_t)); }
+    Value(bool boolean) : m_Bits(boolean ? TRUE_VAL : FALSE_VAL) { }
+    Value(nullptr_t) : m_Bits(NIL_VAL) { }
+    Value(obj_ptr_t object) :
+      m_Bits(SIGN_BIT | QNAN | static_cast<uint64_t>(reinterpret_cast<uintptr_t>(object)))
+    { }
+
+    uint64_t bits(void) const { return m_Bits; }
+  private:
+    uint64_t m_Bits;
+  };
+
+  using value_t = Value;
+
+  inline bool isNumber(const value_t& value) {
+    return (value.bits() & Value::QNAN) != Value::QNAN;
+  }
+
+  // Both tests in one branch, for the guards of quickened instructions.
+  inline bool areNumbers(const value_t& left, const value_t& right) {
+    return ((left.bits() & Value::QNAN) != Value::QNAN) & ((right.bits() & Value::QNAN) != Value::QNAN);
+  }
+
+  inline bool isBool(const value_t& value) {
+    return (value.bits() | 1) == Value::TRUE_VAL;
+  }
+
+  inline bool isNil(const value_t& value) {
+    return value.bits() == Value::NIL_VAL;
+  }
+
+  inline bool isObj(const value_t& value) {
+    return (value.bits() & (Value::QNAN | Value::SIGN_BIT)) == (Value::QNAN | Value::SIGN_BIT);
+  }
+
+  inline dbl_t asNumber(const value_t& value) {
+    dbl_t number;
+    uint64_t bits = value.bits();
+    std::memcpy(&number, &bits, sizeof(dbl_t));
+    return number;
+  }
+
+  inline bool asBool(const value_t& value) {
+    return value.bits() == Value::TRUE_VAL;
+  }
+
+  inline obj_ptr_t asObj(const value_t& value) {
+    return reinterpret_cast<obj_ptr_t>(
+      static_cast<uintptr_t>(value.bits() & ~(Value::SIGN_BIT | Value::QNAN)));
+  }
+
+  inline bool isSameValue(const value_t& left, const value_t& right) {
+    // NaN is never equal to itself, so numbers cannot be compared bitwise.
+    if (isNumber(left) && isNumber(right))
+      return asNumber(left) == asNumber(right);
+
+    return left.bits() == right.bits();
+  }
+#else
+  using value_t = std::variant<dbl_t,
+                               bool,
+                               nullptr_t,
+                               obj_ptr_t>;
+
+  inline bool isNumber(const value_t& value) {
+    return std::holds_alternative<dbl_t>(value);
+  }
+
+  inline bool areNumbers(const value_t& left, const value_t& right) {
+    return isNumber(left) && isNumber(right);
+  }
+
+  inline bool isBool(const value_t& value) {
+    return std::holds_alternative<bool>(value);
+  }
+
+  inline bool isNil(const value_t& value) {
+    return std::holds_alternative<nullptr_t>(value);
+  }
+
+  inline bool isObj(const value_t& value) {
+    return std::holds_alternative<obj_ptr_t>(value);
+  }
+
+  inline dbl_t asNumber(const value_t& value) {
+    return *std::get_if<dbl_t>(&value);
+  }
+
+  inline bool asBool(const value_t& value) {
+    return *std::get_if<bool>(&value);
+  }
+
+  inline obj_ptr_t asObj(const value_t& value) {
+    return *std::get_if<obj_ptr_t>(&value);
+  }
+
+  inline bool isSameValue(const value_t& left, const value_t& right) {
+    return left == right;
+  }
+#endif
+
+  using value_vec_t = std::vector<value_t>;
+  using value_stack_t = std::unique_ptr<value_t[]>;
+
+  // A function implemented in C++. It reads its arguments in place from the
+  // VM stack. On arguments it cannot use it points `error` at a message,
+  // which the VM reports as a runtime error, and its result is ignored.
+  using native_fn_t = value_t(*)(int argc, value_t* argv, const char*& error);
+}
@@ -2,6 +2,11 @@
 
 #include "common.hpp"
 #include "chunk.hpp"
+#include "gc.hpp"
+#include "globals.hpp"
+#include "cache.hpp"
+#include "profiler.hpp"
+#include <string_view>
 
 namespace clox {
 
@@ -12,15 +17,52 @@ namespace clox {
       RUNTIME_ERROR,
     };
 
+    // Deepest call nesting, and value stack capacity, of one VM. Both are
+    // allocated up front; a call that would exceed either is a runtime
+    // error rather than a reallocation.
+    constexpr size_t FRAMES_MAX = 1024;
+    constexpr size_t STACK_MAX = FRAMES_MAX * 256;
+
     struct CallFrame {
       closure_ptr_t m_Closure;
-      size_t m_IP;
-      size_t m_Start;
+      const byte_t* m_IP;
+      // Slot 0 of the frame: the callee, or the receiver of a method.
+      value_t* m_Slots;
+#ifdef CLOX_PROFILE
+      // Where the frame sits in the profiler's call tree.
+      size_t m_ProfileNode;
+#endif
+    };
+
+    struct RunStats {
+      uint64_t m_Instructions = 0;
+      // Executions of quickenable arithmetic and comparisons, split by
+      // whether a quickened form ran them. Counted along with instructions.
+      uint64_t m_QuickenedHits = 0;
+      uint64_t m_QuickenedMisses = 0;
+      // Sites rewritten to a quickened form, and back to the generic one,
+      // which happens at most once per site.
+      uint64_t m_Quickenings = 0;
+      uint64_t m_Deoptimizations = 0;
+      // Loops recorded into traces, and recordings given up.
+      uint64_t m_Traces = 0;
+      uint64_t m_TraceAborts = 0;
+      // Entries into traces, the loop iterations they completed, and the
+      // bytecode instructions they stood in for, which are not counted in
+      // m_Instructions.
+      uint64_t m_TraceRuns = 0;
+      uint64_t m_TracedIterations = 0;
+      uint64_t m_TracedInstructions = 0;
     };
 
     class VM {
     public:
       VM(void);
+      // Output of the 'print' statement goes to `out`, compile and runtime
+      // errors to `err`. A VM shares no state with any other, so each thread
+      // may run one of its own.
+      VM(FILE* out);
+      VM(FILE* out, FILE* err);
       ~VM(void) = default;
 
       // Do not allow copy or move the virtual machine
@@ -31,26 +73,109 @@ namespace clox {
 
       InterpretResult interpret(void);
       InterpretResult interpret(const string_t& source);
-    private:
-      const OpCode& readByte(void);
-      const size_t readOffset(void);
-      const value_t& readConstant(void);
-      const string_t& readString(void);
+      // Runs the bytecode image at `imagePath` if it was saved for the current
+      // contents of the script at `path`, otherwise compiles the script and
+      // saves its image there.
+      InterpretResult interpretFile(const string_t& path, const string_t& imagePath);
 
-      void binaryAdd(void);
-      void binaryOp(char c);
+      // Defines a global `name` bound to a native function. An arity of
+      // obj::Native::VARIADIC accepts any number of arguments.
+      void defineNative(std::string_view name, int_t arity, native_fn_t function);
+
+      void markRoots(gc::Collector& gc) const;
+      const gc::Stats& gcStats(void) const;
+      const CacheStats& cacheStats(void) const;
+      const RunStats& runStats(void) const;
+#ifdef CLOX_PROFILE
+      const Profiler& profiler(void) const;
+#endif
+      // Counting executed instructions runs a separately compiled copy of
+      // the dispatch loop, so it costs nothing while switched off.
+      void setCountInstructions(bool count);
+      // See compiler::optimize; applies to code compiled from now on.
+      void setOptimizationLevel(int_t level);
+      // See compiler::ExecutionMode; applies to code compiled from now on.
+      void setExecutionMode(const compiler::ExecutionMode& mode);
+      // Compiles hot functions to machine code and runs them natively, in
+      // builds where jit::SUPPORTED; elsewhere this changes nothing.
+      void setJit(bool jit);
+      // Records hot loops into traces and runs those instead, where
+      // trace::SUPPORTED; elsewhere this changes nothing.
+      void setTracing(bool tracing);
+    private:
+      // The slow paths of arithmetic and comparisons. On operands of the
+      // wrong type they return false and leave them alone, for the caller
+      // to report the error.
+      bool binaryAdd(void);
+      bool binaryOp(char c);
+      template<char C>
+      bool compare(bool& result);
+      template<char C>
+      bool compare(const value_t& left, const value_t& right, bool& result);
+      template<char C>
+      bool arithmetic(value_t& destination, const value_t& left, const value_t& right);
+      InterpretResult runScript(const function_ptr_t& function);
       InterpretResult run(void);
+      template<bool CountInstructions>
+      InterpretResult execute(void);
+      void push(const value_t& value);
+      value_t pop(void);
       const value_t& peek(size_t offset) const;
 
       bool isFalsey(const value_t& value) const;
       bool areEqual(const value_t& left, const value_t& right) const;
 
+      void runtimeError(const char* format, ...);
+      void resetStack(void);
+
+      upvalue_ptr_t captureUpvalue(value_t* slot);
+      void closeUpvalues(value_t* last);
+
+      bool readProperty(const instance_ptr_t& instance, PropertyCache& cache);
+      void writeProperty(const instance_ptr_t& instance, PropertyCache& cache);
+      bool getProperty(const instance_ptr_t& instance, PropertyCache& cache);
+      void setProperty(const instance_ptr_t& instance, PropertyCache& cache, const value_t& value);
+
+      bool invoke(PropertyCache& cache, size_t count);
+      bool invoke(const instance_ptr_t& instance, PropertyCache& cache, size_t count);
+      bool invokeFromClass(const class_ptr_t& klass, const string_ptr_t& name, size_t count);
+
+      bool bindMethod(const class_ptr_t& klass, const string_ptr_t& name);
+      void bindMethod(const closure_ptr_t& method);
+      void defineMethod(const string_ptr_t& name);
+
       bool callValue(const value_t& value, size_t count);
       bool call(const closure_ptr_t& function, size_t count);
+
+      void countHot(const function_ptr_t& function);
+      void compileNative(const function_ptr_t& function);
+      jit::Exit enterNative(CallFrame& frame);
+      jit::Call callNative(size_t frameCount);
+
+      void traceLoop(CallFrame& frame);
     private:
-      call_frame_vec_t m_Frames;
+      gc::Collector m_Collector;
+      call_frame_stack_t m_Frames;
+      size_t m_FrameCount;
       value_stack_t m_Stack;
-      global_table_t m_Globals;
+      value_t* m_StackTop;
+      GlobalTable m_Globals;
+      // Sorted by slot address, highest first, so closing the upvalues of a
+      // returning frame only visits the ones it captured.
+      upvalue_ptr_t m_OpenUpvalues;
+      string_ptr_t m_InitString;
+      CacheStats m_CacheStats;
+      RunStats m_RunStats;
+#ifdef CLOX_PROFILE
+      Profiler m_Profiler;
+#endif
+      bool m_CountInstructions;
+      int_t m_OptimizationLevel;
+      compiler::ExecutionMode m_Mode;
+      bool m_Jit;
+      bool m_Tracing;
+      FILE* m_Out;
+      FILE* m_Err;
     };
   }
 }
\ No newline at end of file
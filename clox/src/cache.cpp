@@ -0,0 +1,34 @@
+#include "cache.hpp"
+#include "object.hpp"
+#include "gc.hpp"
+
+namespace clox {
+  namespace vm {
+    PropertyCache::PropertyCache(const string_ptr_t& name) :
+      m_Name(name),
+      m_Entries(),
+      m_Count(0),
+      m_Hits(0),
+      m_Misses(0)
+    { }
+
+    void PropertyCache::add(const CacheEntry& entry) {
+      if (m_Count == MAX_ENTRIES)
+        return;
+
+      m_Entries[m_Count++] = entry;
+    }
+
+    // Cached shapes and methods are held strongly; they belong to classes
+    // that are usually alive anyway.
+    void PropertyCache::blacken(gc::Collector& gc) const {
+      gc.markObject(m_Name);
+      for (size_t i = 0; i < m_Count; ++i) {
+        const CacheEntry& entry = m_Entries[i];
+        gc.markObject(entry.m_Shape);
+        gc.markObject(entry.m_Method);
+        gc.markObject(entry.m_Transition);
+      }
+    }
+  }
+}
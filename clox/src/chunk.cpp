@@ -1,16 +1,211 @@
 #include "chunk.hpp"
 #include "object.hpp"
+#include "gc.hpp"
+#include <algorithm>
 
 namespace clox {
   namespace vm {
 
-    void Chunk::write(const byte_code_t& code, int_t line) {
-      m_ByteCodes.push_back(code);
-      m_Lines.push_back(line);
+    OperandFormat operandFormat(const OpCode& code) {
+      switch (code) {
+      case OpCode::CONSTANT:
+      case OpCode::DEFINE_GLOBAL:
+      case OpCode::GET_GLOBAL:
+      case OpCode::SET_GLOBAL:
+      case OpCode::GET_LOCAL:
+      case OpCode::SET_LOCAL:
+      case OpCode::CALL:
+      case OpCode::CLOSURE:
+      case OpCode::GET_UPVALUE:
+      case OpCode::SET_UPVALUE:
+      case OpCode::CLASS:
+      case OpCode::GET_PROPERTY:
+      case OpCode::SET_PROPERTY:
+      case OpCode::METHOD:
+      case OpCode::GET_SUPER:
+        return OperandFormat::OPERAND;
+      case OpCode::INVOKE:
+      case OpCode::SUPER_INVOKE:
+        return OperandFormat::INVOKE;
+      case OpCode::JUMP_IF_FALSE:
+      case OpCode::JUMP:
+      case OpCode::LOOP:
+      case OpCode::POP_JUMP_IF_FALSE:
+      case OpCode::JUMP_IF_LESS:
+      case OpCode::JUMP_IF_NOT_LESS:
+      case OpCode::JUMP_IF_GREATER:
+      case OpCode::JUMP_IF_NOT_GREATER:
+        return OperandFormat::JUMP;
+      case OpCode::ADD_LOCAL_CONSTANT:
+      case OpCode::SUBTRACT_LOCAL_CONSTANT:
+      case OpCode::LOAD_CONSTANT:
+        return OperandFormat::LOCAL_CONSTANT;
+      case OpCode::MOVE:
+        return OperandFormat::MOVE;
+      case OpCode::ADD_RR:
+      case OpCode::SUBTRACT_RR:
+      case OpCode::MULTIPLY_RR:
+      case OpCode::DIVIDE_RR:
+      case OpCode::ADD_RK:
+      case OpCode::SUBTRACT_RK:
+      case OpCode::MULTIPLY_RK:
+      case OpCode::DIVIDE_RK:
+        return OperandFormat::THREE_ADDRESS;
+      case OpCode::JUMP_IF_LESS_RR:
+      case OpCode::JUMP_IF_NOT_LESS_RR:
+      case OpCode::JUMP_IF_GREATER_RR:
+      case OpCode::JUMP_IF_NOT_GREATER_RR:
+      case OpCode::JUMP_IF_LESS_RK:
+      case OpCode::JUMP_IF_NOT_LESS_RK:
+      case OpCode::JUMP_IF_GREATER_RK:
+      case OpCode::JUMP_IF_NOT_GREATER_RK:
+        return OperandFormat::REGISTER_JUMP;
+      default:
+        return OperandFormat::NONE;
+      }
     }
 
-    void Chunk::replace(size_t offset, const byte_code_t& code) {
-      m_ByteCodes[offset] = code;
+    size_t operandSize(const OperandFormat& format) {
+      switch (format) {
+      case OperandFormat::NONE:
+        return 0;
+      case OperandFormat::OPERAND:
+        return 1;
+      case OperandFormat::INVOKE:
+      case OperandFormat::JUMP:
+      case OperandFormat::LOCAL_CONSTANT:
+      case OperandFormat::MOVE:
+        return 2;
+      case OperandFormat::THREE_ADDRESS:
+        return 3;
+      case OperandFormat::REGISTER_JUMP:
+        return 4;
+      }
+
+      return 0;
+    }
+
+    const char* opcodeName(const OpCode& code) {
+      static const char* names[] = {
+#define CLOX_OPCODE_NAME(name) #name,
+        CLOX_OPCODES(CLOX_OPCODE_NAME)
+#undef CLOX_OPCODE_NAME
+      };
+
+      return names[static_cast<size_t>(code)];
+    }
+
+    size_t prefixSize(size_t operand) {
+      return operand > 0xFFFF ? 3 : operand > 0xFF ? 2 : 0;
+    }
+
+    int_t stackEffect(const OpCode& code, size_t count) {
+      switch (code) {
+      case OpCode::CONSTANT:
+      case OpCode::NIL:
+      case OpCode::TRUE:
+      case OpCode::FALSE:
+      case OpCode::GET_GLOBAL:
+      case OpCode::GET_LOCAL:
+      case OpCode::GET_UPVALUE:
+      case OpCode::CLOSURE:
+      case OpCode::CLASS:
+      case OpCode::ADD_LOCAL_CONSTANT:
+      case OpCode::SUBTRACT_LOCAL_CONSTANT:
+        return 1;
+      case OpCode::RETURN:
+      case OpCode::ADD:
+      case OpCode::SUBTRACT:
+      case OpCode::MULTIPLY:
+      case OpCode::DIVIDE:
+      case OpCode::EQUAL:
+      case OpCode::GREATER:
+      case OpCode::LESS:
+      case OpCode::PRINT:
+      case OpCode::POP:
+      case OpCode::DEFINE_GLOBAL:
+      case OpCode::CLOSE_UPVALUE:
+      case OpCode::SET_PROPERTY:
+      case OpCode::METHOD:
+      case OpCode::INHERIT:
+      case OpCode::GET_SUPER:
+      case OpCode::NOT_EQUAL:
+      case OpCode::GREATER_EQUAL:
+      case OpCode::LESS_EQUAL:
+      case OpCode::POP_JUMP_IF_FALSE:
+      case OpCode::ADD_NUM:
+      case OpCode::SUBTRACT_NUM:
+      case OpCode::MULTIPLY_NUM:
+      case OpCode::DIVIDE_NUM:
+      case OpCode::GREATER_NUM:
+      case OpCode::LESS_NUM:
+      case OpCode::GREATER_EQUAL_NUM:
+      case OpCode::LESS_EQUAL_NUM:
+        return -1;
+      case OpCode::JUMP_IF_LESS:
+      case OpCode::JUMP_IF_NOT_LESS:
+      case OpCode::JUMP_IF_GREATER:
+      case OpCode::JUMP_IF_NOT_GREATER:
+        return -2;
+      case OpCode::CALL:
+      case OpCode::INVOKE:
+        // The callee (or receiver) and arguments are replaced by the result.
+        return -static_cast<int_t>(count);
+      case OpCode::SUPER_INVOKE:
+        // As INVOKE, and the superclass is popped too.
+        return -static_cast<int_t>(count) - 1;
+      default:
+        return 0;
+      }
+    }
+
+    Chunk::Chunk(void) :
+      m_Code(),
+      m_Constants(),
+      m_Caches(),
+      m_Globals(),
+      m_Lines(),
+      m_Pinned(),
+      m_Image(),
+      m_ImageCode(nullptr),
+      m_ImageSize(0),
+      m_ImageConstants(nullptr),
+      m_ImageConstantCount(0)
+    { }
+
+    void Chunk::write(byte_t byte, int_t line) {
+      auto run = static_cast<uint32_t>(line);
+      if (m_Lines.empty() || m_Lines.back().m_Line != run)
+        m_Lines.push_back({ static_cast<uint32_t>(m_Code.size()), run });
+      m_Code.push_back(byte);
+    }
+
+    void Chunk::write(const OpCode& code, int_t line) {
+      write(static_cast<byte_t>(code), line);
+    }
+
+    void Chunk::write(const OpCode& code, size_t operand, int_t line) {
+      if (operand > 0xFFFF) {
+        write(OpCode::EXTRA_WIDE, line);
+        write(static_cast<byte_t>(operand >> 16), line);
+        write(static_cast<byte_t>(operand >> 8), line);
+      } else if (operand > 0xFF) {
+        write(OpCode::WIDE, line);
+        write(static_cast<byte_t>(operand >> 8), line);
+      }
+
+      write(code, line);
+      write(static_cast<byte_t>(operand), line);
+    }
+
+    void Chunk::writeShort(uint16_t value, int_t line) {
+      write(static_cast<byte_t>(value >> 8), line);
+      write(static_cast<byte_t>(value), line);
+    }
+
+    void Chunk::replace(size_t offset, uint16_t value) {
+      m_Code[offset] = static_cast<byte_t>(value >> 8);
+      m_Code[offset + 1] = static_cast<byte_t>(value);
     }
 
     size_t Chunk::addConstant(const value_t& value) {
@@ -18,38 +213,130 @@ namespace clox {
       return m_Constants.size() - 1;
     }
 
+    size_t Chunk::addCache(const string_ptr_t& name) {
+      m_Caches.emplace_back(name);
+      return m_Caches.size() - 1;
+    }
+
+    void Chunk::resetCode(void) {
+      m_Code.clear();
+      m_Lines.clear();
+      m_Pinned.clear();
+    }
+
+    size_t Chunk::addGlobal(size_t slot) {
+      m_Globals.push_back(slot);
+      return m_Globals.size() - 1;
+    }
+
+    void Chunk::borrow(const std::shared_ptr<void>& image, byte_t* code, size_t size, line_run_vec_t lines,
+                       value_t* constants, size_t count) {
+      m_Image = image;
+      m_ImageCode = code;
+      m_ImageSize = size;
+      m_Lines = std::move(lines);
+      m_ImageConstants = constants;
+      m_ImageConstantCount = count;
+    }
+
+    void Chunk::pin(size_t offset) {
+      if (m_Pinned.empty())
+        m_Pinned.resize(size());
+      m_Pinned[offset] = true;
+    }
+
+    bool Chunk::isPinned(size_t offset) const {
+      return !m_Pinned.empty() && m_Pinned[offset];
+    }
+
+    size_t Chunk::constantCount(void) const {
+      return m_ImageConstants ? m_ImageConstantCount : m_Constants.size();
+    }
+
+    size_t Chunk::cacheCount(void) const {
+      return m_Caches.size();
+    }
+
+    size_t Chunk::globalCount(void) const {
+      return m_Globals.size();
+    }
+
     size_t Chunk::size(void) const {
-      return m_ByteCodes.size();
+      return m_ImageCode ? m_ImageSize : m_Code.size();
     }
 
     void Chunk::disassemble(const string_t& name) const {
       printf("== %s ==\n", name.c_str());
 
-      for (size_t offset = 0; offset < m_ByteCodes.size(); )
+      for (size_t offset = 0; offset < size(); )
         offset = disassemble(offset);
     }
 
-    const OpCode& Chunk::readByte(size_t offset) {
-      return std::get<OpCode>(m_ByteCodes[offset]);
+    byte_t Chunk::readByte(size_t offset) const {
+      return code()[offset];
+    }
+
+    uint16_t Chunk::readShort(size_t offset) const {
+      return static_cast<uint16_t>((code()[offset] << 8) | code()[offset + 1]);
+    }
+
+    const value_t& Chunk::readConstant(size_t offset) const {
+      return constants()[offset];
+    }
+
+    int_t Chunk::readLine(size_t offset) const {
+      // The last run starting at or before `offset`.
+      auto it = std::upper_bound(m_Lines.cbegin(), m_Lines.cend(), offset,
+        [](size_t offset, const LineRun& run) { return offset < run.m_Offset; });
+      return it == m_Lines.cbegin() ? 0 : static_cast<int_t>(std::prev(it)->m_Line);
+    }
+
+    const line_run_vec_t& Chunk::lineRuns(void) const {
+      return m_Lines;
+    }
+
+    const byte_t* Chunk::code(void) const {
+      return m_ImageCode ? m_ImageCode : m_Code.data();
+    }
+
+    const value_t* Chunk::constants(void) const {
+      return m_ImageConstants ? m_ImageConstants : m_Constants.data();
+    }
+
+    const size_t* Chunk::globals(void) const {
+      return m_Globals.data();
     }
 
-    size_t Chunk::readOffset(size_t offset) {
-      return std::get<size_t>(m_ByteCodes[offset]);
+    PropertyCache* Chunk::caches(void) {
+      return m_Caches.data();
     }
 
-    const value_t& Chunk::readConstant(size_t offset) {
-      return m_Constants[offset];
+    const PropertyCache& Chunk::readCache(size_t offset) const {
+      return m_Caches[offset];
     }
 
     size_t Chunk::disassemble(size_t offset) const {
       printf("%04zu ", offset);
 
-      if (offset > 0 && m_Lines[offset] == m_Lines[offset - 1])
+      int_t line = readLine(offset);
+      if (offset > 0 && line == readLine(offset - 1))
         printf("   | ");
       else
-        printf("%4d ", m_Lines[offset]);
+        printf("%4d ", line);
+
+      // A prefix is printed together with the instruction it widens.
+      size_t ext = 0;
+      auto instruction = static_cast<OpCode>(code()[offset]);
+      if (instruction == OpCode::WIDE) {
+        ext = static_cast<size_t>(code()[offset + 1]) << 8;
+        offset += 2;
+      } else if (instruction == OpCode::EXTRA_WIDE) {
+        ext = (static_cast<size_t>(code()[offset + 1]) << 16) |
+              (static_cast<size_t>(code()[offset + 2]) << 8);
+        offset += 3;
+      }
 
-      auto instruction = std::get<OpCode>(m_ByteCodes[offset]);
+      instruction = static_cast<OpCode>(code()[offset]);
       switch (instruction) {
       case OpCode::RETURN:
         return simpleInstruction("RETURN", offset);
@@ -74,7 +361,7 @@ namespace clox {
       case OpCode::TRUE:
         return simpleInstruction("TRUE", offset);
       case OpCode::CONSTANT:
-        return constantInstruction("CONSTANT", offset);
+        return constantInstruction("CONSTANT", offset, ext);
       case OpCode::NOT:
         return simpleInstruction("NOT", offset);
       case OpCode::EQUAL:
@@ -84,15 +371,15 @@ namespace clox {
       case OpCode::LESS:
         return simpleInstruction("LESS", offset);
       case OpCode::DEFINE_GLOBAL:
-        return constantInstruction("DEFINE_GLOBAL", offset);
+        return globalInstruction("DEFINE_GLOBAL", offset, ext);
       case OpCode::GET_GLOBAL:
-        return constantInstruction("GET_GLOBAL", offset);
+        return globalInstruction("GET_GLOBAL", offset, ext);
       case OpCode::SET_GLOBAL:
-        return constantInstruction("SET_GLOBAL", offset);
+        return globalInstruction("SET_GLOBAL", offset, ext);
       case OpCode::GET_LOCAL:
-        return byteInstruction("GET_LOCAL", offset);
+        return byteInstruction("GET_LOCAL", offset, ext);
       case OpCode::SET_LOCAL:
-        return byteInstruction("SET_LOCAL", offset);
+        return byteInstruction("SET_LOCAL", offset, ext);
       case OpCode::JUMP_IF_FALSE:
         return jumpInstruction("JUMP_IF_FALSE", 1, offset);
       case OpCode::JUMP:
@@ -100,18 +387,86 @@ namespace clox {
       case OpCode::LOOP:
         return jumpInstruction("LOOP", -1, offset);
       case OpCode::CALL:
-        return byteInstruction("CALL", offset);
+        return byteInstruction("CALL", offset, ext);
       case OpCode::CLOSURE:
-      {
-        ++offset;
-        size_t constant = std::get<size_t>(m_ByteCodes[offset++]);
-        printf("%-16s %4zu ", "CLOSURE", constant);
-        printValue(m_Constants[constant]);
-        printf("\n");
-        return offset;
-      }
+        return closureInstruction(offset, ext);
+      case OpCode::GET_UPVALUE:
+        return byteInstruction("GET_UPVALUE", offset, ext);
+      case OpCode::SET_UPVALUE:
+        return byteInstruction("SET_UPVALUE", offset, ext);
+      case OpCode::CLOSE_UPVALUE:
+        return simpleInstruction("CLOSE_UPVALUE", offset);
+      case OpCode::CLASS:
+        return constantInstruction("CLASS", offset, ext);
+      case OpCode::GET_PROPERTY:
+        return cacheInstruction("GET_PROPERTY", offset, ext);
+      case OpCode::SET_PROPERTY:
+        return cacheInstruction("SET_PROPERTY", offset, ext);
+      case OpCode::METHOD:
+        return constantInstruction("METHOD", offset, ext);
+      case OpCode::INHERIT:
+        return simpleInstruction("INHERIT", offset);
+      case OpCode::GET_SUPER:
+        return constantInstruction("GET_SUPER", offset, ext);
+      case OpCode::INVOKE:
+        return invokeInstruction("INVOKE", offset, ext);
+      case OpCode::SUPER_INVOKE:
+        return superInvokeInstruction("SUPER_INVOKE", offset, ext);
+      case OpCode::NOT_EQUAL:
+        return simpleInstruction("NOT_EQUAL", offset);
+      case OpCode::GREATER_EQUAL:
+        return simpleInstruction("GREATER_EQUAL", offset);
+      case OpCode::LESS_EQUAL:
+        return simpleInstruction("LESS_EQUAL", offset);
+      case OpCode::POP_JUMP_IF_FALSE:
+        return jumpInstruction("POP_JUMP_IF_FALSE", 1, offset);
+      case OpCode::JUMP_IF_LESS:
+        return jumpInstruction("JUMP_IF_LESS", 1, offset);
+      case OpCode::JUMP_IF_NOT_LESS:
+        return jumpInstruction("JUMP_IF_NOT_LESS", 1, offset);
+      case OpCode::JUMP_IF_GREATER:
+        return jumpInstruction("JUMP_IF_GREATER", 1, offset);
+      case OpCode::JUMP_IF_NOT_GREATER:
+        return jumpInstruction("JUMP_IF_NOT_GREATER", 1, offset);
+      case OpCode::ADD_LOCAL_CONSTANT:
+        return localConstantInstruction("ADD_LOCAL_CONSTANT", offset);
+      case OpCode::SUBTRACT_LOCAL_CONSTANT:
+        return localConstantInstruction("SUBTRACT_LOCAL_CONSTANT", offset);
+      case OpCode::ADD_NUM:
+      case OpCode::SUBTRACT_NUM:
+      case OpCode::MULTIPLY_NUM:
+      case OpCode::DIVIDE_NUM:
+      case OpCode::GREATER_NUM:
+      case OpCode::LESS_NUM:
+      case OpCode::GREATER_EQUAL_NUM:
+      case OpCode::LESS_EQUAL_NUM:
+        return simpleInstruction(opcodeName(instruction), offset);
+      case OpCode::MOVE:
+        return moveInstruction("MOVE", offset);
+      case OpCode::LOAD_CONSTANT:
+        return localConstantInstruction("LOAD_CONSTANT", offset);
+      case OpCode::ADD_RR:
+      case OpCode::SUBTRACT_RR:
+      case OpCode::MULTIPLY_RR:
+      case OpCode::DIVIDE_RR:
+        return threeAddressInstruction(opcodeName(instruction), false, offset);
+      case OpCode::ADD_RK:
+      case OpCode::SUBTRACT_RK:
+      case OpCode::MULTIPLY_RK:
+      case OpCode::DIVIDE_RK:
+        return threeAddressInstruction(opcodeName(instruction), true, offset);
+      case OpCode::JUMP_IF_LESS_RR:
+      case OpCode::JUMP_IF_NOT_LESS_RR:
+      case OpCode::JUMP_IF_GREATER_RR:
+      case OpCode::JUMP_IF_NOT_GREATER_RR:
+        return registerJumpInstruction(opcodeName(instruction), false, offset);
+      case OpCode::JUMP_IF_LESS_RK:
+      case OpCode::JUMP_IF_NOT_LESS_RK:
+      case OpCode::JUMP_IF_GREATER_RK:
+      case OpCode::JUMP_IF_NOT_GREATER_RK:
+        return registerJumpInstruction(opcodeName(instruction), true, offset);
       default:
-        printf("Unknown opcode %d\n", instruction);
+        printf("Unknown opcode %d\n", static_cast<int>(instruction));
         return offset + 1;
       }
     }
@@ -121,40 +476,141 @@ namespace clox {
       return offset + 1;
     }
 
-    size_t Chunk::constantInstruction(const string_t& name, size_t offset) const {
-      auto constant = std::get<size_t>(m_ByteCodes[offset + 1]);
+    size_t Chunk::constantInstruction(const string_t& name, size_t offset, size_t ext) const {
+      size_t constant = ext | code()[offset + 1];
       printf("%-16s %4zu '", name.c_str(), constant);
-      printValue(m_Constants[constant]);
+      printValue(stdout, constants()[constant]);
+      printf("'\n");
+
+      return offset + 2;
+    }
+
+    size_t Chunk::cacheInstruction(const string_t& name, size_t offset, size_t ext) const {
+      size_t index = ext | code()[offset + 1];
+      const PropertyCache& cache = m_Caches[index];
+      printf("%-16s %4zu '%s' (%zu shapes, %llu hits, %llu misses)\n", name.c_str(), index,
+             cache.m_Name->m_Str.c_str(), cache.m_Count,
+             static_cast<unsigned long long>(cache.m_Hits),
+             static_cast<unsigned long long>(cache.m_Misses));
+
+      return offset + 2;
+    }
+
+    size_t Chunk::invokeInstruction(const string_t& name, size_t offset, size_t ext) const {
+      size_t index = ext | code()[offset + 1];
+      byte_t count = code()[offset + 2];
+      const PropertyCache& cache = m_Caches[index];
+      printf("%-16s (%d args) %4zu '%s' (%zu shapes, %llu hits, %llu misses)\n", name.c_str(), count, index,
+             cache.m_Name->m_Str.c_str(), cache.m_Count,
+             static_cast<unsigned long long>(cache.m_Hits),
+             static_cast<unsigned long long>(cache.m_Misses));
+
+      return offset + 3;
+    }
+
+    size_t Chunk::superInvokeInstruction(const string_t& name, size_t offset, size_t ext) const {
+      size_t constant = ext | code()[offset + 1];
+      byte_t count = code()[offset + 2];
+      printf("%-16s (%d args) %4zu '", name.c_str(), count, constant);
+      printValue(stdout, constants()[constant]);
       printf("'\n");
 
+      return offset + 3;
+    }
+
+    size_t Chunk::closureInstruction(size_t offset, size_t ext) const {
+      size_t next = constantInstruction("CLOSURE", offset, ext);
+
+      size_t constant = ext | code()[offset + 1];
+      function_ptr_t function = obj::asObjType<obj::Function>(constants()[constant]);
+      for (const obj::Capture& capture : function->m_Captures)
+        printf("     |                     %s %u\n", capture.m_IsLocal ? "local" : "upvalue", capture.m_Index);
+
+      return next;
+    }
+
+    size_t Chunk::globalInstruction(const string_t& name, size_t offset, size_t ext) const {
+      size_t index = ext | code()[offset + 1];
+      printf("%-16s %4zu slot %zu\n", name.c_str(), index, m_Globals[index]);
+
       return offset + 2;
     }
 
-    size_t Chunk::byteInstruction(const string_t& name, size_t offset) const {
-      auto constant = std::get<size_t>(m_ByteCodes[offset + 1]);
+    size_t Chunk::byteInstruction(const string_t& name, size_t offset, size_t ext) const {
+      size_t constant = ext | code()[offset + 1];
       printf("%-16s %4zu\n", name.c_str(), constant);
 
       return offset + 2;
     }
 
     size_t Chunk::jumpInstruction(const string_t& name, int_t sign, size_t offset) const {
-      auto jump = std::get<size_t>(m_ByteCodes[offset + 1]);
-      printf("%-16s %4zu -> %zu\n", name.c_str(), offset, offset + 2 + sign * jump);
+      size_t jump = readShort(offset + 1);
+      printf("%-16s %4zu -> %zu\n", name.c_str(), offset, offset + 3 + sign * jump);
 
-      return offset + 2;
+      return offset + 3;
+    }
+
+    size_t Chunk::localConstantInstruction(const string_t& name, size_t offset) const {
+      size_t slot = code()[offset + 1];
+      size_t constant = code()[offset + 2];
+      printf("%-16s %4zu %4zu '", name.c_str(), slot, constant);
+      printValue(stdout, constants()[constant]);
+      printf("'\n");
+
+      return offset + 3;
+    }
+
+    size_t Chunk::moveInstruction(const string_t& name, size_t offset) const {
+      printf("%-16s %4d <- %d\n", name.c_str(), code()[offset + 1], code()[offset + 2]);
+
+      return offset + 3;
+    }
+
+    size_t Chunk::threeAddressInstruction(const string_t& name, bool constant, size_t offset) const {
+      printf("%-16s %4d <- %d, ", name.c_str(), code()[offset + 1], code()[offset + 2]);
+      if (constant) {
+        printf("'");
+        printValue(stdout, constants()[code()[offset + 3]]);
+        printf("'\n");
+      } else {
+        printf("%d\n", code()[offset + 3]);
+      }
+
+      return offset + 4;
+    }
+
+    size_t Chunk::registerJumpInstruction(const string_t& name, bool constant, size_t offset) const {
+      size_t jump = readShort(offset + 3);
+      printf("%-16s %4d, ", name.c_str(), code()[offset + 1]);
+      if (constant) {
+        printf("'");
+        printValue(stdout, constants()[code()[offset + 2]]);
+        printf("'");
+      } else {
+        printf("%d", code()[offset + 2]);
+      }
+      printf(" %zu -> %zu\n", offset, offset + 5 + jump);
+
+      return offset + 5;
+    }
+
+    void Chunk::printValue(FILE* out, const value_t& value) const {
+      if (isNumber(value))
+        fprintf(out, "%g", asNumber(value));
+      else if (isBool(value))
+        fprintf(out, "%s", asBool(value) ? "true" : "false");
+      else if (isNil(value))
+        fprintf(out, "nil");
+      else if (isObj(value))
+        asObj(value)->print(out);
     }
 
-    // todo: use visitor pattern to print for specific types
-    void Chunk::printValue(const value_t& value) const {
-      std::visit(
-        util::overloaded(
-          [](dbl_t x) { printf("%g", x);  },
-          [](bool x) { printf("%s", x ? "true" : "false"); },
-          [](nullptr_t x) { printf("nil"); },
-          [](obj_ptr_t x) { x->print(); }
-        ),
-        value
-      );
+    void Chunk::blacken(gc::Collector& gc) const {
+      for (size_t i = 0; i < constantCount(); ++i)
+        gc.markValue(constants()[i]);
+
+      for (const PropertyCache& cache : m_Caches)
+        cache.blacken(gc);
     }
   }
 }
\ No newline at end of file
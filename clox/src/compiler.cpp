@@ -4,27 +4,50 @@
 #include "scanner.hpp"
 #include "chunk.hpp"
 #include "object.hpp"
+#include "gc.hpp"
+#include "globals.hpp"
+#include "optimizer.hpp"
+#include <charconv>
 
 namespace clox {
   namespace compiler {
     Scope::Scope(const scope_ptr_t& enclosing,
-                 const FunctionType& type) :
+                 const FunctionType& type,
+                 gc::Collector& gc) :
       m_Enclosing(enclosing),
       m_Function(nullptr),
       m_Type(type),
       m_Locals(),
-      m_Depth(0)
+      m_Depth(0),
+      m_StackHeight(1),
+      m_JumpHeights(),
+      m_GlobalOperands()
     {
-      m_Function = obj::Object::formFunctionObject();
-      m_Locals.emplace_back(Token(TokenType(), "", 0), 0);
+      m_Function = obj::Object::formFunctionObject(gc);
+
+      // Slot zero holds the callee, or the receiver inside a method.
+      bool isMethod = type == FunctionType::METHOD || type == FunctionType::INITIALIZER;
+      m_Locals.emplace_back(Token(TokenType(), isMethod ? "this" : "", 0), 0, false);
     }
 
-    Compiler::Compiler(void) :
-      m_Scope(nullptr, FunctionType::SCRIPT),
+    Compiler::Compiler(gc::Collector& gc, GlobalTable& globals, int_t optimizationLevel, const ExecutionMode& mode,
+                       FILE* err) :
+      m_Collector(gc),
+      m_Globals(globals),
+      m_Scope(nullptr, FunctionType::SCRIPT, gc),
+      m_Class(nullptr),
       m_Parser(),
-      m_Scanner()
+      m_Scanner(),
+      m_OptimizationLevel(optimizationLevel),
+      m_Mode(mode),
+      m_Err(err)
     {
       m_Chunk = &m_Scope.m_Function->m_Chunk;
+      m_Collector.setCompiler(this);
+    }
+
+    Compiler::~Compiler(void) {
+      m_Collector.setCompiler(nullptr);
     }
 
     function_ptr_t Compiler::compile(const string_t& source) {
@@ -39,6 +62,11 @@ namespace clox {
       return m_Parser.m_HadError ? nullptr : function;
     }
 
+    void Compiler::markRoots(gc::Collector& gc) const {
+      for (const Scope* scope = &m_Scope; scope; scope = scope->m_Enclosing)
+        gc.markObject(scope->m_Function);
+    }
+
     void Compiler::advance(void) {
       m_Parser.m_Prev = m_Parser.m_Curr;
 
@@ -47,7 +75,7 @@ namespace clox {
         if (m_Parser.m_Curr.m_Type != TokenType::ERROR)
           break;
 
-        errorAtCurrent(m_Parser.m_Curr.m_Lexeme.c_str());
+        errorAtCurrent(m_Parser.m_Curr.m_Lexeme.data());
       }
     }
 
@@ -56,7 +84,9 @@ namespace clox {
     }
 
     void Compiler::declaration(void) {
-      if (match(TokenType::VAR)) {
+      if (match(TokenType::CLASS)) {
+        classDeclaration();
+      } else if (match(TokenType::VAR)) {
         varDeclaration();
       } else if (match(TokenType::FUN)) {
         funDeclaration();
@@ -86,6 +116,58 @@ namespace clox {
       defineVariable(global);
     }
 
+    void Compiler::classDeclaration(void) {
+      size_t global = parseVariable("Expect class name.");
+      Token className = m_Parser.m_Prev;
+      size_t nameConstant = identifierConstant(className);
+
+      emitBytes(OpCode::CLASS, nameConstant);
+      defineVariable(global);
+
+      ClassScope classScope{ m_Class, false };
+      m_Class = &classScope;
+
+      if (match(TokenType::LESS)) {
+        consume(TokenType::IDENTIFIER, "Expect superclass name.");
+        variable(false);
+
+        if (className.m_Lexeme == m_Parser.m_Prev.m_Lexeme)
+          error("A class can't inherit from itself.");
+
+        // The superclass stays on the stack as a local named 'super' for the
+        // methods to capture.
+        beginScope();
+        addLocal(Token(TokenType::SUPER, "super", m_Parser.m_Prev.m_Line));
+        defineVariable(0);
+
+        namedVariable(className, false);
+        emitByte(OpCode::INHERIT);
+        classScope.m_HasSuperclass = true;
+      }
+
+      namedVariable(className, false);
+      consume(TokenType::LEFT_BRACE, "Expect '{' before class body.");
+      while (!check(TokenType::RIGHT_BRACE) && !check(TokenType::END_OF_FILE))
+        method();
+
+      consume(TokenType::RIGHT_BRACE, "Expect '}' after class body.");
+      emitByte(OpCode::POP);
+
+      if (classScope.m_HasSuperclass)
+        endScope();
+
+      m_Class = classScope.m_Enclosing;
+    }
+
+    void Compiler::method(void) {
+      consume(TokenType::IDENTIFIER, "Expect method name.");
+      size_t constant = identifierConstant(m_Parser.m_Prev);
+
+      FunctionType type = m_Parser.m_Prev.m_Lexeme == "init" ? FunctionType::INITIALIZER : FunctionType::METHOD;
+      function(type);
+      emitBytes(OpCode::METHOD, constant);
+    }
+
     void Compiler::statement(void) {
       if (match(TokenType::PRINT)) {
         printStatement();
@@ -211,6 +293,9 @@ namespace clox {
       if (match(TokenType::SEMICOLON)) {
         emitReturn();
       } else {
+        if (m_Scope.m_Type == FunctionType::INITIALIZER)
+          error("Can't return a value from an initializer.");
+
         expression();
         consume(TokenType::SEMICOLON, "Expect ';' after return value.");
         emitByte(OpCode::RETURN);
@@ -239,16 +324,16 @@ namespace clox {
         return;
 
       m_Parser.m_Panic = true;
-      fprintf(stderr, "[line %d] Error", token.m_Line);
+      fprintf(m_Err, "[line %d] Error", token.m_Line);
 
       if (token.m_Type == TokenType::END_OF_FILE)
-        fprintf(stderr, " at end");
+        fprintf(m_Err, " at end");
       else if (token.m_Type == TokenType::ERROR)
         ; //
       else
-        fprintf(stderr, " at '%s'", token.m_Lexeme.c_str());
+        fprintf(m_Err, " at '%.*s'", static_cast<int>(token.m_Lexeme.size()), token.m_Lexeme.data());
 
-      fprintf(stderr, ": %s\n", message);
+      fprintf(m_Err, ": %s\n", message);
       m_Parser.m_HadError = true;
     }
 
@@ -272,51 +357,101 @@ namespace clox {
       --m_Scope.m_Depth;
 
       while (!m_Scope.m_Locals.empty() && m_Scope.m_Locals.back().m_Depth > m_Scope.m_Depth) {
-        emitByte(OpCode::POP);
+        if (m_Scope.m_Locals.back().m_IsCaptured)
+          emitByte(OpCode::CLOSE_UPVALUE);
+        else
+          emitByte(OpCode::POP);
+
         m_Scope.m_Locals.pop_back();
       }
     }
 
-    void Compiler::emitByte(const byte_code_t& code) {
+    void Compiler::adjustStack(int_t delta) {
+      m_Scope.m_StackHeight += delta;
+
+      size_t& maxStack = m_Scope.m_Function->m_MaxStack;
+      maxStack = std::max(maxStack, static_cast<size_t>(m_Scope.m_StackHeight));
+    }
+
+    void Compiler::emitByte(const OpCode& code) {
       m_Chunk->write(code, m_Parser.m_Prev.m_Line);
+      adjustStack(stackEffect(code, 0));
+    }
+
+    void Compiler::emitBytes(const OpCode& first, const OpCode& second) {
+      emitByte(first);
+      emitByte(second);
     }
 
-    void Compiler::emitBytes(const byte_code_vec_t& codes) {
-      for (const auto& code : codes)
-        emitByte(code);
+    void Compiler::emitBytes(const OpCode& code, size_t operand) {
+      m_Chunk->write(code, operand, m_Parser.m_Prev.m_Line);
+      adjustStack(stackEffect(code, operand));
     }
 
     void Compiler::emitConstant(const value_t& value) {
-      emitBytes({ OpCode::CONSTANT, makeConstant(value) });
+      emitBytes(OpCode::CONSTANT, makeConstant(value));
+    }
+
+    void Compiler::emitInvoke(const OpCode& code, size_t operand, size_t count) {
+      m_Chunk->write(code, operand, m_Parser.m_Prev.m_Line);
+      m_Chunk->write(static_cast<byte_t>(count), m_Parser.m_Prev.m_Line);
+      adjustStack(stackEffect(code, count));
     }
 
     void Compiler::emitReturn(void) {
-      emitByte(OpCode::NIL);
+      // Initializers always return the instance.
+      if (m_Scope.m_Type == FunctionType::INITIALIZER)
+        emitBytes(OpCode::GET_LOCAL, 0);
+      else
+        emitByte(OpCode::NIL);
+
       emitByte(OpCode::RETURN);
     }
 
     size_t Compiler::emitJump(const OpCode& jump) {
       emitByte(jump);
-      emitByte(SIZE_MAX);
-      return m_Chunk->size() - 1;
+      m_Chunk->writeShort(UINT16_MAX, m_Parser.m_Prev.m_Line);
+
+      size_t offset = m_Chunk->size() - 2;
+      m_Scope.m_JumpHeights[offset] = m_Scope.m_StackHeight;
+      return offset;
     }
 
     void Compiler::patchJump(size_t offset) {
-      size_t jump = m_Chunk->size() - offset - 1;
-      m_Chunk->replace(offset, jump);
+      // -2 to adjust for the jump offset itself.
+      size_t jump = m_Chunk->size() - offset - 2;
+      if (jump > MAX_JUMP)
+        error("Too much code to jump over.");
+
+      m_Chunk->replace(offset, static_cast<uint16_t>(jump));
+
+      // Code at the target is reached from the jump too. Every forward jump
+      // is emitted either with the same height as the fallthrough path or
+      // right after an unconditional transfer, so taking the jump's height
+      // is exact.
+      auto it = m_Scope.m_JumpHeights.find(offset);
+      m_Scope.m_StackHeight = it->second;
+      m_Scope.m_JumpHeights.erase(it);
     }
 
     void Compiler::emitLoop(size_t start) {
       emitByte(OpCode::LOOP);
 
-      size_t offset = m_Chunk->size() - start + 1;
-      emitByte(offset);
+      size_t offset = m_Chunk->size() - start + 2;
+      if (offset > MAX_JUMP)
+        error("Loop body too large.");
+
+      m_Chunk->writeShort(static_cast<uint16_t>(offset), m_Parser.m_Prev.m_Line);
     }
 
     function_ptr_t Compiler::endCompiler(void) {
       emitReturn();
 
       function_ptr_t function = m_Scope.m_Function;
+      // Code with errors in it is never run, and its jumps may be bogus.
+      if (!m_Parser.m_HadError)
+        optimize(function->m_Chunk, m_OptimizationLevel, m_Mode);
+
       if (m_Scope.m_Enclosing) {
         m_Scope = *m_Scope.m_Enclosing;
         m_Chunk = &m_Scope.m_Function->m_Chunk;
@@ -327,6 +462,21 @@ namespace clox {
 
     size_t Compiler::makeConstant(const value_t& value) {
       size_t offset = m_Chunk->addConstant(value);
+      if (offset > MAX_OPERAND) {
+        error("Too many constants in one chunk.");
+        return 0;
+      }
+
+      return offset;
+    }
+
+    size_t Compiler::makeCache(const Token& token) {
+      size_t offset = m_Chunk->addCache(clox::obj::Object::formStringObject(m_Collector, token.m_Lexeme));
+      if (offset > MAX_OPERAND) {
+        error("Too many property accesses in one chunk.");
+        return 0;
+      }
+
       return offset;
     }
 
@@ -337,7 +487,7 @@ namespace clox {
       if (m_Scope.m_Depth > 0)
         return 0;
 
-      return identifierConstant(m_Parser.m_Prev);
+      return globalSlot(m_Parser.m_Prev);
     }
 
     void Compiler::defineVariable(size_t global) {
@@ -346,7 +496,7 @@ namespace clox {
         return;
       }
 
-      emitBytes({ OpCode::DEFINE_GLOBAL, global });
+      emitBytes(OpCode::DEFINE_GLOBAL, global);
     }
 
     void Compiler::declareVariable(void) {
@@ -359,7 +509,7 @@ namespace clox {
           if (it->m_Depth != -1 && it->m_Depth < m_Scope.m_Depth)
             break;
 
-          if (local.m_Lexeme.compare(it->m_Token.m_Lexeme) == 0)
+          if (local.m_Lexeme == it->m_Token.m_Lexeme)
             error("Already a variable with this name in this scope");
         }
       }
@@ -368,7 +518,7 @@ namespace clox {
     }
 
     void Compiler::addLocal(const Token& token) {
-      m_Scope.m_Locals.emplace_back(token, -1);
+      m_Scope.m_Locals.emplace_back(token, -1, false);
     }
 
     void Compiler::markInitialized(void) {
@@ -379,58 +529,85 @@ namespace clox {
     }
 
     size_t Compiler::identifierConstant(const Token& token) {
-      return makeConstant(clox::obj::Object::formStringObject(token.m_Lexeme));
-    }
-
-    parse_rule_table_t Compiler::getParseRules(void) {
-      static parse_rule_table_t rules = {
-        {TokenType::LEFT_PAREN,       {&Compiler::grouping,   &Compiler::call,      Precedence::CALL}},
-        {TokenType::RIGHT_PAREN,      {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::LEFT_BRACE,       {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::RIGHT_BRACE,      {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::COMMA,            {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::DOT,              {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::MINUS,            {&Compiler::unary,      &Compiler::binary,    Precedence::TERM}},
-        {TokenType::PLUS,             {&Compiler::unary,      &Compiler::binary,    Precedence::TERM}},
-        {TokenType::SEMICOLON,        {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::SLASH,            {nullptr,               &Compiler::binary,    Precedence::FACTOR}},
-        {TokenType::STAR,             {nullptr,               &Compiler::binary,    Precedence::FACTOR}},
-        {TokenType::BANG,             {&Compiler::unary,      nullptr,              Precedence::NONE}},
-        {TokenType::BANG_EQUAL,       {nullptr,               &Compiler::binary,    Precedence::EQUALITY}},
-        {TokenType::EQUAL,            {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::EQUAL_EQUAL,      {nullptr,               &Compiler::binary,    Precedence::EQUALITY}},
-        {TokenType::GREATER,          {nullptr,               &Compiler::binary,    Precedence::COMPARISON}},
-        {TokenType::GREATER_EQUAL,    {nullptr,               &Compiler::binary,    Precedence::COMPARISON}},
-        {TokenType::LESS,             {nullptr,               &Compiler::binary,    Precedence::COMPARISON}},
-        {TokenType::LESS_EQUAL,       {nullptr,               &Compiler::binary,    Precedence::COMPARISON}},
-        {TokenType::IDENTIFIER,       {&Compiler::variable,   nullptr,              Precedence::NONE}},
-        {TokenType::STRING,           {&Compiler::string,     nullptr,              Precedence::NONE}},
-        {TokenType::NUMBER,           {&Compiler::number,     nullptr,              Precedence::NONE}},
-        {TokenType::AND,              {nullptr,               &Compiler::and_,      Precedence::AND}},
-        {TokenType::CLASS,            {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::ELSE,             {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::FALSE,            {&Compiler::literal,    nullptr,              Precedence::NONE}},
-        {TokenType::FOR,              {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::FUN,              {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::IF,               {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::NIL,              {&Compiler::literal,    nullptr,              Precedence::NONE}},
-        {TokenType::OR,               {nullptr,               &Compiler::or_,       Precedence::OR}},
-        {TokenType::PRINT,            {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::RETURN,           {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::SUPER,            {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::THIS,             {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::TRUE,             {&Compiler::literal,    nullptr,              Precedence::NONE}},
-        {TokenType::VAR,              {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::WHILE,            {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::ERROR,            {nullptr,               nullptr,              Precedence::NONE}},
-        {TokenType::END_OF_FILE,      {nullptr,               nullptr,              Precedence::NONE}}
-      };
+      return makeConstant(clox::obj::Object::formStringObject(m_Collector, token.m_Lexeme));
+    }
+
+    // The operand for the global `token` names: its index in the chunk's
+    // global table.
+    size_t Compiler::globalSlot(const Token& token) {
+      size_t slot = m_Globals.resolve(clox::obj::Object::formStringObject(m_Collector, token.m_Lexeme));
+      auto [it, added] = m_Scope.m_GlobalOperands.emplace(slot, m_Chunk->globalCount());
+      if (added)
+        m_Chunk->addGlobal(slot);
+
+      if (it->second > MAX_OPERAND) {
+        error("Too many global variables in one chunk.");
+        return 0;
+      }
+
+      return it->second;
+    }
+
+    // Indexed directly by TokenType. Built at compile time, so lookups are a
+    // single array access and the table needs no run-time initialization.
+    const parse_rule_table_t& Compiler::getParseRules(void) {
+      static constexpr parse_rule_table_t rules = [] {
+        parse_rule_table_t table{};
+        auto rule = [&table](const TokenType& type, parse_func_t prefix, parse_func_t infix, const Precedence& prec) {
+          table[static_cast<size_t>(type)] = { prefix, infix, prec };
+        };
+
+        rule(TokenType::LEFT_PAREN,       &Compiler::grouping,   &Compiler::call,      Precedence::CALL);
+        rule(TokenType::RIGHT_PAREN,      nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::LEFT_BRACE,       nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::RIGHT_BRACE,      nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::COMMA,            nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::DOT,              nullptr,               &Compiler::dot,       Precedence::CALL);
+        rule(TokenType::MINUS,            &Compiler::unary,      &Compiler::binary,    Precedence::TERM);
+        rule(TokenType::PLUS,             &Compiler::unary,      &Compiler::binary,    Precedence::TERM);
+        rule(TokenType::SEMICOLON,        nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::SLASH,            nullptr,               &Compiler::binary,    Precedence::FACTOR);
+        rule(TokenType::STAR,             nullptr,               &Compiler::binary,    Precedence::FACTOR);
+        rule(TokenType::BANG,             &Compiler::unary,      nullptr,              Precedence::NONE);
+        rule(TokenType::BANG_EQUAL,       nullptr,               &Compiler::binary,    Precedence::EQUALITY);
+        rule(TokenType::EQUAL,            nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::EQUAL_EQUAL,      nullptr,               &Compiler::binary,    Precedence::EQUALITY);
+        rule(TokenType::GREATER,          nullptr,               &Compiler::binary,    Precedence::COMPARISON);
+        rule(TokenType::GREATER_EQUAL,    nullptr,               &Compiler::binary,    Precedence::COMPARISON);
+        rule(TokenType::LESS,             nullptr,               &Compiler::binary,    Precedence::COMPARISON);
+        rule(TokenType::LESS_EQUAL,       nullptr,               &Compiler::binary,    Precedence::COMPARISON);
+        rule(TokenType::IDENTIFIER,       &Compiler::variable,   nullptr,              Precedence::NONE);
+        rule(TokenType::STRING,           &Compiler::string,     nullptr,              Precedence::NONE);
+        rule(TokenType::NUMBER,           &Compiler::number,     nullptr,              Precedence::NONE);
+        rule(TokenType::AND,              nullptr,               &Compiler::and_,      Precedence::AND);
+        rule(TokenType::CLASS,            nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::ELSE,             nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::FALSE,            &Compiler::literal,    nullptr,              Precedence::NONE);
+        rule(TokenType::FOR,              nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::FUN,              nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::IF,               nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::NIL,              &Compiler::literal,    nullptr,              Precedence::NONE);
+        rule(TokenType::OR,               nullptr,               &Compiler::or_,       Precedence::OR);
+        rule(TokenType::PRINT,            nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::RETURN,           nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::SUPER,            &Compiler::super_,     nullptr,              Precedence::NONE);
+        rule(TokenType::THIS,             &Compiler::this_,      nullptr,              Precedence::NONE);
+        rule(TokenType::TRUE,             &Compiler::literal,    nullptr,              Precedence::NONE);
+        rule(TokenType::VAR,              nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::WHILE,            nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::ERROR,            nullptr,               nullptr,              Precedence::NONE);
+        rule(TokenType::END_OF_FILE,      nullptr,               nullptr,              Precedence::NONE);
+
+        return table;
+      }();
 
       return rules;
     }
 
     void Compiler::number(bool canAssign) {
-      dbl_t value = std::stod(m_Parser.m_Prev.m_Lexeme);
+      const std::string_view& lexeme = m_Parser.m_Prev.m_Lexeme;
+      dbl_t value = 0.;
+      std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), value);
       emitConstant(value);
     }
 
@@ -476,7 +653,7 @@ namespace clox {
         emitByte(OpCode::DIVIDE);
         break;
       case TokenType::BANG_EQUAL:
-        emitBytes({ OpCode::EQUAL, OpCode::NOT });
+        emitBytes(OpCode::EQUAL, OpCode::NOT);
         break;
       case TokenType::EQUAL_EQUAL:
         emitByte(OpCode::EQUAL);
@@ -485,13 +662,13 @@ namespace clox {
         emitByte(OpCode::GREATER);
         break;
       case TokenType::GREATER_EQUAL:
-        emitBytes({ OpCode::LESS, OpCode::NOT });
+        emitBytes(OpCode::LESS, OpCode::NOT);
         break;
       case TokenType::LESS:
         emitByte(OpCode::LESS);
         break;
       case TokenType::LESS_EQUAL:
-        emitBytes({ OpCode::GREATER, OpCode::NOT });
+        emitBytes(OpCode::GREATER, OpCode::NOT);
         break;
       default:
         return;
@@ -515,9 +692,9 @@ namespace clox {
     }
 
     void Compiler::string(bool canAssign) {
-      emitConstant(clox::obj::Object::formStringObject(
-                        string_t(m_Parser.m_Prev.m_Lexeme.cbegin() + 1U,
-                                 m_Parser.m_Prev.m_Lexeme.cend() - 1U)));
+      const std::string_view& lexeme = m_Parser.m_Prev.m_Lexeme;
+      emitConstant(clox::obj::Object::formStringObject(m_Collector,
+                                                       lexeme.substr(1U, lexeme.size() - 2U)));
     }
 
     void Compiler::variable(bool canAssign) {
@@ -546,11 +723,59 @@ namespace clox {
 
     void Compiler::call(bool canAssign) {
       size_t count = argumentList();
-      emitBytes({ OpCode::CALL, count });
+      emitBytes(OpCode::CALL, count);
+    }
+
+    void Compiler::dot(bool canAssign) {
+      consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
+      size_t cache = makeCache(m_Parser.m_Prev);
+
+      if (canAssign && match(TokenType::EQUAL)) {
+        expression();
+        emitBytes(OpCode::SET_PROPERTY, cache);
+      } else if (match(TokenType::LEFT_PAREN)) {
+        // A method call is looked up and called in one go, without creating
+        // a bound method.
+        size_t count = argumentList();
+        emitInvoke(OpCode::INVOKE, cache, count);
+      } else {
+        emitBytes(OpCode::GET_PROPERTY, cache);
+      }
+    }
+
+    void Compiler::this_(bool canAssign) {
+      if (!m_Class) {
+        error("Can't use 'this' outside of a class.");
+        return;
+      }
+
+      variable(false);
+    }
+
+    void Compiler::super_(bool canAssign) {
+      if (!m_Class)
+        error("Can't use 'super' outside of a class.");
+      else if (!m_Class->m_HasSuperclass)
+        error("Can't use 'super' in a class with no superclass.");
+
+      consume(TokenType::DOT, "Expect '.' after 'super'.");
+      consume(TokenType::IDENTIFIER, "Expect superclass method name.");
+      size_t name = identifierConstant(m_Parser.m_Prev);
+
+      int_t line = m_Parser.m_Prev.m_Line;
+      namedVariable(Token(TokenType::THIS, "this", line), false);
+      if (match(TokenType::LEFT_PAREN)) {
+        size_t count = argumentList();
+        namedVariable(Token(TokenType::SUPER, "super", line), false);
+        emitInvoke(OpCode::SUPER_INVOKE, name, count);
+      } else {
+        namedVariable(Token(TokenType::SUPER, "super", line), false);
+        emitBytes(OpCode::GET_SUPER, name);
+      }
     }
 
     void Compiler::namedVariable(const Token& token, bool canAssign) {
-      int_t arg = resolveLocal(token);
+      int_t arg = resolveLocal(m_Scope, token);
       size_t offset;
 
       OpCode getOp;
@@ -559,24 +784,28 @@ namespace clox {
         offset = static_cast<size_t>(arg);
         getOp = OpCode::GET_LOCAL;
         setOp = OpCode::SET_LOCAL;
+      } else if ((arg = resolveUpvalue(m_Scope, token)) != -1) {
+        offset = static_cast<size_t>(arg);
+        getOp = OpCode::GET_UPVALUE;
+        setOp = OpCode::SET_UPVALUE;
       } else {
-        offset = identifierConstant(token);
+        offset = globalSlot(token);
         getOp = OpCode::GET_GLOBAL;
         setOp = OpCode::SET_GLOBAL;
       }
 
       if (canAssign && match(TokenType::EQUAL)) {
         expression();
-        emitBytes({ setOp, offset });
+        emitBytes(setOp, offset);
       } else {
-        emitBytes({ getOp, offset });
+        emitBytes(getOp, offset);
       }
     }
 
-    int_t Compiler::resolveLocal(const Token& token) {      
-      for (int_t i = static_cast<int_t>(m_Scope.m_Locals.size() - 1); i >= 0; --i) {
-        const Local& local = m_Scope.m_Locals[i];
-        if (token.m_Lexeme.compare(local.m_Token.m_Lexeme) == 0) {
+    int_t Compiler::resolveLocal(Scope& scope, const Token& token) {
+      for (int_t i = static_cast<int_t>(scope.m_Locals.size() - 1); i >= 0; --i) {
+        const Local& local = scope.m_Locals[i];
+        if (token.m_Lexeme == local.m_Token.m_Lexeme) {
           if (local.m_Depth == -1)
             error("Cannot read local variable in its own initializer.");
 
@@ -587,8 +816,36 @@ namespace clox {
       return -1;
     }
 
-    ParseRule Compiler::parseRule(const TokenType& type) {
-      return getParseRules()[type];
+    int_t Compiler::resolveUpvalue(Scope& scope, const Token& token) {
+      if (!scope.m_Enclosing)
+        return -1;
+
+      int_t local = resolveLocal(*scope.m_Enclosing, token);
+      if (local != -1) {
+        scope.m_Enclosing->m_Locals[local].m_IsCaptured = true;
+        return addUpvalue(scope, static_cast<size_t>(local), true);
+      }
+
+      int_t upvalue = resolveUpvalue(*scope.m_Enclosing, token);
+      if (upvalue != -1)
+        return addUpvalue(scope, static_cast<size_t>(upvalue), false);
+
+      return -1;
+    }
+
+    int_t Compiler::addUpvalue(Scope& scope, size_t index, bool isLocal) {
+      capture_vec_t& captures = scope.m_Function->m_Captures;
+      for (size_t i = 0; i < captures.size(); ++i) {
+        if (captures[i].m_Index == index && captures[i].m_IsLocal == isLocal)
+          return static_cast<int_t>(i);
+      }
+
+      captures.emplace_back(isLocal, static_cast<uint32_t>(index));
+      return static_cast<int_t>(captures.size() - 1);
+    }
+
+    const ParseRule& Compiler::parseRule(const TokenType& type) const {
+      return getParseRules()[static_cast<size_t>(type)];
     }
 
     void Compiler::parse(const Precedence& prec) {
@@ -614,9 +871,9 @@ namespace clox {
 
     void Compiler::function(const FunctionType& type) {
       Scope scope = m_Scope;
-      m_Scope = Scope(&scope, FunctionType::FUNCTION);
+      m_Scope = Scope(&scope, type, m_Collector);
       m_Chunk = &m_Scope.m_Function->m_Chunk;
-      m_Scope.m_Function->m_Name = m_Parser.m_Prev.m_Lexeme;
+      m_Scope.m_Function->m_Name = string_t(m_Parser.m_Prev.m_Lexeme);
       beginScope();
 
       consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
@@ -628,11 +885,12 @@ namespace clox {
         } while (match(TokenType::COMMA));
       }
       consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+      adjustStack(static_cast<int_t>(m_Scope.m_Function->m_Arity));
       consume(TokenType::LEFT_BRACE, "Expect '{' before function body.");
       block();
 
       function_ptr_t function = endCompiler();
-      emitBytes({ OpCode::CLOSURE, makeConstant(function)});
+      emitBytes(OpCode::CLOSURE, makeConstant(function));
     }
 
     size_t Compiler::argumentList(void) {
@@ -640,6 +898,9 @@ namespace clox {
       if (!check(TokenType::RIGHT_PAREN)) {
         do {
           expression();
+          if (count == MAX_ARGS)
+            error("Can't have more than 255 arguments.");
+
           count++;
         } while (match(TokenType::COMMA));
       }
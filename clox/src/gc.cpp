@@ -0,0 +1,175 @@
+#include "gc.hpp"
+#include "object.hpp"
+#include "vm.hpp"
+#include "compiler.hpp"
+#include <algorithm>
+
+namespace clox {
+  namespace gc {
+    size_t StringHash::operator()(const string_ptr_t& string) const {
+      return string->m_Hash;
+    }
+
+    size_t StringHash::operator()(const StringKey& key) const {
+      return key.m_Hash;
+    }
+
+    bool StringEqual::operator()(const string_ptr_t& left, const string_ptr_t& right) const {
+      return left == right;
+    }
+
+    bool StringEqual::operator()(const StringKey& left, const string_ptr_t& right) const {
+      return left.m_Hash == right->m_Hash && left.m_Str == right->m_Str;
+    }
+
+    bool StringEqual::operator()(const string_ptr_t& left, const StringKey& right) const {
+      return (*this)(right, left);
+    }
+
+    Collector::Collector(vm::VM& vm) :
+      m_VM(vm),
+      m_Compiler(nullptr),
+      m_Roots(),
+      m_Objects(nullptr),
+      m_Gray(),
+      m_Strings(),
+      m_BytesInUse(0),
+      m_NextGC(INITIAL_THRESHOLD),
+      m_Stats()
+    { }
+
+    Collector::~Collector(void) {
+      obj_ptr_t object = m_Objects;
+      while (object) {
+        obj_ptr_t next = object->m_Next;
+        delete object;
+        object = next;
+      }
+    }
+
+    void Collector::reserve(size_t size) {
+#ifdef CLOX_DEBUG_STRESS_GC
+      collect();
+#else
+      if (m_BytesInUse + size > m_NextGC)
+        collect();
+#endif
+    }
+
+    void Collector::grow(obj_ptr_t object, size_t before) {
+      size_t after = object->size();
+      if (after <= before)
+        return;
+
+      reserve(after - before);
+      m_BytesInUse += after - before;
+      m_Stats.m_BytesAllocated += after - before;
+    }
+
+    void Collector::markObject(obj_ptr_t object) {
+      if (!object || object->m_Marked)
+        return;
+
+      object->m_Marked = true;
+      m_Gray.push_back(object);
+    }
+
+    void Collector::markValue(const value_t& value) {
+      if (isObj(value))
+        markObject(asObj(value));
+    }
+
+    void Collector::collect(void) {
+      auto start = std::chrono::steady_clock::now();
+
+      markRoots();
+      traceReferences();
+      removeUnmarkedStrings();
+      sweep();
+
+      m_NextGC = std::max(m_BytesInUse * GROW_FACTOR, INITIAL_THRESHOLD);
+
+      auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+      ++m_Stats.m_Collections;
+      m_Stats.m_TotalPause += pause;
+      m_Stats.m_MaxPause = std::max(m_Stats.m_MaxPause, pause);
+    }
+
+    void Collector::setCompiler(compiler::Compiler* compiler) {
+      m_Compiler = compiler;
+    }
+
+    void Collector::pushRoot(obj_ptr_t object) {
+      m_Roots.push_back(object);
+    }
+
+    void Collector::popRoot(void) {
+      m_Roots.pop_back();
+    }
+
+    string_ptr_t Collector::findString(std::string_view str, uint32_t hash) const {
+      auto it = m_Strings.find(StringKey{ str, hash });
+      return it == m_Strings.cend() ? nullptr : *it;
+    }
+
+    void Collector::intern(string_ptr_t string) {
+      m_Strings.insert(string);
+    }
+
+    size_t Collector::bytesInUse(void) const {
+      return m_BytesInUse;
+    }
+
+    const Stats& Collector::stats(void) const {
+      return m_Stats;
+    }
+
+    void Collector::markRoots(void) {
+      m_VM.markRoots(*this);
+      if (m_Compiler)
+        m_Compiler->markRoots(*this);
+
+      for (obj_ptr_t object : m_Roots)
+        markObject(object);
+    }
+
+    void Collector::traceReferences(void) {
+      while (!m_Gray.empty()) {
+        obj_ptr_t object = m_Gray.back();
+        m_Gray.pop_back();
+        object->blacken(*this);
+      }
+    }
+
+    void Collector::removeUnmarkedStrings(void) {
+      std::erase_if(m_Strings, [](const string_ptr_t& string) { return !string->m_Marked; });
+    }
+
+    void Collector::sweep(void) {
+      obj_ptr_t previous = nullptr;
+      obj_ptr_t object = m_Objects;
+      while (object) {
+        if (object->m_Marked) {
+          object->m_Marked = false;
+          previous = object;
+          object = object->m_Next;
+          continue;
+        }
+
+        obj_ptr_t unreached = object;
+        object = object->m_Next;
+        if (previous)
+          previous->m_Next = object;
+        else
+          m_Objects = object;
+
+        size_t size = unreached->size();
+        m_BytesInUse -= size;
+        m_Stats.m_BytesFreed += size;
+        ++m_Stats.m_ObjectsFreed;
+        delete unreached;
+      }
+    }
+  }
+}
@@ -0,0 +1,40 @@
+#include "globals.hpp"
+#include "gc.hpp"
+#include "object.hpp"
+
+namespace clox {
+  namespace vm {
+    size_t GlobalTable::resolve(const string_ptr_t& name) {
+      auto it = m_Indices.find(name);
+      if (it != m_Indices.cend())
+        return it->second;
+
+      m_Slots.emplace_back(nullptr, name, false);
+      m_Indices.emplace(name, m_Slots.size() - 1);
+      return m_Slots.size() - 1;
+    }
+
+    size_t GlobalTable::size(void) const {
+      return m_Slots.size();
+    }
+
+    Global& GlobalTable::operator[](size_t slot) {
+      return m_Slots[slot];
+    }
+
+    const Global& GlobalTable::operator[](size_t slot) const {
+      return m_Slots[slot];
+    }
+
+    Global* GlobalTable::data(void) {
+      return m_Slots.data();
+    }
+
+    void GlobalTable::markRoots(gc::Collector& gc) const {
+      for (const Global& global : m_Slots) {
+        gc.markObject(global.m_Name);
+        gc.markValue(global.m_Value);
+      }
+    }
+  }
+}
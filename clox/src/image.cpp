@@ -0,0 +1,630 @@
+#include "image.hpp"
+#include "chunk.hpp"
+#include "object.hpp"
+#include "globals.hpp"
+#include "gc.hpp"
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Layout of an image. Every integer is little-endian; counts, lengths and
+// indices are u32.
+//
+//   header   "CLXB", version, u64 source size, i64 source modification
+//            time, u64 source hash, opcode count, optimization level,
+//            execution mode, string count, function count
+//   strings  length and bytes of each string the body refers to by index,
+//            padded to 8 bytes
+//   functions, nested ones before the functions that create them, the
+//   script last:
+//     name length and bytes, arity, max stack
+//     captures     index, with the top bit set for locals
+//     globals      string index of the name of each global the code uses
+//     code         size and bytes
+//     lines        runs of (line, byte count) covering the code
+//     constants    count, padding to 8 bytes, then a NaN-boxed u64 each
+//     caches       string index of each property name
+//
+// The file is mapped private and writable, and each chunk runs its code
+// where it is mapped: global operands index the chunk's own global table,
+// which the loader fills by name, so no byte of code depends on the VM
+// loading it, and quickening writes to pages of the process's own. So do
+// the constants of a NaN-boxing build, once the loader has swapped string
+// and function indices for objects. What is left proportional to the script
+// is making its strings and functions, and a line table of one entry a run.
+//
+// Only the header is checked: images are written whole and renamed into
+// place, and one whose source, build or settings differ is never read past
+// it. Counts and indices are still bounds-checked, so a truncated file
+// fails to load.
+
+namespace clox {
+  namespace image {
+    namespace {
+      using namespace obj;
+
+      constexpr char MAGIC[4] = { 'C', 'L', 'X', 'B' };
+      constexpr size_t HEADER_SIZE = 52;
+      constexpr uint32_t OPCODE_COUNT = static_cast<uint32_t>(vm::OpCode::EXTRA_WIDE) + 1;
+      constexpr uint32_t LOCAL_CAPTURE = 0x80000000u;
+      constexpr size_t WORD = sizeof(uint64_t);
+
+      // Constant words as value.hpp boxes them. An object constant holds
+      // the index of a string, or of a function with the low bit set, until
+      // the loader puts the object in its place.
+      constexpr uint64_t QNAN = 0x7ffc000000000000;
+      constexpr uint64_t OBJECT = 0x8000000000000000 | QNAN;
+      constexpr uint64_t NIL_WORD = QNAN | 1;
+      constexpr uint64_t FALSE_WORD = QNAN | 2;
+      constexpr uint64_t TRUE_WORD = QNAN | 3;
+      constexpr uint64_t FUNCTION_BIT = 1;
+
+#ifdef CLOX_NAN_BOXING
+      static_assert(QNAN == Value::QNAN && NIL_WORD == Value::NIL_VAL && FALSE_WORD == Value::FALSE_VAL &&
+                    TRUE_WORD == Value::TRUE_VAL && sizeof(value_t) == WORD);
+      constexpr bool CONSTANTS_IN_PLACE = std::endian::native == std::endian::little;
+#else
+      constexpr bool CONSTANTS_IN_PLACE = false;
+#endif
+
+      uint64_t fnv1a(const byte_t* data, size_t size) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < size; ++i) {
+          hash ^= data[i];
+          hash *= 1099511628211ull;
+        }
+
+        return hash;
+      }
+
+      void writeU8(byte_vec_t& out, uint8_t value) {
+        out.push_back(value);
+      }
+
+      void writeU32(byte_vec_t& out, uint32_t value) {
+        for (int i = 0; i < 4; ++i)
+          out.push_back(static_cast<byte_t>(value >> (8 * i)));
+      }
+
+      void writeU64(byte_vec_t& out, uint64_t value) {
+        for (int i = 0; i < 8; ++i)
+          out.push_back(static_cast<byte_t>(value >> (8 * i)));
+      }
+
+      void writeBytes(byte_vec_t& out, std::string_view bytes) {
+        writeU32(out, static_cast<uint32_t>(bytes.size()));
+        out.insert(out.end(), bytes.begin(), bytes.end());
+      }
+
+      void writePadding(byte_vec_t& out) {
+        while (out.size() % WORD != 0)
+          writeU8(out, 0);
+      }
+
+      class Writer {
+      public:
+        Writer(const vm::GlobalTable& globals);
+
+        bool write(const Function& script, const Source& source, int_t optimizationLevel,
+                   compiler::ExecutionMode mode, byte_vec_t& out);
+      private:
+        uint32_t string(const string_ptr_t& string);
+        bool function(const Function& function, uint32_t& index);
+      private:
+        const vm::GlobalTable& m_Globals;
+        string_vec_t m_Strings;
+        std::unordered_map<string_ptr_t, uint32_t> m_StringIndices;
+        byte_vec_t m_Functions;
+        uint32_t m_FunctionCount;
+      };
+
+      Writer::Writer(const vm::GlobalTable& globals) :
+        m_Globals(globals),
+        m_Strings(),
+        m_StringIndices(),
+        m_Functions(),
+        m_FunctionCount(0)
+      { }
+
+      bool Writer::write(const Function& script, const Source& source, int_t optimizationLevel,
+                         compiler::ExecutionMode mode, byte_vec_t& out) {
+        uint32_t root;
+        if (!function(script, root))
+          return false;
+
+        out.clear();
+        for (char c : MAGIC)
+          writeU8(out, static_cast<uint8_t>(c));
+        writeU32(out, VERSION);
+        writeU64(out, source.m_Size);
+        writeU64(out, static_cast<uint64_t>(source.m_ModifiedTime));
+        writeU64(out, source.m_Hash);
+        writeU32(out, OPCODE_COUNT);
+        writeU32(out, static_cast<uint32_t>(optimizationLevel));
+        writeU32(out, static_cast<uint32_t>(mode));
+        writeU32(out, static_cast<uint32_t>(m_Strings.size()));
+        writeU32(out, m_FunctionCount);
+
+        for (const string_ptr_t& string : m_Strings)
+          writeBytes(out, string->m_Str);
+
+        // Functions pad their constants relative to where they start.
+        writePadding(out);
+        out.insert(out.end(), m_Functions.begin(), m_Functions.end());
+        return true;
+      }
+
+      uint32_t Writer::string(const string_ptr_t& string) {
+        auto it = m_StringIndices.find(string);
+        if (it != m_StringIndices.end())
+          return it->second;
+
+        m_Strings.push_back(string);
+        m_StringIndices.emplace(string, static_cast<uint32_t>(m_Strings.size() - 1));
+        return static_cast<uint32_t>(m_Strings.size() - 1);
+      }
+
+      bool Writer::function(const Function& function, uint32_t& index) {
+        const vm::Chunk& chunk = function.m_Chunk;
+
+        // Nested functions go first, so the loader has built every function
+        // a constant refers to by the time it reads the constant.
+        index_vec_t nested(chunk.constantCount(), 0);
+        for (size_t i = 0; i < chunk.constantCount(); ++i) {
+          const value_t& constant = chunk.readConstant(i);
+          if (isObjType<Function>(constant)) {
+            uint32_t child;
+            if (!this->function(*asObjType<Function>(constant), child))
+              return false;
+
+            nested[i] = child;
+          }
+        }
+
+        byte_vec_t& out = m_Functions;
+        writeBytes(out, function.m_Name);
+        writeU32(out, static_cast<uint32_t>(function.m_Arity));
+        writeU32(out, static_cast<uint32_t>(function.m_MaxStack));
+
+        writeU32(out, static_cast<uint32_t>(function.m_Captures.size()));
+        for (const Capture& capture : function.m_Captures)
+          writeU32(out, capture.m_Index | (capture.m_IsLocal ? LOCAL_CAPTURE : 0));
+
+        writeU32(out, static_cast<uint32_t>(chunk.globalCount()));
+        for (size_t i = 0; i < chunk.globalCount(); ++i)
+          writeU32(out, string(m_Globals[chunk.globals()[i]].m_Name));
+
+        writeU32(out, static_cast<uint32_t>(chunk.size()));
+        out.insert(out.end(), chunk.code(), chunk.code() + chunk.size());
+
+        const line_run_vec_t& lines = chunk.lineRuns();
+        writeU32(out, static_cast<uint32_t>(lines.size()));
+        for (size_t i = 0; i < lines.size(); ++i) {
+          size_t end = i + 1 < lines.size() ? lines[i + 1].m_Offset : chunk.size();
+          writeU32(out, static_cast<uint32_t>(lines[i].m_Line));
+          writeU32(out, static_cast<uint32_t>(end - lines[i].m_Offset));
+        }
+
+        writeU32(out, static_cast<uint32_t>(chunk.constantCount()));
+        writePadding(out);
+        for (size_t i = 0; i < chunk.constantCount(); ++i) {
+          const value_t& constant = chunk.readConstant(i);
+          uint64_t word;
+          if (isNumber(constant)) {
+            dbl_t number = asNumber(constant);
+            std::memcpy(&word, &number, sizeof(word));
+          } else if (isNil(constant)) {
+            word = NIL_WORD;
+          } else if (isBool(constant)) {
+            word = asBool(constant) ? TRUE_WORD : FALSE_WORD;
+          } else if (isObjType<String>(constant)) {
+            word = OBJECT | (static_cast<uint64_t>(string(asObjType<String>(constant))) << 1);
+          } else if (isObjType<Function>(constant)) {
+            word = OBJECT | (static_cast<uint64_t>(nested[i]) << 1) | FUNCTION_BIT;
+          } else {
+            return false;
+          }
+
+          writeU64(out, word);
+        }
+
+        writeU32(out, static_cast<uint32_t>(chunk.cacheCount()));
+        for (size_t i = 0; i < chunk.cacheCount(); ++i)
+          writeU32(out, string(chunk.readCache(i).m_Name));
+
+        index = m_FunctionCount++;
+        return true;
+      }
+
+      // Reads an image where it is mapped. Any read past the end, or any
+      // index out of range, fails the whole load.
+      class Reader {
+      public:
+        Reader(const std::shared_ptr<void>& image, size_t size, gc::Collector& gc, vm::GlobalTable& globals);
+        ~Reader(void);
+
+        function_ptr_t read(const Source& source, bool byHash, int_t optimizationLevel, compiler::ExecutionMode mode);
+      private:
+        uint32_t readU32(void);
+        uint64_t readU64(void);
+        std::string_view readBytes(size_t size);
+        // The next `size` bytes, for chunks to use where they are.
+        byte_t* take(size_t size);
+        void skipPadding(void);
+        string_ptr_t string(uint32_t index);
+        function_ptr_t function(void);
+        bool constant(uint64_t word, value_t& value);
+      private:
+        std::shared_ptr<void> m_Image;
+        byte_t* m_Data;
+        byte_t* m_Position;
+        byte_t* m_End;
+        bool m_Failed;
+
+        gc::Collector& m_Collector;
+        vm::GlobalTable& m_Globals;
+        std::vector<std::string_view> m_Strings;
+        // Each string made so far, and every function read so far, is pinned
+        // as a GC root until the reader is done, since the loaded tree is not
+        // reachable from the VM until then.
+        string_vec_t m_StringObjects;
+        std::vector<function_ptr_t> m_Functions;
+        size_t m_Roots;
+      };
+
+      Reader::Reader(const std::shared_ptr<void>& image, size_t size, gc::Collector& gc, vm::GlobalTable& globals) :
+        m_Image(image),
+        m_Data(static_cast<byte_t*>(image.get())),
+        m_Position(m_Data),
+        m_End(m_Data + size),
+        m_Failed(false),
+        m_Collector(gc),
+        m_Globals(globals),
+        m_Strings(),
+        m_StringObjects(),
+        m_Functions(),
+        m_Roots(0)
+      { }
+
+      Reader::~Reader(void) {
+        for (size_t i = 0; i < m_Roots; ++i)
+          m_Collector.popRoot();
+      }
+
+      uint32_t Reader::readU32(void) {
+        if (m_End - m_Position < 4) {
+          m_Failed = true;
+          return 0;
+        }
+
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i)
+          value |= static_cast<uint32_t>(m_Position[i]) << (8 * i);
+        m_Position += 4;
+        return value;
+      }
+
+      uint64_t Reader::readU64(void) {
+        uint64_t low = readU32();
+        uint64_t high = readU32();
+        return low | (high << 32);
+      }
+
+      std::string_view Reader::readBytes(size_t size) {
+        const byte_t* bytes = take(size);
+        return bytes ? std::string_view(reinterpret_cast<const char*>(bytes), size) : std::string_view();
+      }
+
+      byte_t* Reader::take(size_t size) {
+        if (static_cast<size_t>(m_End - m_Position) < size) {
+          m_Failed = true;
+          return nullptr;
+        }
+
+        byte_t* bytes = m_Position;
+        m_Position += size;
+        return bytes;
+      }
+
+      void Reader::skipPadding(void) {
+        size_t offset = static_cast<size_t>(m_Position - m_Data);
+        take((WORD - offset % WORD) % WORD);
+      }
+
+      // String objects are made on first use, each rooted from then on.
+      string_ptr_t Reader::string(uint32_t index) {
+        if (index >= m_Strings.size()) {
+          m_Failed = true;
+          return nullptr;
+        }
+
+        if (!m_StringObjects[index]) {
+          m_StringObjects[index] = Object::formStringObject(m_Collector, m_Strings[index]);
+          m_Collector.pushRoot(m_StringObjects[index]);
+          ++m_Roots;
+        }
+
+        return m_StringObjects[index];
+      }
+
+      function_ptr_t Reader::read(const Source& source, bool byHash, int_t optimizationLevel,
+                                  compiler::ExecutionMode mode) {
+        if (readBytes(sizeof(MAGIC)) != std::string_view(MAGIC, sizeof(MAGIC)) || readU32() != VERSION)
+          return nullptr;
+
+        uint64_t size = readU64();
+        auto modifiedTime = static_cast<int64_t>(readU64());
+        uint64_t hash = readU64();
+        bool current = byHash ? hash == source.m_Hash :
+                                size == source.m_Size && modifiedTime == source.m_ModifiedTime;
+        if (!current || readU32() != OPCODE_COUNT || readU32() != static_cast<uint32_t>(optimizationLevel) ||
+            readU32() != static_cast<uint32_t>(mode))
+          return nullptr;
+
+        uint32_t stringCount = readU32();
+        uint32_t functionCount = readU32();
+        for (uint32_t i = 0; i < stringCount && !m_Failed; ++i)
+          m_Strings.push_back(readBytes(readU32()));
+        m_StringObjects.resize(m_Strings.size(), nullptr);
+        skipPadding();
+
+        for (uint32_t i = 0; i < functionCount && !m_Failed; ++i)
+          function();
+
+        if (m_Failed || m_Functions.empty() || m_Position != m_End)
+          return nullptr;
+
+        return m_Functions.back();
+      }
+
+      function_ptr_t Reader::function(void) {
+        function_ptr_t function = Object::formFunctionObject(m_Collector);
+        m_Collector.pushRoot(function);
+        ++m_Roots;
+        m_Functions.push_back(function);
+
+        function->m_Name = string_t(readBytes(readU32()));
+        function->m_Arity = readU32();
+        function->m_MaxStack = readU32();
+
+        uint32_t captureCount = readU32();
+        for (uint32_t i = 0; i < captureCount && !m_Failed; ++i) {
+          uint32_t capture = readU32();
+          function->m_Captures.push_back({ (capture & LOCAL_CAPTURE) != 0, capture & ~LOCAL_CAPTURE });
+        }
+
+        // The name stays rooted by the global table once resolved.
+        vm::Chunk& chunk = function->m_Chunk;
+        uint32_t globalCount = readU32();
+        for (uint32_t i = 0; i < globalCount && !m_Failed; ++i) {
+          string_ptr_t name = string(readU32());
+          if (name)
+            chunk.addGlobal(m_Globals.resolve(name));
+        }
+
+        uint32_t size = readU32();
+        byte_t* code = take(size);
+
+        line_run_vec_t lines;
+        uint32_t runCount = readU32();
+        size_t offset = 0;
+        for (uint32_t i = 0; i < runCount && !m_Failed; ++i) {
+          uint32_t line = readU32();
+          uint32_t length = readU32();
+          if (length > size - offset) {
+            m_Failed = true;
+            break;
+          }
+
+          lines.push_back({ static_cast<uint32_t>(offset), line });
+          offset += length;
+        }
+
+        if (offset != size)
+          m_Failed = true;
+
+        uint32_t constantCount = readU32();
+        skipPadding();
+        byte_t* words = take(static_cast<size_t>(constantCount) * WORD);
+        for (uint32_t i = 0; i < constantCount && !m_Failed; ++i) {
+          uint64_t word = 0;
+          for (size_t j = 0; j < WORD; ++j)
+            word |= static_cast<uint64_t>(words[i * WORD + j]) << (8 * j);
+
+          value_t value;
+          if (!constant(word, value)) {
+            m_Failed = true;
+            break;
+          }
+
+          if constexpr (CONSTANTS_IN_PLACE)
+            std::memcpy(words + i * WORD, &value, WORD);
+          else
+            chunk.addConstant(value);
+        }
+
+        uint32_t cacheCount = readU32();
+        for (uint32_t i = 0; i < cacheCount && !m_Failed; ++i) {
+          string_ptr_t name = string(readU32());
+          if (name)
+            chunk.addCache(name);
+        }
+
+        // Only once every constant word holds a value, since the collector
+        // marks them from now on.
+        if (!m_Failed) {
+          chunk.borrow(m_Image, code, size, std::move(lines),
+                       CONSTANTS_IN_PLACE ? reinterpret_cast<value_t*>(words) : nullptr, constantCount);
+        }
+
+        return function;
+      }
+
+      bool Reader::constant(uint64_t word, value_t& value) {
+        if ((word & QNAN) != QNAN) {
+          dbl_t number;
+          std::memcpy(&number, &word, sizeof(number));
+          value = number;
+        } else if (word == NIL_WORD) {
+          value = nullptr;
+        } else if (word == FALSE_WORD || word == TRUE_WORD) {
+          value = word == TRUE_WORD;
+        } else if ((word & OBJECT) == OBJECT) {
+          uint64_t index = (word & ~OBJECT) >> 1;
+          if ((word & FUNCTION_BIT) == 0) {
+            string_ptr_t string = index <= UINT32_MAX ? this->string(static_cast<uint32_t>(index)) : nullptr;
+            if (!string)
+              return false;
+
+            value = static_cast<obj_ptr_t>(string);
+          } else {
+            // Only functions written before this one can be referenced.
+            if (index + 1 >= m_Functions.size())
+              return false;
+
+            value = static_cast<obj_ptr_t>(m_Functions[index]);
+          }
+        } else {
+          return false;
+        }
+
+        return true;
+      }
+
+      // The whole file at `path`, mapped private and writable where the
+      // platform allows, read into memory otherwise. Null if it cannot be
+      // opened or is empty.
+      std::shared_ptr<void> mapFile(const string_t& path, size_t& size) {
+#ifdef _WIN32
+        FILE* in = fopen(path.c_str(), "rb");
+        if (!in)
+          return nullptr;
+
+        auto buffer = std::make_shared<byte_vec_t>();
+        byte_t block[4096];
+        size_t count;
+        while ((count = fread(block, 1, sizeof(block), in)) > 0)
+          buffer->insert(buffer->end(), block, block + count);
+        fclose(in);
+
+        size = buffer->size();
+        if (size == 0)
+          return nullptr;
+
+        return std::shared_ptr<void>(buffer, buffer->data());
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+          return nullptr;
+
+        void* data = MAP_FAILED;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+          size = static_cast<size_t>(info.st_size);
+          data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+
+        close(fd);
+        if (data == MAP_FAILED)
+          return nullptr;
+
+        return std::shared_ptr<void>(data, [size](void* data) { munmap(data, size); });
+#endif
+      }
+
+      int processId(void) {
+#ifdef _WIN32
+        return _getpid();
+#else
+        return static_cast<int>(getpid());
+#endif
+      }
+    }
+
+    uint64_t hashSource(std::string_view source) {
+      return fnv1a(reinterpret_cast<const byte_t*>(source.data()), source.size());
+    }
+
+    bool describeSource(const string_t& path, Source& source) {
+      std::error_code error;
+      uintmax_t size = std::filesystem::file_size(path, error);
+      if (error)
+        return false;
+
+      std::filesystem::file_time_type modified = std::filesystem::last_write_time(path, error);
+      if (error)
+        return false;
+
+      source.m_Size = static_cast<uint64_t>(size);
+      source.m_ModifiedTime = static_cast<int64_t>(modified.time_since_epoch().count());
+      return true;
+    }
+
+    bool readSource(const string_t& path, string_t& text) {
+      FILE* in = fopen(path.c_str(), "rb");
+      if (!in)
+        return false;
+
+      text.clear();
+      char block[4096];
+      size_t count;
+      while ((count = fread(block, 1, sizeof(block), in)) > 0)
+        text.append(block, count);
+
+      bool read = !ferror(in);
+      fclose(in);
+      return read;
+    }
+
+    bool save(const string_t& path, const Function& function, const vm::GlobalTable& globals,
+              const Source& source, int_t optimizationLevel, compiler::ExecutionMode mode) {
+      byte_vec_t data;
+      Writer writer(globals);
+      if (!writer.write(function, source, optimizationLevel, mode, data))
+        return false;
+
+      // Written under a temporary name and renamed into place, so that a
+      // process loading the image meanwhile sees the old file or the whole
+      // new one.
+      string_t temporary = path + ".tmp" + std::to_string(processId());
+      FILE* out = fopen(temporary.c_str(), "wb");
+      if (!out)
+        return false;
+
+      bool written = fwrite(data.data(), 1, data.size(), out) == data.size();
+      written = fclose(out) == 0 && written;
+
+      std::error_code error;
+      if (written)
+        std::filesystem::rename(temporary, path, error);
+
+      if (!written || error) {
+        std::filesystem::remove(temporary, error);
+        return false;
+      }
+
+      return true;
+    }
+
+    function_ptr_t load(const string_t& path, gc::Collector& gc, vm::GlobalTable& globals, const Source& source,
+                        bool byHash, int_t optimizationLevel, compiler::ExecutionMode mode) {
+      size_t size = 0;
+      std::shared_ptr<void> image = mapFile(path, size);
+      if (!image || size < HEADER_SIZE)
+        return nullptr;
+
+      Reader reader(image, size, gc, globals);
+      return reader.read(source, byHash, optimizationLevel, mode);
+    }
+  }
+}
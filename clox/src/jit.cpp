@@ -0,0 +1,1207 @@
+#include "jit.hpp"
+#include "chunk.hpp"
+#include "object.hpp"
+#include "globals.hpp"
+#include "vm.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#if CLOX_JIT_ENABLED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace clox {
+  namespace jit {
+#if CLOX_JIT_ENABLED
+    namespace {
+      using namespace vm;
+
+      enum Reg : byte_t {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+      };
+
+      // Registers that hold the same thing all through the native code. They
+      // are callee-saved, so calls into the runtime leave them alone.
+      constexpr Reg SLOTS = RBX;
+      constexpr Reg TOP = R12;
+      constexpr Reg MACHINE = R13;
+      // Where the VM keeps its stack top, written back before every call
+      // into the runtime and on the way out.
+      constexpr Reg TOP_ADDRESS = R14;
+      constexpr Reg GLOBALS = R15;
+      // Value::QNAN, for the number tests.
+      constexpr Reg NAN_BITS = RBP;
+      // Each native frame keeps its CallFrame on the stack, and next to it
+      // whether it was entered from the VM or nested in a native caller.
+      constexpr int32_t FRAME = 0;
+      constexpr int32_t OUTERMOST = 8;
+
+      enum class Condition : byte_t {
+        EQUAL = 0x4,
+        NOT_EQUAL = 0x5,
+        BELOW_EQUAL = 0x6,
+        ABOVE = 0x7,
+        NO_PARITY = 0xB,
+      };
+
+      enum class DoubleOp : byte_t {
+        ADD = 0x58,
+        MULTIPLY = 0x59,
+        SUBTRACT = 0x5C,
+        DIVIDE = 0x5E,
+      };
+
+      constexpr uint32_t NO_ENTRY = UINT32_MAX;
+      constexpr size_t CACHE_LINE = 64;
+      // How many callbacks a call of a method that stays in the interpreter
+      // counts as.
+      constexpr size_t INTERPRETED_CALL = 4;
+
+      // Native code reads these by offsetof, which needs a standard layout.
+      static_assert(std::is_standard_layout_v<CallFrame>);
+      static_assert(std::is_standard_layout_v<Global>);
+
+      // Where native code finds what it reads straight out of objects. The
+      // object types have vtables, so offsetof does not apply to them; the
+      // offsets are measured once on an object of each type instead, from
+      // the pointer native code holds: the Object of a boxed value, and the
+      // Closure or Upvalue itself otherwise.
+      struct Layout {
+        int32_t m_ObjectType;
+        int32_t m_InstanceShape;
+        int32_t m_InstanceFields;
+        int32_t m_ClosureUpvalues;
+        int32_t m_UpvalueLocation;
+      };
+
+      int32_t offsetIn(const void* object, const void* member) {
+        return static_cast<int32_t>(static_cast<const byte_t*>(member) - static_cast<const byte_t*>(object));
+      }
+
+      const Layout& layout(void) {
+        static const Layout measured = [] {
+          // A function without captures, so the closure has no upvalues to
+          // write past its end.
+          obj::Function function;
+          obj::Closure closure(&function);
+          obj::Shape shape;
+          obj::String name("", 0);
+          obj::Class klass(&name, &shape);
+          obj::Instance instance(&klass);
+          const obj::Object& object = instance;
+          obj::Upvalue upvalue(nullptr);
+          return Layout{
+            offsetIn(&object, &object.m_Type),
+            offsetIn(&object, &instance.m_Shape),
+            offsetIn(&object, &instance.m_Fields),
+            offsetIn(&closure, closure.upvalues()),
+            offsetIn(&upvalue, &upvalue.m_Location),
+          };
+        }();
+
+        return measured;
+      }
+
+      // The handful of x86-64 instructions the templates are made of. All
+      // jumps take 32-bit displacements, patched once the target is known.
+      class Assembler {
+      public:
+        size_t size(void) const { return m_Code.size(); }
+        const byte_vec_t& code(void) const { return m_Code; }
+
+        void load(Reg destination, Reg base, int32_t displacement) {
+          rex(true, destination, base);
+          emit(0x8B);
+          address(destination, base, displacement);
+        }
+
+        void store(Reg base, int32_t displacement, Reg source) {
+          rex(true, source, base);
+          emit(0x89);
+          address(source, base, displacement);
+        }
+
+        void storeByte(Reg base, int32_t displacement, byte_t value) {
+          rex(false, RAX, base);
+          emit(0xC6);
+          address(0, base, displacement);
+          emit(value);
+        }
+
+        void compareByte(Reg base, int32_t displacement, byte_t value) {
+          rex(false, RAX, base);
+          emit(0x80);
+          address(7, base, displacement);
+          emit(value);
+        }
+
+        void loadAddress(Reg destination, Reg base, int32_t displacement) {
+          rex(true, destination, base);
+          emit(0x8D);
+          address(destination, base, displacement);
+        }
+
+        void move(Reg destination, Reg source) {
+          rex(true, source, destination);
+          emit(0x89);
+          direct(source, destination);
+        }
+
+        void move(Reg destination, uint64_t value) {
+          rex(true, RAX, destination);
+          emit(static_cast<byte_t>(0xB8 + (destination & 7)));
+          emit64(value);
+        }
+
+        void add(Reg destination, int32_t value) { immediate(0, destination, value); }
+        void subtract(Reg destination, int32_t value) { immediate(5, destination, value); }
+        void bitwiseAnd(Reg destination, Reg source) { binary(0x21, destination, source); }
+        void bitwiseOr(Reg destination, Reg source) { binary(0x09, destination, source); }
+        void bitwiseXor(Reg destination, Reg source) { binary(0x31, destination, source); }
+        void compare(Reg left, Reg right) { binary(0x39, left, right); }
+
+        void flipSignBit(Reg r) {
+          rex(true, RAX, r);
+          emit(0x0F);
+          emit(0xBA);
+          direct(7, r);
+          emit(63);
+        }
+
+        // The byte forms only take rax, rcx, rdx and rbx, which need no REX.
+        void set(const Condition& condition, Reg r) {
+          emit(0x0F);
+          emit(static_cast<byte_t>(0x90 | static_cast<byte_t>(condition)));
+          direct(0, r);
+        }
+
+        void orByte(Reg destination, Reg source) { emit(0x08); direct(source, destination); }
+        void andByte(Reg destination, Reg source) { emit(0x20); direct(source, destination); }
+        void testByte(Reg r) { emit(0x84); direct(r, r); }
+
+        void test(Reg r) { binary(0x85, r, r); }
+
+        void test32(Reg r) {
+          rex(false, r, r);
+          emit(0x85);
+          direct(r, r);
+        }
+
+        void flipByte(Reg r) {
+          emit(0x80);
+          direct(6, r);
+          emit(1);
+        }
+
+        void zeroExtendByte(Reg r) {
+          emit(0x0F);
+          emit(0xB6);
+          direct(r, r);
+        }
+
+        void toDouble(byte_t xmm, Reg source) {
+          emit(0x66);
+          rex(true, xmm, source);
+          emit(0x0F);
+          emit(0x6E);
+          direct(xmm, source);
+        }
+
+        void fromDouble(Reg destination, byte_t xmm) {
+          emit(0x66);
+          rex(true, xmm, destination);
+          emit(0x0F);
+          emit(0x7E);
+          direct(xmm, destination);
+        }
+
+        void arithmetic(const DoubleOp& op, byte_t destination, byte_t source) {
+          emit(0xF2);
+          emit(0x0F);
+          emit(static_cast<byte_t>(op));
+          direct(destination, source);
+        }
+
+        void compareDoubles(byte_t left, byte_t right) {
+          emit(0x66);
+          emit(0x0F);
+          emit(0x2E);
+          direct(left, right);
+        }
+
+        void push(Reg r) {
+          rex(false, RAX, r);
+          emit(static_cast<byte_t>(0x50 + (r & 7)));
+        }
+
+        void pop(Reg r) {
+          rex(false, RAX, r);
+          emit(static_cast<byte_t>(0x58 + (r & 7)));
+        }
+
+        // Clobbers rax.
+        void call(const void* function) {
+          move(RAX, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(function)));
+          emit(0xFF);
+          direct(2, RAX);
+        }
+
+        void call(Reg target) {
+          rex(false, RAX, target);
+          emit(0xFF);
+          direct(2, target);
+        }
+
+        void jump(Reg target) {
+          rex(false, RAX, target);
+          emit(0xFF);
+          direct(4, target);
+        }
+
+        void ret(void) { emit(0xC3); }
+
+        // These return where the displacement goes, for patch() or bind().
+        size_t jump(void) {
+          emit(0xE9);
+          return hole();
+        }
+
+        size_t jump(const Condition& condition) {
+          emit(0x0F);
+          emit(static_cast<byte_t>(0x80 | static_cast<byte_t>(condition)));
+          return hole();
+        }
+
+        void patch(size_t at, size_t target) {
+          int32_t displacement = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+          std::memcpy(&m_Code[at], &displacement, sizeof(displacement));
+        }
+
+        void bind(size_t at) { patch(at, size()); }
+      private:
+        void emit(byte_t byte) { m_Code.push_back(byte); }
+
+        void emit32(uint32_t value) {
+          for (size_t i = 0; i < 4; ++i)
+            emit(static_cast<byte_t>(value >> (8 * i)));
+        }
+
+        void emit64(uint64_t value) {
+          for (size_t i = 0; i < 8; ++i)
+            emit(static_cast<byte_t>(value >> (8 * i)));
+        }
+
+        size_t hole(void) {
+          emit32(0);
+          return size() - 4;
+        }
+
+        void rex(bool wide, int reg, int base) {
+          byte_t prefix = static_cast<byte_t>(0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((base & 8) >> 3));
+          if (prefix != 0x40)
+            emit(prefix);
+        }
+
+        void direct(int reg, int rm) {
+          emit(static_cast<byte_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+        }
+
+        // [base + displacement]; rsp and r12 as a base need a SIB byte, and
+        // rbp and r13 always a displacement.
+        void address(int reg, Reg base, int32_t displacement) {
+          byte_t mod = displacement == 0 && (base & 7) != RBP ? 0x00 :
+                       displacement >= INT8_MIN && displacement <= INT8_MAX ? 0x40 : 0x80;
+          emit(static_cast<byte_t>(mod | ((reg & 7) << 3) | (base & 7)));
+          if ((base & 7) == RSP)
+            emit(0x24);
+
+          if (mod == 0x40)
+            emit(static_cast<byte_t>(displacement));
+          else if (mod == 0x80)
+            emit32(static_cast<uint32_t>(displacement));
+        }
+
+        void binary(byte_t opcode, Reg destination, Reg source) {
+          rex(true, source, destination);
+          emit(opcode);
+          direct(source, destination);
+        }
+
+        void immediate(int extension, Reg destination, int32_t value) {
+          rex(true, RAX, destination);
+          if (value >= INT8_MIN && value <= INT8_MAX) {
+            emit(0x83);
+            direct(extension, destination);
+            emit(static_cast<byte_t>(value));
+          } else {
+            emit(0x81);
+            direct(extension, destination);
+            emit32(static_cast<uint32_t>(value));
+          }
+        }
+      private:
+        byte_vec_t m_Code;
+      };
+
+      // How `left C right` is tested with ucomisd: whether the operands are
+      // compared the other way round, and the condition that holds when the
+      // comparison does. Unordered operands read as below and equal, so
+      // negated comparisons come out true for NaN, as in the interpreter.
+      struct DoubleTest {
+        bool m_Swap;
+        Condition m_Condition;
+      };
+
+      DoubleTest doubleTest(char c, bool negate) {
+        return { c == '<', negate ? Condition::BELOW_EQUAL : Condition::ABOVE };
+      }
+
+      int32_t slotOffset(size_t slot) {
+        return static_cast<int32_t>(slot * sizeof(value_t));
+      }
+
+      int32_t globalOffset(size_t slot) {
+        return static_cast<int32_t>(slot * sizeof(Global));
+      }
+
+      class Translator {
+      public:
+        Translator(obj::Function& function, const Runtime& runtime) :
+          m_Chunk(function.m_Chunk),
+          m_Runtime(runtime),
+          m_Layout(layout()),
+          m_Assembler(),
+          m_Entries(function.m_Chunk.size(), NO_ENTRY),
+          m_Jumps(),
+          m_Interpret(0),
+          m_Epilogue(0),
+          m_Nested(0)
+        { }
+
+        Code* translate(void) {
+          if (!worthCompiling())
+            return nullptr;
+
+          prologue();
+
+          for (size_t offset = 0; offset < m_Chunk.size();) {
+            size_t start = offset;
+            m_Entries[start] = static_cast<uint32_t>(m_Assembler.size());
+
+            OpCode op;
+            size_t ext;
+            size_t next = decode(offset, op, ext);
+            instruction(op, start, next, ext);
+            offset = next;
+          }
+
+          for (const auto& [at, target] : m_Jumps) {
+            if (target >= m_Entries.size() || m_Entries[target] == NO_ENTRY)
+              return nullptr;
+
+            m_Assembler.patch(at, m_Entries[target]);
+          }
+
+          return install();
+        }
+      private:
+        // Reads the instruction at `offset`, past any WIDE / EXTRA_WIDE
+        // prefix, and returns the offset of the one after it.
+        size_t decode(size_t offset, OpCode& op, size_t& ext) const {
+          const byte_t* code = m_Chunk.code();
+          ext = 0;
+          if (code[offset] == static_cast<byte_t>(OpCode::WIDE)) {
+            ext = static_cast<size_t>(code[offset + 1]) << 8;
+            offset += 2;
+          } else if (code[offset] == static_cast<byte_t>(OpCode::EXTRA_WIDE)) {
+            ext = (static_cast<size_t>(code[offset + 1]) << 16) | (static_cast<size_t>(code[offset + 2]) << 8);
+            offset += 3;
+          }
+
+          op = static_cast<OpCode>(code[offset]);
+          return offset + 1 + operandSize(operandFormat(op));
+        }
+
+        // Whether the template of `op` always calls back into the VM.
+        bool callsBack(const OpCode& op, const byte_t* operands, size_t ext) const {
+          switch (op) {
+          case OpCode::GET_PROPERTY:
+          case OpCode::SET_PROPERTY:
+            return cachedSlot(m_Chunk.caches()[ext | operands[0]]) == -1;
+          case OpCode::PRINT:
+          case OpCode::CALL:
+          case OpCode::INVOKE:
+          case OpCode::RETURN:
+            return true;
+          default:
+            return false;
+          }
+        }
+
+        // A function with at least every other instruction calling back into
+        // the VM, such as an empty method or initializer, runs faster in the
+        // interpreter: there a call or return stays in the dispatch loop
+        // rather than costing a runtime call and a native entry and exit.
+        // Invoking a method that stays in the interpreter is heavier still,
+        // as native code is left until the next back-edge, so unless
+        // `callees` is false, those the caches have seen count several times.
+        bool worthCompiling(bool callees = true) const {
+          size_t instructions = 0;
+          size_t callbacks = 0;
+          for (size_t offset = 0; offset < m_Chunk.size();) {
+            OpCode op;
+            size_t ext;
+            size_t next = decode(offset, op, ext);
+            const byte_t* operands = m_Chunk.code() + next - operandSize(operandFormat(op));
+            ++instructions;
+            callbacks += callsBack(op, operands, ext);
+            if (callees && op == OpCode::INVOKE && invokesInterpreted(m_Chunk.caches()[ext | operands[0]]))
+              callbacks += INTERPRETED_CALL - 1;
+
+            offset = next;
+          }
+
+          return callbacks * 2 < instructions;
+        }
+
+        // Whether the first method `cache` has seen is left to the interpreter.
+        bool invokesInterpreted(const PropertyCache& cache) const {
+          if (cache.m_Count == 0 || cache.m_Entries[0].m_Slot != -1)
+            return false;
+
+          obj::Function& callee = *cache.m_Entries[0].m_Method->m_Function;
+          return !callee.m_Native && !Translator(callee, m_Runtime).worthCompiling(false);
+        }
+
+        // Saves the callee-saved registers, loads the pinned ones and jumps
+        // to the entry passed in r8. The exits follow: to the interpreter at
+        // the ip in rcx, and with the Exit in eax, which unwinds a nested
+        // frame back into its caller. The nested entry comes last and falls
+        // through to the first instruction.
+        void prologue(void) {
+          m_Assembler.push(RBP);
+          m_Assembler.push(RBX);
+          m_Assembler.push(R12);
+          m_Assembler.push(R13);
+          m_Assembler.push(R14);
+          m_Assembler.push(R15);
+          // Also realigns the stack to 16 bytes for the calls into the runtime.
+          m_Assembler.subtract(RSP, 24);
+          m_Assembler.move(MACHINE, RDI);
+          m_Assembler.move(TOP_ADDRESS, RSI);
+          m_Assembler.store(RSP, FRAME, RDX);
+          m_Assembler.move(RAX, 1);
+          m_Assembler.store(RSP, OUTERMOST, RAX);
+          m_Assembler.load(SLOTS, RDX, offsetof(CallFrame, m_Slots));
+          m_Assembler.move(GLOBALS, RCX);
+          m_Assembler.load(TOP, TOP_ADDRESS, 0);
+          m_Assembler.move(NAN_BITS, Value::QNAN);
+          m_Assembler.jump(R8);
+
+          m_Interpret = m_Assembler.size();
+          m_Assembler.load(RAX, RSP, FRAME);
+          m_Assembler.store(RAX, offsetof(CallFrame, m_IP), RCX);
+          m_Assembler.move(RAX, static_cast<uint64_t>(Exit::INTERPRET));
+
+          m_Epilogue = m_Assembler.size();
+          m_Assembler.store(TOP_ADDRESS, 0, TOP);
+          m_Assembler.load(RCX, RSP, OUTERMOST);
+          m_Assembler.test32(RCX);
+          size_t outermost = m_Assembler.jump(Condition::NOT_EQUAL);
+          m_Assembler.add(RSP, 16);
+          m_Assembler.pop(SLOTS);
+          m_Assembler.ret();
+
+          m_Assembler.bind(outermost);
+          m_Assembler.add(RSP, 24);
+          m_Assembler.pop(R15);
+          m_Assembler.pop(R14);
+          m_Assembler.pop(R13);
+          m_Assembler.pop(R12);
+          m_Assembler.pop(RBX);
+          m_Assembler.pop(RBP);
+          m_Assembler.ret();
+
+          // Called from a CALL or INVOKE template, which leaves every pinned
+          // register but the slots as they are. Frames sit next to each other,
+          // so the callee's follows the caller's.
+          m_Nested = m_Assembler.size();
+          m_Assembler.push(SLOTS);
+          m_Assembler.subtract(RSP, 16);
+          m_Assembler.load(RAX, RSP, 32 + FRAME);
+          m_Assembler.add(RAX, sizeof(CallFrame));
+          m_Assembler.store(RSP, FRAME, RAX);
+          m_Assembler.move(RCX, 0);
+          m_Assembler.store(RSP, OUTERMOST, RCX);
+          m_Assembler.load(SLOTS, RAX, offsetof(CallFrame, m_Slots));
+        }
+
+        void instruction(const OpCode& op, size_t start, size_t next, size_t ext) {
+          const byte_t* operands = m_Chunk.code() + next - operandSize(operandFormat(op));
+          auto operand = [&](void) { return ext | operands[0]; };
+          auto global = [&](void) { return m_Chunk.globals()[operand()]; };
+          auto jumpOffset = [&](size_t at) {
+            return (static_cast<size_t>(operands[at]) << 8) | operands[at + 1];
+          };
+
+          switch (op) {
+          case OpCode::CONSTANT:
+            pushValue(m_Chunk.constants()[operand()].bits());
+            break;
+          case OpCode::NIL:
+            pushValue(Value::NIL_VAL);
+            break;
+          case OpCode::TRUE:
+            pushValue(Value::TRUE_VAL);
+            break;
+          case OpCode::FALSE:
+            pushValue(Value::FALSE_VAL);
+            break;
+          case OpCode::POP:
+            m_Assembler.subtract(TOP, sizeof(value_t));
+            break;
+          case OpCode::GET_LOCAL:
+            m_Assembler.load(RAX, SLOTS, slotOffset(operand()));
+            push(RAX);
+            break;
+          case OpCode::SET_LOCAL:
+            m_Assembler.load(RAX, TOP, -8);
+            m_Assembler.store(SLOTS, slotOffset(operand()), RAX);
+            break;
+          case OpCode::DEFINE_GLOBAL:
+            m_Assembler.load(RAX, TOP, -8);
+            m_Assembler.store(GLOBALS, globalOffset(global()) + offsetof(Global, m_Value), RAX);
+            m_Assembler.storeByte(GLOBALS, globalOffset(global()) + offsetof(Global, m_Defined), 1);
+            m_Assembler.subtract(TOP, sizeof(value_t));
+            break;
+          case OpCode::GET_GLOBAL:
+            exitIfUndefined(global(), start);
+            m_Assembler.load(RAX, GLOBALS, globalOffset(global()) + offsetof(Global, m_Value));
+            push(RAX);
+            break;
+          case OpCode::SET_GLOBAL:
+            exitIfUndefined(global(), start);
+            m_Assembler.load(RAX, TOP, -8);
+            m_Assembler.store(GLOBALS, globalOffset(global()) + offsetof(Global, m_Value), RAX);
+            break;
+          case OpCode::NEGATE: {
+            index_vec_t slow;
+            m_Assembler.load(RAX, TOP, -8);
+            guardNumber(RAX, slow);
+            m_Assembler.flipSignBit(RAX);
+            m_Assembler.store(TOP, -8, RAX);
+            size_t done = m_Assembler.jump();
+
+            bindAll(slow);
+            exit(start);
+            m_Assembler.bind(done);
+            break;
+          }
+          case OpCode::NOT:
+            m_Assembler.load(RAX, TOP, -8);
+            m_Assembler.move(RCX, Value::NIL_VAL);
+            m_Assembler.compare(RAX, RCX);
+            m_Assembler.set(Condition::EQUAL, RDX);
+            m_Assembler.move(RCX, Value::FALSE_VAL);
+            m_Assembler.compare(RAX, RCX);
+            m_Assembler.set(Condition::EQUAL, RAX);
+            m_Assembler.orByte(RAX, RDX);
+            toBool();
+            m_Assembler.store(TOP, -8, RAX);
+            break;
+          case OpCode::EQUAL:
+          case OpCode::NOT_EQUAL:
+            equality(op == OpCode::NOT_EQUAL);
+            break;
+          case OpCode::ADD:
+          case OpCode::ADD_NUM:
+            arithmetic(DoubleOp::ADD, start);
+            break;
+          case OpCode::SUBTRACT:
+          case OpCode::SUBTRACT_NUM:
+            arithmetic(DoubleOp::SUBTRACT, start);
+            break;
+          case OpCode::MULTIPLY:
+          case OpCode::MULTIPLY_NUM:
+            arithmetic(DoubleOp::MULTIPLY, start);
+            break;
+          case OpCode::DIVIDE:
+          case OpCode::DIVIDE_NUM:
+            arithmetic(DoubleOp::DIVIDE, start);
+            break;
+          case OpCode::GREATER:
+          case OpCode::GREATER_NUM:
+            comparison(doubleTest('>', false), start);
+            break;
+          case OpCode::LESS:
+          case OpCode::LESS_NUM:
+            comparison(doubleTest('<', false), start);
+            break;
+          case OpCode::GREATER_EQUAL:
+          case OpCode::GREATER_EQUAL_NUM:
+            comparison(doubleTest('<', true), start);
+            break;
+          case OpCode::LESS_EQUAL:
+          case OpCode::LESS_EQUAL_NUM:
+            comparison(doubleTest('>', true), start);
+            break;
+          case OpCode::JUMP:
+            jumpTo(m_Assembler.jump(), next + jumpOffset(0));
+            break;
+          case OpCode::LOOP:
+            jumpTo(m_Assembler.jump(), next - jumpOffset(0));
+            break;
+          case OpCode::JUMP_IF_FALSE:
+            m_Assembler.load(RAX, TOP, -8);
+            jumpIfFalsey(next + jumpOffset(0));
+            break;
+          case OpCode::POP_JUMP_IF_FALSE:
+            m_Assembler.load(RAX, TOP, -8);
+            m_Assembler.subtract(TOP, sizeof(value_t));
+            jumpIfFalsey(next + jumpOffset(0));
+            break;
+          case OpCode::JUMP_IF_LESS:
+            compareJump(doubleTest('<', false), next + jumpOffset(0), start);
+            break;
+          case OpCode::JUMP_IF_NOT_LESS:
+            compareJump(doubleTest('<', true), next + jumpOffset(0), start);
+            break;
+          case OpCode::JUMP_IF_GREATER:
+            compareJump(doubleTest('>', false), next + jumpOffset(0), start);
+            break;
+          case OpCode::JUMP_IF_NOT_GREATER:
+            compareJump(doubleTest('>', true), next + jumpOffset(0), start);
+            break;
+          case OpCode::ADD_LOCAL_CONSTANT:
+          case OpCode::SUBTRACT_LOCAL_CONSTANT:
+            // The interpreter pushes both operands on its slow path too.
+            m_Assembler.load(RAX, SLOTS, slotOffset(operands[0]));
+            push(RAX);
+            pushValue(m_Chunk.constants()[operands[1]].bits());
+            if (op == OpCode::ADD_LOCAL_CONSTANT)
+              arithmetic(DoubleOp::ADD, start, 2);
+            else
+              arithmetic(DoubleOp::SUBTRACT, start, 2);
+            break;
+          case OpCode::GET_UPVALUE:
+            upvalue(operand());
+            m_Assembler.load(RAX, RAX, 0);
+            push(RAX);
+            break;
+          case OpCode::SET_UPVALUE:
+            upvalue(operand());
+            m_Assembler.load(RCX, TOP, -8);
+            m_Assembler.store(RAX, 0, RCX);
+            break;
+          case OpCode::GET_PROPERTY:
+            getProperty(m_Chunk.caches()[operand()], start);
+            break;
+          case OpCode::SET_PROPERTY:
+            setProperty(m_Chunk.caches()[operand()], start);
+            break;
+          case OpCode::PRINT:
+            m_Assembler.move(RDI, MACHINE);
+            callRuntime(reinterpret_cast<const void*>(m_Runtime.m_Print));
+            break;
+          case OpCode::CALL:
+            m_Assembler.move(RDI, MACHINE);
+            m_Assembler.load(RSI, RSP, FRAME);
+            m_Assembler.move(RDX, static_cast<uint64_t>(operand()));
+            m_Assembler.move(RCX, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address(next))));
+            callRuntime(reinterpret_cast<const void*>(m_Runtime.m_Call));
+            enterCallee();
+            break;
+          case OpCode::INVOKE:
+            m_Assembler.move(RDI, MACHINE);
+            m_Assembler.load(RSI, RSP, FRAME);
+            m_Assembler.move(RDX, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(m_Chunk.caches() + operand())));
+            m_Assembler.move(RCX, static_cast<uint64_t>(operands[1]));
+            m_Assembler.move(R8, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address(next))));
+            callRuntime(reinterpret_cast<const void*>(m_Runtime.m_Invoke));
+            enterCallee();
+            break;
+          case OpCode::RETURN:
+            m_Assembler.move(RDI, MACHINE);
+            callRuntime(reinterpret_cast<const void*>(m_Runtime.m_Return));
+            m_Assembler.testByte(RAX);
+            exitIf(Condition::EQUAL, start);
+            m_Assembler.move(RAX, static_cast<uint64_t>(Exit::RETURNED));
+            m_Assembler.patch(m_Assembler.jump(), m_Epilogue);
+            break;
+          case OpCode::MOVE:
+            m_Assembler.load(RAX, SLOTS, slotOffset(operands[1]));
+            m_Assembler.store(SLOTS, slotOffset(operands[0]), RAX);
+            break;
+          case OpCode::LOAD_CONSTANT:
+            m_Assembler.move(RAX, m_Chunk.constants()[operands[1]].bits());
+            m_Assembler.store(SLOTS, slotOffset(operands[0]), RAX);
+            break;
+          case OpCode::ADD_RR:
+          case OpCode::SUBTRACT_RR:
+          case OpCode::MULTIPLY_RR:
+          case OpCode::DIVIDE_RR:
+          case OpCode::ADD_RK:
+          case OpCode::SUBTRACT_RK:
+          case OpCode::MULTIPLY_RK:
+          case OpCode::DIVIDE_RK:
+            registerArithmetic(op, operands, start);
+            break;
+          case OpCode::JUMP_IF_LESS_RR:
+          case OpCode::JUMP_IF_LESS_RK:
+            registerJump(op, operands, doubleTest('<', false), next + jumpOffset(2), start);
+            break;
+          case OpCode::JUMP_IF_NOT_LESS_RR:
+          case OpCode::JUMP_IF_NOT_LESS_RK:
+            registerJump(op, operands, doubleTest('<', true), next + jumpOffset(2), start);
+            break;
+          case OpCode::JUMP_IF_GREATER_RR:
+          case OpCode::JUMP_IF_GREATER_RK:
+            registerJump(op, operands, doubleTest('>', false), next + jumpOffset(2), start);
+            break;
+          case OpCode::JUMP_IF_NOT_GREATER_RR:
+          case OpCode::JUMP_IF_NOT_GREATER_RK:
+            registerJump(op, operands, doubleTest('>', true), next + jumpOffset(2), start);
+            break;
+          default:
+            // Closures, classes and super calls stay with the interpreter.
+            exit(start);
+            break;
+          }
+        }
+
+        void push(Reg source) {
+          m_Assembler.store(TOP, 0, source);
+          m_Assembler.add(TOP, sizeof(value_t));
+        }
+
+        void pushValue(uint64_t bits) {
+          m_Assembler.move(RAX, bits);
+          push(RAX);
+        }
+
+        // Leaves for the interpreter, to run the instruction at `start` with
+        // the stack as it was before it.
+        void exit(size_t start) {
+          m_Assembler.move(RCX, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address(start))));
+          m_Assembler.patch(m_Assembler.jump(), m_Interpret);
+        }
+
+        // Leaves with the Exit in eax unless it is RETURNED.
+        void exitUnlessReturned(void) {
+          m_Assembler.test32(RAX);
+          m_Assembler.patch(m_Assembler.jump(Condition::NOT_EQUAL), m_Epilogue);
+        }
+
+        // After a call into the runtime returning a Call in rax and rdx: runs
+        // a compiled callee, then leaves unless it returned.
+        void enterCallee(void) {
+          m_Assembler.test(RDX);
+          size_t interpreted = m_Assembler.jump(Condition::EQUAL);
+          m_Assembler.call(RDX);
+          m_Assembler.bind(interpreted);
+          exitUnlessReturned();
+        }
+
+        const byte_t* address(size_t offset) const {
+          return m_Chunk.code() + offset;
+        }
+
+        void exitIf(const Condition& condition, size_t start) {
+          size_t stay = m_Assembler.jump(static_cast<Condition>(static_cast<byte_t>(condition) ^ 1));
+          exit(start);
+          m_Assembler.bind(stay);
+        }
+
+        void exitIfUndefined(size_t global, size_t start) {
+          m_Assembler.compareByte(GLOBALS, globalOffset(global) + offsetof(Global, m_Defined), 0);
+          exitIf(Condition::EQUAL, start);
+        }
+
+        void jumpTo(size_t at, size_t target) {
+          m_Jumps.emplace_back(at, target);
+        }
+
+        // On rax.
+        void jumpIfFalsey(size_t target) {
+          m_Assembler.move(RCX, Value::NIL_VAL);
+          m_Assembler.compare(RAX, RCX);
+          jumpTo(m_Assembler.jump(Condition::EQUAL), target);
+          m_Assembler.move(RCX, Value::FALSE_VAL);
+          m_Assembler.compare(RAX, RCX);
+          jumpTo(m_Assembler.jump(Condition::EQUAL), target);
+        }
+
+        // Jumps to one of `slow` unless `value` is a number.
+        void guardNumber(Reg value, index_vec_t& slow) {
+          m_Assembler.move(R11, value);
+          m_Assembler.bitwiseAnd(R11, NAN_BITS);
+          m_Assembler.compare(R11, NAN_BITS);
+          slow.push_back(m_Assembler.jump(Condition::EQUAL));
+        }
+
+        // Turns the condition byte in al into a boolean value in rax.
+        void toBool(void) {
+          m_Assembler.zeroExtendByte(RAX);
+          m_Assembler.move(RCX, Value::FALSE_VAL);
+          m_Assembler.bitwiseOr(RAX, RCX);
+        }
+
+        void test(const DoubleTest& test) {
+          m_Assembler.toDouble(0, RAX);
+          m_Assembler.toDouble(1, RDX);
+          if (test.m_Swap)
+            m_Assembler.compareDoubles(1, 0);
+          else
+            m_Assembler.compareDoubles(0, 1);
+        }
+
+        void callRuntime(const void* function) {
+          m_Assembler.store(TOP_ADDRESS, 0, TOP);
+          m_Assembler.call(function);
+          m_Assembler.load(TOP, TOP_ADDRESS, 0);
+        }
+
+        void bindAll(const index_vec_t& jumps) {
+          for (size_t at : jumps)
+            m_Assembler.bind(at);
+        }
+
+        // Numbers are equal by value, anything else by its bits.
+        void equality(bool negate) {
+          m_Assembler.load(RAX, TOP, -16);
+          m_Assembler.load(RDX, TOP, -8);
+          index_vec_t slow;
+          guardNumber(RAX, slow);
+          guardNumber(RDX, slow);
+          test({ false, Condition::EQUAL });
+          m_Assembler.set(Condition::EQUAL, RAX);
+          m_Assembler.set(Condition::NO_PARITY, RCX);
+          m_Assembler.andByte(RAX, RCX);
+          size_t done = m_Assembler.jump();
+
+          bindAll(slow);
+          m_Assembler.compare(RAX, RDX);
+          m_Assembler.set(Condition::EQUAL, RAX);
+
+          m_Assembler.bind(done);
+          if (negate)
+            m_Assembler.flipByte(RAX);
+          toBool();
+          m_Assembler.store(TOP, -16, RAX);
+          m_Assembler.subtract(TOP, sizeof(value_t));
+        }
+
+        // `pushed` operands were pushed for the instruction at `start`, and
+        // are popped again before the interpreter runs it.
+        void arithmetic(const DoubleOp& op, size_t start, size_t pushed = 0) {
+          m_Assembler.load(RAX, TOP, -16);
+          m_Assembler.load(RDX, TOP, -8);
+          index_vec_t slow;
+          guardNumber(RAX, slow);
+          guardNumber(RDX, slow);
+          m_Assembler.toDouble(0, RAX);
+          m_Assembler.toDouble(1, RDX);
+          m_Assembler.arithmetic(op, 0, 1);
+          m_Assembler.fromDouble(RAX, 0);
+          m_Assembler.store(TOP, -16, RAX);
+          m_Assembler.subtract(TOP, sizeof(value_t));
+          index_vec_t done = { m_Assembler.jump() };
+
+          bindAll(slow);
+          if (op == DoubleOp::ADD) {
+            m_Assembler.move(RDI, MACHINE);
+            callRuntime(reinterpret_cast<const void*>(m_Runtime.m_Add));
+            m_Assembler.testByte(RAX);
+            done.push_back(m_Assembler.jump(Condition::NOT_EQUAL));
+          }
+
+          if (pushed)
+            m_Assembler.subtract(TOP, pushed * sizeof(value_t));
+          exit(start);
+          bindAll(done);
+        }
+
+        void comparison(const DoubleTest& doubles, size_t start) {
+          m_Assembler.load(RAX, TOP, -16);
+          m_Assembler.load(RDX, TOP, -8);
+          index_vec_t slow;
+          guardNumber(RAX, slow);
+          guardNumber(RDX, slow);
+          test(doubles);
+          m_Assembler.set(doubles.m_Condition, RAX);
+          toBool();
+          m_Assembler.store(TOP, -16, RAX);
+          m_Assembler.subtract(TOP, sizeof(value_t));
+          size_t done = m_Assembler.jump();
+
+          bindAll(slow);
+          exit(start);
+          m_Assembler.bind(done);
+        }
+
+        void compareJump(const DoubleTest& doubles, size_t target, size_t start) {
+          m_Assembler.load(RAX, TOP, -16);
+          m_Assembler.load(RDX, TOP, -8);
+          index_vec_t slow;
+          guardNumber(RAX, slow);
+          guardNumber(RDX, slow);
+          m_Assembler.subtract(TOP, 2 * sizeof(value_t));
+          test(doubles);
+          jumpTo(m_Assembler.jump(doubles.m_Condition), target);
+          size_t done = m_Assembler.jump();
+
+          bindAll(slow);
+          exit(start);
+          m_Assembler.bind(done);
+        }
+
+        static bool hasConstant(const OpCode& op) {
+          return (op >= OpCode::ADD_RK && op <= OpCode::DIVIDE_RK) ||
+                 (op >= OpCode::JUMP_IF_LESS_RK && op <= OpCode::JUMP_IF_NOT_GREATER_RK);
+        }
+
+        // Loads the operands of a register instruction into rax and rdx.
+        void registerOperands(const OpCode& op, byte_t left, byte_t right, index_vec_t& slow) {
+          m_Assembler.load(RAX, SLOTS, slotOffset(left));
+          guardNumber(RAX, slow);
+          if (hasConstant(op)) {
+            const value_t& constant = m_Chunk.constants()[right];
+            m_Assembler.move(RDX, constant.bits());
+            if (!isNumber(constant))
+              guardNumber(RDX, slow);
+          } else {
+            m_Assembler.load(RDX, SLOTS, slotOffset(right));
+            guardNumber(RDX, slow);
+          }
+        }
+
+        void operandAddress(Reg destination, const OpCode& op, byte_t right) {
+          if (hasConstant(op))
+            m_Assembler.move(destination, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(m_Chunk.constants() + right)));
+          else
+            m_Assembler.loadAddress(destination, SLOTS, slotOffset(right));
+        }
+
+        void registerArithmetic(const OpCode& op, const byte_t* operands, size_t start) {
+          static constexpr DoubleOp ops[] = { DoubleOp::ADD, DoubleOp::SUBTRACT, DoubleOp::MULTIPLY, DoubleOp::DIVIDE };
+          size_t index = static_cast<size_t>(op) - static_cast<size_t>(hasConstant(op) ? OpCode::ADD_RK : OpCode::ADD_RR);
+
+          index_vec_t slow;
+          registerOperands(op, operands[1], operands[2], slow);
+          m_Assembler.toDouble(0, RAX);
+          m_Assembler.toDouble(1, RDX);
+          m_Assembler.arithmetic(ops[index], 0, 1);
+          m_Assembler.fromDouble(RAX, 0);
+          m_Assembler.store(SLOTS, slotOffset(operands[0]), RAX);
+          index_vec_t done = { m_Assembler.jump() };
+
+          bindAll(slow);
+          if (ops[index] == DoubleOp::ADD) {
+            m_Assembler.move(RDI, MACHINE);
+            m_Assembler.loadAddress(RSI, SLOTS, slotOffset(operands[0]));
+            m_Assembler.loadAddress(RDX, SLOTS, slotOffset(operands[1]));
+            operandAddress(RCX, op, operands[2]);
+            callRuntime(reinterpret_cast<const void*>(m_Runtime.m_RegisterAdd));
+            m_Assembler.testByte(RAX);
+            done.push_back(m_Assembler.jump(Condition::NOT_EQUAL));
+          }
+
+          exit(start);
+          bindAll(done);
+        }
+
+        void registerJump(const OpCode& op, const byte_t* operands, const DoubleTest& doubles, size_t target,
+                          size_t start) {
+          index_vec_t slow;
+          registerOperands(op, operands[0], operands[1], slow);
+          test(doubles);
+          jumpTo(m_Assembler.jump(doubles.m_Condition), target);
+          size_t done = m_Assembler.jump();
+
+          bindAll(slow);
+          exit(start);
+          m_Assembler.bind(done);
+        }
+
+        // Leaves the address of upvalue `index` in rax.
+        void upvalue(size_t index) {
+          m_Assembler.load(RAX, RSP, FRAME);
+          m_Assembler.load(RAX, RAX, offsetof(CallFrame, m_Closure));
+          m_Assembler.load(RAX, RAX, m_Layout.m_ClosureUpvalues + static_cast<int32_t>(index * sizeof(upvalue_ptr_t)));
+          m_Assembler.load(RAX, RAX, m_Layout.m_UpvalueLocation);
+        }
+
+        // The field slot that the first entry of `cache` holds for its shape,
+        // or -1 if it is a method or adds a field, which need the VM.
+        static int_t cachedSlot(const PropertyCache& cache) {
+          const CacheEntry& entry = cache.m_Entries[0];
+          return cache.m_Count > 0 && !entry.m_Transition ? entry.m_Slot : -1;
+        }
+
+        // Jumps to one of `slow` unless `value` is an instance of `shape`,
+        // and leaves the instance pointer in it if it is.
+        void guardShape(Reg value, const shape_ptr_t& shape, index_vec_t& slow) {
+          m_Assembler.move(RCX, Value::SIGN_BIT | Value::QNAN);
+          m_Assembler.move(RDX, value);
+          m_Assembler.bitwiseAnd(RDX, RCX);
+          m_Assembler.compare(RDX, RCX);
+          slow.push_back(m_Assembler.jump(Condition::NOT_EQUAL));
+          m_Assembler.bitwiseXor(value, RCX);
+          m_Assembler.compareByte(value, m_Layout.m_ObjectType, static_cast<byte_t>(obj::ObjType::INSTANCE));
+          slow.push_back(m_Assembler.jump(Condition::NOT_EQUAL));
+          m_Assembler.load(RDX, value, m_Layout.m_InstanceShape);
+          m_Assembler.move(RCX, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(shape)));
+          m_Assembler.compare(RDX, RCX);
+          slow.push_back(m_Assembler.jump(Condition::NOT_EQUAL));
+        }
+
+        // Calls `function` on the VM and `cache`, and leaves for the
+        // interpreter if it fails.
+        void propertyCall(const void* function, PropertyCache& cache, size_t start) {
+          m_Assembler.move(RDI, MACHINE);
+          m_Assembler.move(RSI, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&cache)));
+          callRuntime(function);
+          m_Assembler.testByte(RAX);
+          exitIf(Condition::EQUAL, start);
+        }
+
+        // A site that has only read a field so far reads it inline from any
+        // instance of the shape it saw; everything else goes through the VM.
+        // Cache entries are never replaced, and the cache roots the shape.
+        void getProperty(PropertyCache& cache, size_t start) {
+          int_t slot = cachedSlot(cache);
+          if (slot == -1) {
+            propertyCall(reinterpret_cast<const void*>(m_Runtime.m_GetProperty), cache, start);
+            return;
+          }
+
+          index_vec_t slow;
+          m_Assembler.load(RAX, TOP, -8);
+          guardShape(RAX, cache.m_Entries[0].m_Shape, slow);
+          m_Assembler.load(RAX, RAX, m_Layout.m_InstanceFields);
+          m_Assembler.load(RAX, RAX, slotOffset(static_cast<size_t>(slot)));
+          m_Assembler.store(TOP, -8, RAX);
+          size_t done = m_Assembler.jump();
+
+          bindAll(slow);
+          propertyCall(reinterpret_cast<const void*>(m_Runtime.m_GetProperty), cache, start);
+          m_Assembler.bind(done);
+        }
+
+        // As getProperty, for stores to a field the instance already has.
+        void setProperty(PropertyCache& cache, size_t start) {
+          int_t slot = cachedSlot(cache);
+          if (slot == -1) {
+            propertyCall(reinterpret_cast<const void*>(m_Runtime.m_SetProperty), cache, start);
+            return;
+          }
+
+          index_vec_t slow;
+          m_Assembler.load(RAX, TOP, -16);
+          guardShape(RAX, cache.m_Entries[0].m_Shape, slow);
+          m_Assembler.load(RAX, RAX, m_Layout.m_InstanceFields);
+          m_Assembler.load(RCX, TOP, -8);
+          m_Assembler.store(RAX, slotOffset(static_cast<size_t>(slot)), RCX);
+          m_Assembler.store(TOP, -16, RCX);
+          m_Assembler.subtract(TOP, sizeof(value_t));
+          size_t done = m_Assembler.jump();
+
+          bindAll(slow);
+          propertyCall(reinterpret_cast<const void*>(m_Runtime.m_SetProperty), cache, start);
+          m_Assembler.bind(done);
+        }
+
+        // Copies the code into memory that is made executable once written.
+        // Each function has pages of its own, but starts in them where the
+        // one compiled before it ended, as if they were packed together:
+        // started at the same offset, the functions calling one another
+        // would all compete for the same instruction cache sets.
+        Code* install(void) {
+          static std::atomic<size_t> next = 0;
+
+          const byte_vec_t& code = m_Assembler.code();
+          size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+          size_t lines = (code.size() + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+          size_t start = next.fetch_add(lines) % page;
+          size_t capacity = (start + code.size() + page - 1) / page * page;
+          void* memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if (memory == MAP_FAILED)
+            return nullptr;
+
+          byte_t* begin = static_cast<byte_t*>(memory) + start;
+          std::memcpy(begin, code.data(), code.size());
+          if (mprotect(memory, capacity, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, capacity);
+            return nullptr;
+          }
+
+          return new Code(static_cast<byte_t*>(memory), capacity, begin, m_Chunk.code(), std::move(m_Entries),
+                          static_cast<uint32_t>(m_Nested));
+        }
+      private:
+        Chunk& m_Chunk;
+        const Runtime& m_Runtime;
+        const Layout& m_Layout;
+        Assembler m_Assembler;
+        std::vector<uint32_t> m_Entries;
+        // Jump displacements to patch, with the bytecode offset they go to.
+        std::vector<std::pair<size_t, size_t>> m_Jumps;
+        size_t m_Interpret;
+        size_t m_Epilogue;
+        size_t m_Nested;
+      };
+    }
+#endif
+
+    Code::Code(byte_t* memory, size_t capacity, const byte_t* start, const byte_t* bytecode,
+               std::vector<uint32_t> entries, uint32_t nested) :
+      m_Memory(memory),
+      m_Capacity(capacity),
+      m_Start(start),
+      m_Bytecode(bytecode),
+      m_Entries(std::move(entries)),
+      m_Nested(nested)
+    { }
+
+    Code::~Code(void) {
+#if CLOX_JIT_ENABLED
+      munmap(m_Memory, m_Capacity);
+#endif
+    }
+
+    Exit Code::run(vm::VM& vm, value_t*& top, vm::CallFrame& frame, vm::Global* globals) const {
+#if CLOX_JIT_ENABLED
+      using entry_t = Exit (*)(vm::VM* vm, value_t** top, vm::CallFrame* frame, vm::Global* globals, const void* target);
+
+      uint32_t entry = m_Entries[static_cast<size_t>(frame.m_IP - m_Bytecode)];
+      if (entry == NO_ENTRY)
+        return Exit::INTERPRET;
+
+      return reinterpret_cast<entry_t>(m_Start)(&vm, &top, &frame, globals, m_Start + entry);
+#else
+      (void)vm;
+      (void)top;
+      (void)frame;
+      (void)globals;
+      return Exit::INTERPRET;
+#endif
+    }
+
+    const byte_t* Code::nested(void) const {
+      return m_Start + m_Nested;
+    }
+
+    Code* compile(obj::Function& function, const Runtime& runtime) {
+#if CLOX_JIT_ENABLED
+      return Translator(function, runtime).translate();
+#else
+      (void)function;
+      (void)runtime;
+      return nullptr;
+#endif
+    }
+  }
+}
@@ -0,0 +1,109 @@
+#include "natives.hpp"
+#include "object.hpp"
+#include "vm.hpp"
+#include <chrono>
+#include <cmath>
+
+namespace clox {
+  namespace natives {
+    namespace {
+      using namespace obj;
+
+      // Read through the vDSO on most platforms, unlike the process CPU time
+      // behind std::clock, so benchmarks can call clock() in tight loops.
+      const auto START = std::chrono::steady_clock::now();
+
+      constexpr const char* NUMBER_ARGUMENT = "Argument must be a number.";
+      constexpr const char* NUMBER_ARGUMENTS = "Arguments must be numbers.";
+      constexpr const char* STRING_ARGUMENT = "Argument must be a string.";
+
+      value_t clock(int, value_t*, const char*&) {
+        return std::chrono::duration<dbl_t>(std::chrono::steady_clock::now() - START).count();
+      }
+
+      template<dbl_t(*F)(dbl_t)>
+      value_t unary(int, value_t* argv, const char*& error) {
+        if (!isNumber(argv[0])) {
+          error = NUMBER_ARGUMENT;
+          return nullptr;
+        }
+
+        return F(asNumber(argv[0]));
+      }
+
+      dbl_t sqrt(dbl_t x) { return std::sqrt(x); }
+      dbl_t floor(dbl_t x) { return std::floor(x); }
+      dbl_t abs(dbl_t x) { return std::fabs(x); }
+
+      value_t pow(int, value_t* argv, const char*& error) {
+        if (!isNumber(argv[0]) || !isNumber(argv[1])) {
+          error = NUMBER_ARGUMENTS;
+          return nullptr;
+        }
+
+        return std::pow(asNumber(argv[0]), asNumber(argv[1]));
+      }
+
+      template<bool Min>
+      value_t extremum(int argc, value_t* argv, const char*& error) {
+        if (argc == 0) {
+          error = "Expected at least 1 argument but got 0.";
+          return nullptr;
+        }
+
+        if (!isNumber(argv[0])) {
+          error = NUMBER_ARGUMENTS;
+          return nullptr;
+        }
+
+        dbl_t result = asNumber(argv[0]);
+        for (int i = 1; i < argc; ++i) {
+          if (!isNumber(argv[i])) {
+            error = NUMBER_ARGUMENTS;
+            return nullptr;
+          }
+
+          dbl_t value = asNumber(argv[i]);
+          result = Min ? std::min(result, value) : std::max(result, value);
+        }
+
+        return result;
+      }
+
+      value_t len(int, value_t* argv, const char*& error) {
+        if (!isObjType<String>(argv[0])) {
+          error = STRING_ARGUMENT;
+          return nullptr;
+        }
+
+        return static_cast<dbl_t>(asObjType<String>(argv[0])->m_Str.size());
+      }
+
+      value_t ord(int, value_t* argv, const char*& error) {
+        if (!isObjType<String>(argv[0]) || !isNumber(argv[1])) {
+          error = "Arguments must be a string and a number.";
+          return nullptr;
+        }
+
+        const string_t& str = asObjType<String>(argv[0])->m_Str;
+        dbl_t index = asNumber(argv[1]);
+        if (index < 0 || index >= static_cast<dbl_t>(str.size()) || index != std::floor(index))
+          return nullptr;
+
+        return static_cast<dbl_t>(static_cast<uint8_t>(str[static_cast<size_t>(index)]));
+      }
+    }
+
+    void defineAll(vm::VM& vm) {
+      vm.defineNative("clock", 0, clock);
+      vm.defineNative("sqrt", 1, unary<sqrt>);
+      vm.defineNative("floor", 1, unary<floor>);
+      vm.defineNative("abs", 1, unary<abs>);
+      vm.defineNative("pow", 2, pow);
+      vm.defineNative("min", Native::VARIADIC, extremum<true>);
+      vm.defineNative("max", Native::VARIADIC, extremum<false>);
+      vm.defineNative("len", 1, len);
+      vm.defineNative("ord", 2, ord);
+    }
+  }
+}
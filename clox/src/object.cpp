@@ -1,51 +1,378 @@
 #include "object.hpp"
+#include "gc.hpp"
+#include "jit.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <memory>
 
 namespace clox {
   namespace obj {
 
-    string_ptr_t Object::formStringObject(const string_t& str) {
-      return new String(str);
+    string_ptr_t Object::formStringObject(gc::Collector& gc, std::string_view str) {
+      uint32_t hash = String::hash(str);
+      string_ptr_t interned = gc.findString(str, hash);
+      if (interned)
+        return interned;
+
+      string_ptr_t string = gc.allocate<String>(string_t(str), hash);
+      gc.intern(string);
+      return string;
     }
 
-    function_ptr_t Object::formFunctionObject(void) {
-      return new Function();
+    function_ptr_t Object::formFunctionObject(gc::Collector& gc) {
+      return gc.allocate<Function>();
     }
 
-    closure_ptr_t Object::formClosureObject(const function_ptr_t& function)
+    closure_ptr_t Object::formClosureObject(gc::Collector& gc, const function_ptr_t& function)
     {
-      return new Closure(function);
+      return gc.allocateTrailing<Closure>(function->m_Captures.size(), function);
+    }
+
+    upvalue_ptr_t Object::formUpvalueObject(gc::Collector& gc, value_t* slot) {
+      return gc.allocate<Upvalue>(slot);
+    }
+
+    shape_ptr_t Object::formShapeObject(gc::Collector& gc) {
+      return gc.allocate<Shape>();
+    }
+
+    class_ptr_t Object::formClassObject(gc::Collector& gc, const string_ptr_t& name, const shape_ptr_t& shape) {
+      return gc.allocate<Class>(name, shape);
+    }
+
+    instance_ptr_t Object::formInstanceObject(gc::Collector& gc, const class_ptr_t& klass) {
+      return gc.allocate<Instance>(klass);
+    }
+
+    bound_method_ptr_t Object::formBoundMethodObject(gc::Collector& gc, const value_t& receiver, const closure_ptr_t& method) {
+      return gc.allocate<BoundMethod>(receiver, method);
+    }
+
+    native_ptr_t Object::formNativeObject(gc::Collector& gc, native_fn_t function, int_t arity) {
+      return gc.allocate<Native>(function, arity);
+    }
+
+    void Object::print(FILE* out) const {
+      switch (m_Type) {
+      case ObjType::STRING:
+        objCast<String>(this)->print(out);
+        break;
+      case ObjType::FUNCTION:
+        objCast<Function>(this)->print(out);
+        break;
+      case ObjType::CLOSURE:
+        objCast<Closure>(this)->print(out);
+        break;
+      case ObjType::UPVALUE:
+        objCast<Upvalue>(this)->print(out);
+        break;
+      case ObjType::SHAPE:
+        objCast<Shape>(this)->print(out);
+        break;
+      case ObjType::CLASS:
+        objCast<Class>(this)->print(out);
+        break;
+      case ObjType::INSTANCE:
+        objCast<Instance>(this)->print(out);
+        break;
+      case ObjType::BOUND_METHOD:
+        objCast<BoundMethod>(this)->print(out);
+        break;
+      case ObjType::NATIVE:
+        objCast<Native>(this)->print(out);
+        break;
+      }
+    }
+
+    String::String(string_t str, uint32_t hash) :
+      Object(TYPE),
+      m_Str(std::move(str)),
+      m_Hash(hash)
+    { }
+
+    // FNV-1a
+    uint32_t String::hash(std::string_view str) {
+      uint32_t hash = 2166136261u;
+      for (char c : str) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+      }
+
+      return hash;
+    }
+
+    void String::print(FILE* out) const {
+      fprintf(out, "%s", m_Str.c_str());
     }
 
-    String::String(const string_t& str) :
-      Object(),
-      m_Str(str)
+    void String::blacken(gc::Collector&) const
     { }
 
-    void String::print(void) const {
-      printf("%s", m_Str.c_str());
+    size_t String::size(void) const {
+      return sizeof(String) + m_Str.capacity();
     }
 
     Function::Function(void) :
+      Object(TYPE),
       m_Name(""),
       m_Arity(0),
-      m_Chunk()
+      m_MaxStack(1),
+      m_Chunk(),
+      m_Captures(),
+      m_Hotness(0),
+      m_Native(nullptr),
+      m_Loops(nullptr)
     { }
 
-    void Function::print(void) const {
+    Function::~Function(void) {
+      delete m_Native;
+      delete m_Loops;
+    }
+
+    void Function::print(FILE* out) const {
       if (m_Name.empty()) {
-        printf("<script>");
+        fprintf(out, "<script>");
         return;
       }
 
-      printf("<fn %s>", m_Name.c_str());
+      fprintf(out, "<fn %s>", m_Name.c_str());
+    }
+
+    void Function::blacken(gc::Collector& gc) const {
+      m_Chunk.blacken(gc);
+      if (m_Loops)
+        m_Loops->blacken(gc);
+    }
+
+    size_t Function::size(void) const {
+      return sizeof(Function);
     }
 
     Closure::Closure(const function_ptr_t& function) :
-      m_Function(function)
+      Object(TYPE),
+      m_Function(function),
+      m_UpvalueCount(function->m_Captures.size())
+    {
+      std::uninitialized_fill_n(upvalues(), m_UpvalueCount, nullptr);
+    }
+
+    void Closure::print(FILE* out) const {
+      m_Function->print(out);
+    }
+
+    void Closure::blacken(gc::Collector& gc) const {
+      gc.markObject(m_Function);
+      for (size_t i = 0; i < m_UpvalueCount; ++i)
+        gc.markObject(upvalues()[i]);
+    }
+
+    size_t Closure::size(void) const {
+      return sizeof(Closure) + m_UpvalueCount * sizeof(upvalue_ptr_t);
+    }
+
+    upvalue_ptr_t* Closure::upvalues(void) {
+      return reinterpret_cast<upvalue_ptr_t*>(this + 1);
+    }
+
+    const upvalue_ptr_t* Closure::upvalues(void) const {
+      return reinterpret_cast<const upvalue_ptr_t*>(this + 1);
+    }
+
+    void* Closure::operator new(size_t size, Trailing trailing) {
+      return ::operator new(size + trailing.m_Count * sizeof(upvalue_ptr_t));
+    }
+
+    void Closure::operator delete(void* memory, Trailing) {
+      ::operator delete(memory);
+    }
+
+    void Closure::operator delete(void* memory) {
+      ::operator delete(memory);
+    }
+
+    Upvalue::Upvalue(value_t* slot) :
+      Object(TYPE),
+      m_Location(slot),
+      m_Closed(nullptr),
+      m_NextOpen(nullptr)
+    { }
+
+    void Upvalue::print(FILE* out) const {
+      fprintf(out, "upvalue");
+    }
+
+    void Upvalue::blacken(gc::Collector& gc) const {
+      gc.markValue(m_Closed);
+    }
+
+    size_t Upvalue::size(void) const {
+      return sizeof(Upvalue);
+    }
+
+    Shape::Shape(void) :
+      Object(TYPE),
+      m_Parent(nullptr),
+      m_Keys(),
+      m_Transitions()
+    { }
+
+    Shape::Shape(const shape_ptr_t& parent, const string_ptr_t& key) :
+      Object(TYPE),
+      m_Parent(parent),
+      m_Keys(),
+      m_Transitions()
+    {
+      // Sized exactly, so the shape's charge to the collector is fixed.
+      m_Keys.reserve(parent->m_Keys.size() + 1);
+      m_Keys = parent->m_Keys;
+      m_Keys.push_back(key);
+    }
+
+    void Shape::print(FILE* out) const {
+      fprintf(out, "shape");
+    }
+
+    void Shape::blacken(gc::Collector& gc) const {
+      gc.markObject(m_Parent);
+      for (string_ptr_t key : m_Keys)
+        gc.markObject(key);
+
+      for (const auto& [key, shape] : m_Transitions)
+        gc.markObject(shape);
+    }
+
+    size_t Shape::size(void) const {
+      return sizeof(Shape) + m_Keys.capacity() * sizeof(string_ptr_t);
+    }
+
+    int_t Shape::find(const string_ptr_t& key) const {
+      // Instances rarely have more than a handful of fields, and names are
+      // interned, so a linear scan over pointers beats hashing.
+      for (size_t i = 0; i < m_Keys.size(); ++i) {
+        if (m_Keys[i] == key)
+          return static_cast<int_t>(i);
+      }
+
+      return -1;
+    }
+
+    shape_ptr_t Shape::transition(gc::Collector& gc, const string_ptr_t& key) {
+      auto it = m_Transitions.find(key);
+      if (it != m_Transitions.end())
+        return it->second;
+
+      shape_ptr_t shape = gc.allocate<Shape>(this, key);
+      m_Transitions.emplace(key, shape);
+      return shape;
+    }
+
+    Class::Class(const string_ptr_t& name, const shape_ptr_t& shape) :
+      Object(TYPE),
+      m_Name(name),
+      m_Methods(),
+      m_Initializer(nullptr),
+      m_Shape(shape),
+      m_FieldHint(0)
+    { }
+
+    void Class::print(FILE* out) const {
+      fprintf(out, "%s", m_Name->m_Str.c_str());
+    }
+
+    void Class::blacken(gc::Collector& gc) const {
+      gc.markObject(m_Name);
+      gc.markObject(m_Initializer);
+      gc.markObject(m_Shape);
+      for (const auto& [name, method] : m_Methods) {
+        gc.markObject(name);
+        gc.markObject(method);
+      }
+    }
+
+    size_t Class::size(void) const {
+      // A node per method, each with its link, plus the bucket array.
+      return sizeof(Class) + m_Methods.bucket_count() * sizeof(void*) +
+        m_Methods.size() * (sizeof(method_table_t::value_type) + sizeof(void*));
+    }
+
+    Instance::Instance(const class_ptr_t& klass) :
+      Object(TYPE),
+      m_Class(klass),
+      m_Shape(klass->m_Shape),
+      m_Fields(klass->m_FieldHint ? new value_t[klass->m_FieldHint] : nullptr),
+      m_FieldCount(0),
+      m_FieldCapacity(klass->m_FieldHint)
+    { }
+
+    Instance::~Instance(void) {
+      delete[] m_Fields;
+    }
+
+    void Instance::print(FILE* out) const {
+      fprintf(out, "%s instance", m_Class->m_Name->m_Str.c_str());
+    }
+
+    void Instance::blacken(gc::Collector& gc) const {
+      gc.markObject(m_Class);
+      gc.markObject(m_Shape);
+      for (size_t i = 0; i < m_FieldCount; ++i)
+        gc.markValue(m_Fields[i]);
+    }
+
+    size_t Instance::size(void) const {
+      return sizeof(Instance) + m_FieldCapacity * sizeof(value_t);
+    }
+
+    void Instance::addField(gc::Collector& gc, const shape_ptr_t& shape, const value_t& value) {
+      size_t before = size();
+      m_Shape = shape;
+      if (m_FieldCount == m_FieldCapacity) {
+        m_FieldCapacity = std::max<size_t>(m_FieldCapacity * 2, 1);
+        value_t* fields = new value_t[m_FieldCapacity];
+        std::copy(m_Fields, m_Fields + m_FieldCount, fields);
+        delete[] m_Fields;
+        m_Fields = fields;
+      }
+
+      m_Fields[m_FieldCount++] = value;
+      m_Class->m_FieldHint = std::max(m_Class->m_FieldHint, m_FieldCount);
+      gc.grow(this, before);
+    }
+
+    BoundMethod::BoundMethod(const value_t& receiver, const closure_ptr_t& method) :
+      Object(TYPE),
+      m_Receiver(receiver),
+      m_Method(method)
+    { }
+
+    void BoundMethod::print(FILE* out) const {
+      m_Method->print(out);
+    }
+
+    void BoundMethod::blacken(gc::Collector& gc) const {
+      gc.markValue(m_Receiver);
+      gc.markObject(m_Method);
+    }
+
+    size_t BoundMethod::size(void) const {
+      return sizeof(BoundMethod);
+    }
+
+    Native::Native(native_fn_t function, int_t arity) :
+      Object(TYPE),
+      m_Function(function),
+      m_Arity(arity)
+    { }
+
+    void Native::print(FILE* out) const {
+      fprintf(out, "<native fn>");
+    }
+
+    void Native::blacken(gc::Collector&) const
     { }
 
-    void Closure::print(void) const {
-      m_Function->print();
+    size_t Native::size(void) const {
+      return sizeof(Native);
     }
   }
 }
\ No newline at end of file
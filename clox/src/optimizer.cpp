@@ -0,0 +1,704 @@
+#include "optimizer.hpp"
+#include "object.hpp"
+
+namespace clox {
+  namespace compiler {
+    namespace {
+      using namespace vm;
+
+      constexpr size_t NO_INDEX = SIZE_MAX;
+
+      bool isUnconditional(const OpCode& code) {
+        return code == OpCode::JUMP || code == OpCode::LOOP;
+      }
+
+      bool isJump(const OpCode& code) {
+        OperandFormat format = operandFormat(code);
+        return format == OperandFormat::JUMP || format == OperandFormat::REGISTER_JUMP;
+      }
+
+      // One decoded instruction. Jumps refer to their target by index, so
+      // instructions can be removed or change size until the code is encoded
+      // again.
+      struct Instruction {
+        OpCode m_Code;
+        size_t m_Operand;
+        // The argument count of INVOKE and SUPER_INVOKE, or the second byte
+        // operand of the byte operand formats.
+        size_t m_Extra;
+        // The right operand of the three-address register instructions.
+        size_t m_Third;
+        size_t m_Target;
+        int_t m_Line;
+        bool m_Dead;
+      };
+
+      using instruction_vec_t = std::vector<Instruction>;
+      using flag_vec_t = std::vector<bool>;
+
+      class Optimizer {
+      public:
+        Optimizer(Chunk& chunk);
+
+        void foldConstants(void);
+        void threadJumps(void);
+        void removeDeadCode(void);
+        void fuse(void);
+        void toRegisters(void);
+        void encode(void);
+      private:
+        void decode(void);
+        void findTargets(void);
+        size_t next(size_t index) const;
+        size_t previous(size_t index) const;
+        bool literal(size_t index, value_t& value) const;
+        bool number(size_t index, dbl_t& value) const;
+        bool follows(size_t index, size_t count, index_vec_t& indices) const;
+        void kill(size_t index);
+      private:
+        Chunk& m_Chunk;
+        instruction_vec_t m_Code;
+        // Instructions some live jump lands on. Nothing may be fused into
+        // one of these from before it.
+        flag_vec_t m_Targets;
+      };
+
+      Optimizer::Optimizer(Chunk& chunk) :
+        m_Chunk(chunk),
+        m_Code(),
+        m_Targets()
+      {
+        decode();
+      }
+
+      void Optimizer::decode(void) {
+        index_vec_t indices(m_Chunk.size() + 1, NO_INDEX);
+        // Walked alongside the code instead of searched per instruction.
+        const line_run_vec_t& lines = m_Chunk.lineRuns();
+        size_t run = 0;
+        for (size_t offset = 0; offset < m_Chunk.size(); ) {
+          indices[offset] = m_Code.size();
+
+          size_t ext = 0;
+          auto code = static_cast<OpCode>(m_Chunk.readByte(offset));
+          if (code == OpCode::WIDE) {
+            ext = static_cast<size_t>(m_Chunk.readByte(offset + 1)) << 8;
+            offset += 2;
+          } else if (code == OpCode::EXTRA_WIDE) {
+            ext = (static_cast<size_t>(m_Chunk.readByte(offset + 1)) << 16) |
+                  (static_cast<size_t>(m_Chunk.readByte(offset + 2)) << 8);
+            offset += 3;
+          }
+
+          Instruction instruction{};
+          instruction.m_Code = static_cast<OpCode>(m_Chunk.readByte(offset));
+          instruction.m_Target = NO_INDEX;
+          while (run + 1 < lines.size() && lines[run + 1].m_Offset <= offset)
+            ++run;
+          instruction.m_Line = static_cast<int_t>(lines[run].m_Line);
+
+          switch (operandFormat(instruction.m_Code)) {
+          case OperandFormat::NONE:
+            offset += 1;
+            break;
+          case OperandFormat::OPERAND:
+            instruction.m_Operand = ext | m_Chunk.readByte(offset + 1);
+            offset += 2;
+            break;
+          case OperandFormat::INVOKE:
+            instruction.m_Operand = ext | m_Chunk.readByte(offset + 1);
+            instruction.m_Extra = m_Chunk.readByte(offset + 2);
+            offset += 3;
+            break;
+          case OperandFormat::LOCAL_CONSTANT:
+          case OperandFormat::MOVE:
+            instruction.m_Operand = m_Chunk.readByte(offset + 1);
+            instruction.m_Extra = m_Chunk.readByte(offset + 2);
+            offset += 3;
+            break;
+          case OperandFormat::THREE_ADDRESS:
+            instruction.m_Operand = m_Chunk.readByte(offset + 1);
+            instruction.m_Extra = m_Chunk.readByte(offset + 2);
+            instruction.m_Third = m_Chunk.readByte(offset + 3);
+            offset += 4;
+            break;
+          case OperandFormat::REGISTER_JUMP: {
+            instruction.m_Operand = m_Chunk.readByte(offset + 1);
+            instruction.m_Extra = m_Chunk.readByte(offset + 2);
+            size_t jump = m_Chunk.readShort(offset + 3);
+            offset += 5;
+            instruction.m_Target = offset + jump;
+            break;
+          }
+          case OperandFormat::JUMP: {
+            // The target offset for now; it becomes an index below.
+            size_t jump = m_Chunk.readShort(offset + 1);
+            offset += 3;
+            instruction.m_Target = instruction.m_Code == OpCode::LOOP ? offset - jump : offset + jump;
+            break;
+          }
+          }
+
+          m_Code.push_back(instruction);
+        }
+        indices[m_Chunk.size()] = m_Code.size();
+
+        for (Instruction& instruction : m_Code) {
+          if (isJump(instruction.m_Code))
+            instruction.m_Target = indices[instruction.m_Target];
+        }
+      }
+
+      // Also moves every jump target off removed instructions.
+      void Optimizer::findTargets(void) {
+        m_Targets.assign(m_Code.size(), false);
+        for (Instruction& instruction : m_Code) {
+          if (instruction.m_Dead || !isJump(instruction.m_Code))
+            continue;
+
+          instruction.m_Target = next(instruction.m_Target);
+          if (instruction.m_Target < m_Code.size())
+            m_Targets[instruction.m_Target] = true;
+        }
+      }
+
+      size_t Optimizer::next(size_t index) const {
+        while (index < m_Code.size() && m_Code[index].m_Dead)
+          ++index;
+
+        return index;
+      }
+
+      size_t Optimizer::previous(size_t index) const {
+        if (index == NO_INDEX)
+          return NO_INDEX;
+
+        while (index-- > 0) {
+          if (!m_Code[index].m_Dead)
+            return index;
+        }
+
+        return NO_INDEX;
+      }
+
+      bool Optimizer::literal(size_t index, value_t& value) const {
+        if (index == NO_INDEX)
+          return false;
+
+        const Instruction& instruction = m_Code[index];
+        switch (instruction.m_Code) {
+        case OpCode::CONSTANT:
+          value = m_Chunk.readConstant(instruction.m_Operand);
+          return true;
+        case OpCode::NIL:
+          value = nullptr;
+          return true;
+        case OpCode::TRUE:
+          value = true;
+          return true;
+        case OpCode::FALSE:
+          value = false;
+          return true;
+        default:
+          return false;
+        }
+      }
+
+      bool Optimizer::number(size_t index, dbl_t& value) const {
+        value_t constant;
+        if (!literal(index, constant) || !isNumber(constant))
+          return false;
+
+        value = asNumber(constant);
+        return true;
+      }
+
+      // Gathers the `count` live instructions from `index` on, provided no
+      // jump lands inside the sequence.
+      bool Optimizer::follows(size_t index, size_t count, index_vec_t& indices) const {
+        indices.clear();
+        for (size_t i = index; indices.size() < count; i = next(i + 1)) {
+          if (i >= m_Code.size() || (!indices.empty() && m_Targets[i]))
+            return false;
+
+          indices.push_back(i);
+        }
+
+        return true;
+      }
+
+      void Optimizer::kill(size_t index) {
+        m_Code[index].m_Dead = true;
+      }
+
+      // Evaluates operators whose operands are all literals. Folding walks
+      // forward and leaves its result where the first operand was, so nested
+      // expressions like `1 + 2 * 3` fold completely in one pass. Only
+      // numbers are folded; everything else keeps its runtime behavior,
+      // errors included.
+      void Optimizer::foldConstants(void) {
+        findTargets();
+
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          Instruction& instruction = m_Code[i];
+          if (instruction.m_Dead || m_Targets[i])
+            continue;
+
+          size_t operand = previous(i);
+          switch (instruction.m_Code) {
+          case OpCode::NEGATE: {
+            dbl_t value;
+            if (!number(operand, value))
+              break;
+
+            m_Code[operand].m_Operand = m_Chunk.addConstant(-value);
+            m_Code[operand].m_Line = instruction.m_Line;
+            kill(i);
+            break;
+          }
+          case OpCode::NOT: {
+            value_t value;
+            if (!literal(operand, value))
+              break;
+
+            bool falsey = isNil(value) || (isBool(value) && !asBool(value));
+            m_Code[operand].m_Code = falsey ? OpCode::TRUE : OpCode::FALSE;
+            kill(i);
+            break;
+          }
+          case OpCode::ADD:
+          case OpCode::SUBTRACT:
+          case OpCode::MULTIPLY:
+          case OpCode::DIVIDE:
+          case OpCode::EQUAL:
+          case OpCode::GREATER:
+          case OpCode::LESS: {
+            dbl_t a, b;
+            if (operand == NO_INDEX || m_Targets[operand] || !number(operand, b) || !number(previous(operand), a))
+              break;
+
+            size_t left = previous(operand);
+
+            Instruction& result = m_Code[left];
+            result.m_Line = instruction.m_Line;
+            switch (instruction.m_Code) {
+            case OpCode::ADD: result.m_Operand = m_Chunk.addConstant(a + b); break;
+            case OpCode::SUBTRACT: result.m_Operand = m_Chunk.addConstant(a - b); break;
+            case OpCode::MULTIPLY: result.m_Operand = m_Chunk.addConstant(a * b); break;
+            case OpCode::DIVIDE: result.m_Operand = m_Chunk.addConstant(a / b); break;
+            case OpCode::EQUAL: result.m_Code = isSameValue(a, b) ? OpCode::TRUE : OpCode::FALSE; break;
+            case OpCode::GREATER: result.m_Code = a > b ? OpCode::TRUE : OpCode::FALSE; break;
+            default: result.m_Code = a < b ? OpCode::TRUE : OpCode::FALSE; break;
+            }
+
+            kill(operand);
+            kill(i);
+            break;
+          }
+          case OpCode::POP: {
+            // A value pushed only to be popped, as in the statement `1;`.
+            if (operand == NO_INDEX)
+              break;
+
+            OpCode pushed = m_Code[operand].m_Code;
+            if (pushed != OpCode::CONSTANT && pushed != OpCode::NIL && pushed != OpCode::TRUE &&
+                pushed != OpCode::FALSE && pushed != OpCode::GET_LOCAL && pushed != OpCode::GET_UPVALUE)
+              break;
+
+            // Jumps to the push now land after the pop.
+            kill(operand);
+            kill(i);
+            size_t after = next(i);
+            if (m_Targets[operand] && after < m_Code.size())
+              m_Targets[after] = true;
+            break;
+          }
+          default:
+            break;
+          }
+        }
+      }
+
+      // Points each jump straight at the end of a chain of jumps. A
+      // JUMP_IF_FALSE landing on another JUMP_IF_FALSE takes that one's
+      // target too, since the value it tested is still on the stack and
+      // fails the same test. Conditional jumps cannot go backward, so their
+      // chains stop at the first backward hop. Jumps to the next instruction
+      // are dropped.
+      void Optimizer::threadJumps(void) {
+        findTargets();
+
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          Instruction& instruction = m_Code[i];
+          if (instruction.m_Dead || operandFormat(instruction.m_Code) != OperandFormat::JUMP)
+            continue;
+
+          bool unconditional = isUnconditional(instruction.m_Code);
+          size_t target = instruction.m_Target;
+          // Bounded, in case the chain is an empty infinite loop.
+          for (size_t steps = 0; steps < m_Code.size() && target < m_Code.size(); ++steps) {
+            const Instruction& landing = m_Code[target];
+            bool follow = isUnconditional(landing.m_Code) ||
+                          (instruction.m_Code == OpCode::JUMP_IF_FALSE && landing.m_Code == OpCode::JUMP_IF_FALSE);
+            if (!follow)
+              break;
+
+            size_t further = next(landing.m_Target);
+            if (!unconditional && further <= i)
+              break;
+
+            target = further;
+          }
+
+          instruction.m_Target = target;
+          if (unconditional && target == next(i + 1))
+            kill(i);
+        }
+      }
+
+      // Removes every instruction no path from the entry reaches: code after
+      // a RETURN or an unconditional jump that no jump lands on, and jumps
+      // made redundant by threading.
+      void Optimizer::removeDeadCode(void) {
+        findTargets();
+
+        flag_vec_t reached(m_Code.size(), false);
+        index_vec_t work{ next(0) };
+        while (!work.empty()) {
+          size_t i = work.back();
+          work.pop_back();
+          if (i >= m_Code.size() || reached[i])
+            continue;
+
+          reached[i] = true;
+          const Instruction& instruction = m_Code[i];
+          if (isJump(instruction.m_Code))
+            work.push_back(instruction.m_Target);
+
+          if (instruction.m_Code != OpCode::RETURN && !isUnconditional(instruction.m_Code))
+            work.push_back(next(i + 1));
+        }
+
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          if (!reached[i])
+            kill(i);
+        }
+      }
+
+      // Replaces common sequences with superinstructions:
+      //   EQUAL NOT / LESS NOT / GREATER NOT   -> NOT_EQUAL / GREATER_EQUAL / LESS_EQUAL
+      //   JUMP_IF_FALSE L; POP ... L: POP       -> POP_JUMP_IF_FALSE past L
+      //   <comparison> POP_JUMP_IF_FALSE       -> JUMP_IF_[NOT_]LESS / JUMP_IF_[NOT_]GREATER
+      //   GET_LOCAL CONSTANT ADD / SUBTRACT    -> ADD_LOCAL_CONSTANT / SUBTRACT_LOCAL_CONSTANT
+      // The fused instruction takes the line of the part that can fail.
+      void Optimizer::fuse(void) {
+        findTargets();
+
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          Instruction& instruction = m_Code[i];
+          if (instruction.m_Dead)
+            continue;
+
+          switch (instruction.m_Code) {
+          case OpCode::NOT: {
+            size_t compare = previous(i);
+            if (m_Targets[i] || compare == NO_INDEX)
+              break;
+
+            OpCode& code = m_Code[compare].m_Code;
+            if (code == OpCode::EQUAL)
+              code = OpCode::NOT_EQUAL;
+            else if (code == OpCode::LESS)
+              code = OpCode::GREATER_EQUAL;
+            else if (code == OpCode::GREATER)
+              code = OpCode::LESS_EQUAL;
+            else
+              break;
+
+            kill(i);
+            break;
+          }
+          case OpCode::JUMP_IF_FALSE: {
+            // Both paths out of a condition usually start by popping it; the
+            // popping jump skips the POP at its target, which other paths
+            // into the target still run.
+            size_t pop = next(i + 1);
+            size_t target = instruction.m_Target;
+            if (pop >= m_Code.size() || m_Code[pop].m_Code != OpCode::POP || m_Targets[pop] ||
+                target >= m_Code.size() || m_Code[target].m_Code != OpCode::POP || next(target + 1) >= m_Code.size())
+              break;
+
+            instruction.m_Code = OpCode::POP_JUMP_IF_FALSE;
+            instruction.m_Target = next(target + 1);
+            m_Targets[instruction.m_Target] = true;
+            kill(pop);
+
+            size_t compare = previous(i);
+            if (m_Targets[i] || compare == NO_INDEX)
+              break;
+
+            // The jump is taken when the comparison is false.
+            OpCode& code = m_Code[compare].m_Code;
+            if (code == OpCode::LESS)
+              code = OpCode::JUMP_IF_NOT_LESS;
+            else if (code == OpCode::GREATER)
+              code = OpCode::JUMP_IF_NOT_GREATER;
+            else if (code == OpCode::GREATER_EQUAL)
+              code = OpCode::JUMP_IF_LESS;
+            else if (code == OpCode::LESS_EQUAL)
+              code = OpCode::JUMP_IF_GREATER;
+            else
+              break;
+
+            m_Code[compare].m_Target = instruction.m_Target;
+            kill(i);
+            break;
+          }
+          case OpCode::ADD:
+          case OpCode::SUBTRACT: {
+            size_t constant = previous(i);
+            size_t local = constant == NO_INDEX ? NO_INDEX : previous(constant);
+            if (local == NO_INDEX || m_Targets[i] || m_Targets[constant] ||
+                m_Code[constant].m_Code != OpCode::CONSTANT || m_Code[constant].m_Operand > UINT8_MAX ||
+                m_Code[local].m_Code != OpCode::GET_LOCAL || m_Code[local].m_Operand > UINT8_MAX)
+              break;
+
+            Instruction& fused = m_Code[local];
+            fused.m_Code = instruction.m_Code == OpCode::ADD ? OpCode::ADD_LOCAL_CONSTANT : OpCode::SUBTRACT_LOCAL_CONSTANT;
+            fused.m_Extra = m_Code[constant].m_Operand;
+            fused.m_Line = instruction.m_Line;
+            kill(constant);
+            kill(i);
+            break;
+          }
+          default:
+            break;
+          }
+        }
+      }
+
+      // Replaces stack sequences over locals with register instructions:
+      //   GET_LOCAL s SET_LOCAL d POP                        -> MOVE d s
+      //   CONSTANT k SET_LOCAL d POP                         -> LOAD_CONSTANT d k
+      //   GET_LOCAL a GET_LOCAL b <arith> SET_LOCAL d POP    -> <arith>_RR d a b
+      //   GET_LOCAL a CONSTANT k <arith> SET_LOCAL d POP     -> <arith>_RK d a k
+      //   <ADD|SUBTRACT>_LOCAL_CONSTANT a k SET_LOCAL d POP  -> <ADD|SUBTRACT>_RK d a k
+      //   GET_LOCAL a GET_LOCAL b <compare-and-jump>         -> <compare-and-jump>_RR a b
+      //   GET_LOCAL a CONSTANT k <compare-and-jump>          -> <compare-and-jump>_RK a k
+      // Every operand has to fit a byte. Runs after fuse(), whose
+      // compare-and-jumps and local-constant adds it picks up.
+      void Optimizer::toRegisters(void) {
+        findTargets();
+
+        auto byte = [&](size_t index) {
+          return m_Code[index].m_Operand <= UINT8_MAX;
+        };
+        auto is = [&](size_t index, const OpCode& code) {
+          return m_Code[index].m_Code == code && (operandFormat(code) != OperandFormat::OPERAND || byte(index));
+        };
+        // A local store whose value is dropped right after.
+        auto store = [&](size_t set, size_t pop) {
+          return is(set, OpCode::SET_LOCAL) && is(pop, OpCode::POP);
+        };
+
+        index_vec_t at;
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          Instruction& first = m_Code[i];
+          if (first.m_Dead)
+            continue;
+
+          if (is(i, OpCode::GET_LOCAL) || is(i, OpCode::CONSTANT)) {
+            if (follows(i, 3, at) && store(at[1], at[2])) {
+              Instruction& set = m_Code[at[1]];
+              first.m_Extra = first.m_Operand;
+              first.m_Operand = set.m_Operand;
+              first.m_Code = first.m_Code == OpCode::GET_LOCAL ? OpCode::MOVE : OpCode::LOAD_CONSTANT;
+              first.m_Line = set.m_Line;
+              kill(at[1]);
+              kill(at[2]);
+              continue;
+            }
+          }
+
+          if (is(i, OpCode::ADD_LOCAL_CONSTANT) || is(i, OpCode::SUBTRACT_LOCAL_CONSTANT)) {
+            if (follows(i, 3, at) && store(at[1], at[2])) {
+              first.m_Third = first.m_Extra;
+              first.m_Extra = first.m_Operand;
+              first.m_Operand = m_Code[at[1]].m_Operand;
+              first.m_Code = first.m_Code == OpCode::ADD_LOCAL_CONSTANT ? OpCode::ADD_RK : OpCode::SUBTRACT_RK;
+              kill(at[1]);
+              kill(at[2]);
+            }
+            continue;
+          }
+
+          if (!is(i, OpCode::GET_LOCAL) || !follows(i, 3, at))
+            continue;
+
+          bool constant = is(at[1], OpCode::CONSTANT);
+          if (!constant && !is(at[1], OpCode::GET_LOCAL))
+            continue;
+
+          Instruction& right = m_Code[at[1]];
+          Instruction& op = m_Code[at[2]];
+          OpCode code;
+          switch (op.m_Code) {
+          case OpCode::ADD: code = constant ? OpCode::ADD_RK : OpCode::ADD_RR; break;
+          case OpCode::SUBTRACT: code = constant ? OpCode::SUBTRACT_RK : OpCode::SUBTRACT_RR; break;
+          case OpCode::MULTIPLY: code = constant ? OpCode::MULTIPLY_RK : OpCode::MULTIPLY_RR; break;
+          case OpCode::DIVIDE: code = constant ? OpCode::DIVIDE_RK : OpCode::DIVIDE_RR; break;
+          case OpCode::JUMP_IF_LESS: code = constant ? OpCode::JUMP_IF_LESS_RK : OpCode::JUMP_IF_LESS_RR; break;
+          case OpCode::JUMP_IF_NOT_LESS: code = constant ? OpCode::JUMP_IF_NOT_LESS_RK : OpCode::JUMP_IF_NOT_LESS_RR; break;
+          case OpCode::JUMP_IF_GREATER: code = constant ? OpCode::JUMP_IF_GREATER_RK : OpCode::JUMP_IF_GREATER_RR; break;
+          case OpCode::JUMP_IF_NOT_GREATER:
+            code = constant ? OpCode::JUMP_IF_NOT_GREATER_RK : OpCode::JUMP_IF_NOT_GREATER_RR;
+            break;
+          default:
+            continue;
+          }
+
+          if (operandFormat(code) == OperandFormat::REGISTER_JUMP) {
+            // The jump keeps its place, so jumps into the sequence's end and
+            // its target stay where they were.
+            op.m_Code = code;
+            op.m_Operand = first.m_Operand;
+            op.m_Extra = right.m_Operand;
+            kill(i);
+            kill(at[1]);
+            continue;
+          }
+
+          if (!follows(i, 5, at) || !store(at[3], at[4]))
+            continue;
+
+          first.m_Code = code;
+          first.m_Extra = first.m_Operand;
+          first.m_Third = right.m_Operand;
+          first.m_Operand = m_Code[at[3]].m_Operand;
+          first.m_Line = op.m_Line;
+          kill(at[1]);
+          kill(at[2]);
+          kill(at[3]);
+          kill(at[4]);
+        }
+      }
+
+      // Lays the live instructions out again and writes them back to the
+      // chunk. An unconditional jump becomes JUMP or LOOP depending on where
+      // its target ended up.
+      void Optimizer::encode(void) {
+        index_vec_t offsets(m_Code.size() + 1, 0);
+        size_t offset = 0;
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          offsets[i] = offset;
+
+          const Instruction& instruction = m_Code[i];
+          if (instruction.m_Dead)
+            continue;
+
+          OperandFormat format = operandFormat(instruction.m_Code);
+          offset += 1 + operandSize(format);
+          if (format == OperandFormat::OPERAND || format == OperandFormat::INVOKE)
+            offset += prefixSize(instruction.m_Operand);
+        }
+        offsets[m_Code.size()] = offset;
+
+        // Folded constants can need a wider operand than before, so a jump
+        // may no longer reach. Keep the original code then.
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          const Instruction& instruction = m_Code[i];
+          if (instruction.m_Dead || !isJump(instruction.m_Code))
+            continue;
+
+          size_t from = offsets[i + 1];
+          size_t to = offsets[instruction.m_Target];
+          if (!isUnconditional(instruction.m_Code) && to < from)
+            return;
+
+          if ((to < from ? from - to : to - from) > MAX_JUMP)
+            return;
+        }
+
+        m_Chunk.resetCode();
+        for (size_t i = 0; i < m_Code.size(); ++i) {
+          const Instruction& instruction = m_Code[i];
+          if (instruction.m_Dead)
+            continue;
+
+          int_t line = instruction.m_Line;
+          // Jumps count from where the instruction ends, which is where the
+          // next one, dead or not, starts.
+          size_t from = offsets[i + 1];
+          size_t to = isJump(instruction.m_Code) ? offsets[instruction.m_Target] : from;
+          switch (operandFormat(instruction.m_Code)) {
+          case OperandFormat::NONE:
+            m_Chunk.write(instruction.m_Code, line);
+            break;
+          case OperandFormat::OPERAND:
+            m_Chunk.write(instruction.m_Code, instruction.m_Operand, line);
+            break;
+          case OperandFormat::INVOKE:
+            m_Chunk.write(instruction.m_Code, instruction.m_Operand, line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Extra), line);
+            break;
+          case OperandFormat::LOCAL_CONSTANT:
+          case OperandFormat::MOVE:
+            m_Chunk.write(instruction.m_Code, line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Operand), line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Extra), line);
+            break;
+          case OperandFormat::THREE_ADDRESS:
+            m_Chunk.write(instruction.m_Code, line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Operand), line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Extra), line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Third), line);
+            break;
+          case OperandFormat::REGISTER_JUMP:
+            m_Chunk.write(instruction.m_Code, line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Operand), line);
+            m_Chunk.write(static_cast<byte_t>(instruction.m_Extra), line);
+            m_Chunk.writeShort(static_cast<uint16_t>(to - from), line);
+            break;
+          case OperandFormat::JUMP:
+            if (!isUnconditional(instruction.m_Code)) {
+              m_Chunk.write(instruction.m_Code, line);
+              m_Chunk.writeShort(static_cast<uint16_t>(to - from), line);
+            } else if (to >= from) {
+              m_Chunk.write(OpCode::JUMP, line);
+              m_Chunk.writeShort(static_cast<uint16_t>(to - from), line);
+            } else {
+              m_Chunk.write(OpCode::LOOP, line);
+              m_Chunk.writeShort(static_cast<uint16_t>(from - to), line);
+            }
+            break;
+          }
+        }
+      }
+    }
+
+    void optimize(vm::Chunk& chunk, int_t level, const ExecutionMode& mode) {
+      bool registers = mode == ExecutionMode::REGISTER;
+      if (level <= 0 && !registers)
+        return;
+
+      Optimizer optimizer(chunk);
+      if (level >= 1) {
+        optimizer.foldConstants();
+        optimizer.threadJumps();
+        optimizer.removeDeadCode();
+      }
+
+      if (level >= 2 || registers) {
+        optimizer.fuse();
+        optimizer.removeDeadCode();
+      }
+
+      if (registers) {
+        optimizer.toRegisters();
+        optimizer.removeDeadCode();
+      }
+
+      optimizer.encode();
+    }
+  }
+}
@@ -0,0 +1,145 @@
+#include "profiler.hpp"
+#include "object.hpp"
+#include "gc.hpp"
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+
+namespace clox {
+  namespace vm {
+    namespace {
+      constexpr size_t NO_FUNCTION = SIZE_MAX;
+
+      struct Row {
+        string_t m_Name;
+        uint64_t m_Count;
+        uint64_t m_Ticks;
+      };
+
+      void printRows(FILE* out, const char* title, std::vector<Row>& rows, uint64_t total) {
+        std::sort(rows.begin(), rows.end(), [](const Row& left, const Row& right) {
+          return left.m_Ticks != right.m_Ticks ? left.m_Ticks > right.m_Ticks : left.m_Count > right.m_Count;
+        });
+
+        fprintf(out, "\n%-8s %16s %16s  %s\n", "ticks %", "ticks", "count", title);
+        for (const Row& row : rows) {
+          if (row.m_Count == 0)
+            continue;
+
+          double percent = total ? 100. * static_cast<double>(row.m_Ticks) / static_cast<double>(total) : 0.;
+          fprintf(out, "%7.2f%% %16" PRIu64 " %16" PRIu64 "  %s\n", percent, row.m_Ticks, row.m_Count, row.m_Name.c_str());
+        }
+      }
+    }
+
+    Profiler::Profiler(void) :
+      m_Functions(),
+      m_FunctionIndices(),
+      m_Nodes(),
+      m_Opcodes(),
+      m_Running(false),
+      m_Start(0),
+      m_Node(ROOT),
+      m_Offset(0),
+      m_Code(0)
+    {
+      m_Nodes.push_back({ ROOT, NO_FUNCTION, {}, {} });
+    }
+
+    size_t Profiler::enter(size_t caller, const function_ptr_t& function) {
+      auto callee = m_Nodes[caller].m_Callees.find(function);
+      if (callee != m_Nodes[caller].m_Callees.end())
+        return callee->second;
+
+      auto it = m_FunctionIndices.find(function);
+      if (it == m_FunctionIndices.end()) {
+        const Chunk& chunk = function->m_Chunk;
+        m_Functions.push_back({ function, chunk.code(), std::vector<Counter>(chunk.size()) });
+        it = m_FunctionIndices.emplace(function, m_Functions.size() - 1).first;
+      }
+
+      m_Nodes.push_back({ caller, it->second, {}, {} });
+      m_Nodes[caller].m_Callees.emplace(function, m_Nodes.size() - 1);
+      return m_Nodes.size() - 1;
+    }
+
+    void Profiler::pause(void) {
+      if (m_Running)
+        charge(now());
+
+      m_Running = false;
+    }
+
+    void Profiler::report(FILE* out) const {
+      uint64_t count = 0;
+      uint64_t ticks = 0;
+      std::vector<Row> opcodes;
+      for (size_t i = 0; i < std::size(m_Opcodes); ++i) {
+        count += m_Opcodes[i].m_Count;
+        ticks += m_Opcodes[i].m_Ticks;
+        opcodes.push_back({ opcodeName(static_cast<OpCode>(i)), m_Opcodes[i].m_Count, m_Opcodes[i].m_Ticks });
+      }
+
+      std::vector<Row> functions;
+      std::vector<Row> lines;
+      for (size_t i = 0; i < m_Functions.size(); ++i) {
+        const FunctionProfile& profile = m_Functions[i];
+        const Chunk& chunk = profile.m_Function->m_Chunk;
+        string_t name = functionName(i);
+
+        Row function{ name, 0, 0 };
+        std::map<int_t, Row> byLine;
+        for (size_t offset = 0; offset < profile.m_Offsets.size(); ++offset) {
+          const Counter& counter = profile.m_Offsets[offset];
+          if (counter.m_Count == 0)
+            continue;
+
+          function.m_Count += counter.m_Count;
+          function.m_Ticks += counter.m_Ticks;
+
+          int_t line = chunk.readLine(offset);
+          auto [it, added] = byLine.try_emplace(line, Row{ name + ":" + std::to_string(line), 0, 0 });
+          it->second.m_Count += counter.m_Count;
+          it->second.m_Ticks += counter.m_Ticks;
+        }
+
+        functions.push_back(function);
+        for (auto& [line, row] : byLine)
+          lines.push_back(row);
+      }
+
+      fprintf(out, "== profile: %" PRIu64 " instructions, %" PRIu64 " %s ==\n", count, ticks,
+              CLOX_PROFILE_RDTSC ? "cycles" : "ns");
+      printRows(out, "opcode", opcodes, ticks);
+      printRows(out, "function", functions, ticks);
+      printRows(out, "line", lines, ticks);
+    }
+
+    void Profiler::writeCollapsed(FILE* out) const {
+      for (size_t node = ROOT + 1; node < m_Nodes.size(); ++node) {
+        if (m_Nodes[node].m_Self.m_Ticks > 0)
+          fprintf(out, "%s %" PRIu64 "\n", stackName(node).c_str(), m_Nodes[node].m_Self.m_Ticks);
+      }
+    }
+
+    // Profiled functions stay alive, so that their addresses are not reused
+    // by functions compiled later.
+    void Profiler::markRoots(gc::Collector& gc) const {
+      for (const FunctionProfile& profile : m_Functions)
+        gc.markObject(profile.m_Function);
+    }
+
+    string_t Profiler::functionName(size_t function) const {
+      const string_t& name = m_Functions[function].m_Function->m_Name;
+      return name.empty() ? "script" : name;
+    }
+
+    string_t Profiler::stackName(size_t node) const {
+      string_t name = functionName(m_Nodes[node].m_Function);
+      for (size_t caller = m_Nodes[node].m_Caller; caller != ROOT; caller = m_Nodes[caller].m_Caller)
+        name = functionName(m_Nodes[caller].m_Function) + ";" + name;
+
+      return name;
+    }
+  }
+}
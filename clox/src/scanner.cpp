@@ -5,7 +5,7 @@
 namespace clox {
   namespace scanner {
 
-    void Scanner::set(const string_t& source) {
+    void Scanner::set(std::string_view source) {
       m_Source = source;
       m_Start = 0;
       m_Current = 0;
@@ -75,7 +75,9 @@ namespace clox {
       return Token(type, m_Source.substr(m_Start, m_Current - m_Start), m_Line);
     }
 
-    Token Scanner::errorToken(const string_t& message) const {
+    // The message must be a string literal: the compiler reports it through
+    // the lexeme's data(), relying on the terminating null.
+    Token Scanner::errorToken(const char* message) const {
       return Token(TokenType::ERROR, message, m_Line);
     }
 
@@ -124,11 +126,14 @@ namespace clox {
     }
 
     char Scanner::peek(void) const {
+      if (isAtEnd())
+        return '\0';
+
       return m_Source[m_Current];
     }
 
     char Scanner::peekNext(void) const {
-      if (m_Current == m_Source.size() - 1)
+      if (m_Current + 1 >= static_cast<int_t>(m_Source.size()))
         return '\0';
 
       return m_Source[m_Current + 1];
@@ -178,32 +183,63 @@ namespace clox {
       return makeToken(identifierType());
     }
 
-    namespace {
-      std::unordered_map<string_t, TokenType> m =
-      {
-        {"and",    TokenType::AND},
-        {"class",  TokenType::CLASS},
-        {"else",   TokenType::ELSE},
-        {"if",     TokenType::IF},
-        {"nil",    TokenType::NIL},
-        {"or",     TokenType::OR},
-        {"print",  TokenType::PRINT},
-        {"return", TokenType::RETURN},
-        {"super",  TokenType::SUPER},
-        {"var",    TokenType::VAR},
-        {"while",  TokenType::WHILE},
-        {"false",  TokenType::FALSE},
-        {"for",    TokenType::FOR},
-        {"fun",    TokenType::FUN},
-        {"this",   TokenType::THIS},
-        {"true",   TokenType::TRUE}
-      };
+    TokenType Scanner::checkKeyword(int_t start, std::string_view rest, const TokenType& type) const {
+      if (m_Current - m_Start == start + static_cast<int_t>(rest.size()) &&
+          m_Source.substr(m_Start + start, rest.size()) == rest)
+        return type;
+
+      return TokenType::IDENTIFIER;
     }
 
+    // A hand-rolled trie over the keywords: switch on the first one or two
+    // characters, then compare the remainder in place.
     TokenType Scanner::identifierType(void) const {
-      string_t lexeme = m_Source.substr(m_Start, m_Current - m_Start);
-      if (m.count(lexeme))
-        return m[lexeme];
+      switch (m_Source[m_Start]) {
+      case 'a':
+        return checkKeyword(1, "nd", TokenType::AND);
+      case 'c':
+        return checkKeyword(1, "lass", TokenType::CLASS);
+      case 'e':
+        return checkKeyword(1, "lse", TokenType::ELSE);
+      case 'f':
+        if (m_Current - m_Start > 1) {
+          switch (m_Source[m_Start + 1]) {
+          case 'a':
+            return checkKeyword(2, "lse", TokenType::FALSE);
+          case 'o':
+            return checkKeyword(2, "r", TokenType::FOR);
+          case 'u':
+            return checkKeyword(2, "n", TokenType::FUN);
+          }
+        }
+        break;
+      case 'i':
+        return checkKeyword(1, "f", TokenType::IF);
+      case 'n':
+        return checkKeyword(1, "il", TokenType::NIL);
+      case 'o':
+        return checkKeyword(1, "r", TokenType::OR);
+      case 'p':
+        return checkKeyword(1, "rint", TokenType::PRINT);
+      case 'r':
+        return checkKeyword(1, "eturn", TokenType::RETURN);
+      case 's':
+        return checkKeyword(1, "uper", TokenType::SUPER);
+      case 't':
+        if (m_Current - m_Start > 1) {
+          switch (m_Source[m_Start + 1]) {
+          case 'h':
+            return checkKeyword(2, "is", TokenType::THIS);
+          case 'r':
+            return checkKeyword(2, "ue", TokenType::TRUE);
+          }
+        }
+        break;
+      case 'v':
+        return checkKeyword(1, "ar", TokenType::VAR);
+      case 'w':
+        return checkKeyword(1, "hile", TokenType::WHILE);
+      }
 
       return TokenType::IDENTIFIER;
     }
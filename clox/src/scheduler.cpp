@@ -0,0 +1,188 @@
+#include "scheduler.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace clox {
+  namespace scheduler {
+    namespace {
+      // A FILE the output or errors of one job are written to, read back as
+      // a string once the job is done.
+      class Buffer {
+      public:
+        Buffer(void) {
+#ifdef _WIN32
+          m_File = tmpfile();
+#else
+          m_File = open_memstream(&m_Data, &m_Size);
+#endif
+        }
+
+        ~Buffer(void) {
+          if (m_File)
+            fclose(m_File);
+          free(m_Data);
+        }
+
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        FILE* file(void) const {
+          return m_File;
+        }
+
+        string_t contents(void) {
+#ifdef _WIN32
+          string_t contents;
+          fflush(m_File);
+          rewind(m_File);
+          char chunk[4096];
+          for (size_t read; (read = fread(chunk, 1, sizeof(chunk), m_File)) > 0;)
+            contents.append(chunk, read);
+          return contents;
+#else
+          fflush(m_File);
+          return string_t(m_Data, m_Size);
+#endif
+        }
+      private:
+        FILE* m_File = nullptr;
+        char* m_Data = nullptr;
+        size_t m_Size = 0;
+      };
+    }
+
+    Scheduler::Scheduler(const Options& options) : m_Options(options) {
+      size_t count = m_Options.m_Workers;
+      if (count == 0)
+        count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+      for (size_t i = 0; i < count; ++i)
+        m_Workers.push_back(std::make_unique<Worker>());
+
+      // Started once all exist, since thieves look at every queue.
+      for (size_t i = 0; i < count; ++i)
+        m_Workers[i]->m_Thread = std::thread(&Scheduler::work, this, i);
+    }
+
+    Scheduler::~Scheduler(void) {
+      {
+        std::lock_guard<std::mutex> running(m_Running);
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_Stopping = true;
+      }
+
+      m_Started.notify_all();
+      for (auto& worker : m_Workers)
+        worker->m_Thread.join();
+    }
+
+    std::vector<Result> Scheduler::run(const std::vector<string_t>& sources) {
+      std::vector<Result> results(sources.size());
+      if (sources.empty())
+        return results;
+
+      std::lock_guard<std::mutex> running(m_Running);
+
+      // Consecutive jobs go to the same worker, which keeps stealing to the
+      // end of a batch, where the queues run dry.
+      size_t count = m_Workers.size();
+      for (size_t i = 0; i < count; ++i) {
+        std::lock_guard<std::mutex> lock(m_Workers[i]->m_Lock);
+        for (size_t job = i * sources.size() / count; job < (i + 1) * sources.size() / count; ++job)
+          m_Workers[i]->m_Jobs.push_back(job);
+      }
+
+      std::unique_lock<std::mutex> lock(m_Lock);
+      m_Sources = &sources;
+      m_Results = &results;
+      m_Busy = count;
+      ++m_Batch;
+      m_Started.notify_all();
+      m_Finished.wait(lock, [this] { return m_Busy == 0; });
+
+      m_Sources = nullptr;
+      m_Results = nullptr;
+      return results;
+    }
+
+    size_t Scheduler::workers(void) const {
+      return m_Workers.size();
+    }
+
+    Stats Scheduler::stats(void) const {
+      return Stats{ m_Jobs.load(), m_Steals.load() };
+    }
+
+    void Scheduler::work(size_t index) {
+      uint64_t batch = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(m_Lock);
+          m_Started.wait(lock, [&] { return m_Stopping || m_Batch != batch; });
+          if (m_Stopping)
+            return;
+
+          batch = m_Batch;
+        }
+
+        // No jobs are added while a batch runs, so once every queue is empty
+        // what is left is being run by the other workers.
+        size_t job;
+        while (next(index, job))
+          execute(job);
+
+        std::lock_guard<std::mutex> lock(m_Lock);
+        if (--m_Busy == 0)
+          m_Finished.notify_one();
+      }
+    }
+
+    bool Scheduler::next(size_t index, size_t& job) {
+      {
+        Worker& worker = *m_Workers[index];
+        std::lock_guard<std::mutex> lock(worker.m_Lock);
+        if (!worker.m_Jobs.empty()) {
+          job = worker.m_Jobs.front();
+          worker.m_Jobs.pop_front();
+          return true;
+        }
+      }
+
+      for (size_t i = 1; i < m_Workers.size(); ++i) {
+        Worker& victim = *m_Workers[(index + i) % m_Workers.size()];
+        std::lock_guard<std::mutex> lock(victim.m_Lock);
+        if (!victim.m_Jobs.empty()) {
+          job = victim.m_Jobs.back();
+          victim.m_Jobs.pop_back();
+          m_Steals.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    void Scheduler::execute(size_t job) {
+      Result& result = (*m_Results)[job];
+      Buffer out;
+      Buffer err;
+      if (!out.file() || !err.file()) {
+        result.m_Status = vm::InterpretResult::RUNTIME_ERROR;
+        result.m_Errors = "Could not open an output buffer.\n";
+      } else {
+        vm::VM vm(out.file(), err.file());
+        vm.setOptimizationLevel(m_Options.m_OptimizationLevel);
+        vm.setExecutionMode(m_Options.m_Mode);
+        vm.setJit(m_Options.m_Jit);
+        vm.setTracing(m_Options.m_Tracing);
+        result.m_Status = vm.interpret((*m_Sources)[job]);
+        result.m_Output = out.contents();
+        result.m_Errors = err.contents();
+      }
+
+      m_Jobs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
@@ -0,0 +1,1087 @@
+#include "trace.hpp"
+#include "chunk.hpp"
+#include "object.hpp"
+#include "globals.hpp"
+#include "gc.hpp"
+#include "vm.hpp"
+#include <unordered_map>
+#include <unordered_set>
+
+namespace clox {
+  namespace trace {
+    namespace {
+      using namespace vm;
+      using obj::Instance;
+      using obj::isObjType;
+      using obj::asObjType;
+
+      constexpr ref_t NONE = UINT16_MAX;
+      // IR instructions one recording may emit, well short of NONE so that
+      // compiling has room for the loads it adds.
+      constexpr size_t MAX_IR = 16384;
+
+      Type typeOf(const value_t& value) {
+        if (isNumber(value))
+          return Type::NUMBER;
+        if (isBool(value))
+          return Type::BOOL;
+        if (isNil(value))
+          return Type::NIL;
+
+        return Type::OBJECT;
+      }
+
+      bool hasType(const value_t& value, const Type& type) {
+        switch (type) {
+        case Type::NIL:
+          return isNil(value);
+        case Type::BOOL:
+          return isBool(value);
+        case Type::NUMBER:
+          return isNumber(value);
+        case Type::OBJECT:
+          return isObj(value);
+        default:
+          return true;
+        }
+      }
+
+      bool isFalsey(const value_t& value) {
+        return isNil(value) || (isBool(value) && !asBool(value));
+      }
+
+      // The arithmetic and comparisons, the same way the VM does them. The
+      // _EQUAL comparisons negate the strict ones, so a NaN compares true.
+      value_t evaluate(const Op& op, dbl_t left, dbl_t right) {
+        switch (op) {
+        case Op::ADD:
+          return left + right;
+        case Op::SUBTRACT:
+          return left - right;
+        case Op::MULTIPLY:
+          return left * right;
+        case Op::DIVIDE:
+          return left / right;
+        case Op::LESS:
+          return left < right;
+        case Op::GREATER:
+          return left > right;
+        case Op::GREATER_EQUAL:
+          return !(left < right);
+        default:
+          return !(left > right);
+        }
+      }
+
+      bool readsA(const Op& op) {
+        return op != Op::CONSTANT && op != Op::LOAD_SLOT && op != Op::LOAD_GLOBAL;
+      }
+
+      bool readsB(const Op& op) {
+        return (op >= Op::ADD && op <= Op::NOT_EQUAL && op != Op::NEGATE) || op == Op::STORE_FIELD;
+      }
+
+      bool hasSnapshot(const Op& op) {
+        return op == Op::GUARD_TRUE || op == Op::GUARD_FALSE || op == Op::GUARD_SHAPE || op == Op::LOAD_FIELD;
+      }
+
+      // Follows one iteration of a loop from its header, executing every
+      // instruction on the frame the way the interpreter would while it
+      // records it as IR, until the loop closes or an instruction comes up
+      // that the IR does not cover: calls, allocation, upvalues and anything
+      // that would fail. Giving up at an instruction leaves the interpreter
+      // to execute it, so recording never has anything to undo.
+      //
+      // Variables are loaded once, at their first read, with a guard on the
+      // type they hold; stores to them only update which value they hold,
+      // and are written out by the snapshots of the guards. Operations on
+      // constants fold as they are recorded.
+      class Recorder {
+      public:
+        Recorder(obj::Function& function, const byte_t* header, value_t* slots, value_t*& top,
+                 GlobalTable& globals, FILE* out) :
+          m_Chunk(function.m_Chunk),
+          m_Header(header),
+          m_IP(header),
+          m_Slots(slots),
+          m_Top(top),
+          m_Base(static_cast<size_t>(top - slots)),
+          m_Globals(globals),
+          m_Out(out),
+          m_Stack(std::max(function.m_MaxStack, m_Base + 1), NONE),
+          m_Recorded(0)
+        {
+          // Snapshot 0 is the loop header itself, left to by the preamble.
+          m_Snapshots.push_back({ static_cast<uint32_t>(header - m_Chunk.code()),
+                                  static_cast<uint32_t>(m_Base), 0, 0, 0 });
+        }
+
+        // Records the iteration and compiles it. Returns nullptr if it was
+        // given up; either way ip() is where the interpreter carries on.
+        Trace* record(void) {
+          while (true) {
+            switch (step()) {
+            case Step::NEXT:
+              break;
+            case Step::CLOSED:
+              return compile();
+            case Step::ABORT:
+              return nullptr;
+            }
+          }
+        }
+
+        const byte_t* ip(void) const { return m_IP; }
+        size_t recorded(void) const { return m_Recorded; }
+      private:
+        enum class Step {
+          NEXT,
+          CLOSED,
+          ABORT,
+        };
+
+        struct Variable {
+          uint32_t m_Location;
+          // The load the loop reads the variable through, and the value the
+          // variable holds at this point of the iteration.
+          ref_t m_Entry;
+          ref_t m_Current;
+          bool m_Written;
+        };
+
+        Step step(void) {
+          if (m_Recorded == MAX_RECORDED || m_IR.size() >= MAX_IR)
+            return Step::ABORT;
+
+          const byte_t* ip = m_IP;
+          size_t ext = 0;
+          if (*ip == static_cast<byte_t>(OpCode::WIDE)) {
+            ext = static_cast<size_t>(ip[1]) << 8;
+            ip += 2;
+          } else if (*ip == static_cast<byte_t>(OpCode::EXTRA_WIDE)) {
+            ext = (static_cast<size_t>(ip[1]) << 16) | (static_cast<size_t>(ip[2]) << 8);
+            ip += 3;
+          }
+
+          OpCode code = static_cast<OpCode>(*ip++);
+          const byte_t* next = ip + operandSize(operandFormat(code));
+          auto operand = [&](void) { return ext | ip[0]; };
+          // Jump offsets are the last two bytes, relative to the next
+          // instruction.
+          auto target = [&](int_t sign) {
+            return next + sign * static_cast<ptrdiff_t>((next[-2] << 8) | next[-1]);
+          };
+
+          switch (code) {
+          case OpCode::CONSTANT: {
+            const value_t& value = m_Chunk.constants()[operand()];
+            push(constant(value), value);
+            break;
+          }
+          case OpCode::NIL:
+            push(constant(nullptr), nullptr);
+            break;
+          case OpCode::TRUE:
+            push(constant(true), true);
+            break;
+          case OpCode::FALSE:
+            push(constant(false), false);
+            break;
+          case OpCode::POP:
+            if (!has(1))
+              return Step::ABORT;
+
+            --m_Top;
+            break;
+          case OpCode::GET_LOCAL: {
+            size_t slot = operand();
+            if (slot >= height())
+              return Step::ABORT;
+
+            push(readSlot(slot), m_Slots[slot]);
+            break;
+          }
+          case OpCode::SET_LOCAL: {
+            size_t slot = operand();
+            if (!has(1) || slot >= height())
+              return Step::ABORT;
+
+            writeSlot(slot, peek(0), m_Top[-1]);
+            break;
+          }
+          case OpCode::GET_GLOBAL: {
+            // An undefined global is for the interpreter to report. Globals
+            // are never undefined again, so this needs no guard.
+            size_t index = m_Chunk.globals()[operand()];
+            const Global& global = m_Globals[index];
+            if (!global.m_Defined)
+              return Step::ABORT;
+
+            push(read(GLOBAL | static_cast<uint32_t>(index), global.m_Value), global.m_Value);
+            break;
+          }
+          case OpCode::SET_GLOBAL: {
+            size_t index = m_Chunk.globals()[operand()];
+            Global& global = m_Globals[index];
+            if (!global.m_Defined || !has(1))
+              return Step::ABORT;
+
+            global.m_Value = m_Top[-1];
+            write(GLOBAL | static_cast<uint32_t>(index), peek(0));
+            break;
+          }
+          case OpCode::NEGATE: {
+            if (!has(1) || !isNumber(m_Top[-1]))
+              return Step::ABORT;
+
+            value_t value = -asNumber(m_Top[-1]);
+            replace(1, negate(peek(0)), value);
+            break;
+          }
+          case OpCode::NOT: {
+            if (!has(1))
+              return Step::ABORT;
+
+            value_t value = isFalsey(m_Top[-1]);
+            replace(1, logicalNot(peek(0)), value);
+            break;
+          }
+          case OpCode::EQUAL:
+          case OpCode::NOT_EQUAL: {
+            if (!has(2))
+              return Step::ABORT;
+
+            bool negated = code == OpCode::NOT_EQUAL;
+            value_t value = isSameValue(m_Top[-2], m_Top[-1]) != negated;
+            replace(2, equality(negated, peek(1), peek(0)), value);
+            break;
+          }
+          case OpCode::ADD:
+          case OpCode::ADD_NUM:
+            return binary(Op::ADD, next);
+          case OpCode::SUBTRACT:
+          case OpCode::SUBTRACT_NUM:
+            return binary(Op::SUBTRACT, next);
+          case OpCode::MULTIPLY:
+          case OpCode::MULTIPLY_NUM:
+            return binary(Op::MULTIPLY, next);
+          case OpCode::DIVIDE:
+          case OpCode::DIVIDE_NUM:
+            return binary(Op::DIVIDE, next);
+          case OpCode::LESS:
+          case OpCode::LESS_NUM:
+            return binary(Op::LESS, next);
+          case OpCode::GREATER:
+          case OpCode::GREATER_NUM:
+            return binary(Op::GREATER, next);
+          case OpCode::GREATER_EQUAL:
+          case OpCode::GREATER_EQUAL_NUM:
+            return binary(Op::GREATER_EQUAL, next);
+          case OpCode::LESS_EQUAL:
+          case OpCode::LESS_EQUAL_NUM:
+            return binary(Op::LESS_EQUAL, next);
+          case OpCode::PRINT:
+            if (!has(1))
+              return Step::ABORT;
+
+            emit(Op::PRINT, Type::ANY, peek(0));
+            m_Chunk.printValue(m_Out, m_Top[-1]);
+            fprintf(m_Out, "\n");
+            --m_Top;
+            break;
+          case OpCode::JUMP:
+            return jump(target(1));
+          case OpCode::LOOP: {
+            const byte_t* header = target(-1);
+            if (header != m_Header)
+              return jump(header);
+
+            m_IP = header;
+            ++m_Recorded;
+            return Step::CLOSED;
+          }
+          case OpCode::JUMP_IF_FALSE:
+          case OpCode::POP_JUMP_IF_FALSE: {
+            if (!has(1))
+              return Step::ABORT;
+
+            bool falsey = isFalsey(m_Top[-1]);
+            guard(peek(0), !falsey);
+            if (code == OpCode::POP_JUMP_IF_FALSE)
+              --m_Top;
+
+            return jump(falsey ? target(1) : next);
+          }
+          case OpCode::JUMP_IF_LESS:
+            return compareJump(Op::LESS, true, target(1), next);
+          case OpCode::JUMP_IF_NOT_LESS:
+            return compareJump(Op::LESS, false, target(1), next);
+          case OpCode::JUMP_IF_GREATER:
+            return compareJump(Op::GREATER, true, target(1), next);
+          case OpCode::JUMP_IF_NOT_GREATER:
+            return compareJump(Op::GREATER, false, target(1), next);
+          case OpCode::ADD_LOCAL_CONSTANT:
+          case OpCode::SUBTRACT_LOCAL_CONSTANT: {
+            size_t slot = ip[0];
+            const value_t& right = m_Chunk.constants()[ip[1]];
+            if (slot >= height() || !areNumbers(m_Slots[slot], right))
+              return Step::ABORT;
+
+            Op op = code == OpCode::ADD_LOCAL_CONSTANT ? Op::ADD : Op::SUBTRACT;
+            value_t value = evaluate(op, asNumber(m_Slots[slot]), asNumber(right));
+            push(arithmetic(op, readSlot(slot), constant(right)), value);
+            break;
+          }
+          case OpCode::GET_PROPERTY: {
+            if (!has(1) || !isObjType<Instance>(m_Top[-1]))
+              return Step::ABORT;
+
+            // Only fields: binding a method allocates.
+            Instance* instance = asObjType<Instance>(m_Top[-1]);
+            int_t slot = instance->m_Shape->find(m_Chunk.readCache(operand()).m_Name);
+            if (slot == -1)
+              return Step::ABORT;
+
+            ref_t object = peek(0);
+            guardShape(object, instance->m_Shape);
+            value_t value = instance->m_Fields[slot];
+            ref_t field = emit(Op::LOAD_FIELD, typeOf(value), object, static_cast<ref_t>(slot), snapshot());
+            replace(1, field, value);
+            break;
+          }
+          case OpCode::SET_PROPERTY: {
+            if (!has(2) || !isObjType<Instance>(m_Top[-2]))
+              return Step::ABORT;
+
+            // Only fields the instance has: adding one changes its shape.
+            Instance* instance = asObjType<Instance>(m_Top[-2]);
+            int_t slot = instance->m_Shape->find(m_Chunk.readCache(operand()).m_Name);
+            if (slot == -1)
+              return Step::ABORT;
+
+            ref_t object = peek(1);
+            guardShape(object, instance->m_Shape);
+            emit(Op::STORE_FIELD, Type::ANY, object, peek(0), static_cast<uint32_t>(slot));
+            value_t value = m_Top[-1];
+            instance->m_Fields[slot] = value;
+            replace(2, peek(0), value);
+            break;
+          }
+          case OpCode::MOVE: {
+            size_t destination = ip[0];
+            size_t source = ip[1];
+            if (destination >= height() || source >= height())
+              return Step::ABORT;
+
+            value_t value = m_Slots[source];
+            writeSlot(destination, readSlot(source), value);
+            break;
+          }
+          case OpCode::LOAD_CONSTANT: {
+            size_t destination = ip[0];
+            if (destination >= height())
+              return Step::ABORT;
+
+            const value_t& value = m_Chunk.constants()[ip[1]];
+            writeSlot(destination, constant(value), value);
+            break;
+          }
+          case OpCode::ADD_RR:
+          case OpCode::ADD_RK:
+            return registerBinary(Op::ADD, code == OpCode::ADD_RK, ip, next);
+          case OpCode::SUBTRACT_RR:
+          case OpCode::SUBTRACT_RK:
+            return registerBinary(Op::SUBTRACT, code == OpCode::SUBTRACT_RK, ip, next);
+          case OpCode::MULTIPLY_RR:
+          case OpCode::MULTIPLY_RK:
+            return registerBinary(Op::MULTIPLY, code == OpCode::MULTIPLY_RK, ip, next);
+          case OpCode::DIVIDE_RR:
+          case OpCode::DIVIDE_RK:
+            return registerBinary(Op::DIVIDE, code == OpCode::DIVIDE_RK, ip, next);
+          case OpCode::JUMP_IF_LESS_RR:
+          case OpCode::JUMP_IF_LESS_RK:
+            return registerJump(Op::LESS, true, code == OpCode::JUMP_IF_LESS_RK, ip, target(1), next);
+          case OpCode::JUMP_IF_NOT_LESS_RR:
+          case OpCode::JUMP_IF_NOT_LESS_RK:
+            return registerJump(Op::LESS, false, code == OpCode::JUMP_IF_NOT_LESS_RK, ip, target(1), next);
+          case OpCode::JUMP_IF_GREATER_RR:
+          case OpCode::JUMP_IF_GREATER_RK:
+            return registerJump(Op::GREATER, true, code == OpCode::JUMP_IF_GREATER_RK, ip, target(1), next);
+          case OpCode::JUMP_IF_NOT_GREATER_RR:
+          case OpCode::JUMP_IF_NOT_GREATER_RK:
+            return registerJump(Op::GREATER, false, code == OpCode::JUMP_IF_NOT_GREATER_RK, ip, target(1), next);
+          default:
+            return Step::ABORT;
+          }
+
+          return jump(next);
+        }
+
+        Step jump(const byte_t* target) {
+          m_IP = target;
+          ++m_Recorded;
+          return Step::NEXT;
+        }
+
+        // The stack arithmetic and comparisons; anything but numbers is left
+        // to the interpreter, to concatenate or report.
+        Step binary(const Op& op, const byte_t* next) {
+          if (!has(2) || !areNumbers(m_Top[-2], m_Top[-1]))
+            return Step::ABORT;
+
+          value_t value = evaluate(op, asNumber(m_Top[-2]), asNumber(m_Top[-1]));
+          replace(2, op < Op::LESS ? arithmetic(op, peek(1), peek(0)) : comparison(op, peek(1), peek(0)), value);
+          return jump(next);
+        }
+
+        // The stack compare-and-jumps, which pop both operands.
+        Step compareJump(const Op& op, bool jumpIf, const byte_t* target, const byte_t* next) {
+          if (!has(2) || !areNumbers(m_Top[-2], m_Top[-1]))
+            return Step::ABORT;
+
+          bool result = asBool(evaluate(op, asNumber(m_Top[-2]), asNumber(m_Top[-1])));
+          guard(comparison(op, peek(1), peek(0)), result);
+          m_Top -= 2;
+          return jump(result == jumpIf ? target : next);
+        }
+
+        Step registerBinary(const Op& op, bool constantRight, const byte_t* ip, const byte_t* next) {
+          size_t destination = ip[0];
+          size_t left = ip[1];
+          const value_t* constants = m_Chunk.constants();
+          if (destination >= height() || left >= height() || (!constantRight && ip[2] >= height()))
+            return Step::ABORT;
+
+          const value_t& right = constantRight ? constants[ip[2]] : m_Slots[ip[2]];
+          if (!areNumbers(m_Slots[left], right))
+            return Step::ABORT;
+
+          value_t value = evaluate(op, asNumber(m_Slots[left]), asNumber(right));
+          ref_t rightRef = constantRight ? constant(right) : readSlot(ip[2]);
+          writeSlot(destination, arithmetic(op, readSlot(left), rightRef), value);
+          return jump(next);
+        }
+
+        Step registerJump(const Op& op, bool jumpIf, bool constantRight, const byte_t* ip,
+                          const byte_t* target, const byte_t* next) {
+          size_t left = ip[0];
+          if (left >= height() || (!constantRight && ip[1] >= height()))
+            return Step::ABORT;
+
+          const value_t& right = constantRight ? m_Chunk.constants()[ip[1]] : m_Slots[ip[1]];
+          if (!areNumbers(m_Slots[left], right))
+            return Step::ABORT;
+
+          bool result = asBool(evaluate(op, asNumber(m_Slots[left]), asNumber(right)));
+          ref_t rightRef = constantRight ? constant(right) : readSlot(ip[1]);
+          guard(comparison(op, readSlot(left), rightRef), result);
+          return jump(result == jumpIf ? target : next);
+        }
+
+        size_t height(void) const {
+          return static_cast<size_t>(m_Top - m_Slots);
+        }
+
+        // Whether `count` values the iteration pushed are on the stack.
+        bool has(size_t count) const {
+          return height() >= m_Base + count;
+        }
+
+        void push(ref_t ref, const value_t& value) {
+          m_Stack[height()] = ref;
+          *m_Top++ = value;
+        }
+
+        ref_t peek(size_t distance) const {
+          return m_Stack[height() - 1 - distance];
+        }
+
+        // Replaces the top `count` values with one.
+        void replace(size_t count, ref_t ref, const value_t& value) {
+          m_Top -= count;
+          push(ref, value);
+        }
+
+        Variable& variable(uint32_t location) {
+          auto it = m_Locations.find(location);
+          if (it != m_Locations.end())
+            return m_Variables[it->second];
+
+          m_Locations.emplace(location, m_Variables.size());
+          m_Variables.push_back({ location, NONE, NONE, false });
+          return m_Variables.back();
+        }
+
+        ref_t read(uint32_t location, const value_t& value) {
+          Variable& variable = this->variable(location);
+          if (variable.m_Current == NONE) {
+            Op op = location & GLOBAL ? Op::LOAD_GLOBAL : Op::LOAD_SLOT;
+            variable.m_Entry = emit(op, typeOf(value), NONE, NONE, location & ~GLOBAL);
+            variable.m_Current = variable.m_Entry;
+          }
+
+          return variable.m_Current;
+        }
+
+        void write(uint32_t location, ref_t ref) {
+          Variable& variable = this->variable(location);
+          variable.m_Current = ref;
+          variable.m_Written = true;
+        }
+
+        // The loop's locals are variables; the slots above them are the
+        // stack of the iteration.
+        ref_t readSlot(size_t slot) {
+          return slot < m_Base ? read(static_cast<uint32_t>(slot), m_Slots[slot]) : m_Stack[slot];
+        }
+
+        void writeSlot(size_t slot, ref_t ref, const value_t& value) {
+          m_Slots[slot] = value;
+          if (slot < m_Base)
+            write(static_cast<uint32_t>(slot), ref);
+          else
+            m_Stack[slot] = ref;
+        }
+
+        ref_t emit(const Op& op, const Type& type, ref_t a = NONE, ref_t b = NONE, uint32_t aux = 0) {
+          m_IR.push_back({ op, type, NONE, a, b, aux });
+          return static_cast<ref_t>(m_IR.size() - 1);
+        }
+
+        ref_t constant(const value_t& value) {
+          m_Constants.push_back(value);
+          return emit(Op::CONSTANT, typeOf(value), NONE, NONE, static_cast<uint32_t>(m_Constants.size() - 1));
+        }
+
+        bool isConstant(ref_t ref) const {
+          return m_IR[ref].m_Op == Op::CONSTANT;
+        }
+
+        const value_t& constantOf(ref_t ref) const {
+          return m_Constants[m_IR[ref].m_Aux];
+        }
+
+        const Type& type(ref_t ref) const {
+          return m_IR[ref].m_Type;
+        }
+
+        ref_t arithmetic(const Op& op, ref_t left, ref_t right) {
+          if (isConstant(left) && isConstant(right))
+            return constant(evaluate(op, asNumber(constantOf(left)), asNumber(constantOf(right))));
+
+          return emit(op, Type::NUMBER, left, right);
+        }
+
+        ref_t comparison(const Op& op, ref_t left, ref_t right) {
+          if (isConstant(left) && isConstant(right))
+            return constant(evaluate(op, asNumber(constantOf(left)), asNumber(constantOf(right))));
+
+          return emit(op, Type::BOOL, left, right);
+        }
+
+        // Values of different types are never equal, and nil always equals
+        // nil; only numbers, with NaN, can differ from themselves.
+        ref_t equality(bool negated, ref_t left, ref_t right) {
+          if (isConstant(left) && isConstant(right))
+            return constant(isSameValue(constantOf(left), constantOf(right)) != negated);
+
+          if (type(left) != type(right))
+            return constant(negated);
+
+          if (type(left) == Type::NIL || (left == right && type(left) != Type::NUMBER))
+            return constant(!negated);
+
+          return emit(negated ? Op::NOT_EQUAL : Op::EQUAL, Type::BOOL, left, right);
+        }
+
+        ref_t negate(ref_t operand) {
+          if (isConstant(operand))
+            return constant(-asNumber(constantOf(operand)));
+
+          return emit(Op::NEGATE, Type::NUMBER, operand);
+        }
+
+        ref_t logicalNot(ref_t operand) {
+          if (isConstant(operand))
+            return constant(isFalsey(constantOf(operand)));
+
+          switch (type(operand)) {
+          case Type::NIL:
+            return constant(true);
+          case Type::BOOL:
+            return emit(Op::NOT, Type::BOOL, operand);
+          default:
+            return constant(false);
+          }
+        }
+
+        // Guards that `condition` keeps its truthiness. Only a bool that is
+        // not constant can change it, and a guard on the same value earlier
+        // in the iteration has already decided.
+        void guard(ref_t condition, bool truthy) {
+          if (isConstant(condition) || type(condition) != Type::BOOL || !m_Guarded.insert(condition).second)
+            return;
+
+          emit(truthy ? Op::GUARD_TRUE : Op::GUARD_FALSE, Type::ANY, condition, NONE, snapshot());
+        }
+
+        void guardShape(ref_t object, const shape_ptr_t& shape) {
+          size_t index = 0;
+          while (index < m_Shapes.size() && m_Shapes[index] != shape)
+            ++index;
+          if (index == m_Shapes.size())
+            m_Shapes.push_back(shape);
+
+          if (!m_ShapeGuarded.insert((static_cast<uint64_t>(object) << 32) | index).second)
+            return;
+
+          emit(Op::GUARD_SHAPE, Type::ANY, object, static_cast<ref_t>(index), snapshot());
+        }
+
+        // The state before the instruction being recorded: the variables
+        // written so far and the stack of the iteration. Variables written
+        // later are added once the iteration is complete.
+        uint32_t snapshot(void) {
+          Snapshot snapshot = {
+            static_cast<uint32_t>(m_IP - m_Chunk.code()),
+            static_cast<uint32_t>(height()),
+            static_cast<uint32_t>(m_Recorded),
+            static_cast<uint32_t>(m_Entries.size()),
+            0,
+          };
+
+          for (const Variable& variable : m_Variables) {
+            if (variable.m_Written)
+              m_Entries.push_back({ variable.m_Location, variable.m_Current });
+          }
+
+          for (size_t slot = m_Base; slot < height(); ++slot)
+            m_Entries.push_back({ static_cast<uint32_t>(slot), m_Stack[slot] });
+
+          snapshot.m_Count = static_cast<uint32_t>(m_Entries.size()) - snapshot.m_First;
+          m_Snapshots.push_back(snapshot);
+          return static_cast<uint32_t>(m_Snapshots.size() - 1);
+        }
+
+        // Optimizes the recorded iteration into a trace: the loop-carried
+        // variables become phis, everything that does not vary with them
+        // moves into the preamble along with the loads, and what nothing
+        // needs is dropped.
+        Trace* compile(void) {
+          if (height() != m_Base)
+            return nullptr;
+
+          // A variable written before it is read still needs a register that
+          // carries it round the loop, for the exits that write it out. A
+          // variable that is read must come round with the type its load
+          // guards, or the next iteration would be run on the wrong type.
+          for (Variable& variable : m_Variables) {
+            if (!variable.m_Written)
+              continue;
+
+            if (variable.m_Entry == NONE) {
+              Op op = variable.m_Location & GLOBAL ? Op::LOAD_GLOBAL : Op::LOAD_SLOT;
+              variable.m_Entry = emit(op, Type::ANY, NONE, NONE, variable.m_Location & ~GLOBAL);
+            } else if (type(variable.m_Current) != type(variable.m_Entry)) {
+              return nullptr;
+            }
+          }
+
+          size_t count = m_IR.size();
+
+          // Loop-invariant code motion. What depends only on constants, on
+          // variables the loop does not write and on fields it does not
+          // store to gives the same result every iteration. Guards among it
+          // fail on entry if at all, so they leave through snapshot 0.
+          std::vector<bool> variant(count, false);
+          for (const Variable& variable : m_Variables) {
+            if (variable.m_Written)
+              variant[variable.m_Entry] = true;
+          }
+
+          std::unordered_set<uint32_t> storedFields;
+          for (const Instruction& instruction : m_IR) {
+            if (instruction.m_Op == Op::STORE_FIELD)
+              storedFields.insert(instruction.m_Aux);
+          }
+
+          for (size_t i = 0; i < count; ++i) {
+            Instruction& instruction = m_IR[i];
+            switch (instruction.m_Op) {
+            case Op::CONSTANT:
+            case Op::LOAD_SLOT:
+            case Op::LOAD_GLOBAL:
+              break;
+            case Op::STORE_FIELD:
+            case Op::PRINT:
+              variant[i] = true;
+              break;
+            case Op::LOAD_FIELD:
+              variant[i] = variant[instruction.m_A] || storedFields.count(instruction.m_B) != 0;
+              break;
+            default:
+              variant[i] = variant[instruction.m_A] || (readsB(instruction.m_Op) && variant[instruction.m_B]);
+              break;
+            }
+
+            if (hasSnapshot(instruction.m_Op) && !variant[i])
+              instruction.m_Aux = 0;
+          }
+
+          // Every exit writes out each variable the loop writes. Before its
+          // store in the iteration that is the value the last one left.
+          std::vector<SnapshotEntry> entries;
+          for (size_t s = 1; s < m_Snapshots.size(); ++s) {
+            Snapshot& snapshot = m_Snapshots[s];
+            uint32_t first = static_cast<uint32_t>(entries.size());
+            std::unordered_set<uint32_t> written;
+            for (uint32_t i = 0; i < snapshot.m_Count; ++i) {
+              const SnapshotEntry& entry = m_Entries[snapshot.m_First + i];
+              entries.push_back(entry);
+              written.insert(entry.m_Location);
+            }
+
+            for (const Variable& variable : m_Variables) {
+              if (variable.m_Written && !written.count(variable.m_Location))
+                entries.push_back({ variable.m_Location, variable.m_Entry });
+            }
+
+            snapshot.m_First = first;
+            snapshot.m_Count = static_cast<uint32_t>(entries.size()) - first;
+          }
+
+          // Dead code elimination, from the guards, stores, prints and phis
+          // back through what they read. A load or field no one reads needs
+          // no guard on its type either.
+          std::vector<bool> live(count, false);
+          std::vector<std::pair<ref_t, ref_t>> phis;
+          for (const Variable& variable : m_Variables) {
+            if (variable.m_Written) {
+              live[variable.m_Entry] = live[variable.m_Current] = true;
+              if (variable.m_Current != variable.m_Entry)
+                phis.emplace_back(variable.m_Entry, variable.m_Current);
+            }
+          }
+
+          for (size_t i = count; i-- > 0;) {
+            const Instruction& instruction = m_IR[i];
+            if (instruction.m_Op == Op::PRINT || instruction.m_Op == Op::STORE_FIELD ||
+                (hasSnapshot(instruction.m_Op) && instruction.m_Op != Op::LOAD_FIELD))
+              live[i] = true;
+
+            if (!live[i])
+              continue;
+
+            if (readsA(instruction.m_Op))
+              live[instruction.m_A] = true;
+            if (readsB(instruction.m_Op))
+              live[instruction.m_B] = true;
+            if (hasSnapshot(instruction.m_Op)) {
+              const Snapshot& snapshot = m_Snapshots[instruction.m_Aux];
+              for (uint32_t e = 0; e < snapshot.m_Count; ++e)
+                live[entries[snapshot.m_First + e].m_Register] = true;
+            }
+          }
+
+          // Constants take the first registers, then the preamble, which
+          // starts with the loads, and then the body; every instruction
+          // writes a register of its own.
+          std::vector<ref_t> registers(count, NONE);
+          value_vec_t constants;
+          for (size_t i = 0; i < count; ++i) {
+            if (live[i] && m_IR[i].m_Op == Op::CONSTANT) {
+              registers[i] = static_cast<ref_t>(constants.size());
+              constants.push_back(m_Constants[m_IR[i].m_Aux]);
+            }
+          }
+
+          std::vector<size_t> order;
+          for (size_t i = 0; i < count; ++i) {
+            if (live[i] && (m_IR[i].m_Op == Op::LOAD_SLOT || m_IR[i].m_Op == Op::LOAD_GLOBAL))
+              order.push_back(i);
+          }
+
+          for (size_t i = 0; i < count; ++i) {
+            if (live[i] && !variant[i] && readsA(m_IR[i].m_Op))
+              order.push_back(i);
+          }
+
+          size_t body = order.size();
+          for (size_t i = 0; i < count; ++i) {
+            if (live[i] && variant[i] && readsA(m_IR[i].m_Op))
+              order.push_back(i);
+          }
+
+          for (size_t i = 0; i < order.size(); ++i)
+            registers[order[i]] = static_cast<ref_t>(constants.size() + i);
+
+          // Only the snapshots of guards left in the body are kept.
+          std::vector<uint32_t> renumbered(m_Snapshots.size(), 0);
+          std::vector<Snapshot> snapshots = { m_Snapshots[0] };
+          std::vector<SnapshotEntry> kept;
+          std::vector<Instruction> code;
+          for (size_t i : order) {
+            Instruction instruction = m_IR[i];
+            instruction.m_Destination = registers[i];
+            if (readsA(instruction.m_Op))
+              instruction.m_A = registers[instruction.m_A];
+            if (readsB(instruction.m_Op))
+              instruction.m_B = registers[instruction.m_B];
+
+            if (hasSnapshot(instruction.m_Op) && instruction.m_Aux != 0) {
+              uint32_t& index = renumbered[instruction.m_Aux];
+              if (index == 0) {
+                Snapshot snapshot = m_Snapshots[instruction.m_Aux];
+                uint32_t first = static_cast<uint32_t>(kept.size());
+                for (uint32_t e = 0; e < snapshot.m_Count; ++e) {
+                  SnapshotEntry entry = entries[snapshot.m_First + e];
+                  entry.m_Register = registers[entry.m_Register];
+                  kept.push_back(entry);
+                }
+
+                snapshot.m_First = first;
+                index = static_cast<uint32_t>(snapshots.size());
+                snapshots.push_back(snapshot);
+              }
+
+              instruction.m_Aux = index;
+            }
+
+            code.push_back(instruction);
+          }
+
+          std::vector<Phi> carried;
+          for (const auto& [entry, current] : phis)
+            carried.push_back({ registers[entry], registers[current] });
+
+          return new Trace(m_Chunk, std::move(code), body, constants, constants.size() + order.size(),
+                           std::move(carried), std::move(snapshots), std::move(kept), std::move(m_Shapes),
+                           m_Recorded);
+        }
+      private:
+        const Chunk& m_Chunk;
+        const byte_t* m_Header;
+        // The instruction to record next.
+        const byte_t* m_IP;
+        value_t* m_Slots;
+        value_t*& m_Top;
+        // Frame slots in use at the header: the loop's locals.
+        size_t m_Base;
+        GlobalTable& m_Globals;
+        FILE* m_Out;
+
+        std::vector<Instruction> m_IR;
+        value_vec_t m_Constants;
+        std::vector<shape_ptr_t> m_Shapes;
+        std::vector<Snapshot> m_Snapshots;
+        std::vector<SnapshotEntry> m_Entries;
+
+        std::vector<Variable> m_Variables;
+        std::unordered_map<uint32_t, size_t> m_Locations;
+        // What each slot above the loop's locals holds, by slot.
+        std::vector<ref_t> m_Stack;
+        std::unordered_set<ref_t> m_Guarded;
+        std::unordered_set<uint64_t> m_ShapeGuarded;
+        size_t m_Recorded;
+      };
+    }
+
+    Trace::Trace(const vm::Chunk& chunk, std::vector<Instruction> code, size_t body, const value_vec_t& constants,
+                 size_t registers, std::vector<Phi> phis, std::vector<Snapshot> snapshots,
+                 std::vector<SnapshotEntry> entries, std::vector<shape_ptr_t> shapes, size_t length) :
+      m_Chunk(chunk),
+      m_Code(std::move(code)),
+      m_Body(body),
+      m_Registers(registers),
+      m_Constants(constants.size()),
+      m_Phis(std::move(phis)),
+      m_Carried(m_Phis.size()),
+      m_Snapshots(std::move(snapshots)),
+      m_Entries(std::move(entries)),
+      m_Shapes(std::move(shapes)),
+      m_Length(length)
+    {
+      std::copy(constants.begin(), constants.end(), m_Registers.begin());
+    }
+
+    Run Trace::run(value_t* slots, value_t*& top, vm::Global* globals, FILE* out) {
+      uint64_t iterations = 0;
+      const Snapshot& snapshot = m_Snapshots[execute(slots, globals, out, iterations)];
+      for (uint32_t i = 0; i < snapshot.m_Count; ++i) {
+        const SnapshotEntry& entry = m_Entries[snapshot.m_First + i];
+        if (entry.m_Location & GLOBAL)
+          globals[entry.m_Location & ~GLOBAL].m_Value = m_Registers[entry.m_Register];
+        else
+          slots[entry.m_Location] = m_Registers[entry.m_Register];
+      }
+
+      top = slots + snapshot.m_Height;
+      return { snapshot.m_Resume, iterations, iterations * m_Length + snapshot.m_Instructions };
+    }
+
+    uint32_t Trace::execute(value_t* slots, vm::Global* globals, FILE* out, uint64_t& iterations) {
+      value_t* registers = m_Registers.data();
+      const Instruction* body = m_Code.data() + m_Body;
+      const Instruction* end = m_Code.data() + m_Code.size();
+      const Instruction* instruction = m_Code.data();
+      while (true) {
+        while (instruction != end) {
+          const Instruction& in = *instruction++;
+          value_t& destination = registers[in.m_Destination];
+          switch (in.m_Op) {
+          case Op::CONSTANT:
+            break;
+          case Op::LOAD_SLOT:
+            destination = slots[in.m_Aux];
+            if (!hasType(destination, in.m_Type))
+              return 0;
+            break;
+          case Op::LOAD_GLOBAL:
+            destination = globals[in.m_Aux].m_Value;
+            if (!hasType(destination, in.m_Type))
+              return 0;
+            break;
+          case Op::ADD:
+            destination = asNumber(registers[in.m_A]) + asNumber(registers[in.m_B]);
+            break;
+          case Op::SUBTRACT:
+            destination = asNumber(registers[in.m_A]) - asNumber(registers[in.m_B]);
+            break;
+          case Op::MULTIPLY:
+            destination = asNumber(registers[in.m_A]) * asNumber(registers[in.m_B]);
+            break;
+          case Op::DIVIDE:
+            destination = asNumber(registers[in.m_A]) / asNumber(registers[in.m_B]);
+            break;
+          case Op::NEGATE:
+            destination = -asNumber(registers[in.m_A]);
+            break;
+          case Op::LESS:
+            destination = asNumber(registers[in.m_A]) < asNumber(registers[in.m_B]);
+            break;
+          case Op::GREATER:
+            destination = asNumber(registers[in.m_A]) > asNumber(registers[in.m_B]);
+            break;
+          case Op::GREATER_EQUAL:
+            destination = !(asNumber(registers[in.m_A]) < asNumber(registers[in.m_B]));
+            break;
+          case Op::LESS_EQUAL:
+            destination = !(asNumber(registers[in.m_A]) > asNumber(registers[in.m_B]));
+            break;
+          case Op::EQUAL:
+            destination = isSameValue(registers[in.m_A], registers[in.m_B]);
+            break;
+          case Op::NOT_EQUAL:
+            destination = !isSameValue(registers[in.m_A], registers[in.m_B]);
+            break;
+          case Op::NOT:
+            destination = !asBool(registers[in.m_A]);
+            break;
+          case Op::GUARD_TRUE:
+            if (!asBool(registers[in.m_A]))
+              return in.m_Aux;
+            break;
+          case Op::GUARD_FALSE:
+            if (asBool(registers[in.m_A]))
+              return in.m_Aux;
+            break;
+          case Op::GUARD_SHAPE: {
+            const value_t& object = registers[in.m_A];
+            if (!isObjType<Instance>(object) || asObjType<Instance>(object)->m_Shape != m_Shapes[in.m_B])
+              return in.m_Aux;
+            break;
+          }
+          case Op::LOAD_FIELD:
+            destination = asObjType<Instance>(registers[in.m_A])->m_Fields[in.m_B];
+            if (!hasType(destination, in.m_Type))
+              return in.m_Aux;
+            break;
+          case Op::STORE_FIELD:
+            asObjType<Instance>(registers[in.m_A])->m_Fields[in.m_Aux] = registers[in.m_B];
+            break;
+          case Op::PRINT:
+            m_Chunk.printValue(out, registers[in.m_A]);
+            fprintf(out, "\n");
+            break;
+          }
+        }
+
+        // The back-edge. A phi may read what another one writes, so all of
+        // them read before any writes.
+        for (size_t i = 0; i < m_Phis.size(); ++i)
+          m_Carried[i] = registers[m_Phis[i].m_Source];
+        for (size_t i = 0; i < m_Phis.size(); ++i)
+          registers[m_Phis[i].m_Destination] = m_Carried[i];
+
+        ++iterations;
+        instruction = body;
+      }
+    }
+
+    void Trace::blacken(gc::Collector& gc) const {
+      for (size_t i = 0; i < m_Constants; ++i)
+        gc.markValue(m_Registers[i]);
+
+      for (const shape_ptr_t& shape : m_Shapes)
+        gc.markObject(shape);
+    }
+
+    Resume Loops::enter(obj::Function& function, const byte_t* header, value_t* slots, value_t*& top,
+                        vm::GlobalTable& globals, FILE* out, vm::RunStats& stats) {
+      const byte_t* code = function.m_Chunk.code();
+      Loop& loop = find(static_cast<size_t>(header - code));
+      Resume resume = { header, 0 };
+      if (!loop.m_Trace) {
+        if (loop.m_Attempts == MAX_ATTEMPTS || ++loop.m_Count < HOT_LOOP)
+          return resume;
+
+        loop.m_Count = 0;
+        Recorder recorder(function, header, slots, top, globals, out);
+        Trace* trace = recorder.record();
+        resume.m_IP = recorder.ip();
+        resume.m_Recorded = recorder.recorded();
+        if (!trace) {
+          ++loop.m_Attempts;
+          ++stats.m_TraceAborts;
+          return resume;
+        }
+
+        loop.m_Trace.reset(trace);
+        ++stats.m_Traces;
+      }
+
+      Run run = loop.m_Trace->run(slots, top, globals.data(), out);
+      ++stats.m_TraceRuns;
+      stats.m_TracedIterations += run.m_Iterations;
+      stats.m_TracedInstructions += run.m_Instructions;
+      resume.m_IP = code + run.m_Resume;
+
+      // A trace left before it gets round once follows a path the loop no
+      // longer takes; the next recording will follow the one it does.
+      if (run.m_Iterations == 0 && ++loop.m_Misses == MAX_MISSES) {
+        loop.m_Trace.reset();
+        loop.m_Misses = 0;
+        ++loop.m_Attempts;
+      }
+
+      return resume;
+    }
+
+    void Loops::blacken(gc::Collector& gc) const {
+      for (const Loop& loop : m_Loops) {
+        if (loop.m_Trace)
+          loop.m_Trace->blacken(gc);
+      }
+    }
+
+    Loop& Loops::find(size_t header) {
+      for (Loop& loop : m_Loops) {
+        if (loop.m_Header == header)
+          return loop;
+      }
+
+      m_Loops.push_back({ header, 0, 0, nullptr, 0 });
+      return m_Loops.back();
+    }
+  }
+}
@@ -2,344 +2,1590 @@
 #include "chunk.hpp"
 #include "compiler.hpp"
 #include "object.hpp"
+#include "natives.hpp"
+#include "image.hpp"
+#include "optimizer.hpp"
+#include "jit.hpp"
+#include "trace.hpp"
+#include <cstdarg>
+
+// Direct-threaded dispatch needs the labels-as-values extension; every other
+// compiler gets the portable switch.
+#if defined(CLOX_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define CLOX_THREADED_DISPATCH 1
+#else
+#define CLOX_THREADED_DISPATCH 0
+#endif
 
 namespace clox {
   using namespace compiler;
   using namespace obj;
 
   namespace vm {
-    VM::VM(void)
+    namespace {
+      // The type errors of arithmetic and comparisons.
+      constexpr const char* NUMBER_OPERAND = "Operand must be a number.";
+      constexpr const char* NUMBER_OPERANDS = "Operands must be numbers.";
+      constexpr const char* ADD_OPERANDS = "Operands must be two numbers or two strings.";
+    }
+
+    VM::VM(void) :
+      VM(stdout)
     { }
 
+    VM::VM(FILE* out) :
+      VM(out, stderr)
+    { }
+
+    VM::VM(FILE* out, FILE* err) :
+      m_Collector(*this),
+      m_Frames(new CallFrame[FRAMES_MAX]),
+      m_FrameCount(0),
+      m_Stack(new value_t[STACK_MAX]),
+      m_StackTop(m_Stack.get()),
+      m_Globals(),
+      m_OpenUpvalues(nullptr),
+      m_InitString(nullptr),
+      m_CacheStats(),
+      m_RunStats(),
+#ifdef CLOX_PROFILE
+      m_Profiler(),
+#endif
+      m_CountInstructions(false),
+      m_OptimizationLevel(MAX_OPTIMIZATION_LEVEL),
+      m_Mode(ExecutionMode::STACK),
+      m_Jit(false),
+      m_Tracing(false),
+      m_Out(out),
+      m_Err(err)
+    {
+      m_InitString = Object::formStringObject(m_Collector, "init");
+      natives::defineAll(*this);
+    }
+
     InterpretResult VM::interpret(void) {
       return run();
     }
 
     InterpretResult VM::interpret(const string_t& source) {
-      Compiler compiler;
+      Compiler compiler(m_Collector, m_Globals, m_OptimizationLevel, m_Mode, m_Err);
       function_ptr_t function = compiler.compile(source);
       if (!function)
         return InterpretResult::COMPILE_ERROR;
 
-      m_Stack.push_back(function);
-      closure_ptr_t closure = Object::formClosureObject(function);
-      m_Stack.pop_back();
-      m_Stack.push_back(closure);
-      call(closure, 0);
+      return runScript(function);
+    }
+
+    InterpretResult VM::interpretFile(const string_t& path, const string_t& imagePath) {
+      // An image stamped with the size and modification time of the file is
+      // run without reading the source at all.
+      image::Source source = { 0, 0, 0 };
+      bool described = image::describeSource(path, source);
+      function_ptr_t function = described ?
+        image::load(imagePath, m_Collector, m_Globals, source, false, m_OptimizationLevel, m_Mode) : nullptr;
+      if (function)
+        return runScript(function);
+
+      string_t text;
+      if (!image::readSource(path, text)) {
+        fprintf(m_Err, "Could not open file \"%s\".\n", path.c_str());
+        return InterpretResult::COMPILE_ERROR;
+      }
+
+      // A touched but unchanged file still matches on its hash, and the image
+      // is saved again with the new stamp.
+      source.m_Hash = image::hashSource(text);
+      function = image::load(imagePath, m_Collector, m_Globals, source, true, m_OptimizationLevel, m_Mode);
+      if (!function) {
+        Compiler compiler(m_Collector, m_Globals, m_OptimizationLevel, m_Mode, m_Err);
+        function = compiler.compile(text);
+        if (!function)
+          return InterpretResult::COMPILE_ERROR;
+      }
+
+      // A cache that cannot be written only costs the next run a compile.
+      if (described)
+        image::save(imagePath, *function, m_Globals, source, m_OptimizationLevel, m_Mode);
+
+      return runScript(function);
+    }
 
+    InterpretResult VM::runScript(const function_ptr_t& function) {
+      push(function);
+      closure_ptr_t closure = Object::formClosureObject(m_Collector, function);
+      pop();
+      push(closure);
+      if (!call(closure, 0))
+        return InterpretResult::RUNTIME_ERROR;
+
+#ifdef CLOX_DEBUG_PRINT_CODE
       function->m_Chunk.disassemble("debug chunk");
       printf("\n\n");
+#endif
 
       return run();
     }
 
-    const OpCode& VM::readByte(void) {
-      CallFrame& frame = m_Frames.back();
-      return frame.m_Closure->m_Function->m_Chunk.readByte(frame.m_IP++);
+    void VM::defineNative(std::string_view name, int_t arity, native_fn_t function) {
+      // Both objects stay on the stack until the global holds them.
+      string_ptr_t string = Object::formStringObject(m_Collector, name);
+      push(string);
+      native_ptr_t native = Object::formNativeObject(m_Collector, function, arity);
+      push(native);
+
+      Global& global = m_Globals[m_Globals.resolve(string)];
+      global.m_Value = native;
+      global.m_Defined = true;
+
+      pop();
+      pop();
     }
 
-    const size_t VM::readOffset(void) {
-      CallFrame& frame = m_Frames.back();
-      return frame.m_Closure->m_Function->m_Chunk.readOffset(frame.m_IP++);
+    void VM::markRoots(gc::Collector& gc) const {
+      for (const value_t* slot = m_Stack.get(); slot < m_StackTop; ++slot)
+        gc.markValue(*slot);
+
+      for (size_t i = 0; i < m_FrameCount; ++i)
+        gc.markObject(m_Frames[i].m_Closure);
+
+      m_Globals.markRoots(gc);
+
+      for (upvalue_ptr_t upvalue = m_OpenUpvalues; upvalue; upvalue = upvalue->m_NextOpen)
+        gc.markObject(upvalue);
+
+      gc.markObject(m_InitString);
+#ifdef CLOX_PROFILE
+      m_Profiler.markRoots(gc);
+#endif
     }
 
-    const value_t& VM::readConstant(void) {
-      return m_Frames.back().m_Closure->m_Function->m_Chunk.readConstant(readOffset());
+    const gc::Stats& VM::gcStats(void) const {
+      return m_Collector.stats();
     }
 
-    const string_t& VM::readString(void) {
-      const value_t& name = readConstant();
-      const string_ptr_t& pString = dynamic_cast<string_ptr_t>(std::get<obj_ptr_t>(name));
-      return pString->m_Str;
+    const CacheStats& VM::cacheStats(void) const {
+      return m_CacheStats;
     }
 
-    void VM::binaryAdd(void) {
-      value_t r = peek(0);
-      value_t l = peek(1);
+    const RunStats& VM::runStats(void) const {
+      return m_RunStats;
+    }
 
-      m_Stack.pop_back();
-      m_Stack.pop_back();
+#ifdef CLOX_PROFILE
+    const Profiler& VM::profiler(void) const {
+      return m_Profiler;
+    }
+#endif
 
-      if (std::holds_alternative<dbl_t>(r) || std::holds_alternative<dbl_t>(l)) {
-        dbl_t right = std::get<dbl_t>(r);
-        dbl_t left = std::get<dbl_t>(l);
-        m_Stack.push_back(left + right);
-        return;
-      } else if (std::holds_alternative<obj_ptr_t>(r) || std::holds_alternative<obj_ptr_t>(l)) {
-        auto pL = dynamic_cast<string_ptr_t>(std::get<obj_ptr_t>(l));
-        auto pR = dynamic_cast<string_ptr_t>(std::get<obj_ptr_t>(r));
-        if (pL && pR)
-          m_Stack.push_back(Object::formStringObject(pL->m_Str + pR->m_Str));
+    bool VM::binaryAdd(void) {
+      value_t r = peek(0);
+      value_t l = peek(1);
 
-        return;
+      if (isNumber(r) && isNumber(l)) {
+        dbl_t right = asNumber(r);
+        dbl_t left = asNumber(l);
+        pop();
+        pop();
+        push(left + right);
+        return true;
       }
 
-      fprintf(stderr, "Operands for '+' must be either numbers or strings.");
-      throw;
+      if (!isObjType<String>(l) || !isObjType<String>(r))
+        return false;
+
+      string_ptr_t pL = asObjType<String>(l);
+      string_ptr_t pR = asObjType<String>(r);
+      // The operands stay on the stack so a collection triggered by the
+      // allocation cannot free them.
+      string_ptr_t result = Object::formStringObject(m_Collector, pL->m_Str + pR->m_Str);
+      pop();
+      pop();
+      push(result);
+      return true;
     }
 
-    void VM::binaryOp(char c) {
+    bool VM::binaryOp(char c) {
       const auto& r = peek(0);
       const auto& l = peek(1);
-      if (!std::holds_alternative<dbl_t>(r) || !std::holds_alternative<dbl_t>(l)) {
-        fprintf(stderr, "Operands must be numbers.");
-        throw;
-      }
+      if (!isNumber(r) || !isNumber(l))
+        return false;
 
-      dbl_t right = std::get<dbl_t>(r);
-      dbl_t left = std::get<dbl_t>(l);
-      m_Stack.pop_back();
-      m_Stack.pop_back();
+      dbl_t right = asNumber(r);
+      dbl_t left = asNumber(l);
+      pop();
+      pop();
 
       switch (c) {
       case '+':
-        binaryAdd();
+        push(left + right);
         break;
       case '-':
-        m_Stack.push_back(left - right);
+        push(left - right);
         break;
       case '*':
-        m_Stack.push_back(left * right);
+        push(left * right);
         break;
       case '/':
-        m_Stack.push_back(left / right);
+        push(left / right);
         break;
       case '>':
-        m_Stack.push_back(left > right);
+        push(left > right);
         break;
       case '<':
-        m_Stack.push_back(left < right);
+        push(left < right);
         break;
       default:
         throw("Unknown binary operator");
         break;
       }
+
+      return true;
+    }
+
+    // Pops both operands of a comparison into `result`.
+    template<char C>
+    bool VM::compare(bool& result) {
+      const value_t& r = peek(0);
+      const value_t& l = peek(1);
+      if (!isNumber(l) || !isNumber(r))
+        return false;
+
+      result = C == '<' ? asNumber(l) < asNumber(r) : asNumber(l) > asNumber(r);
+      m_StackTop -= 2;
+      return true;
+    }
+
+    // `destination = left C right` for the register instructions, on the
+    // stack only if an operand is not a number.
+    template<char C>
+    bool VM::arithmetic(value_t& destination, const value_t& left, const value_t& right) {
+      if (areNumbers(left, right)) {
+        dbl_t l = asNumber(left);
+        dbl_t r = asNumber(right);
+        destination = C == '+' ? l + r : C == '-' ? l - r : C == '*' ? l * r : l / r;
+        return true;
+      }
+
+      // Only strings are left to add.
+      if (C != '+')
+        return false;
+
+      push(left);
+      push(right);
+      if (!binaryAdd()) {
+        m_StackTop -= 2;
+        return false;
+      }
+
+      destination = pop();
+      return true;
+    }
+
+    template<char C>
+    bool VM::compare(const value_t& left, const value_t& right, bool& result) {
+      if (!areNumbers(left, right))
+        return false;
+
+      result = C == '<' ? asNumber(left) < asNumber(right) : asNumber(left) > asNumber(right);
+      return true;
+    }
+
+    void VM::push(const value_t& value) {
+      *m_StackTop++ = value;
+    }
+
+    value_t VM::pop(void) {
+      return *--m_StackTop;
+    }
+
+    const value_t& VM::peek(size_t offset) const {
+      return m_StackTop[-1 - static_cast<ptrdiff_t>(offset)];
+    }
+
+    void VM::setCountInstructions(bool count) {
+      m_CountInstructions = count;
+    }
+
+    void VM::setOptimizationLevel(int_t level) {
+      m_OptimizationLevel = level;
+    }
+
+    void VM::setExecutionMode(const ExecutionMode& mode) {
+      m_Mode = mode;
+    }
+
+    void VM::setJit(bool jit) {
+      m_Jit = jit && jit::SUPPORTED;
+    }
+
+    void VM::setTracing(bool tracing) {
+      m_Tracing = tracing && trace::SUPPORTED;
     }
 
     InterpretResult VM::run(void) {
+      InterpretResult result = m_CountInstructions ? execute<true>() : execute<false>();
+#ifdef CLOX_PROFILE
+      m_Profiler.pause();
+#endif
+      return result;
+    }
+
+    template<bool CountInstructions>
+    InterpretResult VM::execute(void) {
+      // The hot state of the current frame is cached in locals and written
+      // back to the frame only around calls and returns.
+      CallFrame* frame = nullptr;
+      const byte_t* ip = nullptr;
+      const value_t* constants = nullptr;
+      PropertyCache* caches = nullptr;
+      const size_t* globals = nullptr;
+      function_ptr_t function = nullptr;
+      Chunk* chunk = nullptr;
+      value_t* slots = nullptr;
+      // High operand bits set by a WIDE / EXTRA_WIDE prefix.
+      size_t ext = 0;
+      uint64_t& instructions = m_RunStats.m_Instructions;
+
+      auto loadFrame = [&](void) {
+        frame = &m_Frames[m_FrameCount - 1];
+        function = frame->m_Closure->m_Function;
+        chunk = &function->m_Chunk;
+        constants = chunk->constants();
+        caches = chunk->caches();
+        globals = chunk->globals();
+        ip = frame->m_IP;
+        slots = frame->m_Slots;
+      };
+
+      auto saveFrame = [&](void) {
+        frame->m_IP = ip;
+      };
+
+      auto readShort = [&](void) {
+        ip += 2;
+        return static_cast<uint16_t>((ip[-2] << 8) | ip[-1]);
+      };
+
+      auto readOperand = [&](void) {
+        size_t operand = ext | *ip++;
+        ext = 0;
+        return operand;
+      };
+
+      auto readConstant = [&](void) -> const value_t& {
+        return constants[readOperand()];
+      };
+
+      // Quickening rewrites the operand-less instruction just dispatched.
+      // The code is only const to keep everything else from writing it.
+      auto rewrite = [&](const OpCode& code) {
+        *const_cast<byte_t*>(ip - 1) = static_cast<byte_t>(code);
+      };
+
+      // Run by a generic instruction before its own work: number operands
+      // turn it into `quick` for the next time round, unless a guard has
+      // already failed at this site.
+      auto quicken = [&](const OpCode& quick) {
+        if constexpr (CountInstructions)
+          ++m_RunStats.m_QuickenedMisses;
+
+        if (areNumbers(peek(1), peek(0)) && !chunk->isPinned(ip - 1 - chunk->code())) {
+          rewrite(quick);
+          ++m_RunStats.m_Quickenings;
+        }
+      };
+
+      // The guard of a quickened instruction. On failure the site goes back
+      // to `generic` for good, and the caller does its work the generic way.
+      auto guard = [&](const OpCode& generic) {
+        if (areNumbers(peek(1), peek(0))) {
+          if constexpr (CountInstructions)
+            ++m_RunStats.m_QuickenedHits;
+          return true;
+        }
+
+        rewrite(generic);
+        chunk->pin(ip - 1 - chunk->code());
+        ++m_RunStats.m_Deoptimizations;
+        if constexpr (CountInstructions)
+          ++m_RunStats.m_QuickenedMisses;
+        return false;
+      };
+
+      // Replaces the two number operands with `value`.
+      auto replaceOperands = [&](const value_t& value) {
+        m_StackTop[-2] = value;
+        --m_StackTop;
+      };
+
+      // Reports operands of the wrong type for the instruction being run.
+      auto operandError = [&](const char* message) {
+        saveFrame();
+        runtimeError(message);
+        return InterpretResult::RUNTIME_ERROR;
+      };
+
+      // Hands the frame to its native code, if it has been compiled, and
+      // each caller it returns to that has native code as well. False on a
+      // runtime error. Counted runs stay in the interpreter to count every
+      // instruction.
+      auto runNative = [&](void) {
+        if constexpr (!CountInstructions) {
+          while (m_Jit && function->m_Native) {
+            saveFrame();
+            jit::Exit exit = enterNative(*frame);
+            if (exit == jit::Exit::RUNTIME_ERROR)
+              return false;
+
+            loadFrame();
+            if (exit == jit::Exit::INTERPRET)
+              break;
+          }
+        }
+
+        return true;
+      };
+
+      loadFrame();
+      if (!runNative())
+        return InterpretResult::RUNTIME_ERROR;
+
+#ifdef CLOX_PROFILE
+#define VM_PROFILE() m_Profiler.tick(frame->m_ProfileNode, ip)
+#else
+#define VM_PROFILE() ((void)0)
+#endif
+
+#if CLOX_THREADED_DISPATCH
+      static void* dispatchTable[] = {
+#define CLOX_OPCODE_LABEL(name) &&op_##name,
+        CLOX_OPCODES(CLOX_OPCODE_LABEL)
+#undef CLOX_OPCODE_LABEL
+      };
+
+#define VM_DISPATCH()                   \
+      do {                                \
+        if constexpr (CountInstructions)  \
+          ++instructions;                 \
+        VM_PROFILE();                     \
+        goto *dispatchTable[*ip++];       \
+      } while (false)
+#define VM_CASE(name) op_##name:
+#define VM_NEXT() VM_DISPATCH()
+
+      VM_DISPATCH();
+#else
+#define VM_CASE(name) case OpCode::name:
+#define VM_NEXT() break
+
       while (true) {
-        OpCode instruction;
-        switch (instruction = readByte()) {
-        case OpCode::CONSTANT: {
-          const value_t& value = readConstant();
-          m_Stack.push_back(value);
-          break;
+        if constexpr (CountInstructions)
+          ++instructions;
+        VM_PROFILE();
+
+        switch (static_cast<OpCode>(*ip++)) {
+#endif
+        VM_CASE(CONSTANT) {
+          push(readConstant());
+          VM_NEXT();
         }
-        case OpCode::NEGATE: {
-          dbl_t value = -std::get<dbl_t>(peek(0));
-          m_Stack.pop_back();
-          m_Stack.push_back(value);
-          break;
+        VM_CASE(NEGATE) {
+          if (!isNumber(peek(0)))
+            return operandError(NUMBER_OPERAND);
+
+          m_StackTop[-1] = -asNumber(peek(0));
+          VM_NEXT();
         }
-        case OpCode::ADD:
-          binaryAdd();
-          break;
-        case OpCode::SUBTRACT:
-          binaryOp('-');
-          break;
-        case OpCode::MULTIPLY:
-          binaryOp('*');
-          break;
-        case OpCode::DIVIDE:
-          binaryOp('/');
-          break;
-        case OpCode::RETURN:
-        {
-          value_t result = m_Stack.back();
-          m_Stack.pop_back();
-
-          size_t top = m_Frames.back().m_Start;
-          m_Frames.pop_back();
-          if (m_Frames.empty()) {
-            m_Stack.pop_back();
+        VM_CASE(ADD) {
+          quicken(OpCode::ADD_NUM);
+          if (!binaryAdd())
+            return operandError(ADD_OPERANDS);
+
+          VM_NEXT();
+        }
+        VM_CASE(SUBTRACT) {
+          quicken(OpCode::SUBTRACT_NUM);
+          if (!binaryOp('-'))
+            return operandError(NUMBER_OPERANDS);
+
+          VM_NEXT();
+        }
+        VM_CASE(MULTIPLY) {
+          quicken(OpCode::MULTIPLY_NUM);
+          if (!binaryOp('*'))
+            return operandError(NUMBER_OPERANDS);
+
+          VM_NEXT();
+        }
+        VM_CASE(DIVIDE) {
+          quicken(OpCode::DIVIDE_NUM);
+          if (!binaryOp('/'))
+            return operandError(NUMBER_OPERANDS);
+
+          VM_NEXT();
+        }
+        VM_CASE(RETURN) {
+          value_t result = pop();
+          closeUpvalues(slots);
+          --m_FrameCount;
+          if (m_FrameCount == 0) {
+            pop();
             return InterpretResult::OK;
           }
-          
-          m_Stack.erase(m_Stack.begin() + top, m_Stack.end());
-          m_Stack.push_back(result);
-          break;
+
+          m_StackTop = slots;
+          push(result);
+          // A caller with native code carries on here until its next call or
+          // back-edge, rather than going back and forth between native code
+          // and the interpreter on every call of a callee without any.
+          loadFrame();
+          VM_NEXT();
         }
-        case OpCode::NIL:
-          m_Stack.push_back(nullptr);
-          break;
-        case OpCode::FALSE:
-          m_Stack.push_back(false);
-          break;
-        case OpCode::TRUE:
-          m_Stack.push_back(true);
-          break;
-        case OpCode::NOT: {
-          bool value = isFalsey(peek(0));
-          m_Stack.pop_back();
-          m_Stack.push_back(value);
-          break;
+        VM_CASE(NIL) {
+          push(nullptr);
+          VM_NEXT();
+        }
+        VM_CASE(TRUE) {
+          push(true);
+          VM_NEXT();
         }
-        case OpCode::EQUAL: {
+        VM_CASE(FALSE) {
+          push(false);
+          VM_NEXT();
+        }
+        VM_CASE(NOT) {
+          m_StackTop[-1] = isFalsey(peek(0));
+          VM_NEXT();
+        }
+        VM_CASE(EQUAL) {
           const value_t& right = peek(0);
           const value_t& left = peek(1);
           bool value = areEqual(left, right);
-          m_Stack.pop_back();
-          m_Stack.pop_back();
-          m_Stack.push_back(value);
-          break;
+          pop();
+          m_StackTop[-1] = value;
+          VM_NEXT();
         }
-        case OpCode::GREATER:
-          binaryOp('>');
-          break;
-        case OpCode::LESS:
-          binaryOp('<');
-          break;
-        case OpCode::PRINT:
-          m_Frames.back().m_Closure->m_Function->m_Chunk.printValue(m_Stack.back());
-          m_Stack.pop_back();
-          printf("\n");
-          break;
-        case OpCode::POP:
-          m_Stack.pop_back();
-          break;
-        case OpCode::DEFINE_GLOBAL:
-          m_Globals[readString()] = peek(0);
-          m_Stack.pop_back();
-          break;
-        case OpCode::GET_GLOBAL: {
-          string_t name = readString();
-          auto it = m_Globals.find(name);
-          if (it == m_Globals.cend()) {
-            fprintf(stderr, "Undefined variable '%s'.", name.c_str());
+        VM_CASE(GREATER) {
+          quicken(OpCode::GREATER_NUM);
+          if (!binaryOp('>'))
+            return operandError(NUMBER_OPERANDS);
+
+          VM_NEXT();
+        }
+        VM_CASE(LESS) {
+          quicken(OpCode::LESS_NUM);
+          if (!binaryOp('<'))
+            return operandError(NUMBER_OPERANDS);
+
+          VM_NEXT();
+        }
+        VM_CASE(PRINT) {
+          frame->m_Closure->m_Function->m_Chunk.printValue(m_Out, pop());
+          fprintf(m_Out, "\n");
+          VM_NEXT();
+        }
+        VM_CASE(POP) {
+          pop();
+          VM_NEXT();
+        }
+        VM_CASE(DEFINE_GLOBAL) {
+          Global& global = m_Globals[globals[readOperand()]];
+          global.m_Value = peek(0);
+          global.m_Defined = true;
+          pop();
+          VM_NEXT();
+        }
+        VM_CASE(GET_GLOBAL) {
+          const Global& global = m_Globals[globals[readOperand()]];
+          if (!global.m_Defined) {
+            saveFrame();
+            runtimeError("Undefined variable '%s'.", global.m_Name->m_Str.c_str());
             return InterpretResult::RUNTIME_ERROR;
           }
 
-          m_Stack.push_back(it->second);
-          break;
+          push(global.m_Value);
+          VM_NEXT();
         }
-        case OpCode::SET_GLOBAL:
-        {
-          string_t name = readString();
-          auto it = m_Globals.find(name);
-          if (it == m_Globals.cend()) {
-            fprintf(stderr, "Undefined variable '%s'.", name.c_str());
+        VM_CASE(SET_GLOBAL) {
+          Global& global = m_Globals[globals[readOperand()]];
+          if (!global.m_Defined) {
+            saveFrame();
+            runtimeError("Undefined variable '%s'.", global.m_Name->m_Str.c_str());
             return InterpretResult::RUNTIME_ERROR;
           }
 
-          it->second = peek(0);
-          break;
+          global.m_Value = peek(0);
+          VM_NEXT();
         }
-        case OpCode::GET_LOCAL:
-        {
-          size_t offset = readOffset();
-          value_t local = m_Stack[m_Frames.back().m_Start + offset];
-          m_Stack.push_back(local);
-          break;
+        VM_CASE(GET_LOCAL) {
+          push(slots[readOperand()]);
+          VM_NEXT();
         }
-        case OpCode::SET_LOCAL:
-        {
-          size_t offset = readOffset();
-          m_Stack[m_Frames.back().m_Start + offset] = peek(0);
-          break;
+        VM_CASE(SET_LOCAL) {
+          slots[readOperand()] = peek(0);
+          VM_NEXT();
         }
-        case OpCode::JUMP_IF_FALSE:
-        {
-          size_t offset = readOffset();
+        VM_CASE(JUMP_IF_FALSE) {
+          size_t offset = readShort();
           if (isFalsey(peek(0)))
-            m_Frames.back().m_IP += offset;
+            ip += offset;
 
-          break;
+          VM_NEXT();
         }
-        case OpCode::JUMP:
-        {
-          size_t offset = readOffset();
-          m_Frames.back().m_IP += offset;
-          break;
+        VM_CASE(JUMP) {
+          size_t offset = readShort();
+          ip += offset;
+          VM_NEXT();
         }
-        case OpCode::LOOP:
-        {
-          size_t offset = readOffset();
-          m_Frames.back().m_IP -= offset;
-          break;
+        VM_CASE(LOOP) {
+          size_t offset = readShort();
+          ip -= offset;
+          if (m_Tracing) {
+            saveFrame();
+            traceLoop(*frame);
+            ip = frame->m_IP;
+          }
+
+          if (m_Jit) {
+            countHot(function);
+            if (!runNative())
+              return InterpretResult::RUNTIME_ERROR;
+          }
+
+          VM_NEXT();
         }
-        case OpCode::CALL:
-        {
-          size_t count = readOffset();
+        VM_CASE(CALL) {
+          size_t count = readOperand();
+          saveFrame();
           if (!callValue(peek(count), count))
             return InterpretResult::RUNTIME_ERROR;
 
-          break;
+          loadFrame();
+          if (!runNative())
+            return InterpretResult::RUNTIME_ERROR;
+
+          VM_NEXT();
         }
-        case OpCode::CLOSURE:
-        {
-          function_ptr_t function = dynamic_cast<function_ptr_t>(std::get<obj_ptr_t>(readConstant()));
-          closure_ptr_t closure = Object::formClosureObject(function);
-          m_Stack.push_back(closure);
-          break;
+        VM_CASE(CLOSURE) {
+          function_ptr_t prototype = asObjType<Function>(readConstant());
+          closure_ptr_t closure = Object::formClosureObject(m_Collector, prototype);
+          push(closure);
+
+          upvalue_ptr_t* upvalues = closure->upvalues();
+          for (size_t i = 0; i < closure->m_UpvalueCount; ++i) {
+            const Capture& capture = prototype->m_Captures[i];
+            if (capture.m_IsLocal)
+              upvalues[i] = captureUpvalue(slots + capture.m_Index);
+            else
+              upvalues[i] = frame->m_Closure->upvalues()[capture.m_Index];
+          }
+
+          VM_NEXT();
+        }
+        VM_CASE(GET_UPVALUE) {
+          upvalue_ptr_t upvalue = frame->m_Closure->upvalues()[readOperand()];
+          push(*upvalue->m_Location);
+          VM_NEXT();
+        }
+        VM_CASE(SET_UPVALUE) {
+          upvalue_ptr_t upvalue = frame->m_Closure->upvalues()[readOperand()];
+          *upvalue->m_Location = peek(0);
+
+          VM_NEXT();
+        }
+        VM_CASE(CLOSE_UPVALUE) {
+          closeUpvalues(m_StackTop - 1);
+          pop();
+          VM_NEXT();
+        }
+        VM_CASE(CLASS) {
+          string_ptr_t name = asObjType<String>(readConstant());
+          // The root shape stays on the stack while the class is allocated.
+          shape_ptr_t shape = Object::formShapeObject(m_Collector);
+          push(shape);
+          class_ptr_t klass = Object::formClassObject(m_Collector, name, shape);
+          m_StackTop[-1] = klass;
+          VM_NEXT();
+        }
+        VM_CASE(GET_PROPERTY) {
+          PropertyCache& cache = caches[readOperand()];
+          const value_t& receiver = peek(0);
+          instance_ptr_t instance = isObjType<Instance>(receiver) ? asObjType<Instance>(receiver) : nullptr;
+          if (!instance) {
+            saveFrame();
+            runtimeError("Only instances have properties.");
+            return InterpretResult::RUNTIME_ERROR;
+          }
+
+          if (!readProperty(instance, cache)) {
+            saveFrame();
+            runtimeError("Undefined property '%s'.", cache.m_Name->m_Str.c_str());
+            return InterpretResult::RUNTIME_ERROR;
+          }
+
+          VM_NEXT();
+        }
+        VM_CASE(SET_PROPERTY) {
+          PropertyCache& cache = caches[readOperand()];
+          const value_t& receiver = peek(1);
+          instance_ptr_t instance = isObjType<Instance>(receiver) ? asObjType<Instance>(receiver) : nullptr;
+          if (!instance) {
+            saveFrame();
+            runtimeError("Only instances have fields.");
+            return InterpretResult::RUNTIME_ERROR;
+          }
+
+          writeProperty(instance, cache);
+          VM_NEXT();
+        }
+        VM_CASE(METHOD) {
+          defineMethod(asObjType<String>(readConstant()));
+          VM_NEXT();
+        }
+        VM_CASE(INHERIT) {
+          const value_t& superclass = peek(1);
+          class_ptr_t parent = isObjType<Class>(superclass) ? asObjType<Class>(superclass) : nullptr;
+          if (!parent) {
+            saveFrame();
+            runtimeError("Superclass must be a class.");
+            return InterpretResult::RUNTIME_ERROR;
+          }
+
+          // Methods are copied down when the subclass is created, so lookups
+          // never walk the inheritance chain.
+          class_ptr_t subclass = asObjType<Class>(peek(0));
+          size_t before = subclass->size();
+          subclass->m_Methods = parent->m_Methods;
+          subclass->m_Initializer = parent->m_Initializer;
+          m_Collector.grow(subclass, before);
+          pop();
+          VM_NEXT();
+        }
+        VM_CASE(GET_SUPER) {
+          string_ptr_t name = asObjType<String>(readConstant());
+          class_ptr_t superclass = asObjType<Class>(pop());
+
+          if (!bindMethod(superclass, name)) {
+            saveFrame();
+            runtimeError("Undefined property '%s'.", name->m_Str.c_str());
+            return InterpretResult::RUNTIME_ERROR;
+          }
+
+          VM_NEXT();
+        }
+        VM_CASE(INVOKE) {
+          PropertyCache& cache = caches[readOperand()];
+          size_t count = *ip++;
+          saveFrame();
+
+          if (!invoke(cache, count))
+            return InterpretResult::RUNTIME_ERROR;
+
+          loadFrame();
+          if (!runNative())
+            return InterpretResult::RUNTIME_ERROR;
+
+          VM_NEXT();
+        }
+        VM_CASE(SUPER_INVOKE) {
+          string_ptr_t name = asObjType<String>(readConstant());
+          size_t count = *ip++;
+          saveFrame();
+
+          class_ptr_t superclass = asObjType<Class>(pop());
+          if (!invokeFromClass(superclass, name, count))
+            return InterpretResult::RUNTIME_ERROR;
+
+          loadFrame();
+          if (!runNative())
+            return InterpretResult::RUNTIME_ERROR;
+
+          VM_NEXT();
+        }
+        VM_CASE(NOT_EQUAL) {
+          bool value = !areEqual(peek(1), peek(0));
+          pop();
+          m_StackTop[-1] = value;
+          VM_NEXT();
+        }
+        VM_CASE(GREATER_EQUAL) {
+          quicken(OpCode::GREATER_EQUAL_NUM);
+          // Exactly LESS, NOT: a comparison with NaN is true.
+          if (!binaryOp('<'))
+            return operandError(NUMBER_OPERANDS);
+
+          m_StackTop[-1] = isFalsey(peek(0));
+          VM_NEXT();
+        }
+        VM_CASE(LESS_EQUAL) {
+          quicken(OpCode::LESS_EQUAL_NUM);
+          if (!binaryOp('>'))
+            return operandError(NUMBER_OPERANDS);
+
+          m_StackTop[-1] = isFalsey(peek(0));
+          VM_NEXT();
+        }
+        VM_CASE(POP_JUMP_IF_FALSE) {
+          size_t offset = readShort();
+          if (isFalsey(pop()))
+            ip += offset;
+
+          VM_NEXT();
         }
+        VM_CASE(JUMP_IF_LESS) {
+          size_t offset = readShort();
+          bool result;
+          if (!compare<'<'>(result))
+            return operandError(NUMBER_OPERANDS);
+
+          if (result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_NOT_LESS) {
+          size_t offset = readShort();
+          bool result;
+          if (!compare<'<'>(result))
+            return operandError(NUMBER_OPERANDS);
+
+          if (!result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_GREATER) {
+          size_t offset = readShort();
+          bool result;
+          if (!compare<'>'>(result))
+            return operandError(NUMBER_OPERANDS);
+
+          if (result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_NOT_GREATER) {
+          size_t offset = readShort();
+          bool result;
+          if (!compare<'>'>(result))
+            return operandError(NUMBER_OPERANDS);
+
+          if (!result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(ADD_LOCAL_CONSTANT) {
+          const value_t& local = slots[ip[0]];
+          const value_t& constant = constants[ip[1]];
+          ip += 2;
+          if (isNumber(local) && isNumber(constant)) {
+            push(asNumber(local) + asNumber(constant));
+          } else {
+            push(local);
+            push(constant);
+            if (!binaryAdd())
+              return operandError(ADD_OPERANDS);
+          }
+
+          VM_NEXT();
+        }
+        VM_CASE(SUBTRACT_LOCAL_CONSTANT) {
+          const value_t& local = slots[ip[0]];
+          const value_t& constant = constants[ip[1]];
+          ip += 2;
+          if (isNumber(local) && isNumber(constant)) {
+            push(asNumber(local) - asNumber(constant));
+          } else {
+            push(local);
+            push(constant);
+            if (!binaryOp('-'))
+              return operandError(NUMBER_OPERANDS);
+          }
+
+          VM_NEXT();
+        }
+        VM_CASE(ADD_NUM) {
+          if (!guard(OpCode::ADD)) {
+            if (!binaryAdd())
+              return operandError(ADD_OPERANDS);
+
+            VM_NEXT();
+          }
+
+          replaceOperands(asNumber(m_StackTop[-2]) + asNumber(m_StackTop[-1]));
+          VM_NEXT();
+        }
+        VM_CASE(SUBTRACT_NUM) {
+          if (!guard(OpCode::SUBTRACT)) {
+            if (!binaryOp('-'))
+              return operandError(NUMBER_OPERANDS);
+
+            VM_NEXT();
+          }
+
+          replaceOperands(asNumber(m_StackTop[-2]) - asNumber(m_StackTop[-1]));
+          VM_NEXT();
+        }
+        VM_CASE(MULTIPLY_NUM) {
+          if (!guard(OpCode::MULTIPLY)) {
+            if (!binaryOp('*'))
+              return operandError(NUMBER_OPERANDS);
+
+            VM_NEXT();
+          }
+
+          replaceOperands(asNumber(m_StackTop[-2]) * asNumber(m_StackTop[-1]));
+          VM_NEXT();
+        }
+        VM_CASE(DIVIDE_NUM) {
+          if (!guard(OpCode::DIVIDE)) {
+            if (!binaryOp('/'))
+              return operandError(NUMBER_OPERANDS);
+
+            VM_NEXT();
+          }
+
+          replaceOperands(asNumber(m_StackTop[-2]) / asNumber(m_StackTop[-1]));
+          VM_NEXT();
+        }
+        VM_CASE(GREATER_NUM) {
+          if (!guard(OpCode::GREATER)) {
+            if (!binaryOp('>'))
+              return operandError(NUMBER_OPERANDS);
+
+            VM_NEXT();
+          }
+
+          replaceOperands(asNumber(m_StackTop[-2]) > asNumber(m_StackTop[-1]));
+          VM_NEXT();
+        }
+        VM_CASE(LESS_NUM) {
+          if (!guard(OpCode::LESS)) {
+            if (!binaryOp('<'))
+              return operandError(NUMBER_OPERANDS);
+
+            VM_NEXT();
+          }
+
+          replaceOperands(asNumber(m_StackTop[-2]) < asNumber(m_StackTop[-1]));
+          VM_NEXT();
+        }
+        VM_CASE(GREATER_EQUAL_NUM) {
+          if (!guard(OpCode::GREATER_EQUAL)) {
+            if (!binaryOp('<'))
+              return operandError(NUMBER_OPERANDS);
+
+            m_StackTop[-1] = isFalsey(peek(0));
+            VM_NEXT();
+          }
+
+          replaceOperands(!(asNumber(m_StackTop[-2]) < asNumber(m_StackTop[-1])));
+          VM_NEXT();
+        }
+        VM_CASE(LESS_EQUAL_NUM) {
+          if (!guard(OpCode::LESS_EQUAL)) {
+            if (!binaryOp('>'))
+              return operandError(NUMBER_OPERANDS);
+
+            m_StackTop[-1] = isFalsey(peek(0));
+            VM_NEXT();
+          }
+
+          replaceOperands(!(asNumber(m_StackTop[-2]) > asNumber(m_StackTop[-1])));
+          VM_NEXT();
+        }
+        VM_CASE(MOVE) {
+          slots[ip[0]] = slots[ip[1]];
+          ip += 2;
+          VM_NEXT();
+        }
+        VM_CASE(LOAD_CONSTANT) {
+          slots[ip[0]] = constants[ip[1]];
+          ip += 2;
+          VM_NEXT();
+        }
+        VM_CASE(ADD_RR) {
+          if (!arithmetic<'+'>(slots[ip[0]], slots[ip[1]], slots[ip[2]]))
+            return operandError(ADD_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(SUBTRACT_RR) {
+          if (!arithmetic<'-'>(slots[ip[0]], slots[ip[1]], slots[ip[2]]))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(MULTIPLY_RR) {
+          if (!arithmetic<'*'>(slots[ip[0]], slots[ip[1]], slots[ip[2]]))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(DIVIDE_RR) {
+          if (!arithmetic<'/'>(slots[ip[0]], slots[ip[1]], slots[ip[2]]))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(ADD_RK) {
+          if (!arithmetic<'+'>(slots[ip[0]], slots[ip[1]], constants[ip[2]]))
+            return operandError(ADD_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(SUBTRACT_RK) {
+          if (!arithmetic<'-'>(slots[ip[0]], slots[ip[1]], constants[ip[2]]))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(MULTIPLY_RK) {
+          if (!arithmetic<'*'>(slots[ip[0]], slots[ip[1]], constants[ip[2]]))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(DIVIDE_RK) {
+          if (!arithmetic<'/'>(slots[ip[0]], slots[ip[1]], constants[ip[2]]))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 3;
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_LESS_RR) {
+          bool result;
+          if (!compare<'<'>(slots[ip[0]], slots[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_NOT_LESS_RR) {
+          bool result;
+          if (!compare<'<'>(slots[ip[0]], slots[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (!result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_GREATER_RR) {
+          bool result;
+          if (!compare<'>'>(slots[ip[0]], slots[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_NOT_GREATER_RR) {
+          bool result;
+          if (!compare<'>'>(slots[ip[0]], slots[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (!result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_LESS_RK) {
+          bool result;
+          if (!compare<'<'>(slots[ip[0]], constants[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_NOT_LESS_RK) {
+          bool result;
+          if (!compare<'<'>(slots[ip[0]], constants[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (!result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_GREATER_RK) {
+          bool result;
+          if (!compare<'>'>(slots[ip[0]], constants[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(JUMP_IF_NOT_GREATER_RK) {
+          bool result;
+          if (!compare<'>'>(slots[ip[0]], constants[ip[1]], result))
+            return operandError(NUMBER_OPERANDS);
+
+          ip += 2;
+          size_t offset = readShort();
+          if (!result)
+            ip += offset;
+
+          VM_NEXT();
+        }
+        VM_CASE(WIDE) {
+          ext = static_cast<size_t>(*ip++) << 8;
+          VM_NEXT();
+        }
+        VM_CASE(EXTRA_WIDE) {
+          ext = (static_cast<size_t>(ip[0]) << 16) | (static_cast<size_t>(ip[1]) << 8);
+          ip += 2;
+          VM_NEXT();
+        }
+#if !CLOX_THREADED_DISPATCH
         default:
           return InterpretResult::RUNTIME_ERROR;
         }
       }
-    }
+#endif
 
-    const value_t& VM::peek(size_t offset) const {
-      return *(m_Stack.crbegin() + offset);
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef VM_PROFILE
     }
 
     bool VM::isFalsey(const value_t& value) const {
-      return std::visit(
-        util::overloaded{
-          [](dbl_t x) { return x != 0.; },
-          [](bool x) { return !x; },
-          [](nullptr_t x) { return true; }
-        },
-        value
-      );
+      return isNil(value) || (isBool(value) && !asBool(value));
     }
 
     bool VM::areEqual(const value_t& left, const value_t& right) const {
-      if (left.index() != right.index())
-        return false;
+      // Strings are interned, so identity is equality for every object.
+      return isSameValue(left, right);
+    }
+
+    void VM::runtimeError(const char* format, ...) {
+      va_list args;
+      va_start(args, format);
+      vfprintf(m_Err, format, args);
+      va_end(args);
+      fputs("\n", m_Err);
+
+      for (size_t i = m_FrameCount; i-- > 0;) {
+        const CallFrame& frame = m_Frames[i];
+        function_ptr_t function = frame.m_Closure->m_Function;
+        // The ip has already moved past the failing instruction.
+        size_t offset = static_cast<size_t>(frame.m_IP - function->m_Chunk.code()) - 1;
+        int_t line = function->m_Chunk.readLine(offset);
+        fprintf(m_Err, "[line %d] in ", line);
+        if (function->m_Name.empty())
+          fprintf(m_Err, "script\n");
+        else
+          fprintf(m_Err, "%s()\n", function->m_Name.c_str());
+      }
+
+      resetStack();
+    }
 
-      if (std::holds_alternative<bool>(left))
-        return std::get<bool>(left) == std::get<bool>(right);
-      else if (std::holds_alternative<dbl_t>(left))
-        return std::get<dbl_t>(left) == std::get<dbl_t>(right);
-      else if (std::holds_alternative<nullptr_t>(left))
+    void VM::resetStack(void) {
+      m_StackTop = m_Stack.get();
+      m_FrameCount = 0;
+      m_OpenUpvalues = nullptr;
+    }
+
+    upvalue_ptr_t VM::captureUpvalue(value_t* slot) {
+      upvalue_ptr_t previous = nullptr;
+      upvalue_ptr_t upvalue = m_OpenUpvalues;
+      while (upvalue && upvalue->m_Location > slot) {
+        previous = upvalue;
+        upvalue = upvalue->m_NextOpen;
+      }
+
+      if (upvalue && upvalue->m_Location == slot)
+        return upvalue;
+
+      upvalue_ptr_t created = Object::formUpvalueObject(m_Collector, slot);
+      created->m_NextOpen = upvalue;
+      if (previous)
+        previous->m_NextOpen = created;
+      else
+        m_OpenUpvalues = created;
+
+      return created;
+    }
+
+    void VM::closeUpvalues(value_t* last) {
+      while (m_OpenUpvalues && m_OpenUpvalues->m_Location >= last) {
+        upvalue_ptr_t upvalue = m_OpenUpvalues;
+        upvalue->m_Closed = *upvalue->m_Location;
+        upvalue->m_Location = &upvalue->m_Closed;
+        m_OpenUpvalues = upvalue->m_NextOpen;
+      }
+    }
+
+    // GET_PROPERTY on `instance`, the receiver on top of the stack: through
+    // the inline cache, else by lookup. False if there is no such property.
+    bool VM::readProperty(const instance_ptr_t& instance, PropertyCache& cache) {
+      const CacheEntry* entry = cache.find(instance->m_Shape);
+      if (!entry)
+        return getProperty(instance, cache);
+
+      ++cache.m_Hits;
+      ++m_CacheStats.m_Hits;
+      if (entry->m_Slot != -1)
+        m_StackTop[-1] = instance->m_Fields[entry->m_Slot];
+      else
+        bindMethod(entry->m_Method);
+
+      return true;
+    }
+
+    // SET_PROPERTY on `instance`, below the value on top of the stack; the
+    // value replaces both.
+    void VM::writeProperty(const instance_ptr_t& instance, PropertyCache& cache) {
+      const CacheEntry* entry = cache.find(instance->m_Shape);
+      if (entry) {
+        ++cache.m_Hits;
+        ++m_CacheStats.m_Hits;
+        if (entry->m_Transition)
+          instance->addField(m_Collector, entry->m_Transition, peek(0));
+        else
+          instance->m_Fields[entry->m_Slot] = peek(0);
+      } else {
+        setProperty(instance, cache, peek(0));
+      }
+
+      value_t value = pop();
+      m_StackTop[-1] = value;
+    }
+
+    bool VM::getProperty(const instance_ptr_t& instance, PropertyCache& cache) {
+      ++cache.m_Misses;
+      ++m_CacheStats.m_Misses;
+
+      shape_ptr_t shape = instance->m_Shape;
+      int_t slot = shape->find(cache.m_Name);
+      if (slot != -1) {
+        cache.add({ shape, slot, nullptr, nullptr });
+        m_StackTop[-1] = instance->m_Fields[slot];
         return true;
-      else if (std::holds_alternative<obj_ptr_t>(left)) {
-        auto pL = dynamic_cast<string_ptr_t>(std::get<obj_ptr_t>(left));
-        auto pR = dynamic_cast<string_ptr_t>(std::get<obj_ptr_t>(right));
-        if (pL && pR)
-          return pL->m_Str.compare(pR->m_Str) == 0;
       }
 
-      return false;
+      // Methods cannot change once the class body has run, so the shape alone
+      // decides which one a name resolves to.
+      auto it = instance->m_Class->m_Methods.find(cache.m_Name);
+      if (it == instance->m_Class->m_Methods.end())
+        return false;
+
+      cache.add({ shape, -1, it->second, nullptr });
+      bindMethod(it->second);
+      return true;
+    }
+
+    void VM::setProperty(const instance_ptr_t& instance, PropertyCache& cache, const value_t& value) {
+      ++cache.m_Misses;
+      ++m_CacheStats.m_Misses;
+
+      shape_ptr_t shape = instance->m_Shape;
+      int_t slot = shape->find(cache.m_Name);
+      if (slot != -1) {
+        cache.add({ shape, slot, nullptr, nullptr });
+        instance->m_Fields[slot] = value;
+        return;
+      }
+
+      // Both the instance and the value are still on the stack while the new
+      // shape is allocated.
+      shape_ptr_t transition = shape->transition(m_Collector, cache.m_Name);
+      cache.add({ shape, static_cast<int_t>(shape->m_Keys.size()), nullptr, transition });
+      instance->addField(m_Collector, transition, value);
+    }
+
+    // INVOKE of the property `cache` names on the receiver below the `count`
+    // arguments.
+    bool VM::invoke(PropertyCache& cache, size_t count) {
+      const value_t& receiver = peek(count);
+      instance_ptr_t instance = isObjType<Instance>(receiver) ? asObjType<Instance>(receiver) : nullptr;
+      if (!instance) {
+        runtimeError("Only instances have methods.");
+        return false;
+      }
+
+      const CacheEntry* entry = cache.find(instance->m_Shape);
+      if (!entry)
+        return invoke(instance, cache, count);
+
+      ++cache.m_Hits;
+      ++m_CacheStats.m_Hits;
+      if (entry->m_Slot != -1) {
+        value_t field = instance->m_Fields[entry->m_Slot];
+        m_StackTop[-static_cast<ptrdiff_t>(count) - 1] = field;
+        return callValue(field, count);
+      }
+
+      return call(entry->m_Method, count);
+    }
+
+    bool VM::invoke(const instance_ptr_t& instance, PropertyCache& cache, size_t count) {
+      ++cache.m_Misses;
+      ++m_CacheStats.m_Misses;
+
+      // A field holding a callable shadows a method of the same name.
+      shape_ptr_t shape = instance->m_Shape;
+      int_t slot = shape->find(cache.m_Name);
+      if (slot != -1) {
+        cache.add({ shape, slot, nullptr, nullptr });
+        value_t field = instance->m_Fields[slot];
+        m_StackTop[-static_cast<ptrdiff_t>(count) - 1] = field;
+        return callValue(field, count);
+      }
+
+      auto it = instance->m_Class->m_Methods.find(cache.m_Name);
+      if (it == instance->m_Class->m_Methods.end()) {
+        runtimeError("Undefined property '%s'.", cache.m_Name->m_Str.c_str());
+        return false;
+      }
+
+      cache.add({ shape, -1, it->second, nullptr });
+      return call(it->second, count);
+    }
+
+    bool VM::invokeFromClass(const class_ptr_t& klass, const string_ptr_t& name, size_t count) {
+      auto it = klass->m_Methods.find(name);
+      if (it == klass->m_Methods.end()) {
+        runtimeError("Undefined property '%s'.", name->m_Str.c_str());
+        return false;
+      }
+
+      return call(it->second, count);
+    }
+
+    bool VM::bindMethod(const class_ptr_t& klass, const string_ptr_t& name) {
+      auto it = klass->m_Methods.find(name);
+      if (it == klass->m_Methods.end())
+        return false;
+
+      bindMethod(it->second);
+      return true;
+    }
+
+    void VM::bindMethod(const closure_ptr_t& method) {
+      // The receiver stays on the stack while the bound method is allocated.
+      bound_method_ptr_t bound = Object::formBoundMethodObject(m_Collector, peek(0), method);
+      m_StackTop[-1] = bound;
+    }
+
+    void VM::defineMethod(const string_ptr_t& name) {
+      closure_ptr_t method = asObjType<Closure>(peek(0));
+      class_ptr_t klass = asObjType<Class>(peek(1));
+      size_t before = klass->size();
+      klass->m_Methods[name] = method;
+      if (name == m_InitString)
+        klass->m_Initializer = method;
+
+      // Both are still on the stack if the growth starts a collection.
+      m_Collector.grow(klass, before);
+      pop();
     }
 
     bool VM::callValue(const value_t& value, size_t count) {
-      if (std::holds_alternative<obj_ptr_t>(value)) {
-        obj_ptr_t o = std::get<obj_ptr_t>(value);
-
-        //// Function
-        //function_ptr_t function = dynamic_cast<function_ptr_t>(o);
-        //if (function)
-        //  return call(function, count);
-
-        // Closure
-        closure_ptr_t closure = dynamic_cast<closure_ptr_t>(o);
-        if (closure)
-          return call(closure, count);
+      if (isObj(value)) {
+        obj_ptr_t o = asObj(value);
+        switch (o->m_Type) {
+        case ObjType::CLOSURE:
+          return call(objCast<Closure>(o), count);
+        case ObjType::BOUND_METHOD: {
+          // The receiver takes the callee's slot as 'this'.
+          bound_method_ptr_t bound = objCast<BoundMethod>(o);
+          m_StackTop[-static_cast<ptrdiff_t>(count) - 1] = bound->m_Receiver;
+          return call(bound->m_Method, count);
+        }
+        case ObjType::CLASS: {
+          // The new instance takes the callee's slot.
+          class_ptr_t klass = objCast<Class>(o);
+          m_StackTop[-static_cast<ptrdiff_t>(count) - 1] = Object::formInstanceObject(m_Collector, klass);
+          if (klass->m_Initializer)
+            return call(klass->m_Initializer, count);
+
+          if (count != 0) {
+            runtimeError("Expected 0 arguments but got %zu.", count);
+            return false;
+          }
+
+          return true;
+        }
+        case ObjType::NATIVE: {
+          // Arguments are read in place; the callee and arguments are then
+          // replaced by the result.
+          native_ptr_t native = objCast<Native>(o);
+          if (native->m_Arity != Native::VARIADIC && static_cast<size_t>(native->m_Arity) != count) {
+            runtimeError("Expected %d arguments but got %zu.", native->m_Arity, count);
+            return false;
+          }
+
+          value_t* args = m_StackTop - count;
+          const char* error = nullptr;
+          value_t result = native->m_Function(static_cast<int>(count), args, error);
+          if (error) {
+            runtimeError("%s", error);
+            return false;
+          }
+
+          m_StackTop = args;
+          m_StackTop[-1] = result;
+          return true;
+        }
+        default:
+          break;
+        }
       }
 
-      fprintf(stderr, "Can only call functions now.");
+      runtimeError("Can only call functions and classes.");
       return false;
     }
 
     bool VM::call(const closure_ptr_t& closure, size_t count) {
       if (closure->m_Function->m_Arity != count) {
-        fprintf(stderr, "Expected %zu arguments but found %zu.", closure->m_Function->m_Arity, count);
+        runtimeError("Expected %zu arguments but got %zu.", closure->m_Function->m_Arity, count);
+        return false;
+      }
+
+      // The compiler knows how many slots the body can use, so one check per
+      // call covers every push the callee makes.
+      value_t* slots = m_StackTop - count - 1;
+      if (m_FrameCount == FRAMES_MAX || slots + closure->m_Function->m_MaxStack > m_Stack.get() + STACK_MAX) {
+        runtimeError("Stack overflow.");
         return false;
       }
 
-      m_Frames.emplace_back(closure, 0, m_Stack.size() - count - 1);
+      if (m_Jit)
+        countHot(closure->m_Function);
+
+      CallFrame& frame = m_Frames[m_FrameCount++];
+      frame.m_Closure = closure;
+      frame.m_IP = closure->m_Function->m_Chunk.code();
+      frame.m_Slots = slots;
+#ifdef CLOX_PROFILE
+      frame.m_ProfileNode = m_Profiler.enter(m_FrameCount > 1 ? m_Frames[m_FrameCount - 2].m_ProfileNode : Profiler::ROOT,
+                                             closure->m_Function);
+#endif
       return true;
     }
+
+    jit::Exit VM::enterNative(CallFrame& frame) {
+      return frame.m_Closure->m_Function->m_Native->run(*this, m_StackTop, frame, m_Globals.data());
+    }
+
+    // After a call made from native code: where native code enters the
+    // callee, if there is a new frame for it and it has been compiled.
+    jit::Call VM::callNative(size_t frameCount) {
+      if (m_FrameCount == frameCount)
+        return { jit::Exit::RETURNED, nullptr };
+
+      const jit::Code* code = m_Frames[m_FrameCount - 1].m_Closure->m_Function->m_Native;
+      return code ? jit::Call{ jit::Exit::RETURNED, code->nested() } : jit::Call{ jit::Exit::INTERPRET, nullptr };
+    }
+
+    void VM::countHot(const function_ptr_t& function) {
+      if (++function->m_Hotness == jit::HOT_THRESHOLD)
+        compileNative(function);
+    }
+
+    void VM::compileNative(const function_ptr_t& function) {
+      // Where native code falls back on the VM, for anything beyond numbers.
+      static const jit::Runtime runtime = {
+        .m_Add = [](VM& vm) {
+          return vm.binaryAdd();
+        },
+        .m_RegisterAdd = [](VM& vm, value_t* destination, const value_t* left, const value_t* right) {
+          return vm.arithmetic<'+'>(*destination, *left, *right);
+        },
+        .m_GetProperty = [](VM& vm, PropertyCache& cache) {
+          const value_t& receiver = vm.peek(0);
+          return isObjType<Instance>(receiver) && vm.readProperty(asObjType<Instance>(receiver), cache);
+        },
+        .m_SetProperty = [](VM& vm, PropertyCache& cache) {
+          const value_t& receiver = vm.peek(1);
+          if (!isObjType<Instance>(receiver))
+            return false;
+
+          vm.writeProperty(asObjType<Instance>(receiver), cache);
+          return true;
+        },
+        .m_Print = [](VM& vm) {
+          vm.m_Frames[vm.m_FrameCount - 1].m_Closure->m_Function->m_Chunk.printValue(vm.m_Out, vm.pop());
+          fprintf(vm.m_Out, "\n");
+        },
+        .m_Call = [](VM& vm, CallFrame& frame, size_t count, const byte_t* ip) {
+          frame.m_IP = ip;
+          size_t frameCount = vm.m_FrameCount;
+          if (!vm.callValue(vm.peek(count), count))
+            return jit::Call{ jit::Exit::RUNTIME_ERROR, nullptr };
+
+          return vm.callNative(frameCount);
+        },
+        .m_Invoke = [](VM& vm, CallFrame& frame, PropertyCache& cache, size_t count, const byte_t* ip) {
+          frame.m_IP = ip;
+          size_t frameCount = vm.m_FrameCount;
+          if (!vm.invoke(cache, count))
+            return jit::Call{ jit::Exit::RUNTIME_ERROR, nullptr };
+
+          return vm.callNative(frameCount);
+        },
+        .m_Return = [](VM& vm) {
+          if (vm.m_FrameCount == 1)
+            return false;
+
+          value_t* slots = vm.m_Frames[vm.m_FrameCount - 1].m_Slots;
+          value_t result = vm.pop();
+          vm.closeUpvalues(slots);
+          --vm.m_FrameCount;
+          vm.m_StackTop = slots;
+          vm.push(result);
+          return true;
+        },
+      };
+
+      function->m_Native = jit::compile(*function, runtime);
+    }
+
+    // At a back-edge, with the frame saved: counts it, or records or runs a
+    // trace of the loop, and leaves the frame where the interpreter resumes.
+    void VM::traceLoop(CallFrame& frame) {
+      function_ptr_t function = frame.m_Closure->m_Function;
+      if (!function->m_Loops)
+        function->m_Loops = new trace::Loops();
+
+      trace::Resume resume = function->m_Loops->enter(*function, frame.m_IP, frame.m_Slots, m_StackTop, m_Globals,
+                                                      m_Out, m_RunStats);
+      frame.m_IP = resume.m_IP;
+      if (m_CountInstructions)
+        m_RunStats.m_Instructions += resume.m_Recorded;
+    }
   }
 }
\ No newline at end of file
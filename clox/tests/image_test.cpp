@@ -0,0 +1,268 @@
+// Saves bytecode images through VM::interpretFile and checks when later runs
+// use them. An image is told apart from a compile by rewriting the script
+// with other text of the same size and putting its modification time back:
+// a run that prints the old text ran the image.
+//
+//   clox_image_test
+
+#include "vm.hpp"
+#include "image.hpp"
+#include "optimizer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+namespace {
+  using namespace clox;
+  namespace fs = std::filesystem;
+
+  int failures = 0;
+
+  void check(bool condition, const char* test, const char* what) {
+    if (condition)
+      return;
+
+    fprintf(stderr, "%s: %s\n", test, what);
+    ++failures;
+  }
+
+  // Both end in a print of the same length, so either can stand in for the
+  // other under the same stamp.
+  const char* OLD_SOURCE =
+    "var total = 0;\n"
+    "fun add(n) { total = total + n; return total; }\n"
+    "class Counter {\n"
+    "  init() { this.count = 0; }\n"
+    "  bump() { this.count = this.count + 1; return this; }\n"
+    "}\n"
+    "fun makeAdder(k) { fun adder(n) { return n + k; } return adder; }\n"
+    "var counter = Counter();\n"
+    "for (var i = 0; i < 100; i = i + 1) { add(i); counter.bump(); }\n"
+    "var three = makeAdder(3);\n"
+    "print total;\n"
+    "print counter.count;\n"
+    "print three(4);\n"
+    "print nil == false;\n"
+    "print \"old\";\n";
+  const char* OLD_OUTPUT = "4950\n100\n7\nfalse\nold\n";
+  const char* NEW_OUTPUT = "4950\n100\n7\nfalse\nnew\n";
+
+  string_t newSource(void) {
+    string_t source = OLD_SOURCE;
+    source.replace(source.rfind("old"), 3, "new");
+    return source;
+  }
+
+  struct Settings {
+    int_t m_Level = 2;
+    compiler::ExecutionMode m_Mode = compiler::ExecutionMode::STACK;
+  };
+
+  class Fixture {
+  public:
+    Fixture(void);
+    ~Fixture(void);
+
+    // Writes `text` as the script, with `modified` as its modification time.
+    void write(const string_t& text, fs::file_time_type modified);
+    string_t run(const Settings& settings = Settings());
+
+    byte_vec_t readImage(void);
+    void writeImage(const byte_vec_t& data);
+
+    fs::path m_Directory;
+    fs::path m_Script;
+    fs::path m_Image;
+  };
+
+  Fixture::Fixture(void) :
+    m_Directory(fs::temp_directory_path() / ("clox_image_test_" + std::to_string(std::random_device()()))),
+    m_Script(m_Directory / "script.lox"),
+    m_Image(m_Directory / "script.loxc")
+  {
+    fs::create_directories(m_Directory);
+  }
+
+  Fixture::~Fixture(void) {
+    std::error_code error;
+    fs::remove_all(m_Directory, error);
+  }
+
+  void Fixture::write(const string_t& text, fs::file_time_type modified) {
+    {
+      std::ofstream out(m_Script, std::ios::binary | std::ios::trunc);
+      out << text;
+    }
+
+    fs::last_write_time(m_Script, modified);
+  }
+
+  string_t Fixture::run(const Settings& settings) {
+    FILE* out = tmpfile();
+    FILE* err = tmpfile();
+    string_t output;
+    {
+      vm::VM vm(out, err);
+      vm.setOptimizationLevel(settings.m_Level);
+      vm.setExecutionMode(settings.m_Mode);
+      if (vm.interpretFile(m_Script.string(), m_Image.string()) != vm::InterpretResult::OK)
+        output = "<failed>";
+    }
+
+    rewind(out);
+    char block[256];
+    size_t count;
+    while ((count = fread(block, 1, sizeof(block), out)) > 0)
+      output.append(block, count);
+
+    fclose(out);
+    fclose(err);
+    return output;
+  }
+
+  byte_vec_t Fixture::readImage(void) {
+    std::ifstream in(m_Image, std::ios::binary);
+    return byte_vec_t(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+
+  void Fixture::writeImage(const byte_vec_t& data) {
+    std::ofstream out(m_Image, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+  }
+
+  // Runs the old script to save its image, then swaps in the new text under
+  // the same stamp; `settings` are what the image was saved with.
+  fs::file_time_type prepare(Fixture& fixture, const Settings& settings = Settings()) {
+    fs::file_time_type stamp = fs::file_time_type::clock::now() - std::chrono::hours(1);
+    fixture.write(OLD_SOURCE, stamp);
+    fixture.run(settings);
+    fixture.write(newSource(), stamp);
+    return stamp;
+  }
+
+  void roundTrip(void) {
+    Fixture fixture;
+    fs::file_time_type stamp = fs::file_time_type::clock::now() - std::chrono::hours(1);
+    fixture.write(OLD_SOURCE, stamp);
+    check(fixture.run() == OLD_OUTPUT, "round trip", "wrong output when compiling");
+    check(fs::exists(fixture.m_Image), "round trip", "no image saved");
+    check(fixture.run() == OLD_OUTPUT, "round trip", "wrong output from the image");
+
+    fixture.write(newSource(), stamp);
+    check(fixture.run() == OLD_OUTPUT, "round trip", "image not used for an unchanged stamp");
+
+    // Each mode runs its own image, and quickens it in place.
+    Settings registers;
+    registers.m_Mode = compiler::ExecutionMode::REGISTER;
+    fixture.write(OLD_SOURCE, stamp);
+    check(fixture.run(registers) == OLD_OUTPUT, "round trip", "wrong output compiling for registers");
+    fixture.write(newSource(), stamp);
+    check(fixture.run(registers) == OLD_OUTPUT, "round trip", "register image not used");
+    check(fixture.run(registers) == OLD_OUTPUT, "round trip", "register image not reusable");
+  }
+
+  void staleSource(void) {
+    Fixture fixture;
+    fs::file_time_type stamp = prepare(fixture);
+
+    // Changed text with a new stamp is compiled again.
+    fixture.write(newSource(), stamp + std::chrono::seconds(1));
+    check(fixture.run() == NEW_OUTPUT, "stale source", "stale image used");
+
+    // Touched without changing: the hash matches, and the image is stamped
+    // anew, as the swap under the new stamp shows.
+    fixture.write(newSource(), stamp + std::chrono::seconds(2));
+    check(fixture.run() == NEW_OUTPUT, "stale source", "wrong output for a touched script");
+    fixture.write(OLD_SOURCE, stamp + std::chrono::seconds(2));
+    check(fixture.run() == NEW_OUTPUT, "stale source", "image not stamped again");
+  }
+
+  void changedSettings(void) {
+    Settings saved;
+    Settings level;
+    level.m_Level = 0;
+    Settings mode;
+    mode.m_Mode = compiler::ExecutionMode::REGISTER;
+
+    {
+      Fixture fixture;
+      prepare(fixture, saved);
+      check(fixture.run(level) == NEW_OUTPUT, "changed settings", "image used at another -O level");
+    }
+
+    {
+      Fixture fixture;
+      prepare(fixture, saved);
+      check(fixture.run(mode) == NEW_OUTPUT, "changed settings", "image used in another mode");
+    }
+
+    // The version follows the four-byte magic.
+    Fixture fixture;
+    prepare(fixture, saved);
+    byte_vec_t data = fixture.readImage();
+    check(data.size() > 8 && data[4] == image::VERSION, "changed settings", "version not where expected");
+    ++data[4];
+    fixture.writeImage(data);
+    check(fixture.run(saved) == NEW_OUTPUT, "changed settings", "image of another version used");
+  }
+
+  void damagedImage(void) {
+    Fixture fixture;
+    prepare(fixture);
+    const byte_vec_t good = fixture.readImage();
+    check(fixture.run() == OLD_OUTPUT, "damaged image", "image not used");
+
+    // Cut short anywhere, the image is compiled around. Each run saves a
+    // whole image again, so the cut one is written back every time.
+    for (size_t size = 0; size < good.size(); ++size) {
+      fixture.writeImage(byte_vec_t(good.begin(), good.begin() + size));
+      if (fixture.run() != NEW_OUTPUT) {
+        fprintf(stderr, "damaged image: image cut to %zu bytes used\n", size);
+        ++failures;
+      }
+    }
+
+    // Damage that leaves the header intact: counts that overrun the file,
+    // no functions, a bad magic, and bytes past the end.
+    auto patched = [&](size_t offset, uint32_t value) {
+      byte_vec_t data = good;
+      for (int i = 0; i < 4; ++i)
+        data[offset + i] = static_cast<byte_t>(value >> (8 * i));
+      return data;
+    };
+
+    constexpr size_t STRING_COUNT = 44;
+    constexpr size_t FUNCTION_COUNT = 48;
+    std::vector<std::pair<const char*, byte_vec_t>> damaged = {
+      { "string count", patched(STRING_COUNT, 0xffffffffu) },
+      { "function count", patched(FUNCTION_COUNT, 0xffffffffu) },
+      { "no functions", patched(FUNCTION_COUNT, 0) },
+      { "bad magic", patched(0, 0) },
+      { "trailing bytes", good },
+    };
+    damaged.back().second.push_back(0);
+
+    for (const auto& [what, data] : damaged) {
+      fixture.writeImage(data);
+      if (fixture.run() != NEW_OUTPUT) {
+        fprintf(stderr, "damaged image: %s not noticed\n", what);
+        ++failures;
+      }
+    }
+  }
+}
+
+int main(void) {
+  roundTrip();
+  staleSource();
+  changedSettings();
+  damagedImage();
+
+  if (failures)
+    return 1;
+
+  printf("image: ok\n");
+  return 0;
+}
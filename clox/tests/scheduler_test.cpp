@@ -0,0 +1,98 @@
+// Runs one batch whose jobs end in every way a script can, with a long job
+// among short ones, and checks that each result holds its own job's status,
+// output and errors and nothing from the others.
+//
+//   clox_scheduler_test
+
+#include "scheduler.hpp"
+#include "vm.hpp"
+#include <cstdio>
+
+namespace {
+  using namespace clox;
+
+  int failures = 0;
+
+  void check(bool condition, const char* mode, size_t job, const char* what) {
+    if (condition)
+      return;
+
+    fprintf(stderr, "%s: job %zu: %s\n", mode, job, what);
+    ++failures;
+  }
+
+  struct Job {
+    string_t m_Source;
+    vm::InterpretResult m_Status;
+    string_t m_Output;
+    string_t m_Errors;
+  };
+
+  std::vector<Job> batch(void) {
+    std::vector<Job> jobs;
+    jobs.push_back({
+      "print \"ok\";\nprint 1 + 2;\n",
+      vm::InterpretResult::OK, "ok\n3\n", "" });
+    jobs.push_back({
+      "print \"never\";\nprint ;\n",
+      vm::InterpretResult::COMPILE_ERROR, "", "[line 2] Error at ';': Expect expression.\n" });
+    jobs.push_back({
+      "print \"before\";\nprint -\"x\";\nprint \"after\";\n",
+      vm::InterpretResult::RUNTIME_ERROR, "before\n", "Operand must be a number.\n[line 2] in script\n" });
+    jobs.push_back({
+      "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\nprint fib(25);\n",
+      vm::InterpretResult::OK, "75025\n", "" });
+
+    // Short jobs around the long one, each defining the same global.
+    for (size_t i = 0; i < 32; ++i) {
+      string_t index = std::to_string(i);
+      jobs.push_back({
+        "var name = \"short " + index + "\";\nprint name;\n",
+        vm::InterpretResult::OK, "short " + index + "\n", "" });
+    }
+
+    return jobs;
+  }
+
+  void run(const char* mode, const scheduler::Options& options) {
+    std::vector<Job> jobs = batch();
+    std::vector<string_t> sources;
+    for (const Job& job : jobs)
+      sources.push_back(job.m_Source);
+
+    scheduler::Scheduler pool(options);
+    std::vector<scheduler::Result> results = pool.run(sources);
+    if (results.size() != jobs.size()) {
+      fprintf(stderr, "%s: %zu results for %zu jobs\n", mode, results.size(), jobs.size());
+      ++failures;
+      return;
+    }
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      check(results[i].m_Status == jobs[i].m_Status, mode, i, "wrong status");
+      check(results[i].m_Output == jobs[i].m_Output, mode, i, "wrong output");
+      check(results[i].m_Errors == jobs[i].m_Errors, mode, i, "wrong errors");
+    }
+
+    check(pool.stats().m_Jobs == jobs.size(), mode, jobs.size(), "jobs miscounted");
+  }
+}
+
+int main(void) {
+  scheduler::Options options;
+  options.m_Workers = 4;
+  run("stack", options);
+
+  options.m_Mode = compiler::ExecutionMode::REGISTER;
+  run("register", options);
+
+  options.m_Mode = compiler::ExecutionMode::STACK;
+  options.m_Jit = true;
+  run("jit", options);
+
+  if (failures)
+    return 1;
+
+  printf("scheduler: ok\n");
+  return 0;
+}
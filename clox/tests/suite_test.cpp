@@ -0,0 +1,292 @@
+// Runs every script of the Lox test suite under one execution setting and
+// checks it against the expectations written into its comments:
+//
+//   // expect: <line>                 a line of output
+//   // Error ...                      a compile error on this line
+//   // [line <n>] Error ...           a compile error on line n
+//   // expect runtime error: <msg>    a runtime error raised on this line
+//   // expect trace: <counter> <op> <n>
+//                                     with --trace, a RunStats trace counter
+//                                     compared by ==, >= or <=; the counters
+//                                     are traces, aborts, runs, iterations
+//                                     and instructions
+//
+//   clox_suite_test <O0|O1|O2|registers|jit|trace> <test directory>
+
+#include "vm.hpp"
+#include "optimizer.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace {
+  using namespace clox;
+  namespace fs = std::filesystem;
+
+  // Directories that test stages of the tree-walking interpreter this one
+  // does not have, or that take too long to run as tests.
+  const char* SKIPPED_DIRECTORIES[] = { "benchmark", "expressions", "scanning" };
+
+  // Scripts whose expectations this implementation deliberately or not yet
+  // differs from.
+  const char* SKIPPED_SCRIPTS[] = {
+    // Operands go up to 24 bits, so these limits are far off.
+    "limit/no_reuse_constants.lox",
+    "limit/too_many_constants.lox",
+    "limit/too_many_locals.lox",
+    "limit/too_many_upvalues.lox",
+    "function/too_many_parameters.lox",
+    "method/too_many_parameters.lox",
+    // Redeclaring a local in the same scope is not reported.
+    "variable/collide_with_parameter.lox",
+    "variable/duplicate_local.lox",
+    "variable/duplicate_parameter.lox",
+    // The parser reports an error the reference one recovers from.
+    "class/local_inherit_self.lox",
+    "for/statement_condition.lox",
+    "for/statement_initializer.lox",
+    "function/body_must_be_block.lox",
+    "function/missing_comma_in_parameters.lox",
+    "super/super_at_top_level.lox",
+    // Worded "Cannot" rather than "Can't".
+    "return/at_top_level.lox",
+    "variable/use_local_in_initializer.lox",
+  };
+
+  struct Setting {
+    const char* m_Name;
+    int_t m_Level;
+    compiler::ExecutionMode m_Mode;
+    bool m_Jit;
+    bool m_Tracing;
+  };
+
+  const Setting SETTINGS[] = {
+    { "O0", 0, compiler::ExecutionMode::STACK, false, false },
+    { "O1", 1, compiler::ExecutionMode::STACK, false, false },
+    { "O2", 2, compiler::ExecutionMode::STACK, false, false },
+    { "registers", 2, compiler::ExecutionMode::REGISTER, false, false },
+    { "jit", 2, compiler::ExecutionMode::STACK, true, false },
+    { "trace", 2, compiler::ExecutionMode::STACK, false, true },
+  };
+
+  struct Counter {
+    string_t m_Name;
+    string_t m_Op;
+    uint64_t m_Value;
+  };
+
+  struct Expectations {
+    std::vector<string_t> m_Output;
+    std::vector<string_t> m_CompileErrors;
+    string_t m_RuntimeError;
+    size_t m_RuntimeErrorLine = 0;
+    vm::InterpretResult m_Status = vm::InterpretResult::OK;
+    std::vector<Counter> m_TraceCounters;
+  };
+
+  // The text after `marker` in `line`, if it is there.
+  bool after(const string_t& line, const char* marker, string_t& rest) {
+    size_t at = line.find(marker);
+    if (at == string_t::npos)
+      return false;
+
+    rest = line.substr(at + strlen(marker));
+    return true;
+  }
+
+  Expectations parse(const string_t& source) {
+    Expectations expected;
+    std::istringstream lines(source);
+    string_t line;
+    string_t rest;
+    for (size_t number = 1; std::getline(lines, line); ++number) {
+      if (after(line, "// expect: ", rest)) {
+        expected.m_Output.push_back(rest);
+      } else if (after(line, "// expect runtime error: ", rest)) {
+        expected.m_RuntimeError = rest;
+        expected.m_RuntimeErrorLine = number;
+        expected.m_Status = vm::InterpretResult::RUNTIME_ERROR;
+      } else if (after(line, "// expect trace: ", rest)) {
+        Counter counter{};
+        std::istringstream fields(rest);
+        fields >> counter.m_Name >> counter.m_Op >> counter.m_Value;
+        expected.m_TraceCounters.push_back(counter);
+      } else if (after(line, "// [line ", rest) || after(line, "// [c line ", rest)) {
+        // "// [java line n]" expectations are for the other interpreter.
+        expected.m_CompileErrors.push_back("[line " + rest);
+        expected.m_Status = vm::InterpretResult::COMPILE_ERROR;
+      } else if (after(line, "// Error", rest)) {
+        expected.m_CompileErrors.push_back("[line " + std::to_string(number) + "] Error" + rest);
+        expected.m_Status = vm::InterpretResult::COMPILE_ERROR;
+      }
+    }
+
+    return expected;
+  }
+
+  string_t readAll(FILE* file) {
+    string_t text;
+    rewind(file);
+    char block[4096];
+    size_t count;
+    while ((count = fread(block, 1, sizeof(block), file)) > 0)
+      text.append(block, count);
+
+    return text;
+  }
+
+  std::vector<string_t> split(const string_t& text) {
+    std::vector<string_t> lines;
+    std::istringstream in(text);
+    string_t line;
+    while (std::getline(in, line))
+      lines.push_back(line);
+
+    return lines;
+  }
+
+  // The trace counter `name` of `stats`, or false if there is none.
+  bool traceCounter(const vm::RunStats& stats, const string_t& name, uint64_t& value) {
+    if (name == "traces")
+      value = stats.m_Traces;
+    else if (name == "aborts")
+      value = stats.m_TraceAborts;
+    else if (name == "runs")
+      value = stats.m_TraceRuns;
+    else if (name == "iterations")
+      value = stats.m_TracedIterations;
+    else if (name == "instructions")
+      value = stats.m_TracedInstructions;
+    else
+      return false;
+
+    return true;
+  }
+
+  string_t checkCounters(const vm::RunStats& stats, const std::vector<Counter>& counters) {
+    for (const Counter& counter : counters) {
+      uint64_t value;
+      if (!traceCounter(stats, counter.m_Name, value))
+        return "unknown trace counter " + counter.m_Name;
+
+      bool holds = counter.m_Op == "==" ? value == counter.m_Value :
+                   counter.m_Op == ">=" ? value >= counter.m_Value :
+                   counter.m_Op == "<=" && value <= counter.m_Value;
+      if (!holds) {
+        return "trace counter " + counter.m_Name + " is " + std::to_string(value) + ", expected " + counter.m_Op +
+               " " + std::to_string(counter.m_Value);
+      }
+    }
+
+    return "";
+  }
+
+  // Runs the script at `path` in a VM of its own. Returns a description of
+  // the first mismatch, or an empty string.
+  string_t run(const Setting& setting, const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream text;
+    text << in.rdbuf();
+    string_t source = text.str();
+    Expectations expected = parse(source);
+
+    FILE* out = tmpfile();
+    FILE* err = tmpfile();
+    vm::InterpretResult status;
+    vm::RunStats stats;
+    {
+      vm::VM vm(out, err);
+      vm.setOptimizationLevel(setting.m_Level);
+      vm.setExecutionMode(setting.m_Mode);
+      vm.setJit(setting.m_Jit);
+      vm.setTracing(setting.m_Tracing);
+      status = vm.interpret(source);
+      stats = vm.runStats();
+    }
+
+    std::vector<string_t> output = split(readAll(out));
+    std::vector<string_t> errors = split(readAll(err));
+    fclose(out);
+    fclose(err);
+    errors.erase(std::remove(errors.begin(), errors.end(), ""), errors.end());
+
+    if (output != expected.m_Output)
+      return "wrong output";
+
+    if (status != expected.m_Status)
+      return "wrong status";
+
+    if (!expected.m_CompileErrors.empty() && errors != expected.m_CompileErrors)
+      return "wrong compile errors";
+
+    if (expected.m_Status == vm::InterpretResult::RUNTIME_ERROR) {
+      string_t where = "[line " + std::to_string(expected.m_RuntimeErrorLine) + "]";
+      if (errors.size() < 2 || errors[0] != expected.m_RuntimeError || errors[1].rfind(where, 0) != 0)
+        return "wrong runtime error";
+    }
+
+    // Builds without traces run the scripts all the same.
+    if (setting.m_Tracing && trace::SUPPORTED)
+      return checkCounters(stats, expected.m_TraceCounters);
+
+    return "";
+  }
+
+  bool skipped(const string_t& name) {
+    for (const char* directory : SKIPPED_DIRECTORIES) {
+      if (name.rfind(string_t(directory) + "/", 0) == 0)
+        return true;
+    }
+
+    for (const char* script : SKIPPED_SCRIPTS) {
+      if (name == script)
+        return true;
+    }
+
+    return false;
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  const Setting* setting = nullptr;
+  for (const Setting& candidate : SETTINGS) {
+    if (argc == 3 && std::strcmp(argv[1], candidate.m_Name) == 0)
+      setting = &candidate;
+  }
+
+  if (!setting) {
+    fprintf(stderr, "Usage: clox_suite_test <O0|O1|O2|registers|jit|trace> <test directory>\n");
+    return 64;
+  }
+
+  fs::path root = argv[2];
+  std::vector<string_t> names;
+  for (const fs::directory_entry& entry : fs::recursive_directory_iterator(root)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".lox")
+      names.push_back(entry.path().lexically_relative(root).generic_string());
+  }
+  std::sort(names.begin(), names.end());
+
+  size_t passed = 0;
+  size_t failed = 0;
+  for (const string_t& name : names) {
+    if (skipped(name))
+      continue;
+
+    string_t mismatch = run(*setting, root / name);
+    if (mismatch.empty()) {
+      ++passed;
+    } else {
+      fprintf(stderr, "%s: %s: %s\n", setting->m_Name, name.c_str(), mismatch.c_str());
+      ++failed;
+    }
+  }
+
+  printf("suite %s: %zu passed, %zu failed\n", setting->m_Name, passed, failed);
+  return failed == 0 ? 0 : 1;
+}